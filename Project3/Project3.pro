@@ -1,4 +1,4 @@
-QT       += core gui opengl
+QT       += core gui opengl concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -22,13 +22,20 @@ SOURCES += \
     src/rendering/gl.cpp \
     src/rendering/forwardrenderer.cpp \
     src/rendering/framebufferobject.cpp \
+    src/rendering/gpuculling.cpp \
+    src/rendering/impostors.cpp \
     src/rendering/miscsettings.cpp \
+    src/rendering/occlusionculling.cpp \
     src/rendering/renderer.cpp \
+    src/rendering/ringbuffer.cpp \
+    src/rendering/staticbatches.cpp \
+    src/rendering/texturearrays.cpp \
     src/resources/mesh.cpp \
     src/resources/resource.cpp \
     src/resources/resourcemanager.cpp \
     src/resources/material.cpp \
     src/resources/texture.cpp \
+    src/resources/textureloader.cpp \
     src/resources/shaderprogram.cpp \
     src/ui/resourceswidget.cpp \
     src/ui/mainwindow.cpp \
@@ -47,7 +54,17 @@ SOURCES += \
     src/ui/materialwidget.cpp \
     src/ui/lightsourcewidget.cpp \
     src/ui/miscsettingswidget.cpp \
-    src/util/modelimporter.cpp
+    src/util/modelimporter.cpp \
+    src/util/assetcache.cpp \
+    src/util/blockcompression.cpp \
+    src/util/ktxfile.cpp \
+    src/util/meshcache.cpp \
+    src/util/normalmapgenerator.cpp \
+    src/util/gltfloader.cpp \
+    src/util/objloader.cpp \
+    src/util/meshoptimizer.cpp \
+    src/util/meshsimplifier.cpp \
+    src/util/vertexkernels.cpp
 
 HEADERS += \
     src/globals.h \
@@ -61,14 +78,22 @@ HEADERS += \
     src/rendering/deferredrenderer.h \
     src/rendering/gl.h \
     src/rendering/miscsettings.h \
+    src/rendering/occlusionculling.h \
     src/rendering/renderer.h \
     src/rendering/forwardrenderer.h \
     src/rendering/framebufferobject.h \
+    src/rendering/gpuculling.h \
+    src/rendering/impostors.h \
+    src/rendering/ringbuffer.h \
+    src/rendering/staticbatches.h \
+    src/rendering/texturearrays.h \
     src/resources/mesh.h \
+    src/resources/vertexlayout.h \
     src/resources/resource.h \
     src/resources/resourcemanager.h \
     src/resources/material.h \
     src/resources/texture.h \
+    src/resources/textureloader.h \
     src/resources/shaderprogram.h \
     src/ui/mainwindow.h \
     src/ui/inspectorwidget.h \
@@ -88,6 +113,17 @@ HEADERS += \
     src/ui/lightsourcewidget.h \
     src/ui/miscsettingswidget.h \
     src/util/modelimporter.h \
+    src/util/assetcache.h \
+    src/util/blockcompression.h \
+    src/util/ktxfile.h \
+    src/util/meshcache.h \
+    src/util/normalmapgenerator.h \
+    src/util/gltfloader.h \
+    src/util/objloader.h \
+    src/util/meshoptimizer.h \
+    src/util/meshsimplifier.h \
+    src/util/vertexkernels.h \
+    src/util/completionqueue.h \
     src/util/stb_image.h
 
 FORMS += \
@@ -116,10 +152,18 @@ DISTFILES += \
     res/shaders/deferred_shading.vert \
     res/shaders/forward_shading.frag \
     res/shaders/forward_shading.vert \
+    res/shaders/gpu_cull.geom \
+    res/shaders/gpu_cull.vert \
     res/shaders/grid.frag \
     res/shaders/grid.vert \
+    res/shaders/impostor.frag \
+    res/shaders/impostor.vert \
+    res/shaders/impostor_bake.frag \
+    res/shaders/impostor_bake.vert \
     res/shaders/light_pass.frag \
     res/shaders/light_pass.vert \
+    res/shaders/occlusion_box.frag \
+    res/shaders/occlusion_box.vert \
     res/shaders/outline.frag \
     res/shaders/outline.vert \
     res/shaders/ssao.frag \
@@ -1,7 +1,15 @@
 #version 330 core
 
+#ifdef USE_TEXTURE_ARRAYS
+// Maps packed into texture arrays (see TextureArrays)
+uniform sampler2DArray albedoArray;
+uniform sampler2DArray specularArray;
+uniform float albedoLayer;
+uniform float specularLayer;
+#else
 uniform sampler2D albedoTexture;
 uniform sampler2D specularTexture;
+#endif
 uniform float selectionColor;
 uniform float nearPlane;
 uniform float farPlane;
@@ -13,6 +21,10 @@ in vec4 worldPos;
 in vec3 mPos;
 in vec3 mNormal;
 
+#if defined(STATIC_BATCH) || defined(INSTANCED)
+flat in float vSelection;
+#endif
+
 layout (location = 0) out vec4 outPosition;
 layout (location = 1) out vec4 outNormals;
 layout (location = 2) out vec4 outAlbedo;
@@ -32,10 +44,29 @@ void main(void)
 {
     outPosition = vec4(pos, 1.0);
     outNormals = vec4(vNormal * 0.5 + vec3(0.5), 1.0);
+
+    // Without a map the material uses the default white/black textures,
+    // so their constant value is written instead of sampling them
+#if defined(HAS_ALBEDO_MAP) && defined(USE_TEXTURE_ARRAYS)
+    outAlbedo.rgb = texture(albedoArray, vec3(vTexCoords, albedoLayer)).rgb;
+#elif defined(HAS_ALBEDO_MAP)
     outAlbedo.rgb = texture(albedoTexture, vTexCoords).rgb;
+#else
+    outAlbedo.rgb = vec3(1.0);
+#endif
+#if defined(HAS_SPECULAR_MAP) && defined(USE_TEXTURE_ARRAYS)
+    outAlbedo.a = texture(specularArray, vec3(vTexCoords, specularLayer)).r;
+#elif defined(HAS_SPECULAR_MAP)
     outAlbedo.a = texture(specularTexture, vTexCoords).r;
+#else
+    outAlbedo.a = 0.0;
+#endif
 
+#if defined(STATIC_BATCH) || defined(INSTANCED)
+    outSelection = vec4(vSelection);
+#else
     outSelection = vec4(selectionColor);
+#endif
 
     float depth = 1.0 - (LinearizeDepth(gl_FragCoord.z) / farPlane);
     fragmentdepth = vec4(vec3(depth), 1.0);
@@ -3,8 +3,8 @@
 layout(location=0) in vec3 position;
 layout(location=1) in vec3 normal;
 layout(location=2) in vec2 texCoords;
-layout(location=3) in vec3 tangent;
-layout(location=4) in vec3 bitangent;
+layout(location=3) in vec4 tangent;   // Packed meshes: bitangent sign in w
+layout(location=4) in vec3 bitangent; // Packed meshes: cross(normal, tangent.xyz) * tangent.w
 
 uniform mat4 viewMatrix;
 uniform mat3 normalMatrix;
@@ -12,6 +12,29 @@ uniform mat4 modelMatrix;
 uniform mat4 projectionMatrix;
 uniform vec3 uWorldPos;
 
+// Decoding of the quantized attributes (see SubMesh::sendDecoding())
+uniform vec3 positionOffset = vec3(0.0);
+uniform vec3 positionScale = vec3(1.0);
+uniform vec2 texCoordsOffset = vec2(0.0);
+uniform vec2 texCoordsScale = vec2(1.0);
+
+#ifdef STATIC_BATCH
+// Merged static entities (see StaticBatches): the vertices are in world
+// space, and each one knows the selection color of its entity
+layout(location=5) in float batchEntity;
+uniform samplerBuffer entitySelection;
+#endif
+
+#ifdef INSTANCED
+// Instances that survived the GPU culling (see GpuCulling)
+layout(location=6) in mat4 instanceModel;
+layout(location=10) in float instanceSelection;
+#endif
+
+#if defined(STATIC_BATCH) || defined(INSTANCED)
+flat out float vSelection;
+#endif
+
 out vec2 vTexCoords;
 out vec3 vNormal;
 out vec3 pos;
@@ -21,15 +44,33 @@ out vec3 mNormal;
 
 void main(void)
 {
-    vTexCoords = texCoords;
-    vNormal = normal;
-    pos = (vec4(position, 1.0)).xyz;
-    gl_Position = projectionMatrix * viewMatrix * modelMatrix * vec4(position, 1.0);
-    worldPos = modelMatrix * vec4(position, 1.0);
+#ifdef INSTANCED
+    mat4 model = instanceModel;
+    mat3 normalTransform = transpose(inverse(mat3(viewMatrix * instanceModel)));
+#else
+    mat4 model = modelMatrix;
+    mat3 normalTransform = normalMatrix;
+#endif
+
+    vec3 objectPosition = positionOffset + position * positionScale;
+    vec3 objectNormal = normalize(normal);
+
+    vTexCoords = texCoordsOffset + texCoords * texCoordsScale;
+    vNormal = objectNormal;
+    pos = objectPosition;
+    gl_Position = projectionMatrix * viewMatrix * model * vec4(objectPosition, 1.0);
+    worldPos = model * vec4(objectPosition, 1.0);
 
 
     // SSAO input textures
-    mPos = (viewMatrix * modelMatrix * vec4(position, 1.0)).xyz;
+    mPos = (viewMatrix * model * vec4(objectPosition, 1.0)).xyz;
+
+    mNormal = normalTransform * objectNormal;
 
-    mNormal = normalMatrix * normal;
+#ifdef STATIC_BATCH
+    vSelection = texelFetch(entitySelection, int(batchEntity)).r;
+#endif
+#ifdef INSTANCED
+    vSelection = instanceSelection;
+#endif
 }
@@ -76,5 +76,11 @@ void main(void)
     _specular = clamp(_specular, vec3(0.0), vec3(1.0));
 
 
-    outColor = vec4((ambient + diffuse + _specular) * texture(albedoTexture, vTexCoords).rgb, 1.0);
+#ifdef HAS_ALBEDO_MAP
+    vec3 albedoColor = texture(albedoTexture, vTexCoords).rgb;
+#else
+    vec3 albedoColor = vec3(1.0);
+#endif
+
+    outColor = vec4((ambient + diffuse + _specular) * albedoColor, 1.0);
 }
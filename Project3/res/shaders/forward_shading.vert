@@ -3,20 +3,28 @@
 layout(location=0) in vec3 position;
 layout(location=1) in vec3 normal;
 layout(location=2) in vec2 texCoords;
-layout(location=3) in vec3 tangent;
-layout(location=4) in vec3 bitangent;
+layout(location=3) in vec4 tangent;   // Packed meshes: bitangent sign in w
+layout(location=4) in vec3 bitangent; // Packed meshes: cross(normal, tangent.xyz) * tangent.w
 
 uniform mat4 projectionMatrix;
 uniform mat4 worldViewMatrix;
 
+// Decoding of the quantized attributes (see SubMesh::sendDecoding())
+uniform vec3 positionOffset = vec3(0.0);
+uniform vec3 positionScale = vec3(1.0);
+uniform vec2 texCoordsOffset = vec2(0.0);
+uniform vec2 texCoordsScale = vec2(1.0);
+
 out vec2 vTexCoords;
 out vec3 vNormal;
 out vec3 pos;
 
 void main(void)
 {
-    vTexCoords = texCoords;
-    vNormal = normal;
-    pos = position;
-    gl_Position = projectionMatrix * worldViewMatrix * vec4(position, 1);
+    vec3 objectPosition = positionOffset + position * positionScale;
+
+    vTexCoords = texCoordsOffset + texCoords * texCoordsScale;
+    vNormal = normalize(normal);
+    pos = objectPosition;
+    gl_Position = projectionMatrix * worldViewMatrix * vec4(objectPosition, 1);
 }
@@ -0,0 +1,38 @@
+#version 330 core
+
+// One point per instance (see GpuCulling)
+layout(location=0) in vec4 model0; // Columns of the model matrix
+layout(location=1) in vec4 model1;
+layout(location=2) in vec4 model2;
+layout(location=3) in vec4 model3;
+layout(location=4) in vec4 sphere; // Bounding sphere in object space
+layout(location=5) in float selection;
+
+// World space, normalized
+uniform vec4 frustumPlanes[6];
+
+out vec4 vModel0;
+out vec4 vModel1;
+out vec4 vModel2;
+out vec4 vModel3;
+out float vSelection;
+out float vVisible;
+
+void main(void)
+{
+    mat4 model = mat4(model0, model1, model2, model3);
+    vec3 center = (model * vec4(sphere.xyz, 1.0)).xyz;
+    float radius = sphere.w * max(length(model0.xyz), max(length(model1.xyz), length(model2.xyz)));
+
+    vVisible = 1.0;
+    for (int i = 0; i < 6; ++i)
+    {
+        if (dot(frustumPlanes[i].xyz, center) + frustumPlanes[i].w < -radius) vVisible = 0.0;
+    }
+
+    vModel0 = model0;
+    vModel1 = model1;
+    vModel2 = model2;
+    vModel3 = model3;
+    vSelection = selection;
+}
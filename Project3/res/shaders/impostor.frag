@@ -0,0 +1,66 @@
+#version 330 core
+
+uniform sampler2D albedoSpecularAtlas;
+uniform sampler2D normalDepthAtlas;
+
+uniform mat4 viewMatrix;
+uniform mat4 modelMatrix;
+uniform mat4 projectionMatrix;
+uniform mat3 normalMatrix;
+
+uniform vec3 impostorCenter;
+uniform float impostorRadius;
+uniform vec3 frameDirection;
+uniform vec3 frameRight;
+uniform vec3 frameUp;
+
+uniform float selectionColor;
+uniform float nearPlane;
+uniform float farPlane;
+
+in vec2 vQuad;
+in vec2 vAtlasCoords;
+
+layout (location = 0) out vec4 outPosition;
+layout (location = 1) out vec4 outNormals;
+layout (location = 2) out vec4 outAlbedo;
+layout (location = 3) out vec4 outSelection;
+layout (location = 4) out vec4 outWorldPos;
+layout (location = 5) out vec4 fragmentdepth;
+layout (location = 6) out vec4 outMPosition;
+layout (location = 7) out vec4 outMNormals;
+
+float LinearizeDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0; // back to NDC
+    return (2.0 * nearPlane * farPlane) / (farPlane + nearPlane - z * (farPlane - nearPlane));
+}
+
+void main(void)
+{
+    vec4 normalDepth = texture(normalDepthAtlas, vAtlasCoords);
+    if (normalDepth.a == 0.0) discard;
+
+    // Surface point seen by the frame (see impostor_bake.frag)
+    vec3 normal = normalize(normalDepth.rgb * 2.0 - vec3(1.0));
+    float offset = impostorRadius * (2.0 * normalDepth.a - 1.0);
+    vec3 pos = impostorCenter + (frameRight * vQuad.x + frameUp * vQuad.y) * impostorRadius + frameDirection * offset;
+
+    vec4 worldPos = modelMatrix * vec4(pos, 1.0);
+    vec4 viewPos = viewMatrix * worldPos;
+    vec4 clipPos = projectionMatrix * viewPos;
+    gl_FragDepth = clipPos.z / clipPos.w * 0.5 + 0.5;
+
+    // Same outputs as deferred_shading.frag
+    outPosition = vec4(pos, 1.0);
+    outNormals = vec4(normal * 0.5 + vec3(0.5), 1.0);
+    outAlbedo = texture(albedoSpecularAtlas, vAtlasCoords);
+    outSelection = vec4(selectionColor);
+
+    float depth = 1.0 - (LinearizeDepth(gl_FragDepth) / farPlane);
+    fragmentdepth = vec4(vec3(depth), 1.0);
+
+    outWorldPos = worldPos;
+    outMPosition = vec4(viewPos.xyz, 1.0);
+    outMNormals = vec4(normalize(normalMatrix * normal), 1.0);
+}
@@ -0,0 +1,29 @@
+#version 330 core
+
+layout(location=0) in vec3 position; // Unit quad
+
+uniform mat4 viewMatrix;
+uniform mat4 modelMatrix;
+uniform mat4 projectionMatrix;
+
+// Bounding sphere of the mesh, and axes of the frame used (object space)
+uniform vec3 impostorCenter;
+uniform float impostorRadius;
+uniform vec3 frameRight;
+uniform vec3 frameUp;
+
+// Rectangle of the frame in the atlas
+uniform vec2 frameOffset;
+uniform float frameSize;
+
+out vec2 vQuad;
+out vec2 vAtlasCoords;
+
+void main(void)
+{
+    vec3 objectPosition = impostorCenter + (frameRight * position.x + frameUp * position.y) * impostorRadius;
+
+    vQuad = position.xy;
+    vAtlasCoords = frameOffset + (position.xy * 0.5 + vec2(0.5)) * frameSize;
+    gl_Position = projectionMatrix * viewMatrix * modelMatrix * vec4(objectPosition, 1.0);
+}
@@ -0,0 +1,32 @@
+#version 330 core
+
+uniform sampler2D albedoTexture;
+uniform sampler2D specularTexture;
+uniform float nearPlane;
+uniform float depthRange;
+
+in vec2 vTexCoords;
+in vec3 vNormal;
+in float vViewDepth;
+
+layout (location = 0) out vec4 outAlbedoSpecular;
+layout (location = 1) out vec4 outNormalDepth;
+
+void main(void)
+{
+    // Same values the geometry pass writes into the G-buffer
+#ifdef HAS_ALBEDO_MAP
+    outAlbedoSpecular.rgb = texture(albedoTexture, vTexCoords).rgb;
+#else
+    outAlbedoSpecular.rgb = vec3(1.0);
+#endif
+#ifdef HAS_SPECULAR_MAP
+    outAlbedoSpecular.a = texture(specularTexture, vTexCoords).r;
+#else
+    outAlbedoSpecular.a = 0.0;
+#endif
+
+    // 1 at the front of the bounding sphere, 0 is left for empty texels
+    float depth = 1.0 - (vViewDepth - nearPlane) / depthRange;
+    outNormalDepth = vec4(normalize(vNormal) * 0.5 + vec3(0.5), clamp(depth, 1.0 / 255.0, 1.0));
+}
@@ -0,0 +1,29 @@
+#version 330 core
+
+layout(location=0) in vec3 position;
+layout(location=1) in vec3 normal;
+layout(location=2) in vec2 texCoords;
+
+uniform mat4 viewMatrix;
+uniform mat4 projectionMatrix;
+
+// Decoding of the quantized attributes (see SubMesh::sendDecoding())
+uniform vec3 positionOffset = vec3(0.0);
+uniform vec3 positionScale = vec3(1.0);
+uniform vec2 texCoordsOffset = vec2(0.0);
+uniform vec2 texCoordsScale = vec2(1.0);
+
+out vec2 vTexCoords;
+out vec3 vNormal;
+out float vViewDepth;
+
+void main(void)
+{
+    vec3 objectPosition = positionOffset + position * positionScale;
+    vec4 viewPosition = viewMatrix * vec4(objectPosition, 1.0);
+
+    vTexCoords = texCoordsOffset + texCoords * texCoordsScale;
+    vNormal = normal;
+    vViewDepth = -viewPosition.z;
+    gl_Position = projectionMatrix * viewPosition;
+}
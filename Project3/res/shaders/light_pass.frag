@@ -9,11 +9,27 @@ uniform sampler2D gNormal;
 uniform sampler2D gAlbedoSpec;
 uniform sampler2D gSSAO;
 
-uniform vec3 lightPositions[8];
-uniform vec3 lightColors[8];
-uniform float lightIntensity[8];
-uniform float lightRange[8];
-uniform bool useSSAO;
+// Number of lights the loop is unrolled for (set by the renderer variant)
+#if defined(LIGHT_COUNT_0)
+#define MAX_LIGHTS 0
+#elif defined(LIGHT_COUNT_1)
+#define MAX_LIGHTS 1
+#elif defined(LIGHT_COUNT_2)
+#define MAX_LIGHTS 2
+#elif defined(LIGHT_COUNT_4)
+#define MAX_LIGHTS 4
+#else
+#define MAX_LIGHTS 8
+#endif
+
+#if MAX_LIGHTS > 0
+// Streamed every frame by the renderer
+layout(std140) uniform Lights
+{
+    vec4 lightPositionRange[MAX_LIGHTS];  // xyz position, w range
+    vec4 lightColorIntensity[MAX_LIGHTS]; // rgb color, a intensity
+};
+#endif
 
 float linear = 0.7;
 float quadratic = 1.8;
@@ -26,41 +42,43 @@ void main()
     // retrieve data from gbuffer
     vec3 FragPos = texture(gPosition, TexCoords).rgb;
     vec3 Normal = (texture(gNormal, TexCoords).rgb - vec3(0.5)) * 2.0;
-    vec3 Diffuse = texture(gAlbedoSpec, TexCoords).rgb;
-    float Specular = texture(gAlbedoSpec, TexCoords).a;
+    vec4 AlbedoSpec = texture(gAlbedoSpec, TexCoords);
+    vec3 Diffuse = AlbedoSpec.rgb;
+    float Specular = AlbedoSpec.a;
     float AmbientOcclusion = 1.0;
 
-    if (useSSAO)
-    {
-        AmbientOcclusion = texture(gSSAO, TexCoords).r;
-    }
+#ifdef USE_SSAO
+    AmbientOcclusion = texture(gSSAO, TexCoords).r;
+#endif
 
     vec3 lighting = backgroundColor;
 
     if (length(Normal) >= 0.9 && length(Normal) <= 1.1)
     {    // then calculate lighting as usual
         lighting  = Diffuse * 0.1 * AmbientOcclusion; // hard-coded ambient component
+#if MAX_LIGHTS > 0
         vec3 viewDir  = normalize(viewPos - FragPos);
-        for(int i = 0; i < 8; ++i)
+        for(int i = 0; i < MAX_LIGHTS; ++i)
         {
-            float distance = length(lightPositions[i] - FragPos);
-            if (distance <= lightRange[i])
+            float distance = length(lightPositionRange[i].xyz - FragPos);
+            if (distance <= lightPositionRange[i].w)
             {
                 // diffuse
-                vec3 lightDir = normalize(lightPositions[i] - FragPos);
-                vec3 diffuse = max(dot(Normal, lightDir), 0.0) * Diffuse * lightColors[i];
+                vec3 lightDir = normalize(lightPositionRange[i].xyz - FragPos);
+                vec3 diffuse = max(dot(Normal, lightDir), 0.0) * Diffuse * lightColorIntensity[i].rgb;
                 // specular
                 vec3 halfwayDir = normalize(lightDir + viewDir);
                 float spec = pow(max(dot(Normal, halfwayDir), 0.0), 16.0);
-                vec3 specular = lightColors[i] * spec * Specular;
+                vec3 specular = lightColorIntensity[i].rgb * spec * Specular;
                 // attenuation
-                float distance = length(lightPositions[i] - FragPos);
+                float distance = length(lightPositionRange[i].xyz - FragPos);
                 float attenuation = 1.0 / (1.0 + linear * distance + quadratic * distance * distance);
                 diffuse *= attenuation;
                 specular *= attenuation;
-                lighting += (diffuse + specular) * lightIntensity[i];
+                lighting += (diffuse + specular) * lightColorIntensity[i].a;
             }
         }
+#endif
     }
 
     outColor = vec4(lighting, 1.0);
@@ -0,0 +1,6 @@
+#version 330 core
+
+// Only the samples that pass the depth test matter (see OcclusionCulling)
+void main(void)
+{
+}
@@ -0,0 +1,11 @@
+#version 330 core
+
+layout(location=0) in vec3 position;
+
+// Unit cube to clip space, through the bounds of the mesh
+uniform mat4 boxMatrix;
+
+void main(void)
+{
+    gl_Position = boxMatrix * vec4(position, 1.0);
+}
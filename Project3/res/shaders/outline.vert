@@ -5,7 +5,11 @@ layout(location=0) in vec3 position;
 uniform mat4 projectionMatrix;
 uniform mat4 worldViewMatrix;
 
+// Decoding of quantized positions (see SubMesh::sendDecoding())
+uniform vec3 positionOffset = vec3(0.0);
+uniform vec3 positionScale = vec3(1.0);
+
 void main(void)
 {
-    gl_Position = projectionMatrix * worldViewMatrix * vec4(position, 1);
+    gl_Position = projectionMatrix * worldViewMatrix * vec4(positionOffset + position * positionScale, 1);
 }
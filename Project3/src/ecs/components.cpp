@@ -14,6 +14,14 @@ Transform::Transform() :
 }
 
 QMatrix4x4 Transform::matrix() const
+{
+    if (parent != nullptr) {
+        return parent->matrix() * localMatrix();
+    }
+    return localMatrix();
+}
+
+QMatrix4x4 Transform::localMatrix() const
 {
     QMatrix4x4 mat;
     mat.translate(position);
@@ -38,7 +38,10 @@ class Transform : public Component
 public:
     Transform();
 
+    // World matrix (includes the parents)
     QMatrix4x4 matrix() const;
+    // Relative to the parent
+    QMatrix4x4 localMatrix() const;
 
     ComponentType componentType() const override { return ComponentType::Transform; }
 
@@ -48,6 +51,8 @@ public:
     QVector3D position;
     QQuaternion rotation;
     QVector3D scale;
+
+    Transform *parent = nullptr;
 };
 
 class MeshRenderer : public Component
@@ -65,6 +70,9 @@ public:
 
     Mesh *mesh = nullptr;
     QVector<Material*> materials;
+
+    int lod = 0; // Level of detail of the last frame (see Renderer::selectLod())
+    bool impostor = false; // Drawn as an impostor in the last frame (see Impostors)
 };
 
 class LightSource : public Component
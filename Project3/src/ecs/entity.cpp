@@ -78,6 +78,7 @@ Entity *Entity::clone() const
     Entity *entity = scene->addEntity(); // Global scene
     entity->name = name;
     entity->active = active;
+    entity->isStatic = isStatic;
     if (transform != nullptr) {
         //entity->addComponent(ComponentType::Transform); // transforms are created by default
         *entity->transform = *transform;
@@ -35,6 +35,9 @@ public:
     };
 
     bool active = true;
+
+    // Never moves: merged with the other static entities (see StaticBatches)
+    bool isStatic = false;
 };
 
 #endif // ENTITY_H
@@ -40,6 +40,29 @@ Entity *Scene::entityAt(int index)
 
 void Scene::removeEntityAt(int index)
 {
+    // Children keep their place in the world
+    Transform *removed = entities[index]->transform;
+    for (auto entity : entities)
+    {
+        Transform *transform = entity->transform;
+        if (transform != nullptr && removed != nullptr && transform->parent == removed)
+        {
+            const QMatrix4x4 world = transform->matrix();
+            transform->parent = removed->parent;
+            const QMatrix4x4 local = (removed->parent != nullptr) ?
+                        removed->parent->matrix().inverted() * world : world;
+            transform->position = QVector3D(local.column(3));
+            transform->scale = QVector3D(QVector3D(local.column(0)).length(),
+                                         QVector3D(local.column(1)).length(),
+                                         QVector3D(local.column(2)).length());
+            QMatrix3x3 rotation;
+            for (int c = 0; c < 3; ++c)
+                for (int r = 0; r < 3; ++r)
+                    rotation(r, c) = (transform->scale[c] != 0.0f) ? local(r, c) / transform->scale[c] : 0.0f;
+            transform->rotation = QQuaternion::fromRotationMatrix(rotation);
+        }
+    }
+
     delete entities[index];
     entities.removeAt(index);
 }
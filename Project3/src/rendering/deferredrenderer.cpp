@@ -8,13 +8,21 @@
 #include "resources/shaderprogram.h"
 #include "resources/resourcemanager.h"
 #include "framebufferobject.h"
+#include "impostors.h"
+#include "texturearrays.h"
+#include "staticbatches.h"
+#include "gpuculling.h"
+#include "occlusionculling.h"
+#include "ringbuffer.h"
 #include "gl.h"
 #include "globals.h"
 #include <QVector>
 #include <QVector3D>
+#include <QVector4D>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLTexture>
 
+#include <algorithm>
 #include <iostream>
 #include <random>
 
@@ -46,6 +54,53 @@ static void sendLightsToProgram(QOpenGLShaderProgram &program, const QMatrix4x4
     program.setUniformValue("lightCount", lightPosition.size());
 }
 
+// Variant bits of the geometry program (see deferredGeometry->features)
+enum GeometryFeature
+{
+    GEOMETRY_ALBEDO_MAP     = 1 << 0,
+    GEOMETRY_SPECULAR_MAP   = 1 << 1,
+    GEOMETRY_TEXTURE_ARRAYS = 1 << 2,
+    GEOMETRY_STATIC_BATCH   = 1 << 3,
+    GEOMETRY_INSTANCED      = 1 << 4
+};
+
+// Unit of the selection colors of the static batches (the maps use 0 and 2)
+static const int BATCH_SELECTION_UNIT = 4;
+
+// Variant bits of the light program (see deferredLight->features)
+enum LightFeature
+{
+    LIGHT_SSAO    = 1 << 0,
+    LIGHT_COUNT_0 = 1 << 1,
+    LIGHT_COUNT_1 = 1 << 2,
+    LIGHT_COUNT_2 = 1 << 3,
+    LIGHT_COUNT_4 = 1 << 4
+};
+
+static const int MAX_DEFERRED_LIGHTS = 8;
+
+// Uniform block binding point of the lights
+static const GLuint LIGHTS_BLOCK_BINDING = 0;
+
+// The passes only differ in the depth test
+static void applyDepthTest(bool depthTest)
+{
+    OpenGLState state;
+    state.depthTest = depthTest;
+    state.apply();
+}
+
+// Smallest light loop that fits the given number of lights
+static quint32 lightCountFeature(int count, int &bucketSize)
+{
+    if (count == 0) { bucketSize = 0; return LIGHT_COUNT_0; }
+    if (count == 1) { bucketSize = 1; return LIGHT_COUNT_1; }
+    if (count == 2) { bucketSize = 2; return LIGHT_COUNT_2; }
+    if (count <= 4) { bucketSize = 4; return LIGHT_COUNT_4; }
+    bucketSize = MAX_DEFERRED_LIGHTS;
+    return 0;
+}
+
 float DeferredRenderer::Lerp(float a, float b, float f)
 {
     return a + f * (b - a);
@@ -81,7 +136,7 @@ void DeferredRenderer::GenerateSSAOTextures()
             ssaoNoise.push_back(noise);
         }
         gl->glGenTextures(1, &noiseTexture);
-        gl->glBindTexture(GL_TEXTURE_2D, noiseTexture);
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, noiseTexture);
         gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 4, 4, 0, GL_RGB, GL_FLOAT, &ssaoNoise[0]);
         gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -115,6 +170,7 @@ DeferredRenderer::DeferredRenderer() :
     addTexture("SSAO Blur");
 
     rendererType = RendererType::DEFERRED;
+    supportsImpostors = true;
 }
 
 DeferredRenderer::~DeferredRenderer()
@@ -134,6 +190,7 @@ void DeferredRenderer::initialize()
     deferredGeometry->name = "Deferred Geometry";
     deferredGeometry->vertexShaderFilename = "res/shaders/deferred_shading.vert";
     deferredGeometry->fragmentShaderFilename = "res/shaders/deferred_shading.frag";
+    deferredGeometry->features << "HAS_ALBEDO_MAP" << "HAS_SPECULAR_MAP" << "USE_TEXTURE_ARRAYS" << "STATIC_BATCH" << "INSTANCED";
     deferredGeometry->includeForSerialization = false;
 
     outlineGeometry = resourceManager->createShaderProgram();
@@ -146,6 +203,7 @@ void DeferredRenderer::initialize()
     deferredLight->name = "Deferred Light";
     deferredLight->vertexShaderFilename = "res/shaders/light_pass.vert";
     deferredLight->fragmentShaderFilename = "res/shaders/light_pass.frag";
+    deferredLight->features << "USE_SSAO" << "LIGHT_COUNT_0" << "LIGHT_COUNT_1" << "LIGHT_COUNT_2" << "LIGHT_COUNT_4";
     deferredLight->includeForSerialization = false;
 
     blitProgram = resourceManager->createShaderProgram();
@@ -190,6 +248,24 @@ void DeferredRenderer::initialize()
 
     SSAOBlurFBO = new FramebufferObject();
     SSAOBlurFBO->create();
+
+    impostors = new Impostors();
+    impostors->initialize();
+
+    frameData = new RingBuffer();
+    frameData->initialize();
+
+    textureArrays = new TextureArrays();
+    textureArrays->initialize();
+
+    staticBatches = new StaticBatches();
+    staticBatches->initialize();
+
+    gpuCulling = new GpuCulling();
+    gpuCulling->initialize();
+
+    occlusionCulling = new OcclusionCulling();
+    occlusionCulling->initialize();
 }
 
 void DeferredRenderer::finalize()
@@ -211,15 +287,33 @@ void DeferredRenderer::finalize()
 
     SSAOBlurFBO->destroy();
     delete SSAOBlurFBO;
+
+    impostors->finalize();
+    delete impostors;
+
+    frameData->finalize();
+    delete frameData;
+
+    textureArrays->finalize();
+    delete textureArrays;
+
+    staticBatches->finalize();
+    delete staticBatches;
+
+    gpuCulling->finalize();
+    delete gpuCulling;
+
+    occlusionCulling->finalize();
+    delete occlusionCulling;
 }
 
 void DeferredRenderer::GenerateGeometryFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (texturePosition != 0) gl->glDeleteTextures(1, &texturePosition);
+    if (texturePosition != 0) { OpenGLState::forgetTexture(texturePosition); gl->glDeleteTextures(1, &texturePosition); }
     gl->glGenTextures(1, &texturePosition);
-    gl->glBindTexture(GL_TEXTURE_2D, texturePosition);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, texturePosition);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -227,9 +321,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureNormal != 0) gl->glDeleteTextures(1, &textureNormal);
+    if (textureNormal != 0) { OpenGLState::forgetTexture(textureNormal); gl->glDeleteTextures(1, &textureNormal); }
     gl->glGenTextures(1, &textureNormal);
-    gl->glBindTexture(GL_TEXTURE_2D, textureNormal);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureNormal);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -237,9 +331,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureAlbedo != 0) gl->glDeleteTextures(1, &textureAlbedo);
+    if (textureAlbedo != 0) { OpenGLState::forgetTexture(textureAlbedo); gl->glDeleteTextures(1, &textureAlbedo); }
     gl->glGenTextures(1, &textureAlbedo);
-    gl->glBindTexture(GL_TEXTURE_2D, textureAlbedo);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureAlbedo);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -247,9 +341,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureSelection != 0) gl->glDeleteTextures(1, &textureSelection);
+    if (textureSelection != 0) { OpenGLState::forgetTexture(textureSelection); gl->glDeleteTextures(1, &textureSelection); }
     gl->glGenTextures(1, &textureSelection);
-    gl->glBindTexture(GL_TEXTURE_2D, textureSelection);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureSelection);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -257,9 +351,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureDepth != 0) gl->glDeleteTextures(1, &textureDepth);
+    if (textureDepth != 0) { OpenGLState::forgetTexture(textureDepth); gl->glDeleteTextures(1, &textureDepth); }
     gl->glGenTextures(1, &textureDepth);
-    gl->glBindTexture(GL_TEXTURE_2D, textureDepth);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureDepth);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -267,9 +361,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureWorldPos != 0) gl->glDeleteTextures(1, &textureWorldPos);
+    if (textureWorldPos != 0) { OpenGLState::forgetTexture(textureWorldPos); gl->glDeleteTextures(1, &textureWorldPos); }
     gl->glGenTextures(1, &textureWorldPos);
-    gl->glBindTexture(GL_TEXTURE_2D, textureWorldPos);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureWorldPos);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -277,9 +371,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureMPosition != 0) gl->glDeleteTextures(1, &textureMPosition);
+    if (textureMPosition != 0) { OpenGLState::forgetTexture(textureMPosition); gl->glDeleteTextures(1, &textureMPosition); }
     gl->glGenTextures(1, &textureMPosition);
-    gl->glBindTexture(GL_TEXTURE_2D, textureMPosition);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureMPosition);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -287,9 +381,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (textureMNormals != 0) gl->glDeleteTextures(1, &textureMNormals);
+    if (textureMNormals != 0) { OpenGLState::forgetTexture(textureMNormals); gl->glDeleteTextures(1, &textureMNormals); }
     gl->glGenTextures(1, &textureMNormals);
-    gl->glBindTexture(GL_TEXTURE_2D, textureMNormals);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureMNormals);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -297,9 +391,9 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (depthAttachment != 0) gl->glDeleteTextures(1, &depthAttachment);
+    if (depthAttachment != 0) { OpenGLState::forgetTexture(depthAttachment); gl->glDeleteTextures(1, &depthAttachment); }
     gl->glGenTextures(1, &depthAttachment);
-    gl->glBindTexture(GL_TEXTURE_2D, depthAttachment);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, depthAttachment);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -307,7 +401,7 @@ void DeferredRenderer::GenerateGeometryFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
     fboGeometry->bind();
@@ -343,9 +437,9 @@ void DeferredRenderer::GenerateLightFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (textureFinal == 0) gl->glDeleteTextures(1, &textureFinal);
+    if (textureFinal == 0) { OpenGLState::forgetTexture(textureFinal); gl->glDeleteTextures(1, &textureFinal); }
     gl->glGenTextures(1, &textureFinal);
-    gl->glBindTexture(GL_TEXTURE_2D, textureFinal);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureFinal);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -353,7 +447,7 @@ void DeferredRenderer::GenerateLightFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
 
@@ -375,9 +469,9 @@ void DeferredRenderer::GenerateOutlineFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (textureOutline != 0) gl->glDeleteTextures(1, &textureOutline);
+    if (textureOutline != 0) { OpenGLState::forgetTexture(textureOutline); gl->glDeleteTextures(1, &textureOutline); }
     gl->glGenTextures(1, &textureOutline);
-    gl->glBindTexture(GL_TEXTURE_2D, textureOutline);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureOutline);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -385,7 +479,7 @@ void DeferredRenderer::GenerateOutlineFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
     fboOutline->bind();
@@ -406,9 +500,9 @@ void DeferredRenderer::GenerateGridFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (textureGrid != 0) gl->glDeleteTextures(1, &textureGrid);
+    if (textureGrid != 0) { OpenGLState::forgetTexture(textureGrid); gl->glDeleteTextures(1, &textureGrid); }
     gl->glGenTextures(1, &textureGrid);
-    gl->glBindTexture(GL_TEXTURE_2D, textureGrid);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureGrid);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -416,7 +510,7 @@ void DeferredRenderer::GenerateGridFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
     fboGrid->bind();
@@ -444,9 +538,9 @@ void DeferredRenderer::GenerateSSAOFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (textureSSAO != 0) gl->glDeleteTextures(1, &textureSSAO);
+    if (textureSSAO != 0) { OpenGLState::forgetTexture(textureSSAO); gl->glDeleteTextures(1, &textureSSAO); }
     gl->glGenTextures(1, &textureSSAO);
-    gl->glBindTexture(GL_TEXTURE_2D, textureSSAO);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureSSAO);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -454,7 +548,7 @@ void DeferredRenderer::GenerateSSAOFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
     fboSSAO->bind();
@@ -475,9 +569,9 @@ void DeferredRenderer::GenerateSSAOBlurFBO(int w, int h)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    if (textureSSAOBlur != 0) gl->glDeleteTextures(1, &textureSSAOBlur);
+    if (textureSSAOBlur != 0) { OpenGLState::forgetTexture(textureSSAOBlur); gl->glDeleteTextures(1, &textureSSAOBlur); }
     gl->glGenTextures(1, &textureSSAOBlur);
-    gl->glBindTexture(GL_TEXTURE_2D, textureSSAOBlur);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureSSAOBlur);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -485,7 +579,7 @@ void DeferredRenderer::GenerateSSAOBlurFBO(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    glBindTexture(GL_TEXTURE_2D,0);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, 0);
 
     // Attach textures to the fbo
     SSAOBlurFBO->bind();
@@ -534,6 +628,8 @@ void DeferredRenderer::resize(int w, int h)
 
 void DeferredRenderer::RenderGeometry(Camera *camera)
 {
+    applyDepthTest(true);
+
     fboGeometry->bind();
 
     // Clear color
@@ -549,6 +645,8 @@ void DeferredRenderer::RenderGeometry(Camera *camera)
 
 void DeferredRenderer::RenderOutline(Camera *camera)
 {
+    applyDepthTest(true);
+
     fboOutline->bind();
 
     // Clear color
@@ -566,6 +664,8 @@ void DeferredRenderer::RenderOutline(Camera *camera)
 
 void DeferredRenderer::RenderSSAO(Camera *camera)
 {
+    applyDepthTest(true);
+
     fboSSAO->bind();
 
     // Clear color
@@ -584,6 +684,8 @@ void DeferredRenderer::RenderSSAO(Camera *camera)
 
 void DeferredRenderer::RenderSSAOBlur(Camera *camera)
 {
+    applyDepthTest(true);
+
     SSAOBlurFBO->bind();
 
     //Clear Color
@@ -617,6 +719,8 @@ void DeferredRenderer::RenderLight(Camera *camera)
 
 void DeferredRenderer::RenderGrid(Camera *camera)
 {
+    applyDepthTest(true);
+
     fboGrid->bind();
 
     // Clear color
@@ -649,6 +753,9 @@ void DeferredRenderer::render(Camera *camera)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
+    statistics = RenderStatistics();
+    frameData->beginFrame();
+
     RenderGeometry(camera);
 
     RenderOutline(camera);
@@ -666,94 +773,374 @@ void DeferredRenderer::render(Camera *camera)
 
     //Store the new selection texture pixels
     StoreSelectionPixels();
+
+    // Impostors requested this frame are drawn from the next one
+    impostors->bakePending();
+    textureArrays->packPending();
+
+    frameData->endFrame();
+    statistics.frameDataBytes = frameData->bytes;
+    statistics.frameDataStalls = frameData->stalls;
+    statistics.frameDataWraps = frameData->wraps;
+    statistics.glCallsIssued = OpenGLState::counters.issued;
+    statistics.glCallsFiltered = OpenGLState::counters.filtered;
+    statistics.textureBinds = OpenGLState::counters.textureBinds;
+}
+
+quint32 DeferredRenderer::materialFeatures(Material *material, const TextureLayer *&albedoLayer, const TextureLayer *&specularLayer)
+{
+    // Only sample the maps the material actually has
+    quint32 features = 0;
+    if (material->albedoTexture != nullptr) features |= GEOMETRY_ALBEDO_MAP;
+    if (material->specularTexture != nullptr) features |= GEOMETRY_SPECULAR_MAP;
+
+    // Array layers of the maps, once all of them are packed
+    albedoLayer = nullptr;
+    specularLayer = nullptr;
+    if (miscSettings->useTextureArrays && features != 0)
+    {
+        if (features & GEOMETRY_ALBEDO_MAP) albedoLayer = textureArrays->layer(material->albedoTexture);
+        if (features & GEOMETRY_SPECULAR_MAP) specularLayer = textureArrays->layer(material->specularTexture);
+        if ((albedoLayer != nullptr || !(features & GEOMETRY_ALBEDO_MAP)) &&
+            (specularLayer != nullptr || !(features & GEOMETRY_SPECULAR_MAP)))
+        {
+            features |= GEOMETRY_TEXTURE_ARRAYS;
+        }
+    }
+
+    return features;
+}
+
+void DeferredRenderer::sendMaterial(QOpenGLShaderProgram &program, Material *material, quint32 features,
+                                    const TextureLayer *albedoLayer, const TextureLayer *specularLayer)
+{
+    program.setUniformValue("albedo", material->albedo);
+    program.setUniformValue("emissive", material->emissive);
+    program.setUniformValue("specular", material->specular);
+    program.setUniformValue("smoothness", material->smoothness);
+    program.setUniformValue("bumpiness", material->bumpiness);
+    program.setUniformValue("tiling", material->tiling);
+
+    if (features & GEOMETRY_TEXTURE_ARRAYS) {
+        // Same array as the previous material: only the layer changes
+        if (albedoLayer != nullptr) {
+            program.setUniformValue("albedoArray", 0);
+            program.setUniformValue("albedoLayer", float(albedoLayer->layer));
+            OpenGLState::bindTexture(0, GL_TEXTURE_2D_ARRAY, albedoLayer->array);
+        }
+        if (specularLayer != nullptr) {
+            program.setUniformValue("specularArray", 2);
+            program.setUniformValue("specularLayer", float(specularLayer->layer));
+            OpenGLState::bindTexture(2, GL_TEXTURE_2D_ARRAY, specularLayer->array);
+        }
+    }
+    else {
+        if (features & GEOMETRY_ALBEDO_MAP) {
+            program.setUniformValue("albedoTexture", 0);
+            material->albedoTexture->bind(0);
+        }
+        if (features & GEOMETRY_SPECULAR_MAP) {
+            program.setUniformValue("specularTexture", 2);
+            material->specularTexture->bind(2);
+        }
+    }
+}
+
+void DeferredRenderer::drawMesh(MeshRenderer *meshRenderer, Camera *camera, float percent, QOpenGLShaderProgram *&boundProgram)
+{
+    QMatrix4x4 modelMatrix = meshRenderer->entity->transform->matrix();
+    QMatrix3x3 normalMatrix = (camera->viewMatrix * modelMatrix).normalMatrix();
+
+    // Variant that received the uniforms of this object: they have
+    // to be sent again whenever a submesh switches variants
+    QOpenGLShaderProgram *objectProgram = nullptr;
+
+    int materialIndex = 0;
+    for (auto submesh : meshRenderer->mesh->submeshes)
+    {
+        // Get material from the component
+        Material *material = nullptr;
+        if (materialIndex < meshRenderer->materials.size()) {
+            material = meshRenderer->materials[materialIndex];
+        }
+        if (material == nullptr) {
+            material = resourceManager->materialWhite;
+        }
+        materialIndex++;
+
+        const TextureLayer *albedoLayer = nullptr;
+        const TextureLayer *specularLayer = nullptr;
+        const quint32 features = materialFeatures(material, albedoLayer, specularLayer);
+
+        QOpenGLShaderProgram &program = deferredGeometry->variant(features);
+        if (&program != boundProgram)
+        {
+            if (!OpenGLState::bindProgram(program)) continue;
+            boundProgram = &program;
+        }
+
+        if (objectProgram != boundProgram)
+        {
+            program.setUniformValue("viewMatrix", camera->viewMatrix);
+            program.setUniformValue("normalMatrix", normalMatrix);
+            program.setUniformValue("modelMatrix", modelMatrix);
+            program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+            program.setUniformValue("uWorldPos", meshRenderer->entity->transform->position);
+            program.setUniformValue("selectionColor", percent);
+            program.setUniformValue("nearPlane", camera->znear);
+            program.setUniformValue("farPlane", camera->zfar);
+            objectProgram = boundProgram;
+        }
+
+        // Send the material to the shader
+        sendMaterial(program, material, features, albedoLayer, specularLayer);
+
+        submesh->sendDecoding(program);
+        drawSubMesh(meshRenderer, submesh);
+    }
 }
 
 void DeferredRenderer::passMeshes(Camera *camera)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    QOpenGLShaderProgram &program = deferredGeometry->program;
+    staticBatches->update();
+
+    QVector<MeshRenderer*> meshRenderers;
+    QVector<MeshRenderer*> unbatched;
 
-    if (program.bind())
+    // Get components (all of them count for the selection colors)
+    for (auto entity : scene->entities)
     {
-        sendLightsToProgram(program, camera->viewMatrix);
+        if (entity->active && entity->meshRenderer != nullptr)
+        {
+            meshRenderers.push_back(entity->meshRenderer);
+        }
+    }
 
-        QVector<MeshRenderer*> meshRenderers;
-        QVector<LightSource*> lightSources;
+    // Instances grouped for the GPU culling skip the CPU side culling
+    gpuCulling->collect(meshRenderers, staticBatches);
+    for (auto meshRenderer : meshRenderers)
+    {
+        if (!staticBatches->contains(meshRenderer->entity) && !gpuCulling->contains(meshRenderer))
+        {
+            unbatched.push_back(meshRenderer);
+        }
+    }
 
-        // Get components
-        for (auto entity : scene->entities)
+    prepareMeshes(unbatched, camera);
+    occlusionCulling->beginFrame(unbatched, camera);
+
+    // Variant currently bound
+    QOpenGLShaderProgram *boundProgram = nullptr;
+
+    // Meshes drawn as impostors, with their atlas and selection color
+    struct ImpostorDraw { const MeshRenderer *meshRenderer; const ImpostorAtlas *atlas; float percent; };
+    QVector<ImpostorDraw> impostorDraws;
+
+    // Meshes hidden in the last occlusion results, with their selection color
+    struct HiddenDraw { MeshRenderer *meshRenderer; float percent; };
+    QVector<HiddenDraw> hiddenDraws;
+
+    // Front to back with occlusion culling: the queries of the visible
+    // meshes only see the occluders that wrote their depth before them.
+    // The selection colors stay tied to the order of the entities.
+    QVector<int> order(meshRenderers.size());
+    for (int i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    if (miscSettings->useOcclusionCulling)
+    {
+        QVector<float> distances(meshRenderers.size(), 0.0f);
+        for (int i = 0; i < meshRenderers.size(); ++i)
         {
-            if (entity->active)
+            const MeshRenderer *meshRenderer = meshRenderers[i];
+            if (meshRenderer->mesh == nullptr) continue;
+
+            const Bounds &bounds = meshRenderer->mesh->bounds;
+            const QVector3D center = meshRenderer->entity->transform->matrix().map((bounds.min + bounds.max) * 0.5f);
+            distances[i] = (center - camera->position).lengthSquared();
+        }
+        std::sort(order.begin(), order.end(), [&distances](int a, int b) { return distances[a] < distances[b]; });
+    }
+
+    // Meshes
+    for (int i : order)
+    {
+        float percent = (i + 1.0f) / meshRenderers.size();
+
+        auto meshRenderer = meshRenderers[i];
+        auto mesh = meshRenderer->mesh;
+
+        // Drawn below with the static batches
+        if (staticBatches->contains(meshRenderer->entity))
+        {
+            staticBatches->setSelectionColor(meshRenderer->entity, percent);
+            continue;
+        }
+
+        // Drawn below with the instances culled on the GPU
+        if (gpuCulling->contains(meshRenderer)) continue;
+
+        // Until its atlas is baked the mesh is drawn as usual
+        if (mesh != nullptr && meshRenderer->impostor)
+        {
+            const ImpostorAtlas *atlas = impostors->atlas(meshRenderer);
+            if (atlas != nullptr)
             {
-                if (entity->meshRenderer != nullptr) { meshRenderers.push_back(entity->meshRenderer); }
-                if (entity->lightSource != nullptr) { lightSources.push_back(entity->lightSource); }
+                impostorDraws.push_back({ meshRenderer, atlas, percent });
+                continue;
             }
         }
 
-        // Meshes
-        for (int i = 0; i < meshRenderers.size(); ++i)
+        if (mesh != nullptr)
         {
-            float percent = (i + 1.0f) / meshRenderers.size();
+            // Hidden in the last occlusion results: only its bounds are
+            // queried, once everything else has filled the depth buffer
+            if (!occlusionCulling->isVisible(meshRenderer))
+            {
+                hiddenDraws.push_back({ meshRenderer, percent });
+                continue;
+            }
 
-            auto meshRenderer = meshRenderers[i];
-            auto mesh = meshRenderer->mesh;
+            const bool queried = occlusionCulling->beginQuery(meshRenderer);
+            drawMesh(meshRenderer, camera, percent, boundProgram);
+            if (queried) occlusionCulling->endQuery();
+        }
+    }
 
-            if (mesh != nullptr)
+    // Static batches: world space vertices, one draw per material and cell
+    const QVector<const StaticBatch*> batches = staticBatches->visible(camera);
+    if (!batches.isEmpty())
+    {
+        staticBatches->bindSelectionColors(BATCH_SELECTION_UNIT);
+
+        // Variant that received the camera uniforms
+        QOpenGLShaderProgram *batchProgram = nullptr;
+
+        for (const StaticBatch *batch : batches)
+        {
+            const TextureLayer *albedoLayer = nullptr;
+            const TextureLayer *specularLayer = nullptr;
+            const quint32 features = materialFeatures(batch->material, albedoLayer, specularLayer) | GEOMETRY_STATIC_BATCH;
+
+            QOpenGLShaderProgram &program = deferredGeometry->variant(features);
+            if (&program != boundProgram)
             {
-                QMatrix3x3 normalMatrix = (camera->viewMatrix * meshRenderer->entity->transform->matrix()).normalMatrix();
+                if (!OpenGLState::bindProgram(program)) continue;
+                boundProgram = &program;
+            }
 
+            if (batchProgram != boundProgram)
+            {
                 program.setUniformValue("viewMatrix", camera->viewMatrix);
-                program.setUniformValue("normalMatrix", normalMatrix);
-                program.setUniformValue("modelMatrix", meshRenderer->entity->transform->matrix());
+                program.setUniformValue("normalMatrix", camera->viewMatrix.normalMatrix());
+                program.setUniformValue("modelMatrix", QMatrix4x4());
                 program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+                program.setUniformValue("uWorldPos", QVector3D());
+                program.setUniformValue("entitySelection", BATCH_SELECTION_UNIT);
+                program.setUniformValue("nearPlane", camera->znear);
+                program.setUniformValue("farPlane", camera->zfar);
+                batchProgram = boundProgram;
+            }
 
-                program.setUniformValue("uWorldPos", meshRenderer->entity->transform->position);
+            sendMaterial(program, batch->material, features, albedoLayer, specularLayer);
 
-                int materialIndex = 0;
-                for (auto submesh : mesh->submeshes)
-                {
-                    // Get material from the component
-                    Material *material = nullptr;
-                    if (materialIndex < meshRenderer->materials.size()) {
-                        material = meshRenderer->materials[materialIndex];
-                    }
-                    if (material == nullptr) {
-                        material = resourceManager->materialWhite;
-                    }
-                    materialIndex++;
-
-                    #define SEND_TEXTURE(uniformName, tex1, tex2, texUnit) \
-                        program.setUniformValue(uniformName, texUnit); \
-                        if (tex1 != nullptr) { \
-                        tex1->bind(texUnit); \
-                                    } else { \
-                        tex2->bind(texUnit); \
-                        }
-
-                    // Send the material to the shader
-                    program.setUniformValue("albedo", material->albedo);
-                    program.setUniformValue("emissive", material->emissive);
-                    program.setUniformValue("specular", material->specular);
-                    program.setUniformValue("smoothness", material->smoothness);
-                    program.setUniformValue("bumpiness", material->bumpiness);
-                    program.setUniformValue("tiling", material->tiling);
-
-                    program.setUniformValue("selectionColor", percent);
-                    program.setUniformValue("nearPlane", camera->znear);
-                    program.setUniformValue("farPlane", camera->zfar);
-
-                    SEND_TEXTURE("albedoTexture", material->albedoTexture, resourceManager->texWhite, 0);
-                    SEND_TEXTURE("emissiveTexture", material->emissiveTexture, resourceManager->texBlack, 1);
-                    SEND_TEXTURE("specularTexture", material->specularTexture, resourceManager->texBlack, 2);
-                    SEND_TEXTURE("normalTexture", material->normalsTexture, resourceManager->texNormal, 3);
-                    SEND_TEXTURE("bumpTexture", material->bumpTexture, resourceManager->texWhite, 4);
-
-                    submesh->draw();
-                }
+            batch->submesh->sendDecoding(program);
+            batch->submesh->draw();
+            statistics.triangles += batch->submesh->triangleCount();
+            statistics.staticBatches++;
+        }
+    }
+
+    // Instances: culled on the GPU, then one instanced draw per submesh
+    gpuCulling->cull(camera);
+    for (InstanceGroup *group : gpuCulling->groups())
+    {
+        // Variant that received the camera uniforms
+        QOpenGLShaderProgram *instanceProgram = nullptr;
+
+        for (int i = 0; i < group->mesh->submeshes.size(); ++i)
+        {
+            SubMesh *submesh = group->mesh->submeshes[i];
+
+            Material *material = nullptr;
+            if (i < group->materials.size()) {
+                material = group->materials[i];
+            }
+            if (material == nullptr) {
+                material = resourceManager->materialWhite;
+            }
+
+            const TextureLayer *albedoLayer = nullptr;
+            const TextureLayer *specularLayer = nullptr;
+            const quint32 features = materialFeatures(material, albedoLayer, specularLayer) | GEOMETRY_INSTANCED;
+
+            QOpenGLShaderProgram &program = deferredGeometry->variant(features);
+            if (&program != boundProgram)
+            {
+                if (!OpenGLState::bindProgram(program)) continue;
+                boundProgram = &program;
+            }
+
+            if (instanceProgram != boundProgram)
+            {
+                program.setUniformValue("viewMatrix", camera->viewMatrix);
+                program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+                program.setUniformValue("uWorldPos", QVector3D());
+                program.setUniformValue("nearPlane", camera->znear);
+                program.setUniformValue("farPlane", camera->zfar);
+                instanceProgram = boundProgram;
+            }
+
+            sendMaterial(program, material, features, albedoLayer, specularLayer);
+
+            submesh->sendDecoding(program);
+            const int visible = gpuCulling->draw(group, submesh, i);
+            if (visible > 0) statistics.triangles += qint64(visible) * submesh->triangleCount();
+        }
+        statistics.gpuInstances += group->instanceCount;
+    }
+
+    // Bounds of the hidden meshes against all the above, a batch of queries
+    // at a time. With conditional rendering the meshes of a batch are drawn
+    // right after it, when their bounds pass: the GPU has had the time of
+    // the whole batch to finish the first queries.
+    const int queryBatch = qMax(1, miscSettings->occlusionQueryBatch);
+    for (int first = 0; first < hiddenDraws.size(); first += queryBatch)
+    {
+        const int last = qMin(first + queryBatch, hiddenDraws.size());
+
+        QVector<MeshRenderer*> batch;
+        for (int i = first; i < last; ++i) {
+            batch.push_back(hiddenDraws[i].meshRenderer);
+        }
+        occlusionCulling->queryBounds(batch);
+        boundProgram = nullptr;
+
+        if (!miscSettings->occlusionConditionalRender) continue;
+
+        for (int i = first; i < last; ++i)
+        {
+            const HiddenDraw &draw = hiddenDraws[i];
+            if (occlusionCulling->beginConditionalRender(draw.meshRenderer))
+            {
+                drawMesh(draw.meshRenderer, camera, draw.percent, boundProgram);
+                occlusionCulling->endConditionalRender();
             }
         }
-        program.release();
+    }
+    statistics.occludedMeshes += hiddenDraws.size();
+    statistics.occlusionQueries += occlusionCulling->queries;
+
+    if (!impostorDraws.isEmpty())
+    {
+        impostors->beginPass(camera);
+        for (const ImpostorDraw &draw : impostorDraws) {
+            impostors->draw(draw.meshRenderer, draw.atlas, camera, draw.percent);
+        }
+        impostors->endPass();
+        statistics.impostors += impostorDraws.size();
     }
 }
 
@@ -763,7 +1150,7 @@ void DeferredRenderer::passOutline(Camera *camera)
 
     QOpenGLShaderProgram &program = outlineGeometry->program;
 
-    if (program.bind())
+    if (OpenGLState::bindProgram(program))
     {
         program.setUniformValue("viewMatrix", camera->viewMatrix);
         program.setUniformValue("projectionMatrix", camera->projectionMatrix);
@@ -801,12 +1188,13 @@ void DeferredRenderer::passOutline(Camera *camera)
                 for (auto submesh : mesh->submeshes)
                 {
                     if (selection->contains(meshRenderer->entity))
-                        submesh->draw();
+                    {
+                        submesh->sendDecoding(program);
+                        submesh->drawPositions(GL_TRIANGLES, meshRenderer->lod);
+                    }
                 }
             }
         }
-
-        program.release();
     }
 }
 
@@ -815,65 +1203,73 @@ void DeferredRenderer::passLights(Camera *camera)
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    gl->glDisable(GL_DEPTH_TEST);
+    applyDepthTest(false);
 
-    QOpenGLShaderProgram &program = deferredLight->program;
+    // Layout of the std140 Lights block: position and range, then color and intensity
+    QVector<QVector4D> lightPositionRange;
+    QVector<QVector4D> lightColorIntensity;
 
-    if(program.bind())
+    if (miscSettings->renderLightSources)
     {
-        program.setUniformValue("viewMatrix", camera->viewMatrix);
-        program.setUniformValue("projectionMatrix", camera->projectionMatrix);
-
-        QVector<QVector3D> lightPosition;
-        QVector<QVector3D> lightColors;
-        QVector<GLfloat> lightIntensity;
-        QVector<GLfloat> lightRange;
-
         for (auto entity : scene->entities)
         {
-            if (entity->active && entity->lightSource != nullptr)
+            if (entity->active && entity->lightSource != nullptr && lightPositionRange.size() < MAX_DEFERRED_LIGHTS)
             {
-                lightPosition.push_back(entity->transform->position);
-                lightColors.push_back(QVector3D(entity->lightSource->color.redF(), entity->lightSource->color.greenF(), entity->lightSource->color.blueF()));
-                lightIntensity.push_back(entity->lightSource->intensity);
-                lightRange.push_back(entity->lightSource->range);
+                const QColor &color = entity->lightSource->color;
+                lightPositionRange.push_back(QVector4D(entity->transform->position, entity->lightSource->range));
+                lightColorIntensity.push_back(QVector4D(color.redF(), color.greenF(), color.blueF(), entity->lightSource->intensity));
             }
         }
+    }
+
+    // Pick the variant with the smallest light loop and pad the remaining
+    // slots with lights that never reach any fragment
+    int bucketSize = 0;
+    quint32 features = lightCountFeature(lightPositionRange.size(), bucketSize);
+    if (miscSettings->useSSAO) features |= LIGHT_SSAO;
+    while (lightPositionRange.size() < bucketSize)
+    {
+        lightPositionRange.push_back(QVector4D(0.0f, 0.0f, 0.0f, -1.0f));
+        lightColorIntensity.push_back(QVector4D());
+    }
+
+    QOpenGLShaderProgram &program = deferredLight->variant(features);
+
+    if (OpenGLState::bindProgram(program))
+    {
+        program.setUniformValue("viewMatrix", camera->viewMatrix);
+        program.setUniformValue("projectionMatrix", camera->projectionMatrix);
 
-        if (miscSettings->renderLightSources)
+        if (bucketSize > 0)
         {
-            if(lightPosition.length() > 0 && lightColors.length() > 0)
+            QVector<QVector4D> block = lightPositionRange + lightColorIntensity;
+            RingBuffer::Allocation lights = frameData->upload(block.constData(), block.size() * int(sizeof(QVector4D)), frameData->uniformAlignment());
+
+            const GLuint blockIndex = gl->glGetUniformBlockIndex(program.programId(), "Lights");
+            if (lights.isValid() && blockIndex != GL_INVALID_INDEX)
             {
-                program.setUniformValueArray("lightPositions", &lightPosition[0], lightPosition.length());
-                program.setUniformValueArray("lightColors", &lightColors[0], lightColors.length());
-                program.setUniformValueArray("lightIntensity", &lightIntensity[0], lightIntensity.length(), 1);
-                program.setUniformValueArray("lightRange", &lightRange[0], lightRange.length(), 1);
+                gl->glUniformBlockBinding(program.programId(), blockIndex, LIGHTS_BLOCK_BINDING);
+                RingBuffer::bindUniformBlock(LIGHTS_BLOCK_BINDING, lights);
             }
         }
 
         program.setUniformValue("viewPos", camera->position);
         program.setUniformValue("backgroundColor", QVector3D(miscSettings->backgroundColor.redF(), miscSettings->backgroundColor.greenF(), miscSettings->backgroundColor.blueF()));
-        program.setUniformValue("useSSAO", miscSettings->useSSAO);
 
         program.setUniformValue("gPosition", 0);
-        gl->glActiveTexture(GL_TEXTURE0);
-        gl->glBindTexture(GL_TEXTURE_2D, textureWorldPos);
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureWorldPos);
         program.setUniformValue("gNormal", 1);
-        gl->glActiveTexture(GL_TEXTURE1);
-        gl->glBindTexture(GL_TEXTURE_2D, textureNormal);
+        OpenGLState::bindTexture(1, GL_TEXTURE_2D, textureNormal);
         program.setUniformValue("gAlbedoSpec", 2);
-        gl->glActiveTexture(GL_TEXTURE2);
-        gl->glBindTexture(GL_TEXTURE_2D, textureAlbedo);
-        program.setUniformValue("gSSAO", 3);
-        gl->glActiveTexture(GL_TEXTURE3);
-        gl->glBindTexture(GL_TEXTURE_2D, textureSSAOBlur);
+        OpenGLState::bindTexture(2, GL_TEXTURE_2D, textureAlbedo);
+        if (features & LIGHT_SSAO)
+        {
+            program.setUniformValue("gSSAO", 3);
+            OpenGLState::bindTexture(3, GL_TEXTURE_2D, textureSSAOBlur);
+        }
 
         resourceManager->quad->submeshes[0]->draw();
-
-        program.release();
     }
-
-        gl->glEnable(GL_DEPTH_TEST);
 }
 
 
@@ -883,7 +1279,7 @@ void DeferredRenderer::passGrid(Camera *camera)
 
     QOpenGLShaderProgram &program = gridProgram->program;
 
-    if(program.bind())
+    if (OpenGLState::bindProgram(program))
     {
         QVector4D cameraParameters = camera->getLeftRightBottomTop();
         program.setUniformValue("left", cameraParameters.x());
@@ -898,16 +1294,12 @@ void DeferredRenderer::passGrid(Camera *camera)
         program.setUniformValue("drawGrid", miscSettings->renderGrid) ;
 
         program.setUniformValue("worldPos", 0);
-        gl->glActiveTexture(GL_TEXTURE0);
-        gl->glBindTexture(GL_TEXTURE_2D, textureWorldPos);
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureWorldPos);
 
         program.setUniformValue("finalText", 1);
-        gl->glActiveTexture(GL_TEXTURE1);
-        gl->glBindTexture(GL_TEXTURE_2D, textureFinal);
+        OpenGLState::bindTexture(1, GL_TEXTURE_2D, textureFinal);
 
         resourceManager->quad->submeshes[0]->draw();
-
-        program.release();
     }
 }
 
@@ -917,7 +1309,7 @@ void DeferredRenderer::passSSAO(Camera* camera)
 
     QOpenGLShaderProgram &program = SSAOProgram->program;
 
-    if(program.bind())
+    if (OpenGLState::bindProgram(program))
     {
         program.setUniformValueArray("samples", &ssaoKernel[0], int(ssaoKernel.size()));
         program.setUniformValue("projection", camera->projectionMatrix);
@@ -926,18 +1318,13 @@ void DeferredRenderer::passSSAO(Camera* camera)
         program.setUniformValue("height", float(height));
 
         program.setUniformValue("gPosition", 0);
-        gl->glActiveTexture(GL_TEXTURE0);
-        gl->glBindTexture(GL_TEXTURE_2D, textureMPosition);
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureMPosition);
         program.setUniformValue("gNormal", 1);
-        gl->glActiveTexture(GL_TEXTURE1);
-        gl->glBindTexture(GL_TEXTURE_2D, textureMNormals);
+        OpenGLState::bindTexture(1, GL_TEXTURE_2D, textureMNormals);
         program.setUniformValue("texNoise", 2);
-        gl->glActiveTexture(GL_TEXTURE2);
-        gl->glBindTexture(GL_TEXTURE_2D, noiseTexture);
+        OpenGLState::bindTexture(2, GL_TEXTURE_2D, noiseTexture);
 
         resourceManager->quad->submeshes[0]->draw();
-
-        program.release();
     }
 }
 
@@ -947,14 +1334,11 @@ void DeferredRenderer::passSSAOBlur()
 
     QOpenGLShaderProgram &program = SSAOBlur->program;
 
-    if(program.bind())
+    if (OpenGLState::bindProgram(program))
     {
-        gl->glActiveTexture(GL_TEXTURE0);
-        gl->glBindTexture(GL_TEXTURE_2D, textureSSAO);
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, textureSSAO);
 
         resourceManager->quad->submeshes[0]->draw();
-
-        program.release();
     }
 }
 
@@ -962,53 +1346,54 @@ void DeferredRenderer::passBlit()
 {
     OpenGLErrorGuard guard(__FUNCTION__);
 
-    gl->glDisable(GL_DEPTH_TEST);
+    applyDepthTest(false);
 
     QOpenGLShaderProgram &program = blitProgram->program;
 
-    if (program.bind())
+    if (OpenGLState::bindProgram(program))
     {
         program.setUniformValue("colorTexture", 0);
-        gl->glActiveTexture(GL_TEXTURE0);
 
+        GLuint colorTexture = textureGrid;
         if (shownTexture() == "Final") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureGrid);
+            colorTexture = textureGrid;
         }
         else if (shownTexture() == "Position") {
-            gl->glBindTexture(GL_TEXTURE_2D, texturePosition);
+            colorTexture = texturePosition;
         }
         else if (shownTexture() == "Normals") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureNormal);
+            colorTexture = textureNormal;
         }
 
         else if (shownTexture() == "Albedo") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureAlbedo);
+            colorTexture = textureAlbedo;
         }
         else if (shownTexture() == "Depth") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureDepth);
+            colorTexture = textureDepth;
         }
         else if(shownTexture() == "Selection") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureSelection);
+            colorTexture = textureSelection;
         }
         else if(shownTexture() == "Outline") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureOutline);
+            colorTexture = textureOutline;
         }
         else if(shownTexture() == "SSAO") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureSSAO);
+            colorTexture = textureSSAO;
         }
         else if(shownTexture() == "SSAO Blur") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureSSAOBlur);
+            colorTexture = textureSSAOBlur;
         }
         else if(shownTexture() == "Model Position") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureMPosition);
+            colorTexture = textureMPosition;
         }
         else if(shownTexture() == "Model Normals") {
-            gl->glBindTexture(GL_TEXTURE_2D, textureMNormals);
+            colorTexture = textureMNormals;
         }
 
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, colorTexture);
+
         program.setUniformValue("outlineTexture", 1);
-        gl->glActiveTexture(GL_TEXTURE1);
-        gl->glBindTexture(GL_TEXTURE_2D, textureOutline);
+        OpenGLState::bindTexture(1, GL_TEXTURE_2D, textureOutline);
 
         double r, g, b;
         miscSettings->outlineColor.getRgbF(&r, &g, &b);
@@ -1017,10 +1402,6 @@ void DeferredRenderer::passBlit()
         program.setUniformValue("outlineWidth", float(miscSettings->outlineWidth));
 
         resourceManager->quad->submeshes[0]->draw();
-        program.release();
     }
-
-    gl->glBindTexture(GL_TEXTURE_2D, 0);
-    gl->glEnable(GL_DEPTH_TEST);
 }
 
@@ -6,6 +6,14 @@
 
 class ShaderProgram;
 class FramebufferObject;
+class Impostors;
+class RingBuffer;
+class TextureArrays;
+class GpuCulling;
+class OcclusionCulling;
+class Material;
+struct TextureLayer;
+class QOpenGLShaderProgram;
 
 class DeferredRenderer : public Renderer
 {
@@ -31,6 +39,10 @@ private:
 
     void passLights(Camera *camera);
     void passMeshes(Camera *camera);
+    void drawMesh(MeshRenderer *meshRenderer, Camera *camera, float percent, QOpenGLShaderProgram *&boundProgram);
+    quint32 materialFeatures(Material *material, const TextureLayer *&albedoLayer, const TextureLayer *&specularLayer);
+    void sendMaterial(QOpenGLShaderProgram &program, Material *material, quint32 features,
+                      const TextureLayer *albedoLayer, const TextureLayer *specularLayer);
     void passOutline(Camera *camera);
     void passGrid(Camera *camera);
     void passSSAO(Camera *camera);
@@ -83,6 +95,21 @@ private:
     FramebufferObject *SSAOBlurFBO = nullptr;
 
 
+    // Distant meshes
+    Impostors *impostors = nullptr;
+
+    // Per-frame data (the light uniform block)
+    RingBuffer *frameData = nullptr;
+
+    // Material maps packed by size class
+    TextureArrays *textureArrays = nullptr;
+
+    // Many instances of a mesh, frustum culled on the GPU
+    GpuCulling *gpuCulling = nullptr;
+
+    // Meshes hidden behind others, found with hardware queries
+    OcclusionCulling *occlusionCulling = nullptr;
+
     // SSAO
     std::vector<QVector3D> ssaoKernel;
     GLuint noiseTexture = 0;
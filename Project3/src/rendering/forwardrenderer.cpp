@@ -8,6 +8,7 @@
 #include "resources/shaderprogram.h"
 #include "resources/resourcemanager.h"
 #include "framebufferobject.h"
+#include "staticbatches.h"
 #include "gl.h"
 #include "globals.h"
 #include <QVector>
@@ -44,6 +45,12 @@ static void sendLightsToProgram(QOpenGLShaderProgram &program, const QMatrix4x4
     program.setUniformValue("lightCount", lightPosition.size());
 }
 
+// Variant bits of the forward program (see forwardProgram->features)
+enum ForwardFeature
+{
+    FORWARD_ALBEDO_MAP = 1 << 0
+};
+
 ForwardRenderer::ForwardRenderer() :
     fboColor(QOpenGLTexture::Target2D),
     fboDepth(QOpenGLTexture::Target2D)
@@ -73,6 +80,7 @@ void ForwardRenderer::initialize()
     forwardProgram->name = "Forward shading";
     forwardProgram->vertexShaderFilename = "res/shaders/forward_shading.vert";
     forwardProgram->fragmentShaderFilename = "res/shaders/forward_shading.frag";
+    forwardProgram->features << "HAS_ALBEDO_MAP";
     forwardProgram->includeForSerialization = false;
 
     blitProgram = resourceManager->createShaderProgram();
@@ -86,12 +94,18 @@ void ForwardRenderer::initialize()
 
     fbo = new FramebufferObject;
     fbo->create();
+
+    staticBatches = new StaticBatches();
+    staticBatches->initialize();
 }
 
 void ForwardRenderer::finalize()
 {
     fbo->destroy();
     delete fbo;
+
+    staticBatches->finalize();
+    delete staticBatches;
 }
 
 void ForwardRenderer::resize(int w, int h)
@@ -100,9 +114,9 @@ void ForwardRenderer::resize(int w, int h)
 
     // Regenerate render targets
 
-    if (fboColor == 0) gl->glDeleteTextures(1, &fboColor);
+    if (fboColor == 0) { OpenGLState::forgetTexture(fboColor); gl->glDeleteTextures(1, &fboColor); }
     gl->glGenTextures(1, &fboColor);
-    gl->glBindTexture(GL_TEXTURE_2D, fboColor);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, fboColor);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -110,9 +124,9 @@ void ForwardRenderer::resize(int w, int h)
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
 
-    if (fboDepth == 0) gl->glDeleteTextures(1, &fboDepth);
+    if (fboDepth == 0) { OpenGLState::forgetTexture(fboDepth); gl->glDeleteTextures(1, &fboDepth); }
     gl->glGenTextures(1, &fboDepth);
-    gl->glBindTexture(GL_TEXTURE_2D, fboDepth);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, fboDepth);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -134,6 +148,12 @@ void ForwardRenderer::render(Camera *camera)
 {
     OpenGLErrorGuard guard("ForwardRenderer::render()");
 
+    statistics = RenderStatistics();
+
+    OpenGLState state;
+    state.depthTest = true;
+    state.apply();
+
     fbo->bind();
 
     // Clear color
@@ -152,139 +172,193 @@ void ForwardRenderer::render(Camera *camera)
     gl->glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
     passBlit();
+
+    statistics.glCallsIssued = OpenGLState::counters.issued;
+    statistics.glCallsFiltered = OpenGLState::counters.filtered;
+    statistics.textureBinds = OpenGLState::counters.textureBinds;
 }
 
 void ForwardRenderer::passMeshes(Camera *camera)
 {
-    QOpenGLShaderProgram &program = forwardProgram->program;
+    staticBatches->update();
 
-    if (program.bind())
-    {
-        program.setUniformValue("viewMatrix", camera->viewMatrix);
-        program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+    QVector<MeshRenderer*> meshRenderers;
+    QVector<LightSource*> lightSources;
 
-        sendLightsToProgram(program, camera->viewMatrix);
+    // Get components (the static batches draw some of the meshes)
+    for (auto entity : scene->entities)
+    {
+        if (entity->active)
+        {
+            if (entity->meshRenderer != nullptr && !staticBatches->contains(entity)) { meshRenderers.push_back(entity->meshRenderer); }
+            if (entity->lightSource != nullptr) { lightSources.push_back(entity->lightSource); }
+        }
+    }
 
-        QVector<MeshRenderer*> meshRenderers;
-        QVector<LightSource*> lightSources;
+    // Variant currently bound
+    QOpenGLShaderProgram *boundProgram = nullptr;
 
-        // Get components
-        for (auto entity : scene->entities)
+    // Binds the variant and sends the per-frame uniforms when it changes
+    auto bindVariant = [&](quint32 features) -> QOpenGLShaderProgram *
+    {
+        QOpenGLShaderProgram &program = forwardProgram->variant(features);
+        if (&program != boundProgram)
         {
-            if (entity->active)
-            {
-                if (entity->meshRenderer != nullptr) { meshRenderers.push_back(entity->meshRenderer); }
-                if (entity->lightSource != nullptr) { lightSources.push_back(entity->lightSource); }
-            }
+            if (!OpenGLState::bindProgram(program)) return nullptr;
+            boundProgram = &program;
+            program.setUniformValue("viewMatrix", camera->viewMatrix);
+            program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+            sendLightsToProgram(program, camera->viewMatrix);
         }
+        return &program;
+    };
+
+    prepareMeshes(meshRenderers, camera);
+
+    // Meshes
+    for (auto meshRenderer : meshRenderers)
+    {
+        auto mesh = meshRenderer->mesh;
 
-        // Meshes
-        for (auto meshRenderer : meshRenderers)
+        if (mesh != nullptr)
         {
-            auto mesh = meshRenderer->mesh;
+            QMatrix4x4 worldMatrix = meshRenderer->entity->transform->matrix();
+            QMatrix4x4 worldViewMatrix = camera->viewMatrix * worldMatrix;
+            QMatrix3x3 normalMatrix = worldViewMatrix.normalMatrix();
 
-            if (mesh != nullptr)
+            // Variant that received the uniforms of this object
+            QOpenGLShaderProgram *objectProgram = nullptr;
+
+            int materialIndex = 0;
+            for (auto submesh : mesh->submeshes)
             {
-                QMatrix4x4 worldMatrix = meshRenderer->entity->transform->matrix();
-                QMatrix4x4 worldViewMatrix = camera->viewMatrix * worldMatrix;
-                QMatrix3x3 normalMatrix = worldViewMatrix.normalMatrix();
+                // Get material from the component
+                Material *material = nullptr;
+                if (materialIndex < meshRenderer->materials.size()) {
+                    material = meshRenderer->materials[materialIndex];
+                }
+                if (material == nullptr) {
+                    material = resourceManager->materialWhite;
+                }
+                materialIndex++;
 
-                program.setUniformValue("worldMatrix", worldMatrix);
-                program.setUniformValue("worldViewMatrix", worldViewMatrix);
-                program.setUniformValue("normalMatrix", normalMatrix);
+                quint32 features = 0;
+                if (material->albedoTexture != nullptr) features |= FORWARD_ALBEDO_MAP;
 
-                int materialIndex = 0;
-                for (auto submesh : mesh->submeshes)
+                QOpenGLShaderProgram *program = bindVariant(features);
+                if (program == nullptr) continue;
+
+                if (objectProgram != program)
                 {
-                    // Get material from the component
-                    Material *material = nullptr;
-                    if (materialIndex < meshRenderer->materials.size()) {
-                        material = meshRenderer->materials[materialIndex];
-                    }
-                    if (material == nullptr) {
-                        material = resourceManager->materialWhite;
-                    }
-                    materialIndex++;
-
-#define SEND_TEXTURE(uniformName, tex1, tex2, texUnit) \
-    program.setUniformValue(uniformName, texUnit); \
-    if (tex1 != nullptr) { \
-    tex1->bind(texUnit); \
-                } else { \
-    tex2->bind(texUnit); \
+                    program->setUniformValue("worldMatrix", worldMatrix);
+                    program->setUniformValue("worldViewMatrix", worldViewMatrix);
+                    program->setUniformValue("normalMatrix", normalMatrix);
+                    objectProgram = program;
                 }
 
-                    // Send the material to the shader
-                    program.setUniformValue("albedo", material->albedo);
-                    program.setUniformValue("emissive", material->emissive);
-                    program.setUniformValue("specular", material->specular);
-                    program.setUniformValue("smoothness", material->smoothness);
-                    program.setUniformValue("bumpiness", material->bumpiness);
-                    program.setUniformValue("tiling", material->tiling);
-                    SEND_TEXTURE("albedoTexture", material->albedoTexture, resourceManager->texWhite, 0);
-                    SEND_TEXTURE("emissiveTexture", material->emissiveTexture, resourceManager->texBlack, 1);
-                    SEND_TEXTURE("specularTexture", material->specularTexture, resourceManager->texBlack, 2);
-                    SEND_TEXTURE("normalTexture", material->normalsTexture, resourceManager->texNormal, 3);
-                    SEND_TEXTURE("bumpTexture", material->bumpTexture, resourceManager->texWhite, 4);
-
-                    submesh->draw();
+                // Send the material to the shader
+                program->setUniformValue("albedo", material->albedo);
+                program->setUniformValue("emissive", material->emissive);
+                program->setUniformValue("specular", material->specular);
+                program->setUniformValue("smoothness", material->smoothness);
+                program->setUniformValue("bumpiness", material->bumpiness);
+                program->setUniformValue("tiling", material->tiling);
+                if (features & FORWARD_ALBEDO_MAP) {
+                    program->setUniformValue("albedoTexture", 0);
+                    material->albedoTexture->bind(0);
                 }
+
+                submesh->sendDecoding(*program);
+                drawSubMesh(meshRenderer, submesh);
             }
         }
+    }
+
+    // Static batches: world space vertices, one draw per material and cell
+    for (const StaticBatch *batch : staticBatches->visible(camera))
+    {
+        Material *material = batch->material;
+
+        quint32 features = 0;
+        if (material->albedoTexture != nullptr) features |= FORWARD_ALBEDO_MAP;
+
+        QOpenGLShaderProgram *program = bindVariant(features);
+        if (program == nullptr) continue;
+
+        program->setUniformValue("worldMatrix", QMatrix4x4());
+        program->setUniformValue("worldViewMatrix", camera->viewMatrix);
+        program->setUniformValue("normalMatrix", camera->viewMatrix.normalMatrix());
+
+        program->setUniformValue("albedo", material->albedo);
+        program->setUniformValue("emissive", material->emissive);
+        program->setUniformValue("specular", material->specular);
+        program->setUniformValue("smoothness", material->smoothness);
+        program->setUniformValue("bumpiness", material->bumpiness);
+        program->setUniformValue("tiling", material->tiling);
+        if (features & FORWARD_ALBEDO_MAP) {
+            program->setUniformValue("albedoTexture", 0);
+            material->albedoTexture->bind(0);
+        }
 
-        // Light spheres
-        if (miscSettings->renderLightSources)
+        batch->submesh->sendDecoding(*program);
+        batch->submesh->draw();
+        statistics.triangles += batch->submesh->triangleCount();
+        statistics.staticBatches++;
+    }
+
+    // Light spheres
+    if (miscSettings->renderLightSources)
+    {
+        QOpenGLShaderProgram *program = bindVariant(0);
+
+        for (int i = 0; program != nullptr && i < lightSources.size(); ++i)
         {
-            for (auto lightSource : lightSources)
+            LightSource *lightSource = lightSources[i];
+            QMatrix4x4 worldMatrix = lightSource->entity->transform->matrix();
+            QMatrix4x4 scaleMatrix; scaleMatrix.scale(0.1f, 0.1f, 0.1f);
+            QMatrix4x4 worldViewMatrix = camera->viewMatrix * worldMatrix * scaleMatrix;
+            QMatrix3x3 normalMatrix = worldViewMatrix.normalMatrix();
+            program->setUniformValue("worldMatrix", worldMatrix);
+            program->setUniformValue("worldViewMatrix", worldViewMatrix);
+            program->setUniformValue("normalMatrix", normalMatrix);
+
+            for (auto submesh : resourceManager->sphere->submeshes)
             {
-                QMatrix4x4 worldMatrix = lightSource->entity->transform->matrix();
-                QMatrix4x4 scaleMatrix; scaleMatrix.scale(0.1f, 0.1f, 0.1f);
-                QMatrix4x4 worldViewMatrix = camera->viewMatrix * worldMatrix * scaleMatrix;
-                QMatrix3x3 normalMatrix = worldViewMatrix.normalMatrix();
-                program.setUniformValue("worldMatrix", worldMatrix);
-                program.setUniformValue("worldViewMatrix", worldViewMatrix);
-                program.setUniformValue("normalMatrix", normalMatrix);
-
-                for (auto submesh : resourceManager->sphere->submeshes)
-                {
-                    // Send the material to the shader
-                    Material *material = resourceManager->materialLight;
-                    program.setUniformValue("albedo", material->albedo);
-                    program.setUniformValue("emissive", material->emissive);
-                    program.setUniformValue("smoothness", material->smoothness);
-
-                    submesh->draw();
-                }
+                // Send the material to the shader
+                Material *material = resourceManager->materialLight;
+                program->setUniformValue("albedo", material->albedo);
+                program->setUniformValue("emissive", material->emissive);
+                program->setUniformValue("smoothness", material->smoothness);
+
+                submesh->sendDecoding(*program);
+                submesh->draw();
             }
         }
-
-        program.release();
     }
 }
 
 void ForwardRenderer::passBlit()
 {
-    gl->glDisable(GL_DEPTH_TEST);
+    OpenGLState state;
+    state.depthTest = false;
+    state.apply();
 
     QOpenGLShaderProgram &program = blitProgram->program;
 
-    if (program.bind())
+    if (OpenGLState::bindProgram(program))
     {
         program.setUniformValue("colorTexture", 0);
-        gl->glActiveTexture(GL_TEXTURE0);
 
         if (shownTexture() == "Final render") {
-            gl->glBindTexture(GL_TEXTURE_2D, fboColor);
+            OpenGLState::bindTexture(0, GL_TEXTURE_2D, fboColor);
         }
         else if (shownTexture() == "White") {
-            gl->glBindTexture(GL_TEXTURE_2D, resourceManager->texWhite->textureId());
+            OpenGLState::bindTexture(0, GL_TEXTURE_2D, resourceManager->texWhite->textureId());
         }
         else if (shownTexture() == "Black") {
-            gl->glBindTexture(GL_TEXTURE_2D, resourceManager->texBlack->textureId());
+            OpenGLState::bindTexture(0, GL_TEXTURE_2D, resourceManager->texBlack->textureId());
         }
 
         resourceManager->quad->submeshes[0]->draw();
     }
-
-    gl->glEnable(GL_DEPTH_TEST);
 }
@@ -1,6 +1,5 @@
 #include "framebufferobject.h"
 #include "rendering/gl.h"
-#include <QOpenGLFramebufferObject>
 #include <QDebug>
 
 
@@ -16,6 +15,7 @@ void FramebufferObject::create()
 
 void FramebufferObject::destroy()
 {
+    OpenGLState::forgetFramebuffer(id);
     gl->glDeleteFramebuffers(1, &id);
 }
 
@@ -64,10 +64,10 @@ void FramebufferObject::checkStatus()
 
 void FramebufferObject::bind()
 {
-    gl->glBindFramebuffer(GL_FRAMEBUFFER, id);
+    OpenGLState::bindFramebuffer(id);
 }
 
 void FramebufferObject::release()
 {
-    QOpenGLFramebufferObject::bindDefault();
+    OpenGLState::bindDefaultFramebuffer();
 }
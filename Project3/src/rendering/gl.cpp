@@ -1,4 +1,6 @@
 #include "gl.h"
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
 #include <QDebug>
 #include <stdarg.h>
 
@@ -100,8 +102,13 @@ OpenGLState OpenGLState::currentState;
 
 void OpenGLState::apply()
 {
+    // Calls that would be issued if every state was set every time
+    const int calls = 8 + NUM_CLIP_PLANES;
+    const int issuedBefore = counters.issued;
+
     if (depthTest != currentState.depthTest)
     {
+        counters.issued++;
         if (depthTest) {
             gl->glEnable(GL_DEPTH_TEST);
         } else {
@@ -111,6 +118,7 @@ void OpenGLState::apply()
 
     if (depthWrite != currentState.depthWrite)
     {
+        counters.issued++;
         if (depthWrite) {
             gl->glDepthMask(GL_TRUE);
         } else {
@@ -118,13 +126,25 @@ void OpenGLState::apply()
         }
     }
 
+    if (colorWrite != currentState.colorWrite)
+    {
+        counters.issued++;
+        if (colorWrite) {
+            gl->glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        } else {
+            gl->glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        }
+    }
+
     if (depthFunc != currentState.depthFunc)
     {
+        counters.issued++;
         gl->glDepthFunc(depthFunc);
     }
 
     if (blending != currentState.blending)
     {
+        counters.issued++;
         if (blending) {
             gl->glEnable(GL_BLEND);
         } else {
@@ -134,11 +154,13 @@ void OpenGLState::apply()
 
     if (blendFuncSrc != currentState.blendFuncSrc || blendFuncDst != currentState.blendFuncDst)
     {
+        counters.issued++;
         gl->glBlendFunc(blendFuncSrc, blendFuncDst);
     }
 
     if (faceCulling != currentState.faceCulling)
     {
+        counters.issued++;
         if (faceCulling) {
             gl->glEnable(GL_CULL_FACE);
         } else {
@@ -148,12 +170,14 @@ void OpenGLState::apply()
 
     if (faceCullingMode != currentState.faceCullingMode)
     {
+        counters.issued++;
         gl->glCullFace(faceCullingMode);
     }
 
     for (int i = 0; i < NUM_CLIP_PLANES; ++i)
     {
         if (clipDistance[i] != currentState.clipDistance[i]) {
+            counters.issued++;
             if (clipDistance[i]) {
                 gl->glEnable(GL_CLIP_DISTANCE0 + i);
             } else {
@@ -162,13 +186,17 @@ void OpenGLState::apply()
         }
     }
 
+    counters.filtered += calls - (counters.issued - issuedBefore);
     currentState = *this;
 }
 
+static void forgetBindings();
+
 void OpenGLState::initialize()
 {
     gl->glDisable(GL_DEPTH_TEST);
     gl->glDepthMask(GL_TRUE);
+    gl->glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
     gl->glDepthFunc(GL_LESS);
     gl->glDisable(GL_BLEND);
     gl->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -178,6 +206,7 @@ void OpenGLState::initialize()
     for (int i = 0; i < NUM_CLIP_PLANES; ++i) {
         gl->glDisable(GL_CLIP_DISTANCE0 + i);
     }
+    forgetBindings();
 }
 
 void OpenGLState::reset()
@@ -185,3 +214,328 @@ void OpenGLState::reset()
     OpenGLState gl;
     gl.apply();
 }
+
+// Bindings of OpenGLState //////////////////////////////////////////////
+
+OpenGLState::Counters OpenGLState::counters;
+
+// Bindings not set through OpenGLState since the start of the frame
+static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+static const int MAX_TEXTURE_UNITS = 16;
+
+// Texture targets shadowed per unit (others are always bound)
+static const GLenum TEXTURE_TARGETS[] = {GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_2D_ARRAY};
+static const int NUM_TEXTURE_TARGETS = 3;
+
+struct ShadowBindings
+{
+    GLuint program;
+    GLuint vertexArray;
+    GLuint arrayBuffer;
+    GLuint elementArrayBuffer;
+    GLuint framebuffer;
+    GLuint activeTexture;
+    GLuint textures[MAX_TEXTURE_UNITS][NUM_TEXTURE_TARGETS];
+    GLuint samplers[MAX_TEXTURE_UNITS];
+    GLint viewport[4];
+    bool viewportKnown;
+};
+
+static ShadowBindings shadow;
+
+// True (and counted as filtered) if the binding doesn't change
+static bool redundant(GLuint &shadowed, GLuint value)
+{
+    if (shadowed == value)
+    {
+        OpenGLState::counters.filtered++;
+        return true;
+    }
+    shadowed = value;
+    OpenGLState::counters.issued++;
+    return false;
+}
+
+static int textureTargetIndex(GLenum target)
+{
+    for (int i = 0; i < NUM_TEXTURE_TARGETS; ++i) {
+        if (TEXTURE_TARGETS[i] == target) return i;
+    }
+    return -1;
+}
+
+static void activeTexture(int unit)
+{
+    if (!redundant(shadow.activeTexture, GLuint(unit)))
+    {
+        gl->glActiveTexture(GLenum(GL_TEXTURE0 + unit));
+    }
+}
+
+static void forgetBindings()
+{
+    shadow.program = UNKNOWN;
+    shadow.vertexArray = UNKNOWN;
+    shadow.arrayBuffer = UNKNOWN;
+    shadow.elementArrayBuffer = UNKNOWN;
+    shadow.framebuffer = UNKNOWN;
+    shadow.activeTexture = UNKNOWN;
+    for (int unit = 0; unit < MAX_TEXTURE_UNITS; ++unit)
+    {
+        for (int target = 0; target < NUM_TEXTURE_TARGETS; ++target) {
+            shadow.textures[unit][target] = UNKNOWN;
+        }
+        shadow.samplers[unit] = UNKNOWN;
+    }
+    shadow.viewportKnown = false;
+}
+
+void OpenGLState::beginFrame()
+{
+    counters = Counters();
+
+    initialize();
+    currentState = OpenGLState();
+
+    // Set by Qt for the widget
+    gl->glGetIntegerv(GL_VIEWPORT, shadow.viewport);
+    shadow.viewportKnown = true;
+}
+
+void OpenGLState::useProgram(GLuint program)
+{
+    if (!redundant(shadow.program, program))
+    {
+        gl->glUseProgram(program);
+    }
+}
+
+bool OpenGLState::bindProgram(QOpenGLShaderProgram &program)
+{
+    if (!program.isLinked()) return false;
+    useProgram(program.programId());
+    return true;
+}
+
+void OpenGLState::bindTexture(int unit, GLenum target, GLuint texture)
+{
+    const int targetIndex = textureTargetIndex(target);
+    if (targetIndex < 0 || unit >= MAX_TEXTURE_UNITS)
+    {
+        activeTexture(unit);
+        gl->glBindTexture(target, texture);
+        counters.issued++;
+        counters.textureBinds++;
+        return;
+    }
+
+    GLuint &shadowed = shadow.textures[unit][targetIndex];
+    if (shadowed == texture)
+    {
+        counters.filtered++;
+        return;
+    }
+
+    activeTexture(unit);
+    gl->glBindTexture(target, texture);
+    shadowed = texture;
+    counters.issued++;
+    counters.textureBinds++;
+}
+
+void OpenGLState::bindSampler(int unit, GLuint sampler)
+{
+    if (unit >= MAX_TEXTURE_UNITS || !redundant(shadow.samplers[unit], sampler))
+    {
+        gl->glBindSampler(GLuint(unit), sampler);
+    }
+}
+
+void OpenGLState::bindVertexArray(GLuint vertexArray)
+{
+    if (!redundant(shadow.vertexArray, vertexArray))
+    {
+        gl->glBindVertexArray(vertexArray);
+        shadow.elementArrayBuffer = UNKNOWN;
+    }
+}
+
+void OpenGLState::bindBuffer(GLenum target, GLuint buffer)
+{
+    if (target == GL_ARRAY_BUFFER)
+    {
+        if (redundant(shadow.arrayBuffer, buffer)) return;
+    }
+    else if (target == GL_ELEMENT_ARRAY_BUFFER)
+    {
+        if (redundant(shadow.elementArrayBuffer, buffer)) return;
+    }
+    else
+    {
+        counters.issued++;
+    }
+    gl->glBindBuffer(target, buffer);
+}
+
+void OpenGLState::bindFramebuffer(GLuint framebuffer)
+{
+    if (!redundant(shadow.framebuffer, framebuffer))
+    {
+        gl->glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    }
+}
+
+void OpenGLState::bindDefaultFramebuffer()
+{
+    // The widget renders into a framebuffer of its own
+    bindFramebuffer(QOpenGLContext::currentContext()->defaultFramebufferObject());
+}
+
+void OpenGLState::viewport(int x, int y, int width, int height)
+{
+    if (shadow.viewportKnown &&
+        shadow.viewport[0] == x && shadow.viewport[1] == y &&
+        shadow.viewport[2] == width && shadow.viewport[3] == height)
+    {
+        counters.filtered++;
+        return;
+    }
+
+    gl->glViewport(x, y, width, height);
+    shadow.viewport[0] = x;
+    shadow.viewport[1] = y;
+    shadow.viewport[2] = width;
+    shadow.viewport[3] = height;
+    shadow.viewportKnown = true;
+    counters.issued++;
+}
+
+void OpenGLState::getViewport(GLint viewport[4])
+{
+    if (!shadow.viewportKnown)
+    {
+        gl->glGetIntegerv(GL_VIEWPORT, shadow.viewport);
+        shadow.viewportKnown = true;
+    }
+    for (int i = 0; i < 4; ++i) {
+        viewport[i] = shadow.viewport[i];
+    }
+}
+
+void OpenGLState::forgetTexture(GLuint texture)
+{
+    for (int unit = 0; unit < MAX_TEXTURE_UNITS; ++unit)
+    {
+        for (int target = 0; target < NUM_TEXTURE_TARGETS; ++target) {
+            if (shadow.textures[unit][target] == texture) shadow.textures[unit][target] = 0;
+        }
+    }
+}
+
+void OpenGLState::forgetBuffer(GLuint buffer)
+{
+    if (shadow.arrayBuffer == buffer) shadow.arrayBuffer = 0;
+    if (shadow.elementArrayBuffer == buffer) shadow.elementArrayBuffer = 0;
+}
+
+void OpenGLState::forgetVertexArray(GLuint vertexArray)
+{
+    if (shadow.vertexArray == vertexArray)
+    {
+        shadow.vertexArray = 0;
+        shadow.elementArrayBuffer = UNKNOWN;
+    }
+}
+
+void OpenGLState::forgetFramebuffer(GLuint framebuffer)
+{
+    if (shadow.framebuffer == framebuffer) shadow.framebuffer = 0;
+}
+
+
+// OpenGLExtensions ///////////////////////////////////////////////////
+
+OpenGLExtensions glext;
+
+void OpenGLExtensions::initialize()
+{
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    Q_ASSERT(context != nullptr);
+
+    driverString.clear();
+    driverString += (const char *)gl->glGetString(GL_VENDOR);
+    driverString += '\n';
+    driverString += (const char *)gl->glGetString(GL_RENDERER);
+    driverString += '\n';
+    driverString += (const char *)gl->glGetString(GL_VERSION);
+
+    const QPair<int, int> version = context->format().version();
+    const bool gl41 = version >= qMakePair(4, 1);
+
+    if (gl41 || context->hasExtension(QByteArrayLiteral("GL_ARB_get_program_binary")))
+    {
+        glGetProgramBinary = reinterpret_cast<GetProgramBinaryProc>(context->getProcAddress("glGetProgramBinary"));
+        glProgramBinary = reinterpret_cast<ProgramBinaryProc>(context->getProcAddress("glProgramBinary"));
+        glProgramParameteri = reinterpret_cast<ProgramParameteriProc>(context->getProcAddress("glProgramParameteri"));
+
+        // Some drivers expose the extension without any binary format
+        GLint numFormats = 0;
+        gl->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+
+        programBinary = numFormats > 0 &&
+                glGetProgramBinary != nullptr &&
+                glProgramBinary != nullptr &&
+                glProgramParameteri != nullptr;
+    }
+
+    if (context->hasExtension(QByteArrayLiteral("GL_KHR_parallel_shader_compile")))
+    {
+        glMaxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsProc>(context->getProcAddress("glMaxShaderCompilerThreadsKHR"));
+    }
+    else if (context->hasExtension(QByteArrayLiteral("GL_ARB_parallel_shader_compile")))
+    {
+        glMaxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsProc>(context->getProcAddress("glMaxShaderCompilerThreadsARB"));
+    }
+
+    parallelShaderCompile = glMaxShaderCompilerThreads != nullptr;
+    if (parallelShaderCompile)
+    {
+        // Let the driver decide how many threads to use
+        glMaxShaderCompilerThreads(0xFFFFFFFF);
+    }
+
+    if (version >= qMakePair(4, 4) || context->hasExtension(QByteArrayLiteral("GL_ARB_buffer_storage")))
+    {
+        glBufferStorage = reinterpret_cast<BufferStorageProc>(context->getProcAddress("glBufferStorage"));
+    }
+
+    bufferStorage = glBufferStorage != nullptr;
+
+    if (version >= qMakePair(4, 3) || context->hasExtension(QByteArrayLiteral("GL_ARB_copy_image")))
+    {
+        glCopyImageSubData = reinterpret_cast<CopyImageSubDataProc>(context->getProcAddress("glCopyImageSubData"));
+    }
+
+    copyImage = glCopyImageSubData != nullptr;
+
+    if (version >= qMakePair(4, 0) || context->hasExtension(QByteArrayLiteral("GL_ARB_draw_indirect")))
+    {
+        glDrawElementsIndirect = reinterpret_cast<DrawElementsIndirectProc>(context->getProcAddress("glDrawElementsIndirect"));
+    }
+
+    drawIndirect = glDrawElementsIndirect != nullptr;
+
+    queryBufferObject = version >= qMakePair(4, 4) || context->hasExtension(QByteArrayLiteral("GL_ARB_query_buffer_object"));
+
+    textureCompressionS3TC = context->hasExtension(QByteArrayLiteral("GL_EXT_texture_compression_s3tc"));
+
+    qInfo("Program binaries: %s / Parallel shader compile: %s / Buffer storage: %s / Copy image: %s / Draw indirect: %s / Query buffers: %s / S3TC: %s",
+          programBinary ? "yes" : "no",
+          parallelShaderCompile ? "yes" : "no",
+          bufferStorage ? "yes" : "no",
+          copyImage ? "yes" : "no",
+          drawIndirect ? "yes" : "no",
+          queryBufferObject ? "yes" : "no",
+          textureCompressionS3TC ? "yes" : "no");
+}
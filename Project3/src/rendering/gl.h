@@ -7,6 +7,95 @@
 
 extern QOpenGLFunctions_3_3_Core *gl;
 
+class QOpenGLShaderProgram;
+
+
+// Tokens of optional extensions that may be missing from the GL headers
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_QUERY_BUFFER
+#define GL_QUERY_BUFFER 0x9192
+#endif
+
+
+// Entry points beyond the 3.3 core profile. They are resolved once the
+// context is current and stay null when the driver does not expose them,
+// so every user must check the corresponding flag first.
+class OpenGLExtensions
+{
+public:
+
+    typedef void (QOPENGLF_APIENTRYP GetProgramBinaryProc)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+    typedef void (QOPENGLF_APIENTRYP ProgramBinaryProc)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+    typedef void (QOPENGLF_APIENTRYP ProgramParameteriProc)(GLuint program, GLenum pname, GLint value);
+    typedef void (QOPENGLF_APIENTRYP MaxShaderCompilerThreadsProc)(GLuint count);
+    typedef void (QOPENGLF_APIENTRYP BufferStorageProc)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+    typedef void (QOPENGLF_APIENTRYP CopyImageSubDataProc)(GLuint srcName, GLenum srcTarget, GLint srcLevel, GLint srcX, GLint srcY, GLint srcZ,
+                                                           GLuint dstName, GLenum dstTarget, GLint dstLevel, GLint dstX, GLint dstY, GLint dstZ,
+                                                           GLsizei srcWidth, GLsizei srcHeight, GLsizei srcDepth);
+    typedef void (QOPENGLF_APIENTRYP DrawElementsIndirectProc)(GLenum mode, GLenum type, const void *indirect);
+
+    // GL_ARB_get_program_binary
+    bool programBinary = false;
+    GetProgramBinaryProc glGetProgramBinary = nullptr;
+    ProgramBinaryProc glProgramBinary = nullptr;
+    ProgramParameteriProc glProgramParameteri = nullptr;
+
+    // GL_KHR_parallel_shader_compile / GL_ARB_parallel_shader_compile
+    bool parallelShaderCompile = false;
+    MaxShaderCompilerThreadsProc glMaxShaderCompilerThreads = nullptr;
+
+    // GL_ARB_buffer_storage (persistent mappings)
+    bool bufferStorage = false;
+    BufferStorageProc glBufferStorage = nullptr;
+
+    // GL_ARB_copy_image (GPU side texture copies)
+    bool copyImage = false;
+    CopyImageSubDataProc glCopyImageSubData = nullptr;
+
+    // GL_ARB_draw_indirect (draw parameters read from a buffer)
+    bool drawIndirect = false;
+    DrawElementsIndirectProc glDrawElementsIndirect = nullptr;
+
+    // GL_ARB_query_buffer_object (query results written to a buffer)
+    bool queryBufferObject = false;
+
+    // GL_EXT_texture_compression_s3tc (BC1/BC3). BC5 is core as RGTC2.
+    bool textureCompressionS3TC = false;
+
+    // Driver identification (used to key caches of driver-specific data)
+    QByteArray driverString;
+
+    void initialize();
+};
+
+extern OpenGLExtensions glext;
+
 
 class OpenGLErrorGuard
 {
@@ -22,12 +111,17 @@ class OpenGLErrorGuard
 };
 
 
+// Shadow of the GL state. The fixed function part is set with apply(); the
+// bindings go through the static functions, which skip the calls that
+// would leave the state as it is. All the rendering code has to change the
+// state through here, or the shadow goes out of sync.
 class OpenGLState
 {
 public:
 
     bool depthTest = false;
     bool depthWrite = true;
+    bool colorWrite = true; // All the channels of all the draw buffers
     GLenum depthFunc = GL_LESS;
     bool blending = false;
     GLenum blendFuncSrc = GL_SRC_ALPHA;
@@ -44,6 +138,38 @@ public:
 
     static void initialize();
     static void reset();
+
+    // Sets the default state again and forgets the bindings (Qt binds its
+    // own objects between frames), and resets the counters
+    static void beginFrame();
+
+    // Bindings
+    static void useProgram(GLuint program);
+    static bool bindProgram(QOpenGLShaderProgram &program); // False if not linked
+    static void bindTexture(int unit, GLenum target, GLuint texture);
+    static void bindSampler(int unit, GLuint sampler);
+    static void bindVertexArray(GLuint vertexArray);
+    static void bindBuffer(GLenum target, GLuint buffer); // The element buffer is part of the VAO
+    static void bindFramebuffer(GLuint framebuffer);
+    static void bindDefaultFramebuffer();
+    static void viewport(int x, int y, int width, int height);
+    static void getViewport(GLint viewport[4]);
+
+    // Deleting an object unbinds it, so the shadow must know before its
+    // name is reused
+    static void forgetTexture(GLuint texture);
+    static void forgetBuffer(GLuint buffer);
+    static void forgetVertexArray(GLuint vertexArray);
+    static void forgetFramebuffer(GLuint framebuffer);
+
+    // GL calls of the frame, issued and skipped as redundant
+    struct Counters
+    {
+        int issued = 0;
+        int filtered = 0;
+        int textureBinds = 0; // Issued texture binds
+    };
+    static Counters counters;
 };
 
 
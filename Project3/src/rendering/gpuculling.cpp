@@ -0,0 +1,299 @@
+#include "gpuculling.h"
+#include "rendering/staticbatches.h"
+#include "ecs/camera.h"
+#include "ecs/entity.h"
+#include "ecs/components.h"
+#include "resources/mesh.h"
+#include "resources/shaderprogram.h"
+#include "resources/resourcemanager.h"
+#include "globals.h"
+#include <QVector4D>
+#include <cstring>
+
+
+// Renderers sharing a mesh and its materials before they are grouped
+static const int GPU_CULLING_MIN_INSTANCES = 32;
+
+// Input of the culling: model matrix, bounding sphere, selection color
+static const int INPUT_FLOATS = 16 + 4 + 4;
+static const int INPUT_STRIDE = INPUT_FLOATS * sizeof(float);
+
+// Output of the culling, read by the instanced draws (as captured by the
+// interleaved varyings of gpu_cull.geom): model matrix, selection color
+static const int COMPACTED_STRIDE = (16 + 1) * sizeof(float);
+
+// Locations of the per instance attributes of deferred_shading.vert
+static const GLuint INSTANCE_MODEL_LOCATION = 6;
+static const GLuint INSTANCE_SELECTION_LOCATION = 10;
+
+// Bytes of a DrawElementsIndirectCommand
+static const int COMMAND_SIZE = 5 * sizeof(GLuint);
+
+uint qHash(const GpuCulling::GroupKey &key, uint seed)
+{
+    return qHash(key.mesh, seed) ^ qHash(key.materials, seed);
+}
+
+void GpuCulling::initialize()
+{
+    cullProgram = resourceManager->createShaderProgram();
+    cullProgram->name = "GPU culling";
+    cullProgram->vertexShaderFilename = "res/shaders/gpu_cull.vert";
+    cullProgram->geometryShaderFilename = "res/shaders/gpu_cull.geom";
+    cullProgram->feedbackVaryings << "outModel0" << "outModel1" << "outModel2" << "outModel3" << "outSelection";
+    cullProgram->includeForSerialization = false;
+
+    gl->glGenVertexArrays(1, &cullVertexArray);
+    OpenGLState::bindVertexArray(cullVertexArray);
+    for (GLuint location = 0; location < 6; ++location) {
+        gl->glEnableVertexAttribArray(location);
+    }
+    OpenGLState::bindVertexArray(0);
+
+    frame = 0;
+}
+
+void GpuCulling::finalize()
+{
+    for (InstanceGroup *group : allGroups)
+    {
+        destroy(group);
+    }
+    allGroups.clear();
+    active.clear();
+    grouped.clear();
+
+    OpenGLState::forgetVertexArray(cullVertexArray);
+    gl->glDeleteVertexArrays(1, &cullVertexArray);
+    cullVertexArray = 0;
+}
+
+void GpuCulling::collect(const QVector<MeshRenderer*> &meshRenderers, const StaticBatches *staticBatches)
+{
+    frame++;
+    active.clear();
+    grouped.clear();
+
+    // Candidates by mesh and materials, with their index (selection color)
+    QHash<GroupKey, QVector<int>> candidates;
+    if (miscSettings->useGpuCulling)
+    {
+        for (int i = 0; i < meshRenderers.size(); ++i)
+        {
+            const MeshRenderer *meshRenderer = meshRenderers[i];
+            Mesh *mesh = meshRenderer->mesh;
+            if (mesh == nullptr || mesh->needsUpdate || mesh->submeshes.isEmpty()) continue;
+            if (staticBatches->contains(meshRenderer->entity)) continue;
+
+            candidates[GroupKey{ mesh, meshRenderer->materials }].push_back(i);
+        }
+    }
+
+    for (auto it = candidates.begin(); it != candidates.end(); ++it)
+    {
+        const QVector<int> &indices = it.value();
+        if (indices.size() < GPU_CULLING_MIN_INSTANCES) continue;
+
+        InstanceGroup *&group = allGroups[it.key()];
+        if (group == nullptr)
+        {
+            group = new InstanceGroup;
+            group->mesh = it.key().mesh;
+            group->materials = it.key().materials;
+            gl->glGenBuffers(1, &group->input);
+            gl->glGenBuffers(1, &group->compacted);
+            gl->glGenBuffers(1, &group->commands);
+            gl->glGenQueries(1, &group->query);
+        }
+
+        // Bounding sphere of the mesh in object space
+        const Bounds &bounds = group->mesh->bounds;
+        const QVector3D center = (bounds.min + bounds.max) * 0.5f;
+        const float radius = (bounds.max - bounds.min).length() * 0.5f;
+
+        QVector<float> instances(indices.size() * INPUT_FLOATS);
+        float *out = instances.data();
+        for (int i : indices)
+        {
+            MeshRenderer *meshRenderer = meshRenderers[i];
+            const QMatrix4x4 modelMatrix = meshRenderer->entity->transform->matrix();
+            memcpy(out, modelMatrix.constData(), 16 * sizeof(float));
+            out[16] = center.x();
+            out[17] = center.y();
+            out[18] = center.z();
+            out[19] = radius;
+            out[20] = (i + 1.0f) / meshRenderers.size();
+            out[21] = out[22] = out[23] = 0.0f;
+            out += INPUT_FLOATS;
+
+            // Always the full detail level, never an impostor
+            meshRenderer->lod = 0;
+            meshRenderer->impostor = false;
+            grouped.insert(meshRenderer);
+        }
+
+        if (indices.size() > group->capacity) resize(group, indices.size());
+
+        // Orphaned every frame: the previous culling may still be reading it
+        OpenGLState::bindBuffer(GL_ARRAY_BUFFER, group->input);
+        gl->glBufferData(GL_ARRAY_BUFFER, group->capacity * INPUT_STRIDE, nullptr, GL_STREAM_DRAW);
+        gl->glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size() * sizeof(float), instances.constData());
+
+        group->instanceCount = indices.size();
+        group->lastFrame = frame;
+        active.push_back(group);
+    }
+
+    // Groups that fell apart (entities removed, materials changed...)
+    for (auto it = allGroups.begin(); it != allGroups.end(); )
+    {
+        if (it.value()->lastFrame != frame)
+        {
+            destroy(it.value());
+            it = allGroups.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void GpuCulling::cull(const Camera *camera)
+{
+    if (active.isEmpty()) return;
+
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    QOpenGLShaderProgram &program = cullProgram->program;
+    if (!OpenGLState::bindProgram(program)) return;
+
+    // Frustum planes in world space (Gribb & Hartmann), normalized so that
+    // the distances compare with the radius of the spheres
+    const QMatrix4x4 m = camera->projectionMatrix * camera->viewMatrix;
+    QVector4D planes[6] = {
+        m.row(3) + m.row(0), m.row(3) - m.row(0),
+        m.row(3) + m.row(1), m.row(3) - m.row(1),
+        m.row(3) + m.row(2), m.row(3) - m.row(2)
+    };
+    for (QVector4D &plane : planes)
+    {
+        plane /= plane.toVector3D().length();
+    }
+    program.setUniformValueArray("frustumPlanes", planes, 6);
+
+    // Nothing is rasterized, the geometry shader only writes the survivors
+    gl->glEnable(GL_RASTERIZER_DISCARD);
+    OpenGLState::bindVertexArray(cullVertexArray);
+
+    for (InstanceGroup *group : active)
+    {
+        OpenGLState::bindBuffer(GL_ARRAY_BUFFER, group->input);
+        for (GLuint column = 0; column < 4; ++column) {
+            gl->glVertexAttribPointer(column, 4, GL_FLOAT, GL_FALSE, INPUT_STRIDE, (void *) (column * 4 * sizeof(float)));
+        }
+        gl->glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, INPUT_STRIDE, (void *) (16 * sizeof(float)));
+        gl->glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, INPUT_STRIDE, (void *) (20 * sizeof(float)));
+
+        gl->glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, group->compacted);
+        gl->glBeginQuery(GL_PRIMITIVES_GENERATED, group->query);
+        gl->glBeginTransformFeedback(GL_POINTS);
+        gl->glDrawArrays(GL_POINTS, 0, group->instanceCount);
+        gl->glEndTransformFeedback();
+        gl->glEndQuery(GL_PRIMITIVES_GENERATED);
+
+        // The count of survivors goes straight into the draw commands
+        group->indirect = glext.drawIndirect && glext.queryBufferObject;
+        for (auto submesh : group->mesh->submeshes) {
+            if (!submesh->isIndexed()) group->indirect = false;
+        }
+
+        if (group->indirect)
+        {
+            const int submeshCount = group->mesh->submeshes.size();
+            QVector<GLuint> commands(submeshCount * 5);
+            for (int i = 0; i < submeshCount; ++i) {
+                group->mesh->submeshes[i]->indirectCommand(&commands[i * 5], 0);
+            }
+
+            OpenGLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, group->commands);
+            gl->glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(GLuint), commands.constData(), GL_STREAM_DRAW);
+
+            OpenGLState::bindBuffer(GL_QUERY_BUFFER, group->commands);
+            for (int i = 0; i < submeshCount; ++i) {
+                gl->glGetQueryObjectuiv(group->query, GL_QUERY_RESULT, (GLuint *) size_t(i * COMMAND_SIZE + sizeof(GLuint)));
+            }
+            OpenGLState::bindBuffer(GL_QUERY_BUFFER, 0);
+        }
+    }
+
+    gl->glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    OpenGLState::bindVertexArray(0);
+    gl->glDisable(GL_RASTERIZER_DISCARD);
+}
+
+int GpuCulling::draw(InstanceGroup *group, SubMesh *submesh, int submeshIndex)
+{
+    // Without query buffers the count is read back (waits for the culling)
+    GLuint visible = 0;
+    if (!group->indirect)
+    {
+        gl->glGetQueryObjectuiv(group->query, GL_QUERY_RESULT, &visible);
+        if (visible == 0) return 0;
+    }
+
+    // Per instance attributes on top of the ones of the submesh
+    submesh->bindVertexArray();
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, group->compacted);
+    for (GLuint column = 0; column < 4; ++column)
+    {
+        const GLuint location = INSTANCE_MODEL_LOCATION + column;
+        gl->glEnableVertexAttribArray(location);
+        gl->glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, COMPACTED_STRIDE, (void *) (column * 4 * sizeof(float)));
+        gl->glVertexAttribDivisor(location, 1);
+    }
+    gl->glEnableVertexAttribArray(INSTANCE_SELECTION_LOCATION);
+    gl->glVertexAttribPointer(INSTANCE_SELECTION_LOCATION, 1, GL_FLOAT, GL_FALSE, COMPACTED_STRIDE, (void *) (16 * sizeof(float)));
+    gl->glVertexAttribDivisor(INSTANCE_SELECTION_LOCATION, 1);
+
+    if (group->indirect)
+    {
+        OpenGLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, group->commands);
+        submesh->drawIndirect(submeshIndex * COMMAND_SIZE);
+        OpenGLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+    else
+    {
+        submesh->drawInstanced(int(visible));
+    }
+
+    // The vertex array is shared with the regular draws of the submesh
+    for (GLuint location = INSTANCE_MODEL_LOCATION; location <= INSTANCE_SELECTION_LOCATION; ++location)
+    {
+        gl->glVertexAttribDivisor(location, 0);
+        gl->glDisableVertexAttribArray(location);
+    }
+
+    return group->indirect ? -1 : int(visible);
+}
+
+void GpuCulling::resize(InstanceGroup *group, int capacity)
+{
+    // Some room to grow without reallocating every frame
+    group->capacity = capacity + capacity / 4;
+
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, group->compacted);
+    gl->glBufferData(GL_ARRAY_BUFFER, group->capacity * COMPACTED_STRIDE, nullptr, GL_DYNAMIC_COPY);
+}
+
+void GpuCulling::destroy(InstanceGroup *group)
+{
+    OpenGLState::forgetBuffer(group->input);
+    OpenGLState::forgetBuffer(group->compacted);
+    OpenGLState::forgetBuffer(group->commands);
+    gl->glDeleteBuffers(1, &group->input);
+    gl->glDeleteBuffers(1, &group->compacted);
+    gl->glDeleteBuffers(1, &group->commands);
+    gl->glDeleteQueries(1, &group->query);
+    delete group;
+}
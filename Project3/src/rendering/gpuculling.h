@@ -0,0 +1,89 @@
+#ifndef GPUCULLING_H
+#define GPUCULLING_H
+
+#include "gl.h"
+#include <QHash>
+#include <QSet>
+#include <QVector>
+
+class Camera;
+class Mesh;
+class Material;
+class MeshRenderer;
+class SubMesh;
+class ShaderProgram;
+class StaticBatches;
+
+// Instances of a mesh with the same materials, culled on the GPU
+struct InstanceGroup
+{
+    Mesh *mesh = nullptr;
+    QVector<Material*> materials;
+    int instanceCount = 0;
+
+    GLuint input = 0;     // All the instances (matrix, bounding sphere, selection color)
+    GLuint compacted = 0; // Survivors of the culling (matrix, selection color)
+    int capacity = 0;     // Instances that fit in the buffers
+    GLuint query = 0;     // GL_PRIMITIVES_GENERATED of the culling
+    GLuint commands = 0;  // Indirect draw per submesh, with the count of the query
+    bool indirect = false;
+    int lastFrame = 0;
+};
+
+// Culling of many instances without the CPU going through them: renderers
+// sharing a mesh and materials are grouped, a vertex shader tests the
+// bounding sphere of each instance against the frustum, and a geometry
+// shader only lets the visible ones through to a transform feedback buffer,
+// packed, that the instanced draws read. The count of survivors goes from
+// the query to the indirect draw commands on the GPU when the driver has
+// query buffers and indirect draws; otherwise it is read back.
+class GpuCulling
+{
+public:
+
+    void initialize();
+    void finalize();
+
+    // Groups the renderers (not in the static batches) sharing a mesh and
+    // its materials with enough others, when enabled in the settings. The
+    // selection colors follow the order of the renderers, as in the
+    // geometry pass.
+    void collect(const QVector<MeshRenderer*> &meshRenderers, const StaticBatches *staticBatches);
+
+    // The renderer is drawn by a group this frame
+    bool contains(const MeshRenderer *meshRenderer) const { return grouped.contains(meshRenderer); }
+
+    // Culls all the groups (without waiting for the results)
+    void cull(const Camera *camera);
+
+    const QVector<InstanceGroup*> &groups() const { return active; }
+
+    // Draws the visible instances of a submesh of a group, with the
+    // instanced variant of the program bound. Returns the instances drawn,
+    // or -1 when the count stays on the GPU.
+    int draw(InstanceGroup *group, SubMesh *submesh, int submeshIndex);
+
+private:
+
+    struct GroupKey
+    {
+        Mesh *mesh;
+        QVector<Material*> materials;
+
+        bool operator==(const GroupKey &other) const { return mesh == other.mesh && materials == other.materials; }
+    };
+    friend uint qHash(const GroupKey &key, uint seed);
+
+    void resize(InstanceGroup *group, int capacity);
+    void destroy(InstanceGroup *group);
+
+    ShaderProgram *cullProgram = nullptr;
+    GLuint cullVertexArray = 0;
+
+    QHash<GroupKey, InstanceGroup*> allGroups;
+    QVector<InstanceGroup*> active;
+    QSet<const MeshRenderer*> grouped;
+    int frame = 0;
+};
+
+#endif // GPUCULLING_H
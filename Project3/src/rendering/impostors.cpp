@@ -0,0 +1,497 @@
+#include "impostors.h"
+#include "framebufferobject.h"
+#include "ecs/camera.h"
+#include "ecs/entity.h"
+#include "ecs/components.h"
+#include "resources/mesh.h"
+#include "resources/material.h"
+#include "resources/texture.h"
+#include "resources/shaderprogram.h"
+#include "resources/resourcemanager.h"
+#include "util/assetcache.h"
+#include "globals.h"
+#include <QCryptographicHash>
+#include <QOpenGLShaderProgram>
+#include <QVector2D>
+#include <QtMath>
+#include <cstring>
+
+
+// Views per side of the atlas, and pixels per side of each view
+static const int IMPOSTOR_FRAMES = 8;
+static const int IMPOSTOR_FRAME_SIZE = 128;
+static const int IMPOSTOR_ATLAS_SIZE = IMPOSTOR_FRAMES * IMPOSTOR_FRAME_SIZE;
+
+// Atlases baked (or read from disk) per frame
+static const int MAX_BAKES_PER_FRAME = 1;
+
+// Header of the atlases stored in the disk cache, followed by the
+// compressed pixels of both textures
+struct ImpostorCacheHeader
+{
+    char magic[4];
+    quint32 version;
+    quint32 frames;
+    quint32 frameSize;
+    float center[3];
+    float radius;
+};
+
+static const quint32 IMPOSTOR_CACHE_VERSION = 1;
+
+// Same feature bits as the geometry program
+enum BakeFeature
+{
+    BAKE_ALBEDO_MAP   = 1 << 0,
+    BAKE_SPECULAR_MAP = 1 << 1
+};
+
+static float signNotZero(float value)
+{
+    return value >= 0.0f ? 1.0f : -1.0f;
+}
+
+// Octahedral mapping of the unit sphere onto [-1, 1]^2 (Y up)
+static QVector2D octahedralEncode(QVector3D direction)
+{
+    direction /= qAbs(direction.x()) + qAbs(direction.y()) + qAbs(direction.z());
+    if (direction.y() >= 0.0f) {
+        return QVector2D(direction.x(), direction.z());
+    }
+    return QVector2D((1.0f - qAbs(direction.z())) * signNotZero(direction.x()),
+                     (1.0f - qAbs(direction.x())) * signNotZero(direction.z()));
+}
+
+static QVector3D octahedralDecode(const QVector2D &p)
+{
+    QVector3D direction(p.x(), 1.0f - qAbs(p.x()) - qAbs(p.y()), p.y());
+    if (direction.y() < 0.0f)
+    {
+        direction.setX((1.0f - qAbs(p.y())) * signNotZero(p.x()));
+        direction.setZ((1.0f - qAbs(p.x())) * signNotZero(p.y()));
+    }
+    return direction.normalized();
+}
+
+QVector3D Impostors::frameDirection(int x, int y)
+{
+    const QVector2D p((x + 0.5f) / IMPOSTOR_FRAMES, (y + 0.5f) / IMPOSTOR_FRAMES);
+    return octahedralDecode(p * 2.0f - QVector2D(1.0f, 1.0f));
+}
+
+void Impostors::closestFrame(const QVector3D &direction, int &x, int &y)
+{
+    const QVector2D p = octahedralEncode(direction) * 0.5f + QVector2D(0.5f, 0.5f);
+    x = qBound(0, int(p.x() * IMPOSTOR_FRAMES), IMPOSTOR_FRAMES - 1);
+    y = qBound(0, int(p.y() * IMPOSTOR_FRAMES), IMPOSTOR_FRAMES - 1);
+}
+
+void Impostors::frameBasis(const QVector3D &direction, QVector3D &right, QVector3D &up)
+{
+    // Same axes as QMatrix4x4::lookAt() towards -direction
+    const QVector3D worldUp = qAbs(direction.y()) > 0.99f ? QVector3D(0.0f, 0.0f, 1.0f) : QVector3D(0.0f, 1.0f, 0.0f);
+    right = QVector3D::crossProduct(worldUp, direction).normalized();
+    up = QVector3D::crossProduct(direction, right);
+}
+
+void Impostors::initialize()
+{
+    bakeProgram = resourceManager->createShaderProgram();
+    bakeProgram->name = "Impostor Bake";
+    bakeProgram->vertexShaderFilename = "res/shaders/impostor_bake.vert";
+    bakeProgram->fragmentShaderFilename = "res/shaders/impostor_bake.frag";
+    bakeProgram->features << "HAS_ALBEDO_MAP" << "HAS_SPECULAR_MAP";
+    bakeProgram->includeForSerialization = false;
+
+    drawProgram = resourceManager->createShaderProgram();
+    drawProgram->name = "Impostor";
+    drawProgram->vertexShaderFilename = "res/shaders/impostor.vert";
+    drawProgram->fragmentShaderFilename = "res/shaders/impostor.frag";
+    drawProgram->includeForSerialization = false;
+
+    fbo = new FramebufferObject();
+    fbo->name = "Impostor bake";
+    fbo->create();
+
+    gl->glGenTextures(1, &depthTexture);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, depthTexture);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+}
+
+void Impostors::finalize()
+{
+    for (const ImpostorAtlas &atlas : atlases)
+    {
+        release(atlas);
+    }
+    atlases.clear();
+    currentKeys.clear();
+    pending.clear();
+    queued.clear();
+
+    OpenGLState::forgetTexture(depthTexture);
+    gl->glDeleteTextures(1, &depthTexture);
+    depthTexture = 0;
+
+    fbo->destroy();
+    delete fbo;
+    fbo = nullptr;
+}
+
+QString Impostors::baseKey(const MeshRenderer *meshRenderer)
+{
+    // The albedo comes from the materials, so each combination has its atlas
+    QString key = meshRenderer->mesh->guid.toString();
+    for (auto material : meshRenderer->materials) {
+        key += material ? material->guid.toString() : QString("-");
+    }
+    return key;
+}
+
+QString Impostors::key(const MeshRenderer *meshRenderer)
+{
+    // Reimported meshes and reloaded textures get a new atlas
+    QString key = baseKey(meshRenderer) + QString("@%1").arg(meshRenderer->mesh->revision());
+    for (auto material : meshRenderer->materials)
+    {
+        if (material == nullptr) continue;
+        key += QString(":%1").arg(material->albedoTexture ? material->albedoTexture->revision() : -1);
+        key += QString(":%1").arg(material->specularTexture ? material->specularTexture->revision() : -1);
+    }
+    return key;
+}
+
+bool Impostors::texturesComplete(const MeshRenderer *meshRenderer)
+{
+    // Still the placeholder, or only some of the levels
+    auto complete = [](const Texture *texture) {
+        return texture == nullptr || !(texture->isLoading() || texture->isUploading() || texture->needsUpdate);
+    };
+
+    for (auto material : meshRenderer->materials)
+    {
+        if (material == nullptr) continue;
+        if (!complete(material->albedoTexture) || !complete(material->specularTexture)) return false;
+    }
+    return true;
+}
+
+void Impostors::release(const ImpostorAtlas &atlas)
+{
+    OpenGLState::forgetTexture(atlas.albedoSpecular);
+    OpenGLState::forgetTexture(atlas.normalDepth);
+    gl->glDeleteTextures(1, &atlas.albedoSpecular);
+    gl->glDeleteTextures(1, &atlas.normalDepth);
+}
+
+QString Impostors::cachePath(const MeshRenderer *meshRenderer)
+{
+    const Mesh *mesh = meshRenderer->mesh;
+    const QByteArray meshHash = AssetCache::hashFile(mesh->getFilePath());
+    if (meshHash.isEmpty()) return QString();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(meshHash);
+    hash.addData(mesh->name.toUtf8());
+    hash.addData(QByteArray::number(IMPOSTOR_FRAMES));
+    hash.addData(QByteArray::number(IMPOSTOR_FRAME_SIZE));
+    for (int i = 0; i < mesh->submeshes.size(); ++i)
+    {
+        const Material *material = (i < meshRenderer->materials.size()) ? meshRenderer->materials[i] : nullptr;
+        if (material == nullptr) {
+            hash.addData("white");
+            continue;
+        }
+        hash.addData(material->albedoTexture ? AssetCache::hashFile(material->albedoTexture->getFilePath()) : QByteArray("none"));
+        hash.addData(material->specularTexture ? AssetCache::hashFile(material->specularTexture->getFilePath()) : QByteArray("none"));
+    }
+    return AssetCache::filePath("impostors", hash.result(), "impostor");
+}
+
+const ImpostorAtlas *Impostors::atlas(const MeshRenderer *meshRenderer)
+{
+    const QString atlasKey = key(meshRenderer);
+    auto it = atlases.constFind(atlasKey);
+    if (it != atlases.constEnd()) {
+        return &it.value();
+    }
+
+    if (!queued.contains(atlasKey))
+    {
+        queued.insert(atlasKey);
+        pending.push_back(meshRenderer);
+    }
+    return nullptr;
+}
+
+void Impostors::bakePending()
+{
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    int baked = 0;
+    for (const MeshRenderer *meshRenderer : pending)
+    {
+        if (baked >= MAX_BAKES_PER_FRAME) break;
+        if (meshRenderer->mesh == nullptr) continue;
+
+        // A placeholder baked into the atlas would also end up in the disk
+        // cache, under the hashes of the real textures
+        if (!texturesComplete(meshRenderer)) continue;
+
+        ImpostorAtlas atlas;
+        const QString path = cachePath(meshRenderer);
+        if (path.isEmpty() || !readFromCache(path, atlas))
+        {
+            bake(meshRenderer, atlas);
+            storeInCache(path, atlas);
+        }
+
+        // The atlas of the previous revision is not used anymore
+        const QString atlasKey = key(meshRenderer);
+        QString &currentKey = currentKeys[baseKey(meshRenderer)];
+        if (!currentKey.isEmpty() && currentKey != atlasKey)
+        {
+            auto old = atlases.find(currentKey);
+            if (old != atlases.end())
+            {
+                release(old.value());
+                atlases.erase(old);
+            }
+        }
+        currentKey = atlasKey;
+
+        atlases.insert(atlasKey, atlas);
+        baked++;
+    }
+
+    // The rest are requested again by the next frames that need them (the
+    // renderers may be gone by then)
+    pending.clear();
+    queued.clear();
+}
+
+GLuint Impostors::createTexture(const void *pixels)
+{
+    GLuint texture = 0;
+    gl->glGenTextures(1, &texture);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, texture);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    return texture;
+}
+
+void Impostors::bake(const MeshRenderer *meshRenderer, ImpostorAtlas &atlas)
+{
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    const Mesh *mesh = meshRenderer->mesh;
+    atlas.center = (mesh->bounds.min + mesh->bounds.max) * 0.5f;
+    atlas.radius = qMax(0.5f * (mesh->bounds.max - mesh->bounds.min).length(), 0.0001f);
+    atlas.albedoSpecular = createTexture(nullptr);
+    atlas.normalDepth = createTexture(nullptr);
+
+    // The bake happens between the passes of a frame
+    GLint viewport[4];
+    OpenGLState::getViewport(viewport);
+    OpenGLState previousState = OpenGLState::currentState;
+
+    OpenGLState state;
+    state.depthTest = true;
+    state.apply();
+
+    fbo->bind();
+    fbo->addColorAttachment(0, atlas.albedoSpecular);
+    fbo->addColorAttachment(1, atlas.normalDepth);
+    fbo->addDepthAttachment(depthTexture);
+    GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    gl->glDrawBuffers(2, buffers);
+    fbo->checkStatus();
+
+    OpenGLState::viewport(0, 0, IMPOSTOR_ATLAS_SIZE, IMPOSTOR_ATLAS_SIZE);
+    gl->glClearDepth(1.0);
+    gl->glClearColor(0.0, 0.0, 0.0, 0.0);
+    gl->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Orthographic views of the bounding sphere, from twice its radius
+    const float radius = atlas.radius;
+    QMatrix4x4 projectionMatrix;
+    projectionMatrix.ortho(-radius, radius, -radius, radius, radius, 3.0f * radius);
+
+    QOpenGLShaderProgram *bound = nullptr;
+    for (int y = 0; y < IMPOSTOR_FRAMES; ++y)
+    {
+        for (int x = 0; x < IMPOSTOR_FRAMES; ++x)
+        {
+            const QVector3D direction = frameDirection(x, y);
+            QVector3D right, up;
+            frameBasis(direction, right, up);
+
+            QMatrix4x4 viewMatrix;
+            viewMatrix.lookAt(atlas.center + direction * 2.0f * radius, atlas.center, up);
+
+            OpenGLState::viewport(x * IMPOSTOR_FRAME_SIZE, y * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+
+            int materialIndex = 0;
+            for (auto submesh : mesh->submeshes)
+            {
+                const Material *material = nullptr;
+                if (materialIndex < meshRenderer->materials.size()) {
+                    material = meshRenderer->materials[materialIndex];
+                }
+                if (material == nullptr) {
+                    material = resourceManager->materialWhite;
+                }
+                materialIndex++;
+
+                quint32 features = 0;
+                if (material->albedoTexture != nullptr) features |= BAKE_ALBEDO_MAP;
+                if (material->specularTexture != nullptr) features |= BAKE_SPECULAR_MAP;
+
+                QOpenGLShaderProgram &program = bakeProgram->variant(features);
+                if (&program != bound)
+                {
+                    if (!OpenGLState::bindProgram(program)) continue;
+                    bound = &program;
+                }
+
+                program.setUniformValue("viewMatrix", viewMatrix);
+                program.setUniformValue("projectionMatrix", projectionMatrix);
+                program.setUniformValue("nearPlane", radius);
+                program.setUniformValue("depthRange", 2.0f * radius);
+
+                if (features & BAKE_ALBEDO_MAP) {
+                    program.setUniformValue("albedoTexture", 0);
+                    material->albedoTexture->bind(0);
+                }
+                if (features & BAKE_SPECULAR_MAP) {
+                    program.setUniformValue("specularTexture", 2);
+                    material->specularTexture->bind(2);
+                }
+
+                submesh->sendDecoding(program);
+                submesh->draw();
+            }
+        }
+    }
+
+    fbo->release();
+    OpenGLState::viewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    previousState.apply();
+}
+
+bool Impostors::readFromCache(const QString &path, ImpostorAtlas &atlas)
+{
+    QByteArray data;
+    if (!AssetCache::read(path, data)) return false;
+
+    ImpostorCacheHeader header;
+    if (data.size() < int(sizeof(header))) return false;
+    std::memcpy(&header, data.constData(), sizeof(header));
+    if (std::memcmp(header.magic, "IMPS", 4) != 0 || header.version != IMPOSTOR_CACHE_VERSION ||
+        header.frames != IMPOSTOR_FRAMES || header.frameSize != IMPOSTOR_FRAME_SIZE)
+    {
+        AssetCache::remove(path);
+        return false;
+    }
+
+    const int textureBytes = IMPOSTOR_ATLAS_SIZE * IMPOSTOR_ATLAS_SIZE * 4;
+    const QByteArray pixels = qUncompress(data.mid(sizeof(header)));
+    if (pixels.size() != 2 * textureBytes)
+    {
+        qDebug("Corrupt impostor cache entry %s", path.toLatin1().data());
+        AssetCache::remove(path);
+        return false;
+    }
+
+    atlas.center = QVector3D(header.center[0], header.center[1], header.center[2]);
+    atlas.radius = header.radius;
+    atlas.albedoSpecular = createTexture(pixels.constData());
+    atlas.normalDepth = createTexture(pixels.constData() + textureBytes);
+    return true;
+}
+
+void Impostors::storeInCache(const QString &path, const ImpostorAtlas &atlas)
+{
+    if (path.isEmpty()) return;
+
+    const int textureBytes = IMPOSTOR_ATLAS_SIZE * IMPOSTOR_ATLAS_SIZE * 4;
+    QByteArray pixels(2 * textureBytes, Qt::Uninitialized);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, atlas.albedoSpecular);
+    gl->glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, atlas.normalDepth);
+    gl->glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data() + textureBytes);
+
+    ImpostorCacheHeader header;
+    std::memcpy(header.magic, "IMPS", 4);
+    header.version = IMPOSTOR_CACHE_VERSION;
+    header.frames = IMPOSTOR_FRAMES;
+    header.frameSize = IMPOSTOR_FRAME_SIZE;
+    header.center[0] = atlas.center.x();
+    header.center[1] = atlas.center.y();
+    header.center[2] = atlas.center.z();
+    header.radius = atlas.radius;
+
+    // Most of the atlas is empty, it compresses well
+    QByteArray data(reinterpret_cast<const char *>(&header), sizeof(header));
+    data += qCompress(pixels, 1);
+    AssetCache::write(path, data);
+}
+
+void Impostors::beginPass(const Camera *camera)
+{
+    boundProgram = nullptr;
+
+    QOpenGLShaderProgram &program = drawProgram->program;
+    if (!OpenGLState::bindProgram(program)) return;
+    boundProgram = &program;
+
+    program.setUniformValue("viewMatrix", camera->viewMatrix);
+    program.setUniformValue("projectionMatrix", camera->projectionMatrix);
+    program.setUniformValue("nearPlane", camera->znear);
+    program.setUniformValue("farPlane", camera->zfar);
+    program.setUniformValue("frameSize", 1.0f / IMPOSTOR_FRAMES);
+    program.setUniformValue("albedoSpecularAtlas", 0);
+    program.setUniformValue("normalDepthAtlas", 1);
+}
+
+void Impostors::draw(const MeshRenderer *meshRenderer, const ImpostorAtlas *atlas, const Camera *camera, float selectionColor)
+{
+    if (boundProgram == nullptr) return;
+    QOpenGLShaderProgram &program = *boundProgram;
+
+    const QMatrix4x4 modelMatrix = meshRenderer->entity->transform->matrix();
+
+    // The frame baked closest to the direction of the camera
+    QVector3D direction = modelMatrix.inverted().map(camera->position) - atlas->center;
+    if (direction.isNull()) direction = QVector3D(0.0f, 0.0f, 1.0f);
+    int x, y;
+    closestFrame(direction.normalized(), x, y);
+    const QVector3D frame = frameDirection(x, y);
+    QVector3D right, up;
+    frameBasis(frame, right, up);
+
+    program.setUniformValue("modelMatrix", modelMatrix);
+    program.setUniformValue("normalMatrix", (camera->viewMatrix * modelMatrix).normalMatrix());
+    program.setUniformValue("impostorCenter", atlas->center);
+    program.setUniformValue("impostorRadius", atlas->radius);
+    program.setUniformValue("frameDirection", frame);
+    program.setUniformValue("frameRight", right);
+    program.setUniformValue("frameUp", up);
+    program.setUniformValue("frameOffset", QVector2D(float(x), float(y)) / IMPOSTOR_FRAMES);
+    program.setUniformValue("selectionColor", selectionColor);
+
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, atlas->albedoSpecular);
+    OpenGLState::bindTexture(1, GL_TEXTURE_2D, atlas->normalDepth);
+
+    resourceManager->quad->submeshes[0]->draw();
+}
+
+void Impostors::endPass()
+{
+    boundProgram = nullptr;
+}
@@ -0,0 +1,85 @@
+#ifndef IMPOSTORS_H
+#define IMPOSTORS_H
+
+#include "gl.h"
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QVector>
+#include <QVector3D>
+#include <QMatrix4x4>
+
+class Camera;
+class MeshRenderer;
+class ShaderProgram;
+class FramebufferObject;
+class QOpenGLShaderProgram;
+
+// Views of a mesh baked into an atlas, drawn instead of the mesh when it is
+// small on screen. The views are taken from IMPOSTOR_FRAMES x
+// IMPOSTOR_FRAMES directions laid out on an octahedron, so the frame
+// closest to any view direction is found with a single lookup. Each frame
+// stores albedo/specular and object space normal/depth, enough to write the
+// G-buffer as the mesh itself would.
+struct ImpostorAtlas
+{
+    GLuint albedoSpecular = 0; // RGB albedo, A specular
+    GLuint normalDepth = 0;    // RGB normal, A depth (0 where there's nothing)
+    QVector3D center;          // Bounding sphere in object space
+    float radius = 0.0f;
+};
+
+class Impostors
+{
+public:
+
+    void initialize();
+    void finalize();
+
+    // Atlas of the mesh with the materials of the renderer, or nullptr if
+    // it isn't ready yet (the bake is queued for the end of the frame)
+    const ImpostorAtlas *atlas(const MeshRenderer *meshRenderer);
+
+    // Bakes (or reads from the disk cache) the atlases requested during the
+    // frame, up to a few per frame to avoid hitches
+    void bakePending();
+
+    // Draws a mesh as an impostor into the bound G-buffer
+    void beginPass(const Camera *camera);
+    void draw(const MeshRenderer *meshRenderer, const ImpostorAtlas *atlas, const Camera *camera, float selectionColor);
+    void endPass();
+
+private:
+
+    // Renderer without revisions, and with the revisions of the mesh and
+    // textures (the key of the atlas)
+    static QString baseKey(const MeshRenderer *meshRenderer);
+    static QString key(const MeshRenderer *meshRenderer);
+    static bool texturesComplete(const MeshRenderer *meshRenderer);
+    static QString cachePath(const MeshRenderer *meshRenderer);
+
+    // View direction of a frame, and the closest frame to a direction
+    static QVector3D frameDirection(int x, int y);
+    static void closestFrame(const QVector3D &direction, int &x, int &y);
+    static void frameBasis(const QVector3D &direction, QVector3D &right, QVector3D &up);
+
+    void bake(const MeshRenderer *meshRenderer, ImpostorAtlas &atlas);
+    bool readFromCache(const QString &path, ImpostorAtlas &atlas);
+    void storeInCache(const QString &path, const ImpostorAtlas &atlas);
+    static GLuint createTexture(const void *pixels);
+    static void release(const ImpostorAtlas &atlas);
+
+    ShaderProgram *bakeProgram = nullptr;
+    ShaderProgram *drawProgram = nullptr;
+    FramebufferObject *fbo = nullptr;
+    GLuint depthTexture = 0;
+
+    QHash<QString, ImpostorAtlas> atlases;
+    QHash<QString, QString> currentKeys; // Atlas key by base key
+    QVector<const MeshRenderer*> pending;
+    QSet<QString> queued;
+
+    QOpenGLShaderProgram *boundProgram = nullptr;
+};
+
+#endif // IMPOSTORS_H
@@ -5,6 +5,9 @@
 
 enum RenderingPipeline { ForwardRendering, DeferredRendering };
 
+// How ModelImporter turns model files into entities
+enum ImportMode { FlattenedImport, ChunkedImport, HierarchyImport };
+
 class MiscSettings
 {
 public:
@@ -18,11 +21,35 @@ public:
 
     bool useSSAO = false;
     bool useOutline = true;
+    bool useLods = true;
+    bool useMeshletCulling = true;
+    bool useImpostors = true;
+
+    // Screen height (fraction of the viewport) below which meshes are
+    // drawn as impostors
+    double impostorScreenSize = 0.1;
+
+    // Material maps sampled from texture arrays (see TextureArrays)
+    bool useTextureArrays = false;
+
+    // Instances of a mesh culled on the GPU (see GpuCulling)
+    bool useGpuCulling = false;
+
+    // Meshes hidden behind others skipped with hardware queries (see
+    // OcclusionCulling): bounding box queries issued per batch, frames a
+    // visible mesh is assumed to stay visible, and whether hidden meshes
+    // are drawn in the same frame when their box passes
+    bool useOcclusionCulling = false;
+    int occlusionQueryBatch = 16;
+    int occlusionVisibleFrames = 8;
+    bool occlusionConditionalRender = true;
 
     double outlineWidth = 2.0;
 
     RenderingPipeline renderingPipeline = RenderingPipeline::DeferredRendering;
 
+    ImportMode importMode = ImportMode::FlattenedImport;
+
 };
 
 #endif // MISCSETTINGS_H
@@ -0,0 +1,235 @@
+#include "occlusionculling.h"
+#include "miscsettings.h"
+#include "ecs/camera.h"
+#include "ecs/entity.h"
+#include "ecs/components.h"
+#include "resources/mesh.h"
+#include "resources/shaderprogram.h"
+#include "resources/resourcemanager.h"
+#include "globals.h"
+#include <QOpenGLShaderProgram>
+
+
+// Queries a renderer may have in flight (the GPU is this far behind)
+static const int MAX_PENDING_QUERIES = 4;
+
+// Bounds grown by this fraction, so that boxes sitting right on top of
+// their occluders are not hidden by z-fighting
+static const float BOUNDS_MARGIN = 0.01f;
+
+void OcclusionCulling::initialize()
+{
+    boxProgram = resourceManager->createShaderProgram();
+    boxProgram->name = "Occlusion Box";
+    boxProgram->vertexShaderFilename = "res/shaders/occlusion_box.vert";
+    boxProgram->fragmentShaderFilename = "res/shaders/occlusion_box.frag";
+    boxProgram->includeForSerialization = false;
+
+    frame = 0;
+}
+
+void OcclusionCulling::finalize()
+{
+    clear();
+}
+
+void OcclusionCulling::clear()
+{
+    for (Node &node : nodes)
+    {
+        freeQueries += node.pending;
+    }
+    nodes.clear();
+
+    if (!freeQueries.isEmpty())
+    {
+        gl->glDeleteQueries(freeQueries.size(), freeQueries.constData());
+        freeQueries.clear();
+    }
+}
+
+GLuint OcclusionCulling::takeQuery()
+{
+    if (freeQueries.isEmpty())
+    {
+        GLuint query = 0;
+        gl->glGenQueries(1, &query);
+        return query;
+    }
+    return freeQueries.takeLast();
+}
+
+void OcclusionCulling::beginFrame(const QVector<MeshRenderer*> &meshRenderers, const Camera *camera)
+{
+    queries = 0;
+
+    if (!miscSettings->useOcclusionCulling)
+    {
+        if (!nodes.isEmpty()) clear();
+        return;
+    }
+
+    frame++;
+    viewProjection = camera->projectionMatrix * camera->viewMatrix;
+
+    const int persistence = qMax(1, miscSettings->occlusionVisibleFrames);
+
+    for (auto meshRenderer : meshRenderers)
+    {
+        const Mesh *mesh = meshRenderer->mesh;
+        if (mesh == nullptr) continue;
+
+        auto it = nodes.find(meshRenderer);
+        if (it == nodes.end())
+        {
+            // New renderers start visible, with their first check spread
+            // over the next frames so they don't all query at once
+            it = nodes.insert(meshRenderer, Node());
+            it->nextQueryFrame = frame + int(qHash(meshRenderer) % uint(persistence));
+        }
+        Node &node = *it;
+        node.lastFrame = frame;
+        node.boundsQuery = 0;
+
+        // Results the GPU already has, without waiting for the rest
+        while (!node.pending.isEmpty())
+        {
+            const GLuint query = node.pending.first();
+            GLuint available = GL_FALSE;
+            gl->glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available == GL_FALSE) break;
+
+            GLuint passed = GL_FALSE;
+            gl->glGetQueryObjectuiv(query, GL_QUERY_RESULT, &passed);
+
+            // A mesh that shows up again stays visible for a while
+            if (passed != GL_FALSE && !node.visible) {
+                node.nextQueryFrame = frame + persistence;
+            }
+            node.visible = passed != GL_FALSE;
+
+            freeQueries.push_back(node.pending.takeFirst());
+        }
+
+        const Bounds &bounds = mesh->bounds;
+        const QVector3D size = (bounds.max - bounds.min) * (1.0f + BOUNDS_MARGIN);
+        const QMatrix4x4 modelMatrix = meshRenderer->entity->transform->matrix();
+        node.boxMatrix = modelMatrix;
+        node.boxMatrix.translate((bounds.min + bounds.max) * 0.5f);
+        node.boxMatrix.scale(size);
+
+        // The near plane would cut the box with the camera inside of it
+        // (the unit cube goes from -0.5 to 0.5)
+        bool invertible = false;
+        const QMatrix4x4 worldToBox = node.boxMatrix.inverted(&invertible);
+        const QVector3D cameraInBox = worldToBox.map(camera->position);
+        const float margin = 0.5f + camera->znear * 2.0f / qMax(1e-6f, qMin(size.x(), qMin(size.y(), size.z())));
+        node.cameraInside = !invertible || (qAbs(cameraInBox.x()) < margin && qAbs(cameraInBox.y()) < margin && qAbs(cameraInBox.z()) < margin);
+    }
+
+    // Renderers that are gone
+    for (auto it = nodes.begin(); it != nodes.end(); )
+    {
+        if (it->lastFrame != frame)
+        {
+            freeQueries += it->pending;
+            it = nodes.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool OcclusionCulling::isVisible(const MeshRenderer *meshRenderer) const
+{
+    if (!miscSettings->useOcclusionCulling) return true;
+
+    auto it = nodes.find(meshRenderer);
+    return it == nodes.end() || it->visible || it->cameraInside;
+}
+
+bool OcclusionCulling::beginQuery(const MeshRenderer *meshRenderer)
+{
+    if (!miscSettings->useOcclusionCulling) return false;
+
+    auto it = nodes.find(meshRenderer);
+    if (it == nodes.end() || it->cameraInside || frame < it->nextQueryFrame) return false;
+    if (it->pending.size() >= MAX_PENDING_QUERIES) return false;
+
+    const GLuint query = takeQuery();
+    gl->glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+    it->pending.push_back(query);
+    it->nextQueryFrame = frame + qMax(1, miscSettings->occlusionVisibleFrames);
+    queries++;
+    return true;
+}
+
+void OcclusionCulling::endQuery()
+{
+    gl->glEndQuery(GL_ANY_SAMPLES_PASSED);
+}
+
+void OcclusionCulling::queryBounds(const QVector<MeshRenderer*> &hidden)
+{
+    if (hidden.isEmpty()) return;
+
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    const Mesh *cube = resourceManager->cube;
+    if (cube == nullptr || cube->needsUpdate || cube->submeshes.isEmpty()) return;
+
+    QOpenGLShaderProgram &program = boxProgram->program;
+    if (!OpenGLState::bindProgram(program)) return;
+
+    // Depth tested, nothing written, both sides (the boxes may be mirrored)
+    OpenGLState previous = OpenGLState::currentState;
+    OpenGLState state = previous;
+    state.depthTest = true;
+    state.depthWrite = false;
+    state.colorWrite = false;
+    state.blending = false;
+    state.faceCulling = false;
+    state.apply();
+
+    const bool conditional = miscSettings->occlusionConditionalRender;
+
+    for (auto meshRenderer : hidden)
+    {
+        auto it = nodes.find(meshRenderer);
+        if (it == nodes.end() || it->pending.size() >= MAX_PENDING_QUERIES) continue;
+
+        // Without conditional rendering the box only matters for the next
+        // frames: no need for a new query while the last one is in flight
+        if (!conditional && !it->pending.isEmpty()) continue;
+
+        program.setUniformValue("boxMatrix", viewProjection * it->boxMatrix);
+
+        const GLuint query = takeQuery();
+        gl->glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+        cube->submeshes[0]->draw();
+        gl->glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+        it->pending.push_back(query);
+        it->boundsQuery = query;
+        queries++;
+    }
+
+    previous.apply();
+}
+
+bool OcclusionCulling::beginConditionalRender(const MeshRenderer *meshRenderer)
+{
+    auto it = nodes.find(meshRenderer);
+    if (it == nodes.end() || it->boundsQuery == 0) return false;
+
+    // The GPU waits for its own query, the CPU goes on
+    gl->glBeginConditionalRender(it->boundsQuery, GL_QUERY_WAIT);
+    return true;
+}
+
+void OcclusionCulling::endConditionalRender()
+{
+    gl->glEndConditionalRender();
+}
@@ -0,0 +1,79 @@
+#ifndef OCCLUSIONCULLING_H
+#define OCCLUSIONCULLING_H
+
+#include "gl.h"
+#include <QHash>
+#include <QMatrix4x4>
+#include <QVector>
+
+class Camera;
+class MeshRenderer;
+class ShaderProgram;
+
+// Occlusion culling with hardware queries and temporal coherence (after
+// CHC++). The meshes visible in the last results are drawn right away and
+// fill the depth buffer; every few frames one of those draws also goes
+// through a query, to find out when the mesh becomes hidden. The meshes
+// hidden in the last results only get their bounding box queried, after
+// everything else. The results are read frames later, when the GPU has
+// them, so the CPU never waits; with conditional rendering a hidden mesh is
+// also drawn in the same frame if its box passes, decided on the GPU.
+// The visible meshes have to be drawn front to back (by the distance of the
+// camera to the center of their bounds), or their queries pass against a
+// depth buffer their occluders haven't written yet.
+class OcclusionCulling
+{
+public:
+
+    void initialize();
+    void finalize();
+
+    // Reads the results the GPU already has and forgets the renderers that
+    // are gone. The renderers are the ones that may use the queries.
+    void beginFrame(const QVector<MeshRenderer*> &meshRenderers, const Camera *camera);
+
+    // Drawn right away (always true when the culling is disabled)
+    bool isVisible(const MeshRenderer *meshRenderer) const;
+
+    // Wraps the draw of a visible renderer in a query when its visibility
+    // is due to be checked again. Returns false if there is no query to end.
+    bool beginQuery(const MeshRenderer *meshRenderer);
+    void endQuery();
+
+    // Queries the bounding boxes of hidden renderers against the depth
+    // drawn so far, without writing anything. The state is switched once
+    // for the whole batch, and left as it was.
+    void queryBounds(const QVector<MeshRenderer*> &hidden);
+
+    // Makes the next draws depend on the query of the bounding box of this
+    // frame. Returns false if the box wasn't queried (nothing to draw).
+    bool beginConditionalRender(const MeshRenderer *meshRenderer);
+    void endConditionalRender();
+
+    int queries = 0; // Issued this frame
+
+private:
+
+    struct Node
+    {
+        bool visible = true;      // Last result
+        bool cameraInside = false; // The box can't be queried this frame
+        QMatrix4x4 boxMatrix;     // Unit cube to the world space bounds
+        int nextQueryFrame = 0;   // Query of the draw, while visible
+        int lastFrame = 0;
+        QVector<GLuint> pending;  // Issued queries, oldest first
+        GLuint boundsQuery = 0;   // Bounding box queried this frame
+    };
+
+    GLuint takeQuery();
+    void clear();
+
+    ShaderProgram *boxProgram = nullptr;
+
+    QHash<const MeshRenderer*, Node> nodes;
+    QVector<GLuint> freeQueries;
+    QMatrix4x4 viewProjection;
+    int frame = 0;
+};
+
+#endif // OCCLUSIONCULLING_H
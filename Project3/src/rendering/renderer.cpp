@@ -1,4 +1,19 @@
 #include "renderer.h"
+#include "ecs/camera.h"
+#include "ecs/entity.h"
+#include "ecs/components.h"
+#include "resources/mesh.h"
+#include "globals.h"
+#include <QtMath>
+#include <QVector4D>
+#include <QtConcurrent>
+
+
+// Screen heights (fraction of the viewport) below which each level is used
+static const float LOD_SCREEN_SIZES[MAX_MESH_LODS] = { 1.0f, 0.5f, 0.25f, 0.125f };
+
+// Margin around the thresholds, so the level doesn't pop back and forth
+static const float LOD_HYSTERESIS = 0.1f;
 
 QVector<QString> Renderer::getTextures() const
 {
@@ -21,3 +36,162 @@ void Renderer::addTexture(QString textureName)
 
     textures.push_back(textureName);
 }
+
+float Renderer::screenSize(const MeshRenderer *meshRenderer, const QMatrix4x4 &worldMatrix, const Camera *camera)
+{
+    const Mesh *mesh = meshRenderer->mesh;
+
+    // Bounding sphere in world space
+    float scale = 0.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+        scale = qMax(scale, worldMatrix.column(axis).toVector3D().length());
+    }
+    const QVector3D center = worldMatrix.map((mesh->bounds.min + mesh->bounds.max) * 0.5f);
+    const float radius = 0.5f * (mesh->bounds.max - mesh->bounds.min).length() * scale;
+    const float distance = (center - camera->position).length();
+
+    return (distance > radius) ? radius / (distance * qTan(qDegreesToRadians(camera->fovy) * 0.5f)) : 1.0f;
+}
+
+int Renderer::selectLod(MeshRenderer *meshRenderer, float screenSize)
+{
+    const Mesh *mesh = meshRenderer->mesh;
+
+    int lodCount = 1;
+    for (auto submesh : mesh->submeshes) {
+        lodCount = qMax(lodCount, submesh->lodCount());
+    }
+    if (!miscSettings->useLods || lodCount == 1)
+    {
+        meshRenderer->lod = 0;
+        return 0;
+    }
+
+    int lod = qBound(0, meshRenderer->lod, lodCount - 1);
+    while (lod + 1 < lodCount && screenSize < LOD_SCREEN_SIZES[lod + 1] * (1.0f - LOD_HYSTERESIS)) lod++;
+    while (lod > 0 && screenSize > LOD_SCREEN_SIZES[lod] * (1.0f + LOD_HYSTERESIS)) lod--;
+    meshRenderer->lod = lod;
+    return lod;
+}
+
+void Renderer::cullMeshlets(MeshletCulling &culling)
+{
+    // Frustum planes in object space (Gribb & Hartmann), normalized so the
+    // spheres can be tested against them
+    const QMatrix4x4 &m = culling.objectToClip;
+    QVector4D planes[6] = {
+        m.row(3) + m.row(0), m.row(3) - m.row(0),
+        m.row(3) + m.row(1), m.row(3) - m.row(1),
+        m.row(3) + m.row(2), m.row(3) - m.row(2)
+    };
+    for (QVector4D &plane : planes)
+    {
+        const float length = plane.toVector3D().length();
+        if (length > 0.0f) plane /= length;
+    }
+
+    const QVector<Meshlet> &meshlets = culling.submesh->getMeshlets();
+    culling.visible.clear();
+    culling.visible.reserve(meshlets.size());
+    culling.culledTriangles = 0;
+    for (int i = 0; i < meshlets.size(); ++i)
+    {
+        const Meshlet &meshlet = meshlets[i];
+
+        bool culled = false;
+        for (const QVector4D &plane : planes)
+        {
+            if (QVector3D::dotProduct(plane.toVector3D(), meshlet.center) + plane.w() < -meshlet.radius)
+            {
+                culled = true;
+                break;
+            }
+        }
+
+        // All the triangles face away from anywhere in the sphere
+        if (!culled && culling.coneCulling && meshlet.coneCutoff <= 1.0f)
+        {
+            const QVector3D toCenter = meshlet.center - culling.cameraPosition;
+            culled = QVector3D::dotProduct(toCenter, meshlet.coneAxis) >= meshlet.coneCutoff * toCenter.length() + meshlet.radius;
+        }
+
+        if (culled) {
+            culling.culledTriangles += meshlet.indexCount / 3;
+        } else {
+            culling.visible.push_back(i);
+        }
+    }
+}
+
+void Renderer::prepareMeshes(const QVector<MeshRenderer*> &meshRenderers, const Camera *camera)
+{
+    meshletCulling.clear();
+    meshletCullingIndex.clear();
+
+    for (auto meshRenderer : meshRenderers)
+    {
+        if (meshRenderer->mesh == nullptr) continue;
+
+        const QMatrix4x4 worldMatrix = meshRenderer->entity->transform->matrix();
+        const float size = screenSize(meshRenderer, worldMatrix, camera);
+
+        // Same hysteresis as the levels of detail
+        if (supportsImpostors && miscSettings->useImpostors)
+        {
+            const float threshold = miscSettings->impostorScreenSize * (meshRenderer->impostor ? 1.0f + LOD_HYSTERESIS : 1.0f - LOD_HYSTERESIS);
+            meshRenderer->impostor = size < threshold;
+        }
+        else
+        {
+            meshRenderer->impostor = false;
+        }
+
+        const int lod = selectLod(meshRenderer, size);
+        if (meshRenderer->impostor) continue;
+        if (lod > 0 || !miscSettings->useMeshletCulling) continue;
+
+        // Back-face tests of the normal cones need angles to be preserved
+        float minScale = FLT_MAX, maxScale = 0.0f;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float scale = worldMatrix.column(axis).toVector3D().length();
+            minScale = qMin(minScale, scale);
+            maxScale = qMax(maxScale, scale);
+        }
+        const bool coneCulling = maxScale - minScale <= 0.01f * maxScale && worldMatrix.determinant() > 0.0;
+
+        for (auto submesh : meshRenderer->mesh->submeshes)
+        {
+            if (submesh->getMeshlets().isEmpty()) continue;
+
+            MeshletCulling culling;
+            culling.submesh = submesh;
+            culling.objectToClip = camera->projectionMatrix * camera->viewMatrix * worldMatrix;
+            culling.cameraPosition = worldMatrix.inverted().map(camera->position);
+            culling.coneCulling = coneCulling;
+            meshletCullingIndex.insert(qMakePair(static_cast<const MeshRenderer *>(meshRenderer), static_cast<const SubMesh *>(submesh)), meshletCulling.size());
+            meshletCulling.push_back(culling);
+        }
+    }
+
+    QtConcurrent::blockingMap(meshletCulling, &Renderer::cullMeshlets);
+}
+
+void Renderer::drawSubMesh(MeshRenderer *meshRenderer, SubMesh *submesh)
+{
+    const int lod = meshRenderer->lod;
+
+    const int culling = meshletCullingIndex.value(qMakePair(static_cast<const MeshRenderer *>(meshRenderer), static_cast<const SubMesh *>(submesh)), -1);
+    if (culling >= 0)
+    {
+        const MeshletCulling &result = meshletCulling[culling];
+        submesh->drawMeshlets(result.visible);
+        statistics.triangles += submesh->triangleCount(0) - result.culledTriangles;
+        statistics.meshletTrianglesCulled += result.culledTriangles;
+        return;
+    }
+
+    submesh->draw(GL_TRIANGLES, lod);
+    statistics.triangles += submesh->triangleCount(lod);
+    statistics.lodTrianglesSaved += submesh->triangleCount(0) - submesh->triangleCount(lod);
+}
@@ -3,8 +3,33 @@
 
 #include <QVector>
 #include <QString>
+#include <QHash>
+#include <QPair>
+#include <QMatrix4x4>
 
 class Camera;
+class MeshRenderer;
+class SubMesh;
+class StaticBatches;
+
+// Counters of the last rendered frame
+struct RenderStatistics
+{
+    qint64 triangles = 0;         // Drawn by the mesh passes
+    qint64 lodTrianglesSaved = 0; // Left out by the levels of detail
+    qint64 meshletTrianglesCulled = 0; // Left out by the meshlet culling
+    int impostors = 0;            // Meshes drawn as impostors
+    int frameDataBytes = 0;       // Streamed through the per-frame ring buffer
+    int frameDataStalls = 0;      // Waits for the GPU to release ring buffer space
+    int frameDataWraps = 0;
+    int glCallsIssued = 0;        // State changes and binds that reached GL
+    int glCallsFiltered = 0;      // Skipped by the state cache as redundant
+    int textureBinds = 0;         // Texture binds that reached GL
+    int staticBatches = 0;        // Draws of merged static entities
+    int gpuInstances = 0;         // Instances sent to the GPU culling
+    int occlusionQueries = 0;     // Issued by the occlusion culling
+    int occludedMeshes = 0;       // Hidden in the last occlusion results
+};
 
 class Renderer
 {
@@ -28,10 +53,48 @@ public:
     RendererType rendererType = RendererType::FORWARD;
     QVector<float> selectionPixels;
 
+    RenderStatistics statistics;
+
 protected:
+    // Frame setup of the mesh passes: picks the meshes drawn as impostors
+    // (if the renderer has them) and the level of detail of the rest, and
+    // culls the meshlets of the submeshes drawn at full detail (all the
+    // submeshes in parallel)
+    void prepareMeshes(const QVector<MeshRenderer*> &meshRenderers, const Camera *camera);
+    // Draws a submesh as prepared for this frame and counts its triangles
+    void drawSubMesh(MeshRenderer *meshRenderer, SubMesh *submesh);
+
     void addTexture(QString textureName);
     QVector<QString> textures;
     QString m_shownTexture;
+
+    bool supportsImpostors = false;
+
+    // Static entities merged by material (created by the renderers)
+    StaticBatches *staticBatches = nullptr;
+
+private:
+    // Projected diameter of the bounds of a mesh over the viewport height
+    static float screenSize(const MeshRenderer *meshRenderer, const QMatrix4x4 &worldMatrix, const Camera *camera);
+
+    // Level of detail of a mesh, from its screen size (the level of the
+    // previous frame is kept around the thresholds)
+    int selectLod(MeshRenderer *meshRenderer, float screenSize);
+
+    // Meshlets of a submesh that survive the culling of this frame
+    struct MeshletCulling
+    {
+        const SubMesh *submesh = nullptr;
+        QMatrix4x4 objectToClip;
+        QVector3D cameraPosition; // In object space
+        bool coneCulling = false; // Not valid with non-uniform scales or mirrors
+        QVector<int> visible;
+        qint64 culledTriangles = 0;
+    };
+    static void cullMeshlets(MeshletCulling &culling);
+
+    QVector<MeshletCulling> meshletCulling;
+    QHash<QPair<const MeshRenderer*, const SubMesh*>, int> meshletCullingIndex;
 };
 
 #endif // RENDERER_H
@@ -0,0 +1,230 @@
+#include "ringbuffer.h"
+#include <QDebug>
+#include <cstring>
+
+
+// Time waited on a fence before checking it again (in nanoseconds)
+static const GLuint64 FENCE_WAIT_TIMEOUT = 1000000;
+
+static int alignUp(int value, int alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void RingBuffer::initialize(int size)
+{
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    capacity = size;
+    head = 0;
+    frameBegin = 0;
+
+    GLint alignment = 0;
+    gl->glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    uboAlignment = qMax(1, int(alignment));
+
+    // Bound to the copy target so the VAO and uniform block bindings stay as they are
+    gl->glGenBuffers(1, &buffer);
+    OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+
+    persistent = false;
+    if (glext.bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glext.glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, nullptr, flags);
+        mapped = static_cast<unsigned char *>(gl->glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags));
+        persistent = mapped != nullptr;
+
+        if (!persistent)
+        {
+            // Immutable storage can't be specified again
+            qDebug("RingBuffer: persistent mapping failed, falling back to orphaning");
+            OpenGLState::forgetBuffer(buffer);
+            gl->glDeleteBuffers(1, &buffer);
+            gl->glGenBuffers(1, &buffer);
+            OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        }
+    }
+
+    if (!persistent)
+    {
+        gl->glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+    }
+
+    OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void RingBuffer::finalize()
+{
+    while (!inFlight.isEmpty())
+    {
+        retireOldest(false);
+    }
+
+    if (mapped != nullptr)
+    {
+        OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        gl->glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        mapped = nullptr;
+    }
+
+    if (buffer != 0)
+    {
+        OpenGLState::forgetBuffer(buffer);
+        gl->glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+}
+
+void RingBuffer::beginFrame()
+{
+    stalls = 0;
+    wraps = 0;
+    bytes = 0;
+    frameBegin = head;
+
+    // Forget the frames the GPU is already done with
+    while (!inFlight.isEmpty())
+    {
+        const GLenum result = gl->glClientWaitSync(inFlight.first().fence, 0, 0);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) break;
+        retireOldest(false);
+    }
+}
+
+void RingBuffer::endFrame()
+{
+    // Without persistent mapping the old data is never overwritten in place
+    if (!persistent || bytes == 0) return;
+
+    FrameFence frame;
+    frame.fence = gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.begin = frameBegin;
+    frame.end = head;
+    inFlight.push_back(frame);
+}
+
+RingBuffer::Allocation RingBuffer::upload(const void *data, int size, int alignment)
+{
+    Allocation allocation;
+
+    if (buffer == 0 || size <= 0) return allocation;
+    if (size > capacity)
+    {
+        qDebug("RingBuffer: %d bytes don't fit in the buffer (%d bytes)", size, capacity);
+        return allocation;
+    }
+
+    int offset = alignUp(head, qMax(1, alignment));
+    int padding = offset - head;
+    if (offset + size > capacity)
+    {
+        // The end of the buffer is skipped
+        padding = capacity - head;
+        offset = 0;
+        wraps++;
+
+        if (!persistent)
+        {
+            // Orphaning: new storage, the driver keeps the old one until
+            // the GPU is done with it
+            OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            gl->glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+            OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+    }
+
+    if (persistent)
+    {
+        if (bytes + padding + size >= capacity)
+        {
+            // The frame went all the way around over its own data
+            qDebug("RingBuffer: more than %d bytes in a frame, waiting for the GPU", capacity);
+            gl->glFinish();
+            stalls++;
+            while (!inFlight.isEmpty())
+            {
+                retireOldest(false);
+            }
+            bytes = 0;
+            padding = 0;
+            frameBegin = offset;
+        }
+
+        while (!inFlight.isEmpty() && overlapsInFlight(offset, offset + size))
+        {
+            retireOldest(true);
+        }
+
+        memcpy(mapped + offset, data, size_t(size));
+    }
+    else
+    {
+        OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+        void *destination = gl->glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size, access);
+        if (destination != nullptr)
+        {
+            memcpy(destination, data, size_t(size));
+            gl->glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        }
+        OpenGLState::bindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        if (destination == nullptr)
+        {
+            qDebug("RingBuffer: glMapBufferRange failed");
+            return allocation;
+        }
+    }
+
+    bytes += padding + size;
+    head = offset + size;
+
+    allocation.buffer = buffer;
+    allocation.offset = offset;
+    allocation.size = size;
+    return allocation;
+}
+
+void RingBuffer::bindUniformBlock(GLuint binding, const Allocation &allocation)
+{
+    gl->glBindBufferRange(GL_UNIFORM_BUFFER, binding, allocation.buffer, allocation.offset, allocation.size);
+}
+
+bool RingBuffer::overlapsInFlight(int begin, int end) const
+{
+    for (const FrameFence &frame : inFlight)
+    {
+        if (frame.begin < frame.end)
+        {
+            if (begin < frame.end && frame.begin < end) return true;
+        }
+        else if (frame.begin > frame.end)
+        {
+            // Wrapped: up to the end of the buffer, and from the start
+            if (begin < capacity && frame.begin < end) return true;
+            if (begin < frame.end) return true;
+        }
+    }
+    return false;
+}
+
+void RingBuffer::retireOldest(bool wait)
+{
+    FrameFence frame = inFlight.takeFirst();
+
+    if (wait)
+    {
+        GLenum result = gl->glClientWaitSync(frame.fence, 0, 0);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+        {
+            stalls++;
+            do {
+                result = gl->glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_WAIT_TIMEOUT);
+            } while (result == GL_TIMEOUT_EXPIRED);
+        }
+    }
+
+    gl->glDeleteSync(frame.fence);
+}
@@ -0,0 +1,74 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "gl.h"
+#include <QVector>
+
+// Transient per-frame data (uniform blocks, instance data, debug lines...)
+// streamed through one large buffer, instead of small glBufferData calls.
+// With GL_ARB_buffer_storage the buffer is mapped once, persistent and
+// coherent, and a fence per frame in flight tells when the oldest data can
+// be overwritten. Otherwise each allocation is mapped unsynchronized, and
+// the buffer is orphaned when the allocations wrap around.
+class RingBuffer
+{
+public:
+
+    struct Allocation
+    {
+        GLuint buffer = 0;
+        int offset = 0;
+        int size = 0;
+
+        bool isValid() const { return buffer != 0; }
+    };
+
+    void initialize(int size = 4 * 1024 * 1024);
+    void finalize();
+
+    // Everything allocated between these is fenced together
+    void beginFrame();
+    void endFrame();
+
+    // Copies the data into the buffer at an offset multiple of alignment
+    // (uniformAlignment() for uniform blocks, the vertex size for vertices).
+    // The data of a frame must fit in the buffer.
+    Allocation upload(const void *data, int size, int alignment = 16);
+
+    // Binds an allocation to a uniform block binding point
+    static void bindUniformBlock(GLuint binding, const Allocation &allocation);
+
+    int uniformAlignment() const { return uboAlignment; }
+    bool isPersistent() const { return persistent; }
+
+    // Counters of the current (or last) frame
+    int stalls = 0; // Waits for the GPU to release old data
+    int wraps = 0;  // Times the allocations went back to the start
+    int bytes = 0;  // Allocated, with the alignment padding
+
+private:
+
+    // Data of a frame in flight, between begin and end (wrapping around
+    // when begin > end)
+    struct FrameFence
+    {
+        GLsync fence = nullptr;
+        int begin = 0;
+        int end = 0;
+    };
+
+    bool overlapsInFlight(int begin, int end) const;
+    void retireOldest(bool wait);
+
+    GLuint buffer = 0;
+    int capacity = 0;
+    unsigned char *mapped = nullptr; // Persistent mapping
+    bool persistent = false;
+    int uboAlignment = 256;
+
+    int head = 0;
+    int frameBegin = 0;
+    QVector<FrameFence> inFlight; // Oldest first
+};
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,464 @@
+#include "staticbatches.h"
+#include "ecs/camera.h"
+#include "ecs/entity.h"
+#include "ecs/components.h"
+#include "resources/vertexlayout.h"
+#include "resources/resourcemanager.h"
+#include "globals.h"
+#include <QVector4D>
+#include <cmath>
+#include <cstring>
+
+
+// Side of the cells of the world grid
+static const float STATIC_CELL_SIZE = 32.0f;
+
+// Frames an edited entity has to stay still before it is batched again
+static const int STATIC_SETTLE_FRAMES = 30;
+
+// Floats per decoded vertex: position, normal and texture coordinates
+static const int DECODED_VERTEX_FLOATS = 8;
+
+// Slot of the selection color of the entity of each vertex
+struct Entity1f { typedef float Type; static constexpr int location = 5; static constexpr int components = 1; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 4; };
+
+typedef VertexLayout<Pos3f, Norm3f, UV2f, Entity1f> BatchLayout;
+
+struct BatchVertex
+{
+    float position[3];
+    float normal[3];
+    float texCoords[2];
+    float entity;
+};
+
+static_assert(sizeof(BatchVertex) == BatchLayout::size, "BatchVertex doesn't match BatchLayout");
+
+static bool decodableType(GLenum type)
+{
+    switch (type)
+    {
+    case GL_FLOAT:
+    case GL_UNSIGNED_SHORT:
+    case GL_SHORT:
+    case GL_UNSIGNED_BYTE:
+    case GL_BYTE:
+    case GL_INT_2_10_10_10_REV:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Reads an attribute the way the vertex shader gets it (before the
+// decoding of the quantized positions and texture coordinates)
+static void decodeAttribute(const unsigned char *vertex, const VertexAttribute &attribute, float *out)
+{
+    const unsigned char *p = vertex + attribute.offset;
+    for (int i = 0; i < attribute.ncomp && attribute.type != GL_INT_2_10_10_10_REV; ++i)
+    {
+        switch (attribute.type)
+        {
+        case GL_FLOAT: {
+            memcpy(&out[i], p + 4 * i, sizeof(float));
+            break;
+        }
+        case GL_UNSIGNED_SHORT: {
+            quint16 value; memcpy(&value, p + 2 * i, sizeof(value));
+            out[i] = attribute.normalized ? value / 65535.0f : float(value);
+            break;
+        }
+        case GL_SHORT: {
+            qint16 value; memcpy(&value, p + 2 * i, sizeof(value));
+            out[i] = attribute.normalized ? qMax(value / 32767.0f, -1.0f) : float(value);
+            break;
+        }
+        case GL_UNSIGNED_BYTE:
+            out[i] = attribute.normalized ? p[i] / 255.0f : float(p[i]);
+            break;
+        case GL_BYTE:
+            out[i] = attribute.normalized ? qMax(qint8(p[i]) / 127.0f, -1.0f) : float(qint8(p[i]));
+            break;
+        }
+    }
+
+    if (attribute.type == GL_INT_2_10_10_10_REV)
+    {
+        quint32 packed; memcpy(&packed, p, sizeof(packed));
+        for (int i = 0; i < 3 && i < attribute.ncomp; ++i)
+        {
+            const int value = qint32(packed << (22 - 10 * i)) >> 22;
+            out[i] = attribute.normalized ? qMax(value / 511.0f, -1.0f) : float(value);
+        }
+    }
+}
+
+void StaticBatches::initialize()
+{
+    gl->glGenBuffers(1, &selectionBuffer);
+    gl->glGenTextures(1, &selectionTexture);
+
+    OpenGLState::bindBuffer(GL_TEXTURE_BUFFER, selectionBuffer);
+    gl->glBufferData(GL_TEXTURE_BUFFER, sizeof(float), nullptr, GL_STREAM_DRAW);
+    OpenGLState::bindTexture(0, GL_TEXTURE_BUFFER, selectionTexture);
+    gl->glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, selectionBuffer);
+    OpenGLState::bindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void StaticBatches::finalize()
+{
+    for (StaticBatch &batch : batches)
+    {
+        batch.submesh->destroy();
+        delete batch.submesh;
+    }
+    batches.clear();
+    members.clear();
+    records.clear();
+    selectionColors.clear();
+    freeSlots.clear();
+
+    OpenGLState::forgetTexture(selectionTexture);
+    gl->glDeleteTextures(1, &selectionTexture);
+    selectionTexture = 0;
+    OpenGLState::forgetBuffer(selectionBuffer);
+    gl->glDeleteBuffers(1, &selectionBuffer);
+    selectionBuffer = 0;
+}
+
+void StaticBatches::update()
+{
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    QSet<StaticBatchKey> dirty;
+    QSet<const Entity*> present;
+
+    for (auto entity : scene->entities)
+    {
+        if (!batchable(entity)) continue;
+        present.insert(entity);
+
+        auto it = records.find(entity);
+        if (it == records.end())
+        {
+            it = records.insert(entity, Record());
+            if (freeSlots.isEmpty()) {
+                it->slot = selectionColors.size();
+                selectionColors.push_back(0.0f);
+            } else {
+                it->slot = freeSlots.takeLast();
+            }
+        }
+
+        Record &record = *it;
+        const Signature current = signature(entity);
+        if (record.signature != current)
+        {
+            // Out of the batches while it is being edited
+            if (record.baked) unbake(entity, record, dirty);
+            record.signature = current;
+            record.stillFrames = 0;
+        }
+        else if (!record.baked && ++record.stillFrames >= STATIC_SETTLE_FRAMES)
+        {
+            bake(entity, record, dirty);
+        }
+    }
+
+    // Entities gone, no longer static or no longer batchable
+    for (auto it = records.begin(); it != records.end(); )
+    {
+        if (present.contains(it.key())) { ++it; continue; }
+        if (it->baked) unbake(it.key(), *it, dirty);
+        freeSlots.push_back(it->slot);
+        it = records.erase(it);
+    }
+
+    // Submeshes shared by several entities are only read back once
+    QHash<SubMesh*, Geometry> geometries;
+    for (const StaticBatchKey &key : dirty)
+    {
+        rebuild(key, geometries);
+    }
+}
+
+bool StaticBatches::contains(const Entity *entity) const
+{
+    auto it = records.find(entity);
+    return it != records.end() && it->baked;
+}
+
+void StaticBatches::setSelectionColor(const Entity *entity, float color)
+{
+    auto it = records.find(entity);
+    if (it != records.end()) {
+        selectionColors[it->slot] = color;
+    }
+}
+
+void StaticBatches::bindSelectionColors(int textureUnit)
+{
+    OpenGLState::bindBuffer(GL_TEXTURE_BUFFER, selectionBuffer);
+    gl->glBufferData(GL_TEXTURE_BUFFER, qMax(1, selectionColors.size()) * int(sizeof(float)), nullptr, GL_STREAM_DRAW);
+    if (!selectionColors.isEmpty()) {
+        gl->glBufferSubData(GL_TEXTURE_BUFFER, 0, selectionColors.size() * int(sizeof(float)), selectionColors.constData());
+    }
+    OpenGLState::bindBuffer(GL_TEXTURE_BUFFER, 0);
+    OpenGLState::bindTexture(textureUnit, GL_TEXTURE_BUFFER, selectionTexture);
+}
+
+QVector<const StaticBatch*> StaticBatches::visible(const Camera *camera) const
+{
+    // Frustum planes in world space (Gribb & Hartmann)
+    const QMatrix4x4 m = camera->projectionMatrix * camera->viewMatrix;
+    const QVector4D planes[6] = {
+        m.row(3) + m.row(0), m.row(3) - m.row(0),
+        m.row(3) + m.row(1), m.row(3) - m.row(1),
+        m.row(3) + m.row(2), m.row(3) - m.row(2)
+    };
+
+    QVector<const StaticBatch*> result;
+    for (const StaticBatch &batch : batches)
+    {
+        bool culled = false;
+        for (const QVector4D &plane : planes)
+        {
+            // Corner of the box furthest along the plane normal
+            const QVector3D corner(plane.x() >= 0.0f ? batch.bounds.max.x() : batch.bounds.min.x(),
+                                   plane.y() >= 0.0f ? batch.bounds.max.y() : batch.bounds.min.y(),
+                                   plane.z() >= 0.0f ? batch.bounds.max.z() : batch.bounds.min.z());
+            if (QVector3D::dotProduct(plane.toVector3D(), corner) + plane.w() < 0.0f)
+            {
+                culled = true;
+                break;
+            }
+        }
+        if (!culled) result.push_back(&batch);
+    }
+    return result;
+}
+
+bool StaticBatches::batchable(const Entity *entity)
+{
+    if (!entity->active || !entity->isStatic || entity->meshRenderer == nullptr) return false;
+
+    const Mesh *mesh = entity->meshRenderer->mesh;
+    if (mesh == nullptr || mesh->needsUpdate || mesh->submeshes.isEmpty()) return false;
+
+    for (auto submesh : mesh->submeshes)
+    {
+        const VertexFormat &format = submesh->format();
+        if (submesh->isDynamic() || !submesh->vbo.isCreated()) return false;
+        if (!format.attribute[0].enabled) return false;
+        for (int location = 0; location < 3; ++location)
+        {
+            if (format.attribute[location].enabled && !decodableType(format.attribute[location].type)) return false;
+        }
+    }
+    return true;
+}
+
+StaticBatches::Signature StaticBatches::signature(const Entity *entity)
+{
+    Signature result;
+    result.worldMatrix = entity->transform->matrix();
+    result.mesh = entity->meshRenderer->mesh;
+    result.meshRevision = result.mesh->revision();
+    result.materials = entity->meshRenderer->materials;
+    return result;
+}
+
+Material *StaticBatches::material(const Entity *entity, int submeshIndex)
+{
+    // Same fallback as the renderers
+    Material *result = nullptr;
+    if (submeshIndex < entity->meshRenderer->materials.size()) {
+        result = entity->meshRenderer->materials[submeshIndex];
+    }
+    return (result != nullptr) ? result : resourceManager->materialWhite;
+}
+
+QVector<StaticBatchKey> StaticBatches::keys(const Entity *entity)
+{
+    // The whole entity goes to the cell of its center
+    const Mesh *mesh = entity->meshRenderer->mesh;
+    const QVector3D center = entity->transform->matrix().map((mesh->bounds.min + mesh->bounds.max) * 0.5f);
+
+    StaticBatchKey key;
+    key.x = int(std::floor(center.x() / STATIC_CELL_SIZE));
+    key.y = int(std::floor(center.y() / STATIC_CELL_SIZE));
+    key.z = int(std::floor(center.z() / STATIC_CELL_SIZE));
+
+    QVector<StaticBatchKey> result;
+    for (int i = 0; i < mesh->submeshes.size(); ++i)
+    {
+        key.material = material(entity, i);
+        if (!result.contains(key)) result.push_back(key);
+    }
+    return result;
+}
+
+void StaticBatches::bake(const Entity *entity, Record &record, QSet<StaticBatchKey> &dirty)
+{
+    record.keys = keys(entity);
+    for (const StaticBatchKey &key : record.keys)
+    {
+        members[key].push_back(entity);
+        dirty.insert(key);
+    }
+    record.baked = true;
+}
+
+void StaticBatches::unbake(const Entity *entity, Record &record, QSet<StaticBatchKey> &dirty)
+{
+    for (const StaticBatchKey &key : record.keys)
+    {
+        members[key].removeOne(entity);
+        dirty.insert(key);
+    }
+    record.keys.clear();
+    record.baked = false;
+}
+
+void StaticBatches::readBack(SubMesh *submesh, Geometry &geometry)
+{
+    // The CPU copy is gone after the upload
+    const int vertexCount = int(submesh->vertexCount());
+    const VertexFormat &format = submesh->vertexFormat;
+
+    QByteArray raw(int(submesh->data_size), 0);
+    OpenGLState::bindBuffer(GL_COPY_READ_BUFFER, submesh->vbo.bufferId());
+    gl->glGetBufferSubData(GL_COPY_READ_BUFFER, 0, raw.size(), raw.data());
+
+    // Full detail level only
+    const int firstIndex = submesh->lods.isEmpty() ? 0 : submesh->lods[0].firstIndex;
+    const int indexCount = submesh->lods.isEmpty() ? int(submesh->indices_count) : submesh->lods[0].indexCount;
+    geometry.indices.resize(submesh->ibo.isCreated() ? indexCount : vertexCount);
+    if (submesh->ibo.isCreated())
+    {
+        OpenGLState::bindBuffer(GL_COPY_READ_BUFFER, submesh->ibo.bufferId());
+        if (submesh->indexType == GL_UNSIGNED_SHORT)
+        {
+            QVector<quint16> shortIndices(indexCount);
+            gl->glGetBufferSubData(GL_COPY_READ_BUFFER, firstIndex * int(sizeof(quint16)), indexCount * int(sizeof(quint16)), shortIndices.data());
+            for (int i = 0; i < indexCount; ++i) {
+                geometry.indices[i] = shortIndices[i];
+            }
+        }
+        else
+        {
+            gl->glGetBufferSubData(GL_COPY_READ_BUFFER, firstIndex * int(sizeof(unsigned int)), indexCount * int(sizeof(unsigned int)), geometry.indices.data());
+        }
+    }
+    else
+    {
+        for (int i = 0; i < vertexCount; ++i) {
+            geometry.indices[i] = unsigned(i);
+        }
+    }
+    OpenGLState::bindBuffer(GL_COPY_READ_BUFFER, 0);
+
+    geometry.vertices.resize(vertexCount * DECODED_VERTEX_FLOATS);
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(raw.constData());
+    for (int i = 0; i < vertexCount; ++i)
+    {
+        const unsigned char *vertex = bytes + i * format.size;
+        float *out = geometry.vertices.data() + i * DECODED_VERTEX_FLOATS;
+        float position[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        float normal[4] = { 0.0f, 0.0f, 1.0f, 0.0f };
+        float texCoords[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        decodeAttribute(vertex, format.attribute[0], position);
+        if (format.attribute[1].enabled) decodeAttribute(vertex, format.attribute[1], normal);
+        if (format.attribute[2].enabled) decodeAttribute(vertex, format.attribute[2], texCoords);
+
+        for (int c = 0; c < 3; ++c) {
+            out[c] = format.positionOffset[c] + position[c] * format.positionScale[c];
+            out[3 + c] = normal[c];
+        }
+        out[6] = format.texCoordsOffset.x() + texCoords[0] * format.texCoordsScale.x();
+        out[7] = format.texCoordsOffset.y() + texCoords[1] * format.texCoordsScale.y();
+    }
+}
+
+void StaticBatches::rebuild(const StaticBatchKey &key, QHash<SubMesh*, Geometry> &geometries)
+{
+    auto batchIt = batches.find(key);
+    if (batchIt != batches.end())
+    {
+        batchIt->submesh->destroy();
+        delete batchIt->submesh;
+        batches.erase(batchIt);
+    }
+
+    const QVector<const Entity*> entities = members.value(key);
+    if (entities.isEmpty())
+    {
+        members.remove(key);
+        return;
+    }
+
+    QVector<BatchVertex> vertices;
+    QVector<unsigned int> indices;
+    Bounds bounds;
+
+    for (const Entity *entity : entities)
+    {
+        const Record &record = records[entity];
+        const QMatrix4x4 &worldMatrix = record.signature.worldMatrix;
+        const QMatrix4x4 normalMatrix = worldMatrix.inverted().transposed();
+        const bool mirrored = worldMatrix.determinant() < 0.0;
+
+        const Mesh *mesh = entity->meshRenderer->mesh;
+        for (int s = 0; s < mesh->submeshes.size(); ++s)
+        {
+            if (material(entity, s) != key.material) continue;
+
+            SubMesh *submesh = mesh->submeshes[s];
+            auto geometryIt = geometries.find(submesh);
+            if (geometryIt == geometries.end())
+            {
+                geometryIt = geometries.insert(submesh, Geometry());
+                readBack(submesh, *geometryIt);
+            }
+            const Geometry &geometry = *geometryIt;
+
+            const unsigned int firstVertex = unsigned(vertices.size());
+            const int vertexCount = geometry.vertices.size() / DECODED_VERTEX_FLOATS;
+            for (int i = 0; i < vertexCount; ++i)
+            {
+                const float *in = geometry.vertices.constData() + i * DECODED_VERTEX_FLOATS;
+                const QVector3D position = worldMatrix.map(QVector3D(in[0], in[1], in[2]));
+                const QVector3D normal = normalMatrix.mapVector(QVector3D(in[3], in[4], in[5])).normalized();
+
+                BatchVertex vertex;
+                vertex.position[0] = position.x(); vertex.position[1] = position.y(); vertex.position[2] = position.z();
+                vertex.normal[0] = normal.x(); vertex.normal[1] = normal.y(); vertex.normal[2] = normal.z();
+                vertex.texCoords[0] = in[6];
+                vertex.texCoords[1] = in[7];
+                vertex.entity = float(record.slot);
+                vertices.push_back(vertex);
+
+                bounds.min = QVector3D(qMin(bounds.min.x(), position.x()), qMin(bounds.min.y(), position.y()), qMin(bounds.min.z(), position.z()));
+                bounds.max = QVector3D(qMax(bounds.max.x(), position.x()), qMax(bounds.max.y(), position.y()), qMax(bounds.max.z(), position.z()));
+            }
+
+            // Mirroring flips the winding of the triangles
+            for (int i = 0; i + 2 < geometry.indices.size(); i += 3)
+            {
+                indices.push_back(firstVertex + geometry.indices[i]);
+                indices.push_back(firstVertex + geometry.indices[mirrored ? i + 2 : i + 1]);
+                indices.push_back(firstVertex + geometry.indices[mirrored ? i + 1 : i + 2]);
+            }
+        }
+    }
+
+    if (indices.isEmpty()) return;
+
+    StaticBatch batch;
+    batch.material = key.material;
+    batch.bounds = bounds;
+    batch.submesh = new SubMesh(BatchLayout::format(), vertices.data(), vertices.size() * int(sizeof(BatchVertex)),
+                                indices.data(), indices.size());
+    batch.submesh->update();
+    batches.insert(key, batch);
+}
@@ -0,0 +1,122 @@
+#ifndef STATICBATCHES_H
+#define STATICBATCHES_H
+
+#include "gl.h"
+#include "resources/mesh.h"
+#include <QHash>
+#include <QMatrix4x4>
+#include <QSet>
+#include <QVector>
+
+class Camera;
+class Entity;
+class Material;
+
+// Batch of the static geometry of a material in a cell of a world grid
+struct StaticBatchKey
+{
+    Material *material = nullptr;
+    int x = 0, y = 0, z = 0;
+
+    bool operator==(const StaticBatchKey &other) const
+    {
+        return material == other.material && x == other.x && y == other.y && z == other.z;
+    }
+};
+
+inline uint qHash(const StaticBatchKey &key, uint seed = 0)
+{
+    return qHash(key.material, seed) ^ qHash(key.x * 73856093 ^ key.y * 19349663 ^ key.z * 83492791, seed);
+}
+
+struct StaticBatch
+{
+    Material *material = nullptr;
+    SubMesh *submesh = nullptr; // Vertices in world space
+    Bounds bounds;              // World space, to cull the whole batch
+};
+
+// Submeshes of the static entities (see Entity::isStatic) merged by material
+// and by cell of a world grid, with the vertices already in world space. A
+// batch is drawn with a single call instead of one per submesh, and the
+// cells keep the batches small enough to be frustum culled. When a static
+// entity changes it leaves its batches, it is drawn on its own while it
+// keeps changing, and it goes back into the batches once it stays still:
+// only the batches it was or will be in are rebuilt.
+class StaticBatches
+{
+public:
+
+    void initialize();
+    void finalize();
+
+    // Follows the static entities of the scene and rebuilds the batches of
+    // the ones that changed
+    void update();
+
+    // The entity is drawn by the batches (not on its own) this frame
+    bool contains(const Entity *entity) const;
+
+    // Selection color of each batched entity (written to the G-buffer by
+    // the vertices of the entity). Bound as a buffer texture.
+    void setSelectionColor(const Entity *entity, float color);
+    void bindSelectionColors(int textureUnit);
+
+    // Batches that may be inside the frustum of the camera
+    QVector<const StaticBatch*> visible(const Camera *camera) const;
+
+private:
+
+    // Vertices of a submesh decoded to floats, in object space
+    struct Geometry
+    {
+        QVector<float> vertices; // Position, normal and texture coordinates
+        QVector<unsigned int> indices;
+    };
+
+    // What the batches of an entity are built from
+    struct Signature
+    {
+        QMatrix4x4 worldMatrix;
+        const Mesh *mesh = nullptr;
+        int meshRevision = -1;
+        QVector<Material*> materials;
+
+        bool operator==(const Signature &other) const
+        {
+            return worldMatrix == other.worldMatrix && mesh == other.mesh &&
+                   meshRevision == other.meshRevision && materials == other.materials;
+        }
+        bool operator!=(const Signature &other) const { return !(*this == other); }
+    };
+
+    struct Record
+    {
+        Signature signature;
+        int stillFrames = 0;         // Frames without changes
+        bool baked = false;          // In the batches
+        int slot = -1;               // Index of its selection color
+        QVector<StaticBatchKey> keys; // Batches it is in
+    };
+
+    static bool batchable(const Entity *entity);
+    static Signature signature(const Entity *entity);
+    static Material *material(const Entity *entity, int submeshIndex);
+    static QVector<StaticBatchKey> keys(const Entity *entity);
+    static void readBack(SubMesh *submesh, Geometry &geometry);
+
+    void bake(const Entity *entity, Record &record, QSet<StaticBatchKey> &dirty);
+    void unbake(const Entity *entity, Record &record, QSet<StaticBatchKey> &dirty);
+    void rebuild(const StaticBatchKey &key, QHash<SubMesh*, Geometry> &geometries);
+
+    QHash<const Entity*, Record> records;
+    QHash<StaticBatchKey, QVector<const Entity*>> members;
+    QHash<StaticBatchKey, StaticBatch> batches;
+
+    QVector<float> selectionColors; // Per slot
+    QVector<int> freeSlots;
+    GLuint selectionBuffer = 0;
+    GLuint selectionTexture = 0;
+};
+
+#endif // STATICBATCHES_H
@@ -0,0 +1,274 @@
+#include "texturearrays.h"
+#include "resources/texture.h"
+#include "resources/resourcemanager.h"
+#include "globals.h"
+#include <QByteArray>
+
+
+// Most layers per array, and the memory a pool of big textures may take
+static const int POOL_LAYERS = 16;
+static const int POOL_BYTES = 64 * 1024 * 1024;
+
+// Textures copied per frame
+static const int MAX_PACKS_PER_FRAME = 4;
+
+void TextureArrays::initialize()
+{
+    pools.clear();
+    entries.clear();
+    pending.clear();
+    queued.clear();
+}
+
+void TextureArrays::finalize()
+{
+    for (Pool &pool : pools)
+    {
+        OpenGLState::forgetTexture(pool.texture);
+        gl->glDeleteTextures(1, &pool.texture);
+    }
+
+    pools.clear();
+    entries.clear();
+    pending.clear();
+    queued.clear();
+}
+
+const TextureLayer *TextureArrays::layer(Texture *texture)
+{
+    if (texture == nullptr || texture->textureId() == 0) return nullptr;
+
+    auto it = entries.find(texture->guid);
+    if (it != entries.end() && it->revision == texture->revision())
+    {
+        return &it->layer;
+    }
+
+    if (!queued.contains(texture->guid))
+    {
+        queued.insert(texture->guid);
+        pending.push_back(texture);
+    }
+    return nullptr;
+}
+
+void TextureArrays::packPending()
+{
+    OpenGLErrorGuard guard(__FUNCTION__);
+
+    releaseDeadTextures();
+
+    int packed = 0;
+    for (Texture *texture : pending)
+    {
+        if (packed >= MAX_PACKS_PER_FRAME) break;
+
+        // Only complete textures are copied
+        if (texture->isLoading() || texture->isUploading() || texture->needsUpdate) continue;
+
+        Pool description;
+        if (!describe(texture, description)) continue;
+
+        Entry &entry = entries[texture->guid];
+        if (entry.pool < 0 || !sameClass(pools[entry.pool], description))
+        {
+            // New texture, or the size class changed: move to another pool
+            if (entry.pool >= 0) releaseLayer(entry);
+
+            int index = findPool(description);
+            if (index < 0)
+            {
+                createPool(description);
+                pools.push_back(description);
+                index = pools.size() - 1;
+            }
+
+            Pool &pool = pools[index];
+            entry.pool = index;
+            entry.layer.array = pool.texture;
+            entry.layer.layer = pool.freeLayers.isEmpty() ? pool.used++ : pool.freeLayers.takeLast();
+        }
+
+        copy(texture, pools[entry.pool], entry.layer.layer);
+        entry.revision = texture->revision();
+        packed++;
+    }
+
+    // The rest are requested again by the next frames that need them (the
+    // textures may be gone by then)
+    pending.clear();
+    queued.clear();
+}
+
+bool TextureArrays::sameClass(const Pool &a, const Pool &b)
+{
+    return a.width == b.width && a.height == b.height && a.levels == b.levels &&
+           a.internalFormat == b.internalFormat && a.wrap == b.wrap;
+}
+
+bool TextureArrays::describe(Texture *texture, Pool &description) const
+{
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, texture->textureId());
+
+    GLint width = 0, height = 0, internalFormat = 0, compressed = 0;
+    gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+    gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    if (width <= 0 || height <= 0) return false;
+
+    GLint baseLevel = 0, maxLevel = 0, wrap = 0;
+    gl->glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, &baseLevel);
+    gl->glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+    gl->glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, &wrap);
+    if (baseLevel != 0) return false;
+
+    GLint redType = 0;
+    gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_RED_TYPE, &redType);
+
+    description.width = width;
+    description.height = height;
+    description.internalFormat = GLenum(internalFormat);
+    description.wrap = wrap;
+    description.compressed = compressed != 0;
+    description.pixelType = (redType == GL_FLOAT || redType == GL_HALF_FLOAT) ? GL_FLOAT : GL_UNSIGNED_BYTE;
+
+    // Levels actually defined (e.g. HDR images have no mips)
+    const int bytesPerPixel = (description.pixelType == GL_FLOAT) ? 16 : 4;
+    description.layerSizes.clear();
+    for (int level = 0; level <= maxLevel; ++level)
+    {
+        GLint levelWidth = 0;
+        gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &levelWidth);
+        if (levelWidth <= 0) break;
+
+        GLint size = 0;
+        if (description.compressed) {
+            gl->glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+        } else {
+            size = qMax(1, width >> level) * qMax(1, height >> level) * bytesPerPixel;
+        }
+        description.layerSizes.push_back(size);
+
+        if (levelWidth == 1 && qMax(1, height >> level) == 1) break;
+    }
+    description.levels = description.layerSizes.size();
+
+    int layerBytes = 0;
+    for (int size : description.layerSizes) layerBytes += size;
+    description.layers = qBound(1, POOL_BYTES / qMax(1, layerBytes), POOL_LAYERS);
+
+    return true;
+}
+
+int TextureArrays::findPool(const Pool &description)
+{
+    for (int i = 0; i < pools.size(); ++i)
+    {
+        const Pool &pool = pools[i];
+        if (sameClass(pool, description) && (pool.used < pool.layers || !pool.freeLayers.isEmpty()))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void TextureArrays::createPool(Pool &pool)
+{
+    gl->glGenTextures(1, &pool.texture);
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D_ARRAY, pool.texture);
+
+    for (int level = 0; level < pool.levels; ++level)
+    {
+        const int width = qMax(1, pool.width >> level);
+        const int height = qMax(1, pool.height >> level);
+        if (pool.compressed) {
+            gl->glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, pool.internalFormat, width, height, pool.layers, 0,
+                                       pool.layerSizes[level] * pool.layers, nullptr);
+        } else {
+            gl->glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GLint(pool.internalFormat), width, height, pool.layers, 0,
+                             GL_RGBA, pool.pixelType, nullptr);
+        }
+    }
+
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, pool.levels - 1);
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (pool.levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, pool.wrap);
+    gl->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, pool.wrap);
+
+    qInfo("TextureArrays: %dx%d pool with %d layers", pool.width, pool.height, pool.layers);
+}
+
+void TextureArrays::copy(Texture *texture, const Pool &pool, int layer)
+{
+    // GPU side copy when available
+    if (glext.copyImage)
+    {
+        for (int level = 0; level < pool.levels; ++level)
+        {
+            glext.glCopyImageSubData(texture->textureId(), GL_TEXTURE_2D, level, 0, 0, 0,
+                                     pool.texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                                     qMax(1, pool.width >> level), qMax(1, pool.height >> level), 1);
+        }
+        return;
+    }
+
+    // Otherwise through a readback, only once per texture revision
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D, texture->textureId());
+    OpenGLState::bindTexture(0, GL_TEXTURE_2D_ARRAY, pool.texture);
+
+    QByteArray pixels;
+    for (int level = 0; level < pool.levels; ++level)
+    {
+        const int width = qMax(1, pool.width >> level);
+        const int height = qMax(1, pool.height >> level);
+        pixels.resize(pool.layerSizes[level]);
+
+        if (pool.compressed)
+        {
+            gl->glGetCompressedTexImage(GL_TEXTURE_2D, level, pixels.data());
+            gl->glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1,
+                                          pool.internalFormat, pixels.size(), pixels.constData());
+        }
+        else
+        {
+            gl->glGetTexImage(GL_TEXTURE_2D, level, GL_RGBA, pool.pixelType, pixels.data());
+            gl->glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1,
+                                GL_RGBA, pool.pixelType, pixels.constData());
+        }
+    }
+}
+
+void TextureArrays::releaseLayer(const Entry &entry)
+{
+    pools[entry.pool].freeLayers.push_back(entry.layer.layer);
+}
+
+void TextureArrays::releaseDeadTextures()
+{
+    if (entries.isEmpty()) return;
+
+    QSet<QUuid> live;
+    for (auto resource : resourceManager->resources)
+    {
+        Texture *texture = resource->asTexture();
+        if (texture != nullptr && !texture->needsRemove) live.insert(texture->guid);
+    }
+
+    // Layers of removed textures go back to their pools
+    for (auto it = entries.begin(); it != entries.end(); )
+    {
+        if (!live.contains(it.key()))
+        {
+            if (it->pool >= 0) releaseLayer(it.value());
+            it = entries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
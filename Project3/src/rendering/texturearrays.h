@@ -0,0 +1,78 @@
+#ifndef TEXTUREARRAYS_H
+#define TEXTUREARRAYS_H
+
+#include "gl.h"
+#include <QHash>
+#include <QSet>
+#include <QUuid>
+#include <QVector>
+
+class Texture;
+
+// Layer of a texture copied into an array
+struct TextureLayer
+{
+    GLuint array = 0;
+    int layer = 0;
+};
+
+// Material textures copied into GL_TEXTURE_2D_ARRAY pools, one pool per size
+// class (size, mip count, format and wrap mode). Consecutive draws whose
+// textures share a pool keep the same array bound and only change the layer
+// uniform, so most texture binds between materials go away. The textures
+// keep their own copy, used when the arrays are disabled and by other passes.
+class TextureArrays
+{
+public:
+
+    void initialize();
+    void finalize();
+
+    // Layer with the current contents of the texture, or nullptr if it isn't
+    // ready yet (the copy is queued for the end of the frame)
+    const TextureLayer *layer(Texture *texture);
+
+    // Copies the textures requested during the frame, up to a few per frame
+    void packPending();
+
+private:
+
+    struct Pool
+    {
+        GLuint texture = 0;
+        int width = 0;
+        int height = 0;
+        int levels = 0;
+        GLenum internalFormat = 0;
+        GLint wrap = 0;
+        bool compressed = false;
+        GLenum pixelType = GL_UNSIGNED_BYTE; // Readback type when uncompressed
+        QVector<int> layerSizes; // Bytes of a layer, per level
+        int layers = 0;
+        int used = 0;
+        QVector<int> freeLayers;
+    };
+
+    struct Entry
+    {
+        int pool = -1;
+        TextureLayer layer;
+        int revision = -1;
+    };
+
+    static bool sameClass(const Pool &a, const Pool &b);
+
+    bool describe(Texture *texture, Pool &description) const;
+    int findPool(const Pool &description);
+    void createPool(Pool &pool);
+    void copy(Texture *texture, const Pool &pool, int layer);
+    void releaseLayer(const Entry &entry);
+    void releaseDeadTextures();
+
+    QVector<Pool> pools;
+    QHash<QUuid, Entry> entries;
+    QVector<Texture*> pending;
+    QSet<QUuid> queued;
+};
+
+#endif // TEXTUREARRAYS_H
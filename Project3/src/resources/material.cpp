@@ -2,7 +2,11 @@
 #include "texture.h"
 #include "resourcemanager.h"
 #include "globals.h"
+#include "util/assetcache.h"
+#include "util/normalmapgenerator.h"
+#include <QCryptographicHash>
 #include <QJsonObject>
+#include <cstring>
 
 
 const char *Material::TypeName = "Material";
@@ -32,6 +36,12 @@ void Material::handleResourcesAboutToDie()
     HANDLE_TEXTURE_IF_ABOUT_TO_DIE(bumpTexture);
  }
 
+void Material::update()
+{
+    // Normal map waiting for its bump texture to be decoded
+    createNormalFromBump();
+}
+
 #define TEXTURE_GUID(tex) (tex != nullptr)?tex->guid.toString():QUuid().toString()
 
 void Material::write(QJsonObject &json)
@@ -46,46 +56,95 @@ void Material::link(const QJsonObject &json)
 {
 }
 
+static const quint32 NORMAL_MAP_MAGIC = 0x4D524E42; // "BNRM"
+
+static QString normalMapCachePath(Texture *bumpTexture, float bumpiness)
+{
+    QByteArray sourceHash;
+    if (!bumpTexture->getFilePath().isEmpty()) {
+        sourceHash = AssetCache::hashFile(bumpTexture->getFilePath());
+    }
+    if (sourceHash.isEmpty())
+    {
+        const QImage image = bumpTexture->getImage();
+        sourceHash = QCryptographicHash::hash(
+                    QByteArray::fromRawData(reinterpret_cast<const char *>(image.constBits()), int(image.sizeInBytes())),
+                    QCryptographicHash::Sha1);
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(sourceHash);
+    hash.addData(reinterpret_cast<const char *>(&bumpiness), sizeof(bumpiness));
+    return AssetCache::filePath("normalmaps", hash.result(), "nrm");
+}
+
+// Entries: magic, width and height followed by the packed RGB rows
+static QImage readCachedNormalMap(const QString &path)
+{
+    QByteArray data;
+    if (!AssetCache::read(path, data)) return QImage();
+    if (data.size() < int(3 * sizeof(quint32))) return QImage();
+
+    const quint32 *header = reinterpret_cast<const quint32 *>(data.constData());
+    const int w = int(header[1]);
+    const int h = int(header[2]);
+    if (header[0] != NORMAL_MAP_MAGIC || data.size() != int(3 * sizeof(quint32)) + w * h * 3) return QImage();
+
+    QImage image(w, h, QImage::Format_RGB888);
+    const char *rows = data.constData() + 3 * sizeof(quint32);
+    for (int y = 0; y < h; ++y) {
+        memcpy(image.scanLine(y), rows + y * w * 3, size_t(w * 3));
+    }
+    return image;
+}
+
+static void writeCachedNormalMap(const QString &path, const QImage &image)
+{
+    const int w = image.width();
+    const int h = image.height();
+
+    QByteArray data(int(3 * sizeof(quint32)) + w * h * 3, Qt::Uninitialized);
+    quint32 *header = reinterpret_cast<quint32 *>(data.data());
+    header[0] = NORMAL_MAP_MAGIC;
+    header[1] = quint32(w);
+    header[2] = quint32(h);
+    char *rows = data.data() + 3 * sizeof(quint32);
+    for (int y = 0; y < h; ++y) {
+        memcpy(rows + y * w * 3, image.constScanLine(y), size_t(w * 3));
+    }
+
+    AssetCache::write(path, data);
+}
+
 void Material::createNormalFromBump()
 {
     if (normalsTexture == nullptr && bumpTexture != nullptr)
     {
+        if (bumpTexture->isLoading())
+        {
+            // Try again on the next update
+            needsUpdate = true;
+            return;
+        }
+
         // Create normal map from the height texture
         QImage bumpMap = bumpTexture->getImage();
-        QImage normalMap(bumpMap.size(), QImage::Format_RGB888);
-        const int w = normalMap.width();
-        const int h = normalMap.height();
+        if (bumpMap.isNull())
+        {
+            // Block-compressed textures don't keep their image on the CPU
+            qDebug("No image data to create a normal map from %s", bumpTexture->name.toLatin1().data());
+            return;
+        }
+
+        // Strength of the generated normals (not the bumpiness uniform)
         const float bumpiness = 2.0f;
-        for (int y = 0; y < h; ++y) {
-            for (int x = 0; x < w; ++x) {
-
-                // surrounding indices
-                const int il = (x + w - 1) % w;
-                const int ir = (x + 1) % w;
-                const int ib = (y + 1) % h;
-                const int it = (y + w - 1) % h;
-
-                // surrounding pixels
-                float tl = qRed( bumpMap.pixel(il, it) ) / 255.0f; // top left
-                float  l = qRed( bumpMap.pixel(il,  y) ) / 255.0f; // left
-                float bl = qRed( bumpMap.pixel(il, ib) ) / 255.0f; // bottom left
-                float  t = qRed( bumpMap.pixel(x,  it) ) / 255.0f; // top
-                float  b = qRed( bumpMap.pixel(x,  ib) ) / 255.0f; // bottom
-                float tr = qRed( bumpMap.pixel(ir, it) ) / 255.0f; // top right
-                float  r = qRed( bumpMap.pixel(ir,  y) ) / 255.0f; // right
-                float br = qRed( bumpMap.pixel(ir, ib) ) / 255.0f; // bottom right
-
-                // sobel filter
-                const float dX = (tl + 2.0 * l + bl) - (tr + 2.0 * r + br);
-                const float dY = (bl + 2.0 * b + br) - (tl + 2.0 * t + tr);
-                const float dZ = 1.0/bumpiness;
-
-                QVector3D n(dX, dY, dZ);
-                n.normalize();
-                n = n* 0.5 + QVector3D(0.5f, 0.5f, 0.5f);
-
-                normalMap.setPixelColor(x, y, QColor::fromRgbF(n.x(), n.y(), n.z()));
-            }
+
+        const QString cachePath = normalMapCachePath(bumpTexture, bumpiness);
+        QImage normalMap = readCachedNormalMap(cachePath);
+        if (normalMap.isNull())
+        {
+            normalMap = NormalMapGenerator::fromBump(bumpMap, bumpiness);
+            writeCachedNormalMap(cachePath, normalMap);
         }
 
         // Test to see the saved file
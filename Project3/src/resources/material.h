@@ -27,6 +27,7 @@ public:
     Material * asMaterial() override { return this; }
 
     void handleResourcesAboutToDie() override;
+    void update() override;
 
     void write(QJsonObject &json) override;
     void read(const QJsonObject &json) override;
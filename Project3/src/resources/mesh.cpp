@@ -1,9 +1,13 @@
 #include "mesh.h"
 #include "rendering/gl.h"
+#include "util/vertexkernels.h"
 #include <QVector2D>
 #include <QVector3D>
+#include <QByteArray>
 #include <QFile>
 #include <QJsonObject>
+#include <QOpenGLShaderProgram>
+#include <algorithm>
 
 
 const char *Mesh::TypeName = "Mesh";
@@ -14,8 +18,9 @@ ibo(QOpenGLBuffer::Type::IndexBuffer)
 {
     vertexFormat = vf;
     data_size = size_t(in_data_size);
-    data = new unsigned char[data_size];
-    memcpy(data, in_data, data_size);
+    unsigned char *data_copy = new unsigned char[data_size];
+    memcpy(data_copy, in_data, data_size);
+    data = data_copy;
 	
     computeBounds();
 }
@@ -26,26 +31,62 @@ ibo(QOpenGLBuffer::Type::IndexBuffer)
     vertexFormat = vf;
 	
     data_size = size_t(in_data_size);
-    data = new unsigned char[data_size];
-    memcpy(data, in_data, data_size);
+    unsigned char *data_copy = new unsigned char[data_size];
+    memcpy(data_copy, in_data, data_size);
+    data = data_copy;
 	
     indices_count = size_t(in_indices_count);
-    indices = new unsigned int[indices_count];
-    memcpy(indices, in_indices, indices_count * sizeof(unsigned int));
+    unsigned int *indices_copy = new unsigned int[indices_count];
+    memcpy(indices_copy, in_indices, indices_count * sizeof(unsigned int));
+    indices = indices_copy;
 	
     computeBounds();
 }
 
+SubMesh::SubMesh(VertexFormat vf, const void *in_data, int in_data_size, const unsigned int *in_indices, int in_indices_count, const Bounds &in_bounds) :
+ibo(QOpenGLBuffer::Type::IndexBuffer)
+{
+    vertexFormat = vf;
+    data = static_cast<const unsigned char *>(in_data);
+    data_size = size_t(in_data_size);
+    indices = in_indices;
+    indices_count = size_t(in_indices_count);
+    ownsData = false;
+    bounds = in_bounds;
+}
+
 SubMesh::~SubMesh()
 {
-    delete[] data;
-    delete[] indices;
+    if (ownsData)
+    {
+        delete[] data;
+        delete[] indices;
+    }
+}
+
+// Deleted objects are unbound, the state cache has to know
+static void destroyBuffer(QOpenGLBuffer &buffer)
+{
+    if (buffer.isCreated())
+    {
+        OpenGLState::forgetBuffer(buffer.bufferId());
+        buffer.destroy();
+    }
+}
+
+static void destroyVertexArray(QOpenGLVertexArrayObject &vertexArray)
+{
+    if (vertexArray.isCreated())
+    {
+        OpenGLState::forgetVertexArray(vertexArray.objectId());
+        vertexArray.destroy();
+    }
 }
 
 void SubMesh::enableAttributes()
 {
-    vbo.bind();
-    if (ibo.isCreated()) { ibo.bind(); }
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, vbo.bufferId());
+    if (ibo.isCreated()) { OpenGLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.bufferId()); }
 	
     for (int location = 0; location < MAX_VERTEX_ATTRIBUTES; ++location)
     {
@@ -54,67 +95,373 @@ void SubMesh::enableAttributes()
         if (attr.enabled)
         {
             gl->glEnableVertexAttribArray(GLuint(location));
-            gl->glVertexAttribPointer(GLuint(location), attr.ncomp, GL_FLOAT, GL_FALSE, vertexFormat.size, (void *) (attr.offset));
+            gl->glVertexAttribPointer(GLuint(location), attr.ncomp, attr.type, attr.normalized ? GL_TRUE : GL_FALSE, vertexFormat.size, (void *) (attr.offset));
         }
     }
 }
 
+void SubMesh::sendDecoding(QOpenGLShaderProgram &program) const
+{
+    program.setUniformValue("positionOffset", vertexFormat.positionOffset);
+    program.setUniformValue("positionScale", vertexFormat.positionScale);
+    program.setUniformValue("texCoordsOffset", vertexFormat.texCoordsOffset);
+    program.setUniformValue("texCoordsScale", vertexFormat.texCoordsScale);
+}
+
 void SubMesh::update()
 {
-    if (vbo.isCreated()) vbo.destroy();
-    if (ibo.isCreated()) ibo.destroy();
-    if (vao.isCreated()) vao.destroy();
+    // Dynamic submeshes keep their buffers and VAOs, only the edits go up
+    if (dynamic && vao.isCreated())
+    {
+        updateDynamic();
+        return;
+    }
+
+    // Static submeshes free their data once uploaded: nothing to upload again
+    if (data == nullptr && !dynamic) return;
+
+    // The index buffers below would end up in whatever VAO is bound
+    OpenGLState::bindVertexArray(0);
+
+    destroy();
 	
     // VBO: Buffer with vertex data
     vbo.create();
-    vbo.bind();
-    vbo.setUsagePattern(QOpenGLBuffer::UsagePattern::StaticDraw);
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, vbo.bufferId());
+    vbo.setUsagePattern(dynamic ? QOpenGLBuffer::UsagePattern::DynamicDraw : QOpenGLBuffer::UsagePattern::StaticDraw);
     vbo.allocate(data, int(data_size));
-    vbo.release();
-    delete[] data;
-    data = nullptr;
+    vertexCapacity = int(data_size);
+
+    if (!dynamic)
+    {
+        createPositionStream();
+
+        if (ownsData) { delete[] data; }
+        data = nullptr;
+    }
 	
     // IBO: Buffer with indexes
     if (indices != nullptr)
     {
         ibo.create();
-        ibo.bind();
-        ibo.setUsagePattern(QOpenGLBuffer::UsagePattern::StaticDraw);
-        ibo.allocate(indices, int(indices_count * sizeof(unsigned int)));
-        ibo.release();
-        delete[] indices;
-        indices = nullptr;
+        OpenGLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.bufferId());
+        ibo.setUsagePattern(dynamic ? QOpenGLBuffer::UsagePattern::DynamicDraw : QOpenGLBuffer::UsagePattern::StaticDraw);
+        if (vertexCount() <= 65536 && !dynamic)
+        {
+            // Half the memory and bandwidth of 32-bit indices
+            QVector<quint16> shortIndices(int(indices_count));
+            for (size_t i = 0; i < indices_count; ++i) {
+                shortIndices[int(i)] = quint16(indices[i]);
+            }
+            ibo.allocate(shortIndices.constData(), int(indices_count * sizeof(quint16)));
+            indexType = GL_UNSIGNED_SHORT;
+        }
+        else
+        {
+            ibo.allocate(indices, int(indices_count * sizeof(unsigned int)));
+            indexType = GL_UNSIGNED_INT;
+        }
+        indexCapacity = int(indices_count);
+        if (!dynamic)
+        {
+            if (ownsData) { delete[] indices; }
+            indices = nullptr;
+        }
     }
+    dirtyRanges.clear();
+    indicesDirty = false;
 	
     // VAO: Vertex format description and state of VBOs
     vao.create();
-    vao.bind();
+    OpenGLState::bindVertexArray(vao.objectId());
 	
     enableAttributes();
-	
-    // Release
-    vao.release();
-    vbo.release();
-    if (ibo.isCreated()) { ibo.release(); }
+
+    // Position VAO: same indices, positions only
+    if (positionVbo.isCreated())
+    {
+        const VertexAttribute &position = vertexFormat.attribute[0];
+        const int stride = (VertexFormat::attributeSize(position.ncomp, position.type) + 3) & ~3;
+
+        positionVao.create();
+        OpenGLState::bindVertexArray(positionVao.objectId());
+        OpenGLState::bindBuffer(GL_ARRAY_BUFFER, positionVbo.bufferId());
+        if (ibo.isCreated()) { OpenGLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.bufferId()); }
+        gl->glEnableVertexAttribArray(0);
+        gl->glVertexAttribPointer(0, position.ncomp, position.type, position.normalized ? GL_TRUE : GL_FALSE, stride, nullptr);
+    }
+
+    OpenGLState::bindVertexArray(0);
 }
 
-void SubMesh::draw(GLenum primitiveType)
+void SubMesh::makeDynamic()
 {
-    int num_vertices = data_size / vertexFormat.size;
-    vao.bind();
+    if (dynamic) return;
+    if (data == nullptr)
+    {
+        qDebug("SubMesh::makeDynamic(): the data has already been uploaded");
+        return;
+    }
+
+    vertexMirror = QByteArray(reinterpret_cast<const char *>(data), int(data_size));
+    indexMirror.resize(int(indices_count));
     if (indices_count > 0) {
-        gl->glDrawElements(primitiveType, indices_count, GL_UNSIGNED_INT, nullptr);
+        memcpy(indexMirror.data(), indices, indices_count * sizeof(unsigned int));
+    }
+    if (ownsData)
+    {
+        delete[] data;
+        delete[] indices;
+    }
+    ownsData = false;
+
+    lods.clear();
+    meshlets.clear();
+    dynamic = true;
+    syncMirror();
+}
+
+void SubMesh::syncMirror()
+{
+    data = reinterpret_cast<const unsigned char *>(vertexMirror.constData());
+    data_size = size_t(vertexMirror.size());
+    indices = indexMirror.isEmpty() ? nullptr : indexMirror.constData();
+    indices_count = size_t(indexMirror.size());
+}
+
+void SubMesh::markDirty(int offset, int bytes)
+{
+    const int begin = qBound(0, offset, vertexMirror.size());
+    const int end = qBound(begin, offset + bytes, vertexMirror.size());
+    if (begin < end) {
+        dirtyRanges.push_back(qMakePair(begin, end));
+    }
+}
+
+void SubMesh::updateVertices(int offset, const void *vertices, int bytes)
+{
+    if (!dynamic || offset < 0 || offset + bytes > vertexMirror.size()) return;
+
+    memcpy(vertexMirror.data() + offset, vertices, size_t(bytes));
+    markDirty(offset, bytes);
+}
+
+void SubMesh::setVertices(const void *vertices, int bytes)
+{
+    if (!dynamic) return;
+
+    vertexMirror = QByteArray(reinterpret_cast<const char *>(vertices), bytes);
+    syncMirror();
+    dirtyRanges.clear();
+    markDirty(0, bytes);
+}
+
+void SubMesh::setIndices(const unsigned int *newIndices, int count)
+{
+    if (!dynamic) return;
+
+    indexMirror.resize(count);
+    if (count > 0) {
+        memcpy(indexMirror.data(), newIndices, size_t(count) * sizeof(unsigned int));
+    }
+    syncMirror();
+    indicesDirty = true;
+}
+
+void SubMesh::updateDynamic()
+{
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, vbo.bufferId());
+    if (int(data_size) > vertexCapacity)
+    {
+        // Room to grow, so meshes growing every frame don't reallocate every frame
+        vertexCapacity = qMax(int(data_size), vertexCapacity + vertexCapacity / 2);
+        vbo.allocate(vertexCapacity);
+        vbo.write(0, data, int(data_size));
+    }
+    else if (!dirtyRanges.isEmpty())
+    {
+        // Overlapping and touching ranges are merged
+        std::sort(dirtyRanges.begin(), dirtyRanges.end());
+        QVector<QPair<int, int>> ranges;
+        int dirtyBytes = 0;
+        for (const QPair<int, int> &range : qAsConst(dirtyRanges))
+        {
+            if (!ranges.isEmpty() && range.first <= ranges.back().second) {
+                ranges.back().second = qMax(ranges.back().second, range.second);
+            } else {
+                ranges.push_back(range);
+            }
+        }
+        for (const QPair<int, int> &range : qAsConst(ranges)) {
+            dirtyBytes += range.second - range.first;
+        }
+
+        if (2 * dirtyBytes > int(data_size))
+        {
+            // Mostly rewritten: orphaning gives a new store instead of
+            // waiting for the draws still reading the old one
+            vbo.allocate(vertexCapacity);
+            vbo.write(0, data, int(data_size));
+        }
+        else
+        {
+            for (const QPair<int, int> &range : qAsConst(ranges)) {
+                vbo.write(range.first, data + range.first, range.second - range.first);
+            }
+        }
+    }
+    dirtyRanges.clear();
+
+    if (indicesDirty)
+    {
+        // Bound with the VAO, which keeps the index buffer binding
+        OpenGLState::bindVertexArray(vao.objectId());
+        if (!ibo.isCreated())
+        {
+            ibo.create();
+            ibo.setUsagePattern(QOpenGLBuffer::UsagePattern::DynamicDraw);
+            indexCapacity = 0;
+        }
+        OpenGLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.bufferId());
+        if (int(indices_count) > indexCapacity)
+        {
+            indexCapacity = qMax(int(indices_count), indexCapacity + indexCapacity / 2);
+            ibo.allocate(indexCapacity * int(sizeof(unsigned int)));
+        }
+        if (indices_count > 0) {
+            ibo.write(0, indices, int(indices_count * sizeof(unsigned int)));
+        }
+        OpenGLState::bindVertexArray(0);
+        indexType = GL_UNSIGNED_INT;
+        indicesDirty = false;
+    }
+
+    computeBounds();
+}
+
+void SubMesh::createPositionStream()
+{
+    const VertexAttribute &position = vertexFormat.attribute[0];
+    if (!position.enabled) return;
+
+    // Rows aligned to 4 bytes (quantized positions are 6)
+    const int positionSize = VertexFormat::attributeSize(position.ncomp, position.type);
+    const int stride = (positionSize + 3) & ~3;
+    if (stride >= vertexFormat.size) return;
+
+    const int count = int(vertexCount());
+    QByteArray positions(count * stride, 0);
+    for (int i = 0; i < count; ++i) {
+        memcpy(positions.data() + i * stride, data + i * vertexFormat.size + position.offset, size_t(positionSize));
+    }
+
+    positionVbo.create();
+    OpenGLState::bindBuffer(GL_ARRAY_BUFFER, positionVbo.bufferId());
+    positionVbo.setUsagePattern(QOpenGLBuffer::UsagePattern::StaticDraw);
+    positionVbo.allocate(positions.constData(), positions.size());
+}
+
+void SubMesh::draw(GLenum primitiveType, int lod)
+{
+    drawRange(vao, primitiveType, lod);
+}
+
+void SubMesh::drawPositions(GLenum primitiveType, int lod)
+{
+    drawRange(positionVao.isCreated() ? positionVao : vao, primitiveType, lod);
+}
+
+void SubMesh::drawRange(QOpenGLVertexArrayObject &vertexArray, GLenum primitiveType, int lod)
+{
+    int num_vertices = data_size / vertexFormat.size;
+    // Left bound: the next draw of the same submesh skips the bind
+    OpenGLState::bindVertexArray(vertexArray.objectId());
+    if (!lods.isEmpty()) {
+        const LodLevel &level = lods[qBound(0, lod, lods.size() - 1)];
+        const size_t indexSize = (indexType == GL_UNSIGNED_SHORT) ? sizeof(quint16) : sizeof(unsigned int);
+        gl->glDrawElements(primitiveType, level.indexCount, indexType, (void *) (level.firstIndex * indexSize));
+    } else if (indices_count > 0) {
+        gl->glDrawElements(primitiveType, indices_count, indexType, nullptr);
     } else {
         gl->glDrawArrays(primitiveType, 0, num_vertices);
     }
-    vao.release();
+}
+
+void SubMesh::drawMeshlets(const QVector<int> &visible, GLenum primitiveType)
+{
+    // Consecutive meshlets are merged into a single range
+    const size_t indexSize = (indexType == GL_UNSIGNED_SHORT) ? sizeof(quint16) : sizeof(unsigned int);
+    QVector<GLsizei> counts;
+    QVector<const void *> offsets;
+    int rangeEnd = -1;
+    for (int index : visible)
+    {
+        const Meshlet &meshlet = meshlets[index];
+        if (meshlet.firstIndex == rangeEnd) {
+            counts.back() += meshlet.indexCount;
+        } else {
+            counts.push_back(meshlet.indexCount);
+            offsets.push_back((const void *) (meshlet.firstIndex * indexSize));
+        }
+        rangeEnd = meshlet.firstIndex + meshlet.indexCount;
+    }
+    if (counts.isEmpty()) return;
+
+    OpenGLState::bindVertexArray(vao.objectId());
+    gl->glMultiDrawElements(primitiveType, counts.constData(), indexType, offsets.constData(), counts.size());
+}
+
+void SubMesh::bindVertexArray()
+{
+    OpenGLState::bindVertexArray(vao.objectId());
+}
+
+void SubMesh::drawInstanced(int instanceCount, GLenum primitiveType)
+{
+    OpenGLState::bindVertexArray(vao.objectId());
+    if (!lods.isEmpty()) {
+        const size_t indexSize = (indexType == GL_UNSIGNED_SHORT) ? sizeof(quint16) : sizeof(unsigned int);
+        gl->glDrawElementsInstanced(primitiveType, lods[0].indexCount, indexType, (void *) (lods[0].firstIndex * indexSize), instanceCount);
+    } else if (indices_count > 0) {
+        gl->glDrawElementsInstanced(primitiveType, indices_count, indexType, nullptr, instanceCount);
+    } else {
+        gl->glDrawArraysInstanced(primitiveType, 0, vertexCount(), instanceCount);
+    }
+}
+
+void SubMesh::drawIndirect(int offset, GLenum primitiveType)
+{
+    OpenGLState::bindVertexArray(vao.objectId());
+    glext.glDrawElementsIndirect(primitiveType, indexType, (const void *) size_t(offset));
+}
+
+void SubMesh::indirectCommand(GLuint command[5], GLuint instanceCount) const
+{
+    // count, instanceCount, firstIndex, baseVertex, baseInstance
+    command[0] = GLuint(lods.isEmpty() ? indices_count : lods[0].indexCount);
+    command[1] = instanceCount;
+    command[2] = GLuint(lods.isEmpty() ? 0 : lods[0].firstIndex);
+    command[3] = 0;
+    command[4] = 0;
+}
+
+int SubMesh::triangleCount(int lod) const
+{
+    if (!lods.isEmpty()) {
+        return lods[qBound(0, lod, lods.size() - 1)].indexCount / 3;
+    }
+    return int(indices_count > 0 ? indices_count : vertexCount()) / 3;
 }
 
 void SubMesh::destroy()
 {
-    if (vbo.isCreated()) { vbo.destroy(); }
-    if (ibo.isCreated()) { ibo.destroy(); }
-    if (vao.isCreated()) { vao.destroy(); }
+    destroyBuffer(vbo);
+    destroyBuffer(ibo);
+    destroyVertexArray(vao);
+    destroyBuffer(positionVbo);
+    destroyVertexArray(positionVao);
+    vertexCapacity = 0;
+    indexCapacity = 0;
 }
 
 static QVector3D min(const QVector3D &a, const QVector3D &b)
@@ -137,16 +484,15 @@ static QVector3D max(const QVector3D &a, const QVector3D &b)
 
 void SubMesh::computeBounds()
 {
-    const float *vertex = (const float *)data;
-    const float *end = (const float *)(data + data_size);
-    const int float_advance = vertexFormat.size / sizeof(float);
-    while (vertex < end)
+    // Quantized positions span the box they are relative to
+    if (vertexFormat.attribute[0].type != GL_FLOAT)
     {
-        const QVector3D pos = QVector3D(vertex[0], vertex[1], vertex[2]);
-        bounds.min = min(bounds.min, pos);
-        bounds.max = max(bounds.max, pos);
-        vertex += float_advance;
+        bounds.min = vertexFormat.positionOffset;
+        bounds.max = vertexFormat.positionOffset + vertexFormat.positionScale;
+        return;
     }
+
+    bounds = VertexKernels::bounds(StridedView<const QVector3D>(data + vertexFormat.attribute[0].offset, vertexFormat.size, int(vertexCount())));
 }
 
 Mesh::Mesh()
@@ -169,13 +515,42 @@ void Mesh::addSubMesh(VertexFormat vertexFormat, void *data, int bytes)
     needsUpdate = true;
 }
 
-void Mesh::addSubMesh(VertexFormat vertexFormat, void *data, int data_size, unsigned int *indices, int indices_size)
+void Mesh::addSubMesh(VertexFormat vertexFormat, void *data, int data_size, unsigned int *indices, int indices_size,
+                      const QVector<LodLevel> &lods, const QVector<Meshlet> &meshlets)
 {
     submeshes.push_back(new SubMesh(vertexFormat, data, data_size, indices, indices_size));
+    submeshes.back()->lods = lods;
+    submeshes.back()->meshlets = meshlets;
     updateBounds(submeshes.back()->bounds);
     needsUpdate = true;
 }
 
+void Mesh::addMappedSubMesh(const QSharedPointer<MeshSource> &source, VertexFormat vertexFormat,
+                            const void *data, int data_size, const unsigned int *indices, int indices_count,
+                            const Bounds &bounds, const QVector<LodLevel> &lods,
+                            const QVector<Meshlet> &meshlets)
+{
+    mappedData = source;
+    submeshes.push_back(new SubMesh(vertexFormat, data, data_size, indices, indices_count, bounds));
+    submeshes.back()->lods = lods;
+    submeshes.back()->meshlets = meshlets;
+    updateBounds(bounds);
+    needsUpdate = true;
+}
+
+SubMesh *Mesh::addDynamicSubMesh(VertexFormat vertexFormat, const void *data, int bytes,
+                                 const unsigned int *indexes, int indices_count)
+{
+    SubMesh *submesh = (indexes != nullptr)
+            ? new SubMesh(vertexFormat, const_cast<void *>(data), bytes, const_cast<unsigned int *>(indexes), indices_count)
+            : new SubMesh(vertexFormat, const_cast<void *>(data), bytes);
+    submesh->makeDynamic();
+    submeshes.push_back(submesh);
+    updateBounds(submesh->bounds);
+    needsUpdate = true;
+    return submesh;
+}
+
 void Mesh::updateBounds(const Bounds &b)
 {
     bounds.min = min(bounds.min, b.min);
@@ -184,10 +559,20 @@ void Mesh::updateBounds(const Bounds &b)
 
 void Mesh::update()
 {
+    // Dynamic submeshes may have moved
+    bounds = Bounds();
     for (auto submesh : submeshes)
     {
-        submesh->update();
+        // Uploaded static submeshes keep their buffers and bounds
+        if (submesh->isDynamic() || !submesh->vao.isCreated()) {
+            submesh->update();
+        }
+        updateBounds(submesh->bounds);
     }
+
+    // The GPU has its own copy now
+    mappedData.clear();
+    uploadRevision++;
 }
 
 void Mesh::destroy()
@@ -5,23 +5,60 @@
 #include <QOpenGLBuffer>
 #include <QOpenGLVertexArrayObject>
 #include <QVector>
+#include <QByteArray>
+#include <QPair>
+#include <QVector2D>
 #include <QVector3D>
+#include <QSharedPointer>
 #include <cfloat>
 
 static const int MAX_VERTEX_ATTRIBUTES = 8;
+static const int MAX_MESH_LODS = 4;
+
+// Owner of the data referenced by non-owning submeshes (a memory-mapped
+// file, for example). Meshes keep it alive until the data is uploaded.
+class MeshSource
+{
+public:
+    virtual ~MeshSource() { }
+};
 
 struct Bounds {
     QVector3D min = QVector3D(FLT_MAX, FLT_MAX, FLT_MAX);
     QVector3D max = QVector3D(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 };
 
+// Range of the index buffer with one level of detail. All the levels of
+// a submesh share its vertices.
+struct LodLevel
+{
+    int firstIndex = 0;
+    int indexCount = 0;
+};
+
+// Cluster of neighbouring triangles of the full detail level, with the
+// bounds used to cull it
+struct Meshlet
+{
+    int firstIndex = 0;
+    int indexCount = 0;
+    QVector3D center;         // Bounding sphere
+    float radius = 0.0f;
+    QVector3D coneAxis;       // Average normal
+    float coneCutoff = 2.0f;  // Sine of the spread of the normals (above 1 it never faces away)
+};
+
 struct VertexAttribute
 {
     bool enabled = false;
     int offset = 0;
     int ncomp = 0;
+    GLenum type = GL_FLOAT;
+    bool normalized = false; // Integers read as [0, 1] or [-1, 1]
 };
 
+class QOpenGLShaderProgram;
+
 class VertexFormat
 {
 public:
@@ -35,16 +72,40 @@ public:
         }
     }
 
-    void setVertexAttribute(int location, int offset, int ncomp)
+    void setVertexAttribute(int location, int offset, int ncomp, GLenum type = GL_FLOAT, bool normalized = false)
     {
         attribute[location].enabled = true;
         attribute[location].offset = offset;
         attribute[location].ncomp = ncomp;
-        size += ncomp * sizeof(float);
+        attribute[location].type = type;
+        attribute[location].normalized = normalized;
+        size += attributeSize(ncomp, type);
+    }
+
+    static int attributeSize(int ncomp, GLenum type)
+    {
+        switch (type)
+        {
+        case GL_INT_2_10_10_10_REV:
+        case GL_UNSIGNED_INT_2_10_10_10_REV: return 4; // All the components
+        case GL_HALF_FLOAT:
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT: return ncomp * 2;
+        case GL_BYTE:
+        case GL_UNSIGNED_BYTE: return ncomp;
+        default: return ncomp * 4;
+        }
     }
 
     VertexAttribute attribute[MAX_VERTEX_ATTRIBUTES];
     int size = 0;
+
+    // Quantized attributes are decoded in the vertex shader as
+    // offset + value * scale (identity for float data)
+    QVector3D positionOffset = QVector3D(0.0f, 0.0f, 0.0f);
+    QVector3D positionScale = QVector3D(1.0f, 1.0f, 1.0f);
+    QVector2D texCoordsOffset = QVector2D(0.0f, 0.0f);
+    QVector2D texCoordsScale = QVector2D(1.0f, 1.0f);
 };
 
 class SubMesh
@@ -52,33 +113,101 @@ class SubMesh
 public:
     SubMesh(VertexFormat vertexFormat, void *data, int size);
     SubMesh(VertexFormat vertexFormat, void *data, int size, unsigned int *indices, int indices_count);
+    // References the data instead of copying it (it must outlive update())
+    SubMesh(VertexFormat vertexFormat, const void *data, int size, const unsigned int *indices, int indices_count, const Bounds &bounds);
     ~SubMesh();
 
     void update();
-    void draw(GLenum primitiveType = GL_TRIANGLES);
+    // The level of detail is clamped to the available ones
+    void draw(GLenum primitiveType = GL_TRIANGLES, int lod = 0);
+    // Same, reading only the position stream (only location 0 is set), for
+    // passes that don't shade: outline, depth, picking...
+    void drawPositions(GLenum primitiveType = GL_TRIANGLES, int lod = 0);
+    // Draws some meshlets of the full detail level in a single call
+    void drawMeshlets(const QVector<int> &visible, GLenum primitiveType = GL_TRIANGLES);
+    // Full detail level once per instance. The caller sets up the per
+    // instance attributes after bindVertexArray() (see GpuCulling).
+    void bindVertexArray();
+    void drawInstanced(int instanceCount, GLenum primitiveType = GL_TRIANGLES);
+    // Same, with the parameters read from the GL_DRAW_INDIRECT_BUFFER bound
+    // (at a byte offset), as written by indirectCommand(). Indexed only.
+    void drawIndirect(int offset, GLenum primitiveType = GL_TRIANGLES);
+    void indirectCommand(GLuint command[5], GLuint instanceCount) const;
+    bool isIndexed() const { return indices_count > 0; }
     void destroy();
 
     unsigned int vertexCount() const { return data_size/vertexFormat.size; }
 
+    int lodCount() const { return qMax(lods.size(), 1); }
+    int triangleCount(int lod = 0) const;
+
+    const QVector<Meshlet> &getMeshlets() const { return meshlets; }
+
+    const VertexFormat &format() const { return vertexFormat; }
+
+    // Sends the decoding of the quantized attributes to the entity shaders
+    void sendDecoding(QOpenGLShaderProgram &program) const;
+
     void enableAttributes();
 
+    // Dynamic submeshes keep a CPU copy of their vertices and indices. The
+    // edits mark byte ranges dirty, and update() only uploads those ranges
+    // into the same buffers, so the VAOs survive. Set needsUpdate on the
+    // mesh after editing. They have no meshlets, levels of detail or
+    // position stream (those would be stale after the first edit).
+    void makeDynamic();
+    bool isDynamic() const { return dynamic; }
+
+    // Writable copy of the vertices: mark what is written with markDirty()
+    unsigned char *dynamicVertices() { return reinterpret_cast<unsigned char *>(vertexMirror.data()); }
+    void markDirty(int offset, int bytes);
+    void updateVertices(int offset, const void *vertices, int bytes);
+    // Replace everything (the buffers only grow when they run out of room)
+    void setVertices(const void *vertices, int bytes);
+    void setIndices(const unsigned int *indices, int count);
+
 private:
 
     friend class Mesh;
+    friend class StaticBatches;
     Bounds bounds;
 
     void computeBounds();
+    void createPositionStream();
+    void updateDynamic();
+    void syncMirror();
+    void drawRange(QOpenGLVertexArrayObject &vertexArray, GLenum primitiveType, int lod);
 
-    unsigned char *data = nullptr;
+    const unsigned char *data = nullptr;
     size_t data_size = 0;
 
-    unsigned int *indices = nullptr;
+    const unsigned int *indices = nullptr;
     size_t indices_count = 0;
+    GLenum indexType = GL_UNSIGNED_INT; // 16-bit on the GPU when the vertices fit
+
+    QVector<LodLevel> lods; // Empty when all the indices are a single level
+    QVector<Meshlet> meshlets;
+
+    bool ownsData = true;
 
     VertexFormat vertexFormat;
     QOpenGLBuffer vbo;
     QOpenGLBuffer ibo;
     QOpenGLVertexArrayObject vao;
+
+    // Positions deinterleaved from the shading vertices, sharing the index
+    // buffer. Not created when the vertices are only positions.
+    QOpenGLBuffer positionVbo;
+    QOpenGLVertexArrayObject positionVao;
+
+    // Dynamic mode (data and indices point into the mirrors)
+    bool dynamic = false;
+    QByteArray vertexMirror;
+    QVector<unsigned int> indexMirror;
+    QVector<QPair<int, int>> dirtyRanges; // Bytes [first, second) of the vertices
+    bool indicesDirty = false;
+    int vertexCapacity = 0; // Bytes allocated in the VBO
+    int indexCapacity = 0;  // Indices allocated in the IBO
 };
 
 class Mesh : public Resource
@@ -98,13 +227,30 @@ public:
     void destroy() override;
 
     void addSubMesh(VertexFormat vertexFormat, void *data, int bytes);
-    void addSubMesh(VertexFormat vertexFormat, void *data, int bytes, unsigned int *indexes, int bytes_indexes);
+    void addSubMesh(VertexFormat vertexFormat, void *data, int bytes, unsigned int *indexes, int bytes_indexes,
+                    const QVector<LodLevel> &lods = QVector<LodLevel>(),
+                    const QVector<Meshlet> &meshlets = QVector<Meshlet>());
+
+    // Submesh reading its data from a memory-mapped file (mesh cache, glTF
+    // buffer...). The mesh keeps the source alive until the data has been
+    // uploaded.
+    void addMappedSubMesh(const QSharedPointer<MeshSource> &source, VertexFormat vertexFormat,
+                          const void *data, int bytes, const unsigned int *indexes, int indices_count,
+                          const Bounds &bounds, const QVector<LodLevel> &lods = QVector<LodLevel>(),
+                          const QVector<Meshlet> &meshlets = QVector<Meshlet>());
+
+    // Submesh meant to be edited after the upload (see SubMesh::makeDynamic())
+    SubMesh *addDynamicSubMesh(VertexFormat vertexFormat, const void *data, int bytes,
+                               const unsigned int *indexes = nullptr, int indices_count = 0);
 
     void read(const QJsonObject &json) override;
     void write(QJsonObject &json) override;
 
     const QString &getFilePath() const { return filePath; }
 
+    // Incremented each time the submeshes are uploaded
+    int revision() const { return uploadRevision; }
+
     QVector<SubMesh*> submeshes;
 
     Bounds bounds;
@@ -114,6 +260,8 @@ private:
     void updateBounds(const Bounds &b);
 
     QString filePath;
+    QSharedPointer<MeshSource> mappedData;
+    int uploadRevision = 0;
     friend class ModelImporter;
 };
 
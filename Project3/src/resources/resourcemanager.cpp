@@ -1,17 +1,23 @@
 #include "resourcemanager.h"
 #include "mesh.h"
+#include "vertexlayout.h"
 #include "material.h"
 #include "texture.h"
+#include "textureloader.h"
 #include "shaderprogram.h"
 #include <QVector3D>
 #include <cmath>
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QFileInfo>
+#include <QElapsedTimer>
+#include <QThread>
 
 
 ResourceManager::ResourceManager()
 {
+    textureLoader = new TextureLoader;
+
     float quad[] = {
         -1.0, -1.0, 0.0,
          1.0, -1.0, 0.0,
@@ -121,12 +127,13 @@ ResourceManager::ResourceManager()
         }
     }
 
-    VertexFormat vertexFormatPos;
-    vertexFormatPos.setVertexAttribute(0, 0, 3);
+    typedef VertexLayout<Pos3f> PositionLayout;
+    typedef VertexLayout<Pos3f, Norm3f> PositionNormalLayout;
+    typedef VertexLayout<Pos3f, Norm3f, UV2f, Tan3f, Bitan3f> TangentSpaceLayout;
+    static_assert(PositionNormalLayout::size == sizeof(Vertex), "Sphere vertices don't match their layout");
 
-    VertexFormat vertexFormat;
-    vertexFormat.setVertexAttribute(0, 0, 3);
-    vertexFormat.setVertexAttribute(1, sizeof(QVector3D), 3);
+    VertexFormat vertexFormatPos = PositionLayout::format();
+    VertexFormat vertexFormat = PositionNormalLayout::format();
 
     Mesh *mesh = nullptr;
 
@@ -151,13 +158,8 @@ ResourceManager::ResourceManager()
     mesh->addSubMesh(vertexFormat, cube, sizeof(cube));
     this->cube = mesh;
 
-    VertexFormat planeVertexFormat;
-    int offset = 0;
-    planeVertexFormat.setVertexAttribute(0, offset, 3); offset += 3 * sizeof(float);
-    planeVertexFormat.setVertexAttribute(1, offset, 3); offset += 3 * sizeof(float);
-    planeVertexFormat.setVertexAttribute(2, offset, 2); offset += 2 * sizeof(float);
-    planeVertexFormat.setVertexAttribute(3, offset, 3); offset += 3 * sizeof(float);
-    planeVertexFormat.setVertexAttribute(4, offset, 3); offset += 3 * sizeof(float);
+    static_assert(sizeof(plane) == 6 * TangentSpaceLayout::size, "Plane vertices don't match their layout");
+    VertexFormat planeVertexFormat = TangentSpaceLayout::format();
     mesh = createMesh();
     mesh->guid = "b53c759b-d6d6-4210-83e6-556bcb28624f";
     mesh->name = "Plane";
@@ -187,8 +189,7 @@ ResourceManager::ResourceManager()
         VEC3(1, 1, 0), VEC3(1, 1, 1)
     };
 
-    VertexFormat unitCubeGridVertexFormat;
-    unitCubeGridVertexFormat.setVertexAttribute(0, 0, 3);
+    VertexFormat unitCubeGridVertexFormat = PositionLayout::format();
 
     mesh = createMesh();
     mesh->guid = "ab044246-37ac-47a0-8373-e20ee929f57b";
@@ -241,6 +242,8 @@ ResourceManager::ResourceManager()
 ResourceManager::~ResourceManager()
 {
     qDebug("ResourceManager deletion");
+    // Waits for the decoding tasks, which write into the loader
+    delete textureLoader;
     for (auto res : resources) {
         delete res;
     }
@@ -292,20 +295,24 @@ Texture *ResourceManager::createTexture()
     return t;
 }
 
-Texture *ResourceManager::loadTexture(const QString &filePath)
+Texture *ResourceManager::loadTexture(const QString &filePath, TextureUsage usage,
+                                      const QByteArray &encoded, bool flipVertically)
 {
     Texture *tex = nullptr;
     for (auto res : resources)
     {
+        // The same file may be loaded for several usages (e.g. a color map
+        // compressed without a CPU copy, and the same image as a bump map)
         tex = res->asTexture();
-        if (tex != nullptr && tex->getFilePath() == filePath)
+        if (tex != nullptr && tex->getFilePath() == filePath && tex->usage == usage)
         {
             return tex;
         }
     }
     QFileInfo fileInfo(filePath);
     tex = createTexture();
-    tex->loadTexture(filePath.toLatin1());
+    tex->usage = usage;
+    textureLoader->load(tex, filePath, usage, encoded, flipVertically);
     tex->name = fileInfo.fileName();
     return tex;
 }
@@ -441,8 +448,84 @@ void ResourceManager::clear()
     }
 }
 
+void ResourceManager::updateShaderPrograms()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Hand every pending program to the driver before waiting for any
+    QVector<ShaderProgram*> pending;
+    for (auto resource : resources)
+    {
+        ShaderProgram *program = resource->asShaderProgram();
+        if (program != nullptr && program->needsUpdate && !program->needsRemove)
+        {
+            program->submit();
+            pending.push_back(program);
+        }
+    }
+
+    if (pending.isEmpty()) return;
+
+    int fromCache = 0;
+    const int count = pending.size();
+    while (!pending.isEmpty())
+    {
+        int i = 0;
+        while (i < pending.size())
+        {
+            ShaderProgram *program = pending[i];
+            if (program->isCompiled())
+            {
+                program->finish();
+                program->needsUpdate = false;
+                if (program->loadedFromCache()) fromCache++;
+                pending.removeAt(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if (!pending.isEmpty()) {
+            QThread::yieldCurrentThread();
+        }
+    }
+
+    qInfo("Built %d shader programs (%d from the binary cache) in %lld ms",
+          count, fromCache, timer.elapsed());
+}
+
+void ResourceManager::updateLoadedTextures()
+{
+    for (TextureData *data : textureLoader->takeCompleted())
+    {
+        Texture *tex = getTexture(data->guid);
+        if (tex != nullptr && !tex->needsRemove) {
+            tex->finishLoading(data);
+        } else {
+            delete data;
+        }
+    }
+}
+
+bool ResourceManager::isLoading() const
+{
+    if (textureLoader->pendingCount() > 0) return true;
+    for (auto resource : resources) {
+        if (resource->needsUpdate) return true;
+    }
+    return false;
+}
+
 void ResourceManager::updateResources()
 {
+    updateShaderPrograms();
+    updateLoadedTextures();
+
+    textureUploadBudget = TextureUploadBudgetPerFrame;
+
     int i = 0;
     while (i < resources.size())
     {
@@ -452,8 +535,10 @@ void ResourceManager::updateResources()
 
         if (resource->needsUpdate)
         {
-            resource->update();
+            // Cleared first: update() can ask for another one (e.g.
+            // textures uploading their mips over several frames)
             resource->needsUpdate = false;
+            resource->update();
         }
 
         if (resource->needsRemove)
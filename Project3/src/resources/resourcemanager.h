@@ -3,12 +3,13 @@
 
 #include <QVector>
 #include <QUuid>
+#include "texture.h"
 
 class Resource;
 class Mesh;
 class Material;
-class Texture;
 class ShaderProgram;
+class TextureLoader;
 class QJsonObject;
 
 class ResourceManager
@@ -24,7 +25,9 @@ public:
     Material *getMaterial(const QUuid &guid);
 
     Texture *createTexture();
-    Texture *loadTexture(const QString &filename);
+    // Embedded images pass their encoded contents, and filename only names them
+    Texture *loadTexture(const QString &filename, TextureUsage usage = TextureUsage::Color,
+                         const QByteArray &encoded = QByteArray(), bool flipVertically = true);
     Texture *getTexture(const QUuid &guid);
 
     ShaderProgram *createShaderProgram();
@@ -46,6 +49,9 @@ public:
     void updateResources();
     void destroyResources();
 
+    // Textures still being decoded or uploaded
+    bool isLoading() const;
+
     // Serialization
     void read(const QJsonObject &json);
     void write(QJsonObject &json);
@@ -72,8 +78,17 @@ public:
     Material *materialWhite = nullptr;
     Material *materialLight = nullptr;
 
+    // Bytes of texture data that can still be uploaded this frame
+    static const qint64 TextureUploadBudgetPerFrame = 8 * 1024 * 1024;
+    qint64 textureUploadBudget = TextureUploadBudgetPerFrame;
+
 private:
 
+    void updateShaderPrograms();
+    void updateLoadedTextures();
+
+    TextureLoader *textureLoader = nullptr;
+
     QVector<Resource*> resourcesToDestroy;
 };
 
@@ -1,10 +1,134 @@
 #include "shaderprogram.h"
+#include "rendering/gl.h"
+#include "util/assetcache.h"
+#include <QCryptographicHash>
+#include <QVector>
+#include <QFile>
+
+
+static const quint32 PROGRAM_BINARY_MAGIC = 0x42504C47; // "GLPB"
+
+static QByteArray readSource(const QString &filename)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug("Could not open shader file %s", filename.toLatin1().data());
+        return QByteArray();
+    }
+    return file.readAll();
+}
+
+static QByteArray injectDefines(const QByteArray &source, const QStringList &defines)
+{
+    if (defines.isEmpty()) return source;
+
+    // Defines must go after the #version directive
+    int insertAt = 0;
+    const int version = source.indexOf("#version");
+    if (version >= 0) {
+        const int endOfLine = source.indexOf('\n', version);
+        insertAt = (endOfLine >= 0) ? endOfLine + 1 : source.size();
+    }
+
+    QByteArray prelude;
+    for (const QString &define : defines) {
+        prelude += "#define " + define.toLatin1() + "\n";
+    }
+    // Keep the line numbers of compilation errors matching the file
+    if (version >= 0) {
+        prelude += "#line 2\n";
+    }
+
+    QByteArray result = source;
+    result.insert(insertAt, prelude);
+    return result;
+}
+
+static QByteArray programKey(const QByteArray &vertexSource, const QByteArray &geometrySource,
+                             const QByteArray &fragmentSource, const QStringList &feedbackVaryings)
+{
+    // The injected defines are already part of the sources, and the driver
+    // string invalidates the entries when the GPU or the driver changes
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(vertexSource);
+    hash.addData("\0", 1);
+    hash.addData(geometrySource);
+    hash.addData("\0", 1);
+    hash.addData(fragmentSource);
+    hash.addData("\0", 1);
+    hash.addData(feedbackVaryings.join(',').toLatin1());
+    hash.addData("\0", 1);
+    hash.addData(glext.driverString);
+    return hash.result();
+}
+
+static bool loadProgramBinary(GLuint program, const QString &path)
+{
+    QByteArray data;
+    if (!AssetCache::read(path, data)) return false;
+    if (data.size() <= int(2 * sizeof(quint32))) return false;
+
+    const quint32 *header = reinterpret_cast<const quint32 *>(data.constData());
+    if (header[0] != PROGRAM_BINARY_MAGIC) return false;
+
+    const GLenum format = GLenum(header[1]);
+    const char *binary = data.constData() + 2 * sizeof(quint32);
+    const GLsizei length = GLsizei(data.size() - 2 * sizeof(quint32));
+    glext.glProgramBinary(program, format, binary, length);
+    return true;
+}
+
+static void saveProgramBinary(GLuint program, const QString &path)
+{
+    GLint length = 0;
+    gl->glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    QByteArray data(int(2 * sizeof(quint32)) + length, Qt::Uninitialized);
+    quint32 *header = reinterpret_cast<quint32 *>(data.data());
+    GLenum format = 0;
+    glext.glGetProgramBinary(program, length, nullptr, &format, data.data() + 2 * sizeof(quint32));
+    header[0] = PROGRAM_BINARY_MAGIC;
+    header[1] = quint32(format);
+
+    AssetCache::write(path, data);
+}
+
+static GLuint submitShader(GLenum type, const QByteArray &source)
+{
+    // No status query here: that would wait for the compilation to end
+    GLuint shader = gl->glCreateShader(type);
+    const char *text = source.constData();
+    const GLint length = source.size();
+    gl->glShaderSource(shader, 1, &text, &length);
+    gl->glCompileShader(shader);
+    return shader;
+}
+
+static void checkShader(GLuint shader, const QString &filename)
+{
+    GLint compiled = 0;
+    gl->glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled)
+    {
+        GLint logLength = 0;
+        gl->glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+        QByteArray log(logLength + 1, '\0');
+        gl->glGetShaderInfoLog(shader, logLength, nullptr, log.data());
+        qDebug("Could not compile %s:\n%s", filename.toLatin1().data(), log.constData());
+    }
+}
 
 ShaderProgram::ShaderProgram()
 {
     needsUpdate = true;
 }
 
+ShaderProgram::~ShaderProgram()
+{
+    clearVariants();
+}
+
 void ShaderProgram::reload()
 {
     needsUpdate = true;
@@ -12,14 +136,218 @@ void ShaderProgram::reload()
 
 void ShaderProgram::update()
 {
-    program.removeAllShaders();
+    submit();
+    finish();
+}
+
+void ShaderProgram::submit()
+{
+    // Variants are rebuilt lazily from the new sources
+    clearVariants();
+    loadSources();
+    submit(program, defines, build);
+}
+
+bool ShaderProgram::isCompiled()
+{
+    return isCompiled(program, build);
+}
+
+void ShaderProgram::finish()
+{
+    finish(program, build);
+}
+
+QOpenGLShaderProgram &ShaderProgram::variant(quint32 key)
+{
+    if (key == 0) return program;
+
+    auto it = variants.constFind(key);
+    if (it != variants.constEnd()) {
+        return it.value()->program;
+    }
+
+    QStringList defs = defines;
+    for (int i = 0; i < features.size(); ++i)
+    {
+        if (key & (1u << i)) {
+            defs << features[i];
+        }
+    }
+
+    if (vertexSource.isEmpty() && fragmentSource.isEmpty()) {
+        loadSources();
+    }
+
+    Variant *v = new Variant;
+    submit(v->program, defs, v->build);
+    finish(v->program, v->build);
+    variants.insert(key, v);
+    return v->program;
+}
+
+void ShaderProgram::clearVariants()
+{
+    for (auto v : variants) {
+        delete v;
+    }
+    variants.clear();
+}
+
+bool ShaderProgram::loadSources()
+{
+    vertexSource.clear();
+    geometrySource.clear();
+    fragmentSource.clear();
     if (!vertexShaderFilename.isEmpty())
-        program.addShaderFromSourceFile(QOpenGLShader::Vertex, vertexShaderFilename);
+        vertexSource = readSource(vertexShaderFilename);
+    if (!geometryShaderFilename.isEmpty())
+        geometrySource = readSource(geometryShaderFilename);
     if (!fragmentShaderFilename.isEmpty())
-        program.addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentShaderFilename);
-    program.link();
+        fragmentSource = readSource(fragmentShaderFilename);
+    return !vertexSource.isEmpty() || !fragmentSource.isEmpty();
+}
+
+void ShaderProgram::submit(QOpenGLShaderProgram &prog, const QStringList &defs, Build &b)
+{
+    // Resets the linked state that QOpenGLShaderProgram keeps
+    prog.removeAllShaders();
+    if (!prog.create()) return;
+
+    b = Build();
+    b.vertexSource = injectDefines(vertexSource, defs);
+    b.geometrySource = injectDefines(geometrySource, defs);
+    b.fragmentSource = injectDefines(fragmentSource, defs);
+    b.pending = true;
+
+    if (glext.programBinary)
+    {
+        b.cachePath = AssetCache::filePath("shaders", programKey(b.vertexSource, b.geometrySource, b.fragmentSource, feedbackVaryings), "bin");
+        if (loadProgramBinary(prog.programId(), b.cachePath))
+        {
+            b.fromBinary = true;
+            return;
+        }
+    }
+
+    compileAndLink(prog, b);
+}
+
+void ShaderProgram::compileAndLink(QOpenGLShaderProgram &prog, Build &b)
+{
+    const GLuint id = prog.programId();
+
+    if (!b.vertexSource.isEmpty()) {
+        b.vertexShader = submitShader(GL_VERTEX_SHADER, b.vertexSource);
+        gl->glAttachShader(id, b.vertexShader);
+    }
+    if (!b.geometrySource.isEmpty()) {
+        b.geometryShader = submitShader(GL_GEOMETRY_SHADER, b.geometrySource);
+        gl->glAttachShader(id, b.geometryShader);
+    }
+    if (!b.fragmentSource.isEmpty()) {
+        b.fragmentShader = submitShader(GL_FRAGMENT_SHADER, b.fragmentSource);
+        gl->glAttachShader(id, b.fragmentShader);
+    }
+
+    // Only takes effect at link time
+    if (!feedbackVaryings.isEmpty())
+    {
+        QVector<QByteArray> names;
+        QVector<const char *> pointers;
+        for (const QString &varying : feedbackVaryings) {
+            names.push_back(varying.toLatin1());
+        }
+        for (const QByteArray &name : names) {
+            pointers.push_back(name.constData());
+        }
+        gl->glTransformFeedbackVaryings(id, pointers.size(), pointers.constData(), GL_INTERLEAVED_ATTRIBS);
+    }
+
+    if (glext.programBinary) {
+        glext.glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    gl->glLinkProgram(id);
+}
+
+bool ShaderProgram::isCompiled(QOpenGLShaderProgram &prog, const Build &b)
+{
+    if (!b.pending) return true;
+
+    // Without the extension the status can't be polled: finish() will block
+    if (!glext.parallelShaderCompile) return true;
+
+    GLint completed = GL_FALSE;
+    gl->glGetProgramiv(prog.programId(), GL_COMPLETION_STATUS_KHR, &completed);
+    return completed != GL_FALSE;
+}
+
+void ShaderProgram::finish(QOpenGLShaderProgram &prog, Build &b)
+{
+    if (!b.pending) return;
+    b.pending = false;
+
+    const GLuint id = prog.programId();
+
+    GLint linked = GL_FALSE;
+    gl->glGetProgramiv(id, GL_LINK_STATUS, &linked);
+
+    if (!linked && b.fromBinary)
+    {
+        // The driver rejected the cached binary (e.g. after a driver update)
+        AssetCache::remove(b.cachePath);
+        b.fromBinary = false;
+        compileAndLink(prog, b);
+        gl->glGetProgramiv(id, GL_LINK_STATUS, &linked);
+    }
+
+    if (!linked)
+    {
+        if (b.vertexShader != 0) checkShader(b.vertexShader, vertexShaderFilename);
+        if (b.geometryShader != 0) checkShader(b.geometryShader, geometryShaderFilename);
+        if (b.fragmentShader != 0) checkShader(b.fragmentShader, fragmentShaderFilename);
+
+        GLint logLength = 0;
+        gl->glGetProgramiv(id, GL_INFO_LOG_LENGTH, &logLength);
+        QByteArray log(logLength + 1, '\0');
+        gl->glGetProgramInfoLog(id, logLength, nullptr, log.data());
+        qDebug("Could not link program %s:\n%s", name.toLatin1().data(), log.constData());
+    }
+
+    if (b.vertexShader != 0) {
+        gl->glDetachShader(id, b.vertexShader);
+        gl->glDeleteShader(b.vertexShader);
+        b.vertexShader = 0;
+    }
+    if (b.geometryShader != 0) {
+        gl->glDetachShader(id, b.geometryShader);
+        gl->glDeleteShader(b.geometryShader);
+        b.geometryShader = 0;
+    }
+    if (b.fragmentShader != 0) {
+        gl->glDetachShader(id, b.fragmentShader);
+        gl->glDeleteShader(b.fragmentShader);
+        b.fragmentShader = 0;
+    }
+
+    if (linked)
+    {
+        if (!b.fromBinary && !b.cachePath.isEmpty()) {
+            saveProgramBinary(id, b.cachePath);
+        }
+
+        // QOpenGLShaderProgram has no shaders of its own, so link() only
+        // queries GL_LINK_STATUS and marks the program as linked
+        prog.link();
+    }
+
+    b.vertexSource.clear();
+    b.geometrySource.clear();
+    b.fragmentSource.clear();
 }
 
 void ShaderProgram::destroy()
 {
+    clearVariants();
 }
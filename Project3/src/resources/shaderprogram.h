@@ -3,12 +3,15 @@
 
 #include "resource.h"
 #include <QOpenGLShaderProgram>
+#include <QStringList>
+#include <QHash>
 
 
 class ShaderProgram : public Resource
 {
 public:
     ShaderProgram();
+    ~ShaderProgram() override;
 
     virtual const char *typeName() const override { return "ShaderProgram"; }
 
@@ -19,12 +22,67 @@ public:
     void update() override;
     void destroy() override;
 
+    // update() split in two steps: submit() hands the program to the driver
+    // (a cached binary if there is one, the sources otherwise) and finish()
+    // checks the result. Submitting all the programs before finishing any of
+    // them lets drivers with parallel shader compilation overlap the work.
+    void submit();
+    bool isCompiled();
+    void finish();
+
+    bool loadedFromCache() const { return build.fromBinary; }
+
+    // Permutation of the program with the features enabled in the key.
+    // Bit i of the key adds features[i] as a #define. Variants are
+    // compiled on first use and kept until the program is reloaded.
+    // The key 0 is the base program.
+    QOpenGLShaderProgram &variant(quint32 key);
+
     void read(const QJsonObject &) override { }
     void write(QJsonObject &) override { }
 
     QString vertexShaderFilename;
+    QString geometryShaderFilename; // Optional
     QString fragmentShaderFilename;
+    QStringList defines; // Injected as #define lines right after #version
+    QStringList features; // Optional defines selected per variant
+    QStringList feedbackVaryings; // Outputs captured (interleaved) by transform feedback
     QOpenGLShaderProgram program;
+
+private:
+
+    // State of a program between submit() and finish()
+    struct Build
+    {
+        QByteArray vertexSource;
+        QByteArray geometrySource;
+        QByteArray fragmentSource;
+        QString cachePath;
+        GLuint vertexShader = 0;
+        GLuint geometryShader = 0;
+        GLuint fragmentShader = 0;
+        bool pending = false;
+        bool fromBinary = false;
+    };
+
+    struct Variant
+    {
+        QOpenGLShaderProgram program;
+        Build build;
+    };
+
+    bool loadSources();
+    void clearVariants();
+    void submit(QOpenGLShaderProgram &prog, const QStringList &defs, Build &b);
+    bool isCompiled(QOpenGLShaderProgram &prog, const Build &b);
+    void finish(QOpenGLShaderProgram &prog, Build &b);
+    void compileAndLink(QOpenGLShaderProgram &prog, Build &b);
+
+    QByteArray vertexSource;
+    QByteArray geometrySource;
+    QByteArray fragmentSource;
+    Build build;
+    QHash<quint32, Variant*> variants;
 };
 
 #endif // SHADERPROGRAM_H
@@ -1,10 +1,14 @@
 #include "texture.h"
+#include "textureloader.h"
+#include "resourcemanager.h"
+#include "globals.h"
 #include <QJsonObject>
 #include <QVector2D>
 #include "rendering/gl.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "util/stb_image.h"
+#include "util/ktxfile.h"
 
 
 const char *Texture::TypeName = "Texture";
@@ -26,7 +30,14 @@ Texture::~Texture()
 
 void Texture::update()
 {
+    if (decodedData != nullptr)
+    {
+        uploadDecodedData();
+        return;
+    }
+
     if (tex.isCreated()) {
+        OpenGLState::forgetTexture(tex.textureId());
         tex.destroy();
     }
 
@@ -50,7 +61,7 @@ void Texture::update()
     }
     else if (hdrData != nullptr) // For HDR images
     {
-        gl->glBindTexture(GL_TEXTURE_2D, tex.textureId());
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, tex.textureId());
         gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, w, h, 0, GL_RGB, GL_FLOAT, hdrData);
         gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -58,22 +69,31 @@ void Texture::update()
         gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         clear();
     }
+
+    uploadRevision++;
 }
 
 void Texture::destroy()
 {
+    if (tex.isCreated()) {
+        OpenGLState::forgetTexture(tex.textureId());
+    }
     tex.destroy();
 }
 
 void Texture::bind(unsigned int textureUnit)
 {
-    tex.bind(textureUnit);
+    OpenGLState::bindTexture(int(textureUnit), GLenum(tex.target()), tex.textureId());
 }
 
 void Texture::clear()
 {
     image = QImage();
 
+    delete decodedData;
+    decodedData = nullptr;
+    loadTicket = 0;
+
     if (hdrData != nullptr)
     {
         stbi_image_free(hdrData);
@@ -110,6 +130,149 @@ void Texture::loadTexture(const char *filename)
     filePath = QString::fromLatin1(filename);
 }
 
+int Texture::beginLoading(const QString &filename)
+{
+    static int lastTicket = 0;
+
+    clear();
+
+    // Neutral placeholder shown until the decoded data arrives
+    image = QImage(1, 1, QImage::Format::Format_RGB888);
+    image.setPixelColor(0, 0, QColor::fromRgb(128, 128, 128));
+    w = h = 1;
+    comp = 3;
+    needsUpdate = true;
+
+    filePath = filename;
+    loadTicket = ++lastTicket;
+    return loadTicket;
+}
+
+void Texture::finishLoading(TextureData *data)
+{
+    // Results of a request that was replaced or cancelled
+    if (data->ticket != loadTicket)
+    {
+        delete data;
+        return;
+    }
+
+    loadTicket = 0;
+
+    if (data->hdrData != nullptr)
+    {
+        // Single level, uploaded by update() as usual
+        image = QImage();
+        hdrData = data->hdrData;
+        data->hdrData = nullptr;
+        w = data->w;
+        h = data->h;
+        comp = data->comp;
+        delete data;
+        needsUpdate = true;
+        return;
+    }
+
+    if (data->mips.isEmpty() && data->compressed == nullptr)
+    {
+        // Could not be decoded: keep the placeholder
+        delete data;
+        return;
+    }
+
+    image = data->image;
+    w = data->w;
+    h = data->h;
+    comp = data->comp;
+
+    delete decodedData;
+    decodedData = data;
+    nextMipToUpload = -1;
+    needsUpdate = true;
+}
+
+void Texture::uploadDecodedData()
+{
+    const KtxFile *compressed = decodedData->compressed;
+    const QVector<QImage> &mips = decodedData->mips;
+    const int levels = (compressed != nullptr) ? compressed->levels.size() : mips.size();
+
+    if (nextMipToUpload < 0)
+    {
+        // The placeholder stays until at least the smallest level can go up
+        // in the same frame: the new storage is undefined until then
+        if (resourceManager->textureUploadBudget <= 0)
+        {
+            needsUpdate = true;
+            return;
+        }
+
+        if (tex.isCreated()) {
+            OpenGLState::forgetTexture(tex.textureId());
+            tex.destroy();
+        }
+        tex.create();
+
+        if (compressed != nullptr)
+        {
+            // Levels defined one by one with glCompressedTexImage2D below
+            OpenGLState::bindTexture(0, GL_TEXTURE_2D, tex.textureId());
+            gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        }
+        else
+        {
+            // Allocate all the levels, the smallest one is uploaded right below
+            tex.setSize(mips[0].width(), mips[0].height());
+            tex.setFormat(QOpenGLTexture::RGBA8_UNorm);
+            tex.setMipLevels(levels);
+            tex.allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+            tex.setMipMaxLevel(levels - 1);
+        }
+        tex.setMinificationFilter(QOpenGLTexture::LinearMipMapLinear);
+        tex.setMagnificationFilter(QOpenGLTexture::Linear);
+        tex.setWrapMode(wrapMode);
+        nextMipToUpload = levels - 1;
+    }
+
+    // Smallest levels first: each one lowers the base level so the surface
+    // gets sharper frame after frame. Big levels may use up the per-frame
+    // budget of the remaining textures.
+    if (compressed != nullptr) {
+        OpenGLState::bindTexture(0, GL_TEXTURE_2D, tex.textureId());
+    }
+    while (nextMipToUpload >= 0 && resourceManager->textureUploadBudget > 0)
+    {
+        if (compressed != nullptr)
+        {
+            const KtxFile::Level &level = compressed->levels[nextMipToUpload];
+            gl->glCompressedTexImage2D(GL_TEXTURE_2D, nextMipToUpload, compressed->glInternalFormat,
+                                       level.width, level.height, 0, level.size, level.data);
+            gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, nextMipToUpload);
+            resourceManager->textureUploadBudget -= level.size;
+        }
+        else
+        {
+            const QImage &level = mips[nextMipToUpload];
+            tex.setData(nextMipToUpload, QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, level.constBits());
+            tex.setMipBaseLevel(nextMipToUpload);
+            resourceManager->textureUploadBudget -= level.sizeInBytes();
+        }
+        nextMipToUpload--;
+    }
+
+    if (nextMipToUpload < 0)
+    {
+        // Also unmaps the cached file
+        delete decodedData;
+        decodedData = nullptr;
+        uploadRevision++;
+    }
+    else
+    {
+        needsUpdate = true;
+    }
+}
+
 void Texture::setImage(const QImage &img)
 {
     image = img;
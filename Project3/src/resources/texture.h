@@ -6,6 +6,16 @@
 #include <QImage>
 
 
+struct TextureData;
+
+// How a loaded texture is used, which selects its GPU format
+enum class TextureUsage
+{
+    Color,     // Block compressed as BC1 (opaque) or BC3 (with alpha)
+    NormalMap, // Block compressed as BC5: only XY are kept
+    Data       // Uncompressed, and the image stays available on the CPU
+};
+
 class Texture : public Resource
 {
 public:
@@ -26,6 +36,15 @@ public:
 
     void clear();
     void loadTexture(const char *filename);
+
+    // Asynchronous loading (see TextureLoader): the texture shows a
+    // placeholder until finishLoading() receives the decoded data, and then
+    // uploads its mips progressively, smallest first.
+    int beginLoading(const QString &filename);
+    void finishLoading(TextureData *data);
+    bool isLoading() const { return loadTicket != 0; }
+    bool isUploading() const { return decodedData != nullptr; }
+
     void setImage(const QImage &img);
     void setWrapMode(QOpenGLTexture::WrapMode wrap);
     int width() const;
@@ -40,12 +59,25 @@ public:
     QImage getImage() { return image; } // Shallow copy
     GLuint textureId() const { return tex.textureId(); }
 
+    // Incremented each time the GPU texture is complete with new contents
+    int revision() const { return uploadRevision; }
+
+    // Format it was loaded for (see ResourceManager::loadTexture())
+    TextureUsage usage = TextureUsage::Color;
+
 private:
 
+    void uploadDecodedData();
+
     QString filePath;
 
     QImage image;
 
+    int loadTicket = 0;
+    TextureData *decodedData = nullptr;
+    int nextMipToUpload = -1;
+    int uploadRevision = 0;
+
     float *hdrData = nullptr;
     int w, h, comp;
 
@@ -0,0 +1,233 @@
+#include "textureloader.h"
+#include "texture.h"
+#include "rendering/gl.h"
+#include "util/assetcache.h"
+#include "util/blockcompression.h"
+#include "util/ktxfile.h"
+#include <QCryptographicHash>
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+
+#include "util/stb_image.h"
+
+
+// Bump when the encoder output changes to invalidate the cached files
+static const int TEXTURE_ENCODER_VERSION = 1;
+
+TextureData::~TextureData()
+{
+    delete compressed;
+
+    if (hdrData != nullptr) {
+        stbi_image_free(hdrData);
+    }
+}
+
+// 2x2 box filter (the last row/column is repeated on odd sizes)
+static QImage downsample(const QImage &src)
+{
+    const int sw = src.width();
+    const int sh = src.height();
+    const int dw = std::max(1, sw / 2);
+    const int dh = std::max(1, sh / 2);
+
+    QImage dst(dw, dh, QImage::Format_RGBA8888);
+    for (int y = 0; y < dh; ++y)
+    {
+        const uchar *row0 = src.constScanLine(std::min(2 * y, sh - 1));
+        const uchar *row1 = src.constScanLine(std::min(2 * y + 1, sh - 1));
+        uchar *out = dst.scanLine(y);
+        for (int x = 0; x < dw; ++x)
+        {
+            const int x0 = std::min(2 * x, sw - 1) * 4;
+            const int x1 = std::min(2 * x + 1, sw - 1) * 4;
+            for (int c = 0; c < 4; ++c)
+            {
+                out[4 * x + c] = uchar((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+            }
+        }
+    }
+    return dst;
+}
+
+static QByteArray compressedKey(const QByteArray &fileHash, TextureUsage usage, bool flipVertically)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(fileHash);
+    hash.addData(QByteArray::number(int(usage)));
+    hash.addData(QByteArray::number(flipVertically ? 1 : 0));
+    hash.addData(QByteArray::number(TEXTURE_ENCODER_VERSION));
+    return hash.result();
+}
+
+// Encodes all the mips and stores them in the cache. The KTX contents are
+// also parsed in place, so the first load uploads the same bytes as the
+// following (memory-mapped) ones.
+static KtxFile *compressMips(const QVector<QImage> &mips, BlockCompression::Format format, const QString &cachePath)
+{
+    quint32 internalFormat = 0, baseFormat = 0;
+    switch (format)
+    {
+    case BlockCompression::Format::BC1:
+        internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        baseFormat = GL_RGB;
+        break;
+    case BlockCompression::Format::BC3:
+        internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        baseFormat = GL_RGBA;
+        break;
+    case BlockCompression::Format::BC5:
+        internalFormat = GL_COMPRESSED_RG_RGTC2;
+        baseFormat = GL_RG;
+        break;
+    }
+
+    QVector<QByteArray> levels;
+    for (const QImage &mip : mips) {
+        levels.push_back(BlockCompression::encode(mip, format));
+    }
+
+    const QByteArray contents = KtxFile::build(internalFormat, baseFormat, mips[0].width(), mips[0].height(), levels);
+    if (!cachePath.isEmpty()) {
+        AssetCache::write(cachePath, contents);
+    }
+
+    KtxFile *ktx = new KtxFile;
+    ktx->load(contents);
+    return ktx;
+}
+
+class TextureDecodeTask : public QRunnable
+{
+public:
+
+    TextureDecodeTask(TextureLoader *l, TextureData *d) : loader(l), data(d) { }
+
+    void run() override
+    {
+        const QByteArray filename = data->filePath.toLocal8Bit();
+
+        const bool embedded = !data->encoded.isEmpty();
+
+        if (!embedded && stbi_is_hdr(filename.constData()))
+        {
+            // The vertical flip is configured once by the loader
+            data->hdrData = stbi_loadf(filename.constData(), &data->w, &data->h, &data->comp, 0);
+            if (data->hdrData == nullptr) {
+                qDebug("Could not open image %s in TextureDecodeTask", filename.constData());
+            }
+        }
+        else
+        {
+            // Block compression: BC5 is always available, BC1/BC3 need S3TC
+            const bool compress =
+                    data->usage == TextureUsage::NormalMap ||
+                    (data->usage == TextureUsage::Color && glext.textureCompressionS3TC);
+
+            QString cachePath;
+            if (compress)
+            {
+                const QByteArray fileHash = embedded ?
+                            QCryptographicHash::hash(data->encoded, QCryptographicHash::Sha1) :
+                            AssetCache::hashFile(data->filePath);
+                if (!fileHash.isEmpty()) {
+                    cachePath = AssetCache::filePath("textures", compressedKey(fileHash, data->usage, data->flipVertically), "ktx");
+                }
+
+                // Warm load: no decoding at all
+                KtxFile *ktx = new KtxFile;
+                if (!cachePath.isEmpty() && QFile::exists(cachePath) && ktx->map(cachePath))
+                {
+                    data->compressed = ktx;
+                    data->w = ktx->width;
+                    data->h = ktx->height;
+                    data->comp = 4;
+                    loader->completed.push(data);
+                    return;
+                }
+                delete ktx;
+            }
+
+            data->image = embedded ? QImage::fromData(data->encoded) : QImage(data->filePath);
+            data->encoded.clear();
+
+            if (data->image.isNull())
+            {
+                qDebug("Could not open image %s in TextureDecodeTask", filename.constData());
+            }
+            else
+            {
+                data->w = data->image.width();
+                data->h = data->image.height();
+                data->comp = data->image.depth() / 8;
+
+                QImage level = (data->flipVertically ? data->image.mirrored() : data->image).convertToFormat(QImage::Format_RGBA8888);
+                data->mips.push_back(level);
+                while (level.width() > 1 || level.height() > 1)
+                {
+                    level = downsample(level);
+                    data->mips.push_back(level);
+                }
+
+                if (compress)
+                {
+                    BlockCompression::Format format = BlockCompression::Format::BC5;
+                    if (data->usage == TextureUsage::Color) {
+                        format = BlockCompression::hasTransparency(data->image) ?
+                                    BlockCompression::Format::BC3 :
+                                    BlockCompression::Format::BC1;
+                    }
+                    data->compressed = compressMips(data->mips, format, cachePath);
+                    data->mips.clear();
+                    data->image = QImage();
+                }
+            }
+        }
+
+        loader->completed.push(data);
+    }
+
+private:
+
+    TextureLoader *loader;
+    TextureData *data;
+};
+
+TextureLoader::TextureLoader() :
+    pending(0)
+{
+    // Leave a core for the UI thread
+    pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+
+    // stb keeps this flag in a global: set it here once instead of
+    // from the worker threads
+    stbi_set_flip_vertically_on_load(true);
+}
+
+TextureLoader::~TextureLoader()
+{
+    pool.waitForDone();
+}
+
+void TextureLoader::load(Texture *texture, const QString &filePath, TextureUsage usage,
+                         const QByteArray &encoded, bool flipVertically)
+{
+    TextureData *data = new TextureData;
+    data->guid = texture->guid;
+    data->ticket = texture->beginLoading(filePath);
+    data->filePath = filePath;
+    data->encoded = encoded;
+    data->usage = usage;
+    data->flipVertically = flipVertically;
+
+    pending++;
+    pool.start(new TextureDecodeTask(this, data));
+}
+
+QVector<TextureData*> TextureLoader::takeCompleted()
+{
+    QVector<TextureData*> items = completed.takeAll();
+    pending -= items.size();
+    return items;
+}
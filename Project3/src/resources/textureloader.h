@@ -0,0 +1,62 @@
+#ifndef TEXTURELOADER_H
+#define TEXTURELOADER_H
+
+#include "util/completionqueue.h"
+#include "resources/texture.h"
+#include <QThreadPool>
+#include <QImage>
+#include <QUuid>
+#include <QVector>
+#include <atomic>
+
+class KtxFile;
+
+// Result of decoding a texture file on a worker thread
+struct TextureData
+{
+    ~TextureData();
+
+    QUuid guid;          // Texture that requested the data
+    int ticket = 0;      // Request number (discards outdated results)
+    QString filePath;
+    QByteArray encoded;  // File contents of embedded images (filePath is only a name then)
+    TextureUsage usage = TextureUsage::Color;
+    bool flipVertically = true; // False for models with the UV origin at the top (glTF)
+
+    QImage image;        // Decoded image, as stored in the file
+    QVector<QImage> mips; // RGBA8888 mip chain flipped for OpenGL, level 0 first
+
+    KtxFile *compressed = nullptr; // Block-compressed mip chain (replaces mips)
+
+    float *hdrData = nullptr; // For HDR images (no mips)
+    int w = 0, h = 0, comp = 0;
+};
+
+// Decodes texture files on a pool of worker threads. The decoded data is
+// collected by the main thread with takeCompleted() and handed to the
+// textures, which upload it progressively (see Texture::update()).
+class TextureLoader
+{
+public:
+
+    TextureLoader();
+    ~TextureLoader();
+
+    void load(Texture *texture, const QString &filePath, TextureUsage usage,
+              const QByteArray &encoded = QByteArray(), bool flipVertically = true);
+
+    QVector<TextureData*> takeCompleted();
+
+    // Requests not yet collected by takeCompleted()
+    int pendingCount() const { return pending.load(); }
+
+private:
+
+    friend class TextureDecodeTask;
+
+    QThreadPool pool;
+    CompletionQueue<TextureData> completed;
+    std::atomic<int> pending;
+};
+
+#endif // TEXTURELOADER_H
@@ -0,0 +1,97 @@
+#ifndef VERTEXLAYOUT_H
+#define VERTEXLAYOUT_H
+
+#include "mesh.h"
+#include <QVector2D>
+#include <QVector3D>
+#include <type_traits>
+
+// Typed view of one attribute in interleaved vertices
+template <typename T>
+class StridedView
+{
+public:
+
+    typedef typename std::conditional<std::is_const<T>::value, const unsigned char, unsigned char>::type Byte;
+
+    StridedView(typename std::conditional<std::is_const<T>::value, const void, void>::type *data, int stride, int count) :
+        base(static_cast<Byte *>(data)), stride(stride), count(count) { }
+
+    T &operator[](int i) const { return *reinterpret_cast<T *>(base + i * stride); }
+
+    int size() const { return count; }
+    int byteStride() const { return stride; }
+
+private:
+
+    Byte *base;
+    int stride;
+    int count;
+};
+
+// Float attributes at the locations the shaders expect
+struct Pos3f   { typedef QVector3D Type; static constexpr int location = 0; static constexpr int components = 3; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 12; };
+struct Norm3f  { typedef QVector3D Type; static constexpr int location = 1; static constexpr int components = 3; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 12; };
+struct UV2f    { typedef QVector2D Type; static constexpr int location = 2; static constexpr int components = 2; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 8; };
+struct Tan3f   { typedef QVector3D Type; static constexpr int location = 3; static constexpr int components = 3; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 12; };
+struct Bitan3f { typedef QVector3D Type; static constexpr int location = 4; static constexpr int components = 3; static constexpr GLenum type = GL_FLOAT; static constexpr int size = 12; };
+
+namespace VertexLayoutDetail
+{
+
+template <typename... Attributes> struct Size;
+template <> struct Size<> { static constexpr int value = 0; };
+template <typename A, typename... Rest> struct Size<A, Rest...> { static constexpr int value = A::size + Size<Rest...>::value; };
+
+// Fails to compile if the layout doesn't have the attribute
+template <typename Target, typename... Attributes> struct Offset;
+template <typename Target, typename... Rest> struct Offset<Target, Target, Rest...> { static constexpr int value = 0; };
+template <typename Target, typename A, typename... Rest> struct Offset<Target, A, Rest...> { static constexpr int value = A::size + Offset<Target, Rest...>::value; };
+
+template <typename... Attributes> struct Format;
+template <> struct Format<> { static void add(VertexFormat &) { } };
+template <typename A, typename... Rest> struct Format<A, Rest...>
+{
+    static void add(VertexFormat &format)
+    {
+        format.setVertexAttribute(A::location, format.size, A::components, A::type);
+        Format<Rest...>::add(format);
+    }
+};
+
+} // namespace VertexLayoutDetail
+
+// Interleaved vertex with the given attributes, in order. Sizes and offsets
+// are known at compile time, e.g.:
+//   typedef VertexLayout<Pos3f, Norm3f, UV2f> Layout;
+//   mesh->addSubMesh(Layout::format(), data, bytes);
+//   auto uvs = Layout::view<UV2f>(data, count);
+template <typename... Attributes>
+struct VertexLayout
+{
+    static constexpr int size = VertexLayoutDetail::Size<Attributes...>::value;
+
+    template <typename A>
+    static constexpr int offset() { return VertexLayoutDetail::Offset<A, Attributes...>::value; }
+
+    static VertexFormat format()
+    {
+        VertexFormat vertexFormat;
+        VertexLayoutDetail::Format<Attributes...>::add(vertexFormat);
+        return vertexFormat;
+    }
+
+    template <typename A>
+    static StridedView<typename A::Type> view(void *vertices, int count)
+    {
+        return StridedView<typename A::Type>(static_cast<unsigned char *>(vertices) + offset<A>(), size, count);
+    }
+
+    template <typename A>
+    static StridedView<const typename A::Type> view(const void *vertices, int count)
+    {
+        return StridedView<const typename A::Type>(static_cast<const unsigned char *>(vertices) + offset<A>(), size, count);
+    }
+};
+
+#endif // VERTEXLAYOUT_H
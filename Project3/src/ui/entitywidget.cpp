@@ -11,6 +11,7 @@ EntityWidget::EntityWidget(QWidget *parent) :
     ui->setupUi(this);
 
     connect(ui->checkActive, SIGNAL(clicked()), this, SLOT(onActiveChanged()));
+    connect(ui->checkStatic, SIGNAL(clicked()), this, SLOT(onStaticChanged()));
     connect(ui->nameText, SIGNAL(editingFinished()), this, SLOT(clearFocus()));
     connect(ui->nameText, SIGNAL(returnPressed()), this, SLOT(onReturnPressed()));
 }
@@ -32,6 +33,9 @@ void EntityWidget::setEntity(Entity *ent)
     QSignalBlocker b(ui->checkActive);
     ui->checkActive->setChecked(ent->active);
 
+    QSignalBlocker bs(ui->checkStatic);
+    ui->checkStatic->setChecked(ent->isStatic);
+
     show();
 }
 
@@ -41,6 +45,12 @@ void EntityWidget::onActiveChanged()
     emit entityChanged(entity);
 }
 
+void EntityWidget::onStaticChanged()
+{
+    entity->isStatic = ui->checkStatic->isChecked();
+    emit entityChanged(entity);
+}
+
 void EntityWidget::onReturnPressed()
 {
     entity->name = ui->nameText->text();
@@ -26,6 +26,7 @@ signals:
 public slots:
 
     void onActiveChanged();
+    void onStaticChanged();
     void onReturnPressed();
     void clearFocus();
 
@@ -14,6 +14,7 @@
 #include "util/modelimporter.h"
 #include "globals.h"
 #include <iostream>
+#include <functional>
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QCloseEvent>
@@ -22,7 +23,10 @@
 #include <QMimeData>
 #include <QComboBox>
 #include <QDockWidget>
+#include <QStatusBar>
 #include <QVBoxLayout>
+#include <QtConcurrent>
+#include <QFutureWatcher>
 
 
 MainWindow *g_MainWindow = nullptr;
@@ -118,6 +122,7 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(inspectorWidget, SIGNAL(entityChanged(Entity*)), this, SLOT(onEntityChangedFromInspector(Entity*)));
     connect(inspectorWidget, SIGNAL(resourceChanged(Resource*)), this, SLOT(onResourceChangedFromInspector(Resource*)));
     connect(openGLWidget, SIGNAL(interacted()), this, SLOT(onEntityChangedInteractively()));
+    connect(openGLWidget, SIGNAL(frameRendered()), this, SLOT(showRenderStatistics()));
     connect(miscSettingsWidget, SIGNAL(settingsChanged()), this, SLOT(updateRender()));
 
     connect(selection, SIGNAL(entitySelected(Entity *)), this, SLOT(onEntitySelectedFromSceneView(Entity *)));
@@ -264,11 +269,11 @@ void MainWindow::addDirectionalLight()
 
 void MainWindow::importModel()
 {
-    QString path = QFileDialog::getOpenFileName(this, "Choose a 3D model file.",QString(), "3D Models (*.obj *.fbx)");
+    QString path = QFileDialog::getOpenFileName(this, "Choose a 3D model file.",QString(), "3D Models (*.obj *.fbx *.glb *.gltf)");
     if (path.isEmpty()) return;
 
     ModelImporter importer;
-    Entity *entity = importer.import(path);
+    Entity *entity = importer.import(path, miscSettings->importMode);
     onEntityAdded(entity);
 }
 
@@ -309,6 +314,28 @@ void MainWindow::updateRender()
     openGLWidget->update();
 }
 
+void MainWindow::showRenderStatistics()
+{
+    const RenderStatistics &statistics = renderer->statistics;
+    const qint64 clusterTriangles = statistics.triangles + statistics.meshletTrianglesCulled;
+    const double culledPercent = clusterTriangles > 0 ? 100.0 * statistics.meshletTrianglesCulled / clusterTriangles : 0.0;
+    statusBar()->showMessage(QString("Triangles: %1 (%2 saved by LODs, %3% culled by meshlets), impostors: %4, frame data: %5 B (%6 stalls, %7 wraps), GL calls: %8 (%9 filtered), texture binds: %10, static batches: %11, GPU culled instances: %12, occlusion queries: %13 (%14 hidden)")
+                             .arg(statistics.triangles)
+                             .arg(statistics.lodTrianglesSaved)
+                             .arg(culledPercent, 0, 'f', 1)
+                             .arg(statistics.impostors)
+                             .arg(statistics.frameDataBytes)
+                             .arg(statistics.frameDataStalls)
+                             .arg(statistics.frameDataWraps)
+                             .arg(statistics.glCallsIssued)
+                             .arg(statistics.glCallsFiltered)
+                             .arg(statistics.textureBinds)
+                             .arg(statistics.staticBatches)
+                             .arg(statistics.gpuInstances)
+                             .arg(statistics.occlusionQueries)
+                             .arg(statistics.occludedMeshes));
+}
+
 void MainWindow::updateEverything()
 {
     hierarchyWidget->updateLayout();
@@ -416,11 +443,10 @@ void MainWindow::dropEvent(QDropEvent* event)
     for (int i = 0; i < urlList.size() && i < 32; ++i)
     {
       QString filePath = urlList.at(i).toLocalFile();
-      if (filePath.endsWith("obj") || filePath.endsWith("fbx"))
+      if (filePath.endsWith("obj") || filePath.endsWith("fbx") ||
+              filePath.endsWith("glb") || filePath.endsWith("gltf"))
       {
-          ModelImporter importer;
-          Entity *entity = importer.import(filePath);
-          onEntityAdded(entity);
+          pathList.push_back(filePath);
       }
       else
       {
@@ -430,6 +456,20 @@ void MainWindow::dropEvent(QDropEvent* event)
 
     onResourceAdded(res);
 
+    // Models are read concurrently on the thread pool, and added to the
+    // scene in the order they were dropped once all of them are ready
+    if (!pathList.isEmpty())
+    {
+        const ImportMode mode = miscSettings->importMode;
+        std::function<ImportedModel*(const QString &)> load = [mode](const QString &path) {
+            return ModelImporter::load(path, mode);
+        };
+
+        auto watcher = new QFutureWatcher<ImportedModel*>(this);
+        connect(watcher, SIGNAL(finished()), this, SLOT(onModelsLoaded()));
+        watcher->setFuture(QtConcurrent::mapped(pathList, load));
+    }
+
     event->acceptProposedAction();
   }
   else
@@ -438,6 +478,22 @@ void MainWindow::dropEvent(QDropEvent* event)
   }
 }
 
+void MainWindow::onModelsLoaded()
+{
+    auto watcher = static_cast<QFutureWatcher<ImportedModel*>*>(sender());
+
+    const QList<ImportedModel*> models = watcher->future().results();
+    for (ImportedModel *model : models)
+    {
+        if (model == nullptr) continue;
+        Entity *entity = ModelImporter::instantiate(*model);
+        onEntityAdded(entity);
+        delete model;
+    }
+
+    watcher->deleteLater();
+}
+
 void MainWindow::closeEvent(QCloseEvent *event)
 {
     QMessageBox::StandardButton button = QMessageBox::question(
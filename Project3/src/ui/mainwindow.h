@@ -56,6 +56,8 @@ public slots:
     void updateEverything();
     void reloadShaderPrograms();
     void onRenderOutputChanged(QString);
+    void onModelsLoaded();
+    void showRenderStatistics();
 
 private:
 
@@ -24,6 +24,17 @@ MiscSettingsWidget::MiscSettingsWidget(QWidget *parent) :
     //connect(ui->renderingPipeline, SIGNAL(currentIndexChanged(int)), this, SLOT(RenderingPipelineStateChanged(int)));
     connect(ui->SSAO, SIGNAL(stateChanged(int)), this, SLOT(StateChangeSSAO(int)));
     connect(ui->Outline, SIGNAL(stateChanged(int)), this, SLOT(StateChangeOutline(int)));
+    connect(ui->checkBoxLods, SIGNAL(clicked()), this, SLOT(onLodsChanged()));
+    connect(ui->checkBoxMeshletCulling, SIGNAL(clicked()), this, SLOT(onMeshletCullingChanged()));
+    connect(ui->checkBoxImpostors, SIGNAL(clicked()), this, SLOT(onImpostorsChanged()));
+    connect(ui->spinImpostorScreenSize, SIGNAL(valueChanged(double)), this, SLOT(onImpostorScreenSizeChanged(double)));
+    connect(ui->checkBoxTextureArrays, SIGNAL(clicked()), this, SLOT(onTextureArraysChanged()));
+    connect(ui->checkBoxGpuCulling, SIGNAL(clicked()), this, SLOT(onGpuCullingChanged()));
+    connect(ui->checkBoxOcclusionCulling, SIGNAL(clicked()), this, SLOT(onOcclusionCullingChanged()));
+    connect(ui->spinOcclusionQueryBatch, SIGNAL(valueChanged(int)), this, SLOT(onOcclusionQueryBatchChanged(int)));
+    connect(ui->spinOcclusionVisibleFrames, SIGNAL(valueChanged(int)), this, SLOT(onOcclusionVisibleFramesChanged(int)));
+    connect(ui->checkBoxConditionalRender, SIGNAL(clicked()), this, SLOT(onConditionalRenderChanged()));
+    connect(ui->comboImportMode, SIGNAL(currentIndexChanged(int)), this, SLOT(onImportModeChanged(int)));
 }
 
 void MiscSettingsWidget::RenderingPipelineStateChanged(int activeIndex)
@@ -92,6 +103,72 @@ void MiscSettingsWidget::StateChangeOutline(int state)
     emit settingsChanged();
 }
 
+void MiscSettingsWidget::onLodsChanged()
+{
+    miscSettings->useLods = ui->checkBoxLods->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onMeshletCullingChanged()
+{
+    miscSettings->useMeshletCulling = ui->checkBoxMeshletCulling->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onImpostorsChanged()
+{
+    miscSettings->useImpostors = ui->checkBoxImpostors->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onImpostorScreenSizeChanged(double size)
+{
+    miscSettings->impostorScreenSize = size;
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onTextureArraysChanged()
+{
+    miscSettings->useTextureArrays = ui->checkBoxTextureArrays->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onGpuCullingChanged()
+{
+    miscSettings->useGpuCulling = ui->checkBoxGpuCulling->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onOcclusionCullingChanged()
+{
+    miscSettings->useOcclusionCulling = ui->checkBoxOcclusionCulling->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onOcclusionQueryBatchChanged(int batch)
+{
+    miscSettings->occlusionQueryBatch = batch;
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onOcclusionVisibleFramesChanged(int frames)
+{
+    miscSettings->occlusionVisibleFrames = frames;
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onConditionalRenderChanged()
+{
+    miscSettings->occlusionConditionalRender = ui->checkBoxConditionalRender->isChecked();
+    emit settingsChanged();
+}
+
+void MiscSettingsWidget::onImportModeChanged(int index)
+{
+    // Only affects the next imports
+    miscSettings->importMode = ImportMode(index);
+}
+
 
 MiscSettingsWidget::~MiscSettingsWidget()
 {
@@ -36,6 +36,18 @@ public slots:
     void StateChangeSSAO(int state);
     void StateChangeOutline(int state);
 
+    void onImportModeChanged(int index);
+    void onLodsChanged();
+    void onMeshletCullingChanged();
+    void onImpostorsChanged();
+    void onImpostorScreenSizeChanged(double size);
+    void onTextureArraysChanged();
+    void onGpuCullingChanged();
+    void onOcclusionCullingChanged();
+    void onOcclusionQueryBatchChanged(int batch);
+    void onOcclusionVisibleFramesChanged(int frames);
+    void onConditionalRenderChanged();
+
 private slots:
     void on_buttonBackgroundColor_clicked();
 
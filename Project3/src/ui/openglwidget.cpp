@@ -73,6 +73,8 @@ void OpenGLWidget::initializeGL()
 
     OpenGLState::initialize();
 
+    glext.initialize();
+
     if (context()->hasExtension(QByteArrayLiteral("GL_KHR_debug")))
     {
         QOpenGLDebugLogger *logger = new QOpenGLDebugLogger(this);
@@ -86,12 +88,6 @@ void OpenGLWidget::initializeGL()
     // Handle context destructions
     connect(context(), SIGNAL(aboutToBeDestroyed()), this, SLOT(finalizeGL()));
 
-    // Backface culling and z-test
-    gl->glEnable(GL_CULL_FACE);
-    gl->glCullFace(GL_BACK);
-    gl->glEnable(GL_DEPTH_TEST);
-    gl->glDisable(GL_BLEND);
-
     renderer->initialize();
 }
 
@@ -106,9 +102,14 @@ void OpenGLWidget::paintGL()
 {
     resourceManager->updateResources();
 
+    // Qt binds its own objects between frames
+    OpenGLState::beginFrame();
+
     camera->prepareMatrices();
 
     renderer->render(camera);
+
+    emit frameRendered();
 }
 
 void OpenGLWidget::finalizeGL()
@@ -236,7 +237,8 @@ void OpenGLWidget::frame()
     static int framesSinceLastInteraction = 0;
     bool didInteraction = interaction->update();
     if (didInteraction) { framesSinceLastInteraction = 0; }
-    if (framesSinceLastInteraction < 5)
+    // Keep repainting while textures stream in
+    if (framesSinceLastInteraction < 5 || resourceManager->isLoading())
     {
         update();
     }
@@ -47,6 +47,7 @@ public:
 signals:
 
     void interacted();
+    void frameRendered();
 
 public slots:
 
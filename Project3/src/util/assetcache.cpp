@@ -0,0 +1,63 @@
+#include "util/assetcache.h"
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+
+
+QString AssetCache::directory(const QString &category)
+{
+    QString root = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QDir dir(root);
+    dir.mkpath(category);
+    return dir.absoluteFilePath(category);
+}
+
+QString AssetCache::filePath(const QString &category, const QByteArray &key, const QString &extension)
+{
+    return QString::fromLatin1("%0/%1.%2")
+            .arg(directory(category))
+            .arg(QString::fromLatin1(key.toHex()))
+            .arg(extension);
+}
+
+QByteArray AssetCache::hashFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(&file);
+    return hash.result();
+}
+
+bool AssetCache::read(const QString &path, QByteArray &data)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    data = file.readAll();
+    return true;
+}
+
+bool AssetCache::write(const QString &path, const QByteArray &data)
+{
+    // QSaveFile writes to a temporary file and renames it on commit,
+    // so a crash never leaves a truncated entry behind
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug("Could not write the cache entry %s", path.toLatin1().data());
+        return false;
+    }
+    file.write(data);
+    return file.commit();
+}
+
+void AssetCache::remove(const QString &path)
+{
+    QFile::remove(path);
+}
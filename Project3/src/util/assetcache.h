@@ -0,0 +1,28 @@
+#ifndef ASSETCACHE_H
+#define ASSETCACHE_H
+
+#include <QString>
+#include <QByteArray>
+
+// On-disk cache of derived data (program binaries, processed assets...).
+// Entries are addressed by a category and a content hash, so stale entries
+// are never read back: any change in the inputs produces a different key.
+class AssetCache
+{
+public:
+
+    // Directory where the entries of the given category are stored
+    static QString directory(const QString &category);
+
+    // Full path of the entry with the given key
+    static QString filePath(const QString &category, const QByteArray &key, const QString &extension);
+
+    // Hash of the contents of a file (empty if the file can't be read)
+    static QByteArray hashFile(const QString &path);
+
+    static bool read(const QString &path, QByteArray &data);
+    static bool write(const QString &path, const QByteArray &data);
+    static void remove(const QString &path);
+};
+
+#endif // ASSETCACHE_H
@@ -0,0 +1,280 @@
+#include "util/blockcompression.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOCKCOMPRESSION_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace BlockCompression
+{
+
+// Pixels of a block as separate float channels (r, g, b, a)
+struct Block
+{
+    alignas(16) float channel[4][16];
+};
+
+static void fetchBlock(const QImage &image, int bx, int by, Block &block)
+{
+    const int w = image.width();
+    const int h = image.height();
+    for (int y = 0; y < 4; ++y)
+    {
+        const uchar *row = image.constScanLine(std::min(by * 4 + y, h - 1));
+        for (int x = 0; x < 4; ++x)
+        {
+            const uchar *pixel = row + std::min(bx * 4 + x, w - 1) * 4;
+            for (int c = 0; c < 4; ++c) {
+                block.channel[c][y * 4 + x] = pixel[c];
+            }
+        }
+    }
+}
+
+// Position of each pixel along the segment from p0 to p1, quantized to
+// [0, steps]. This is the hot loop of both encoders.
+static void projectOnSegment(const Block &block, int numChannels, const int *channels,
+                             const float *p0, const float *p1, int steps, int *result)
+{
+    float dir[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float len2 = 0.0f;
+    for (int i = 0; i < numChannels; ++i) {
+        dir[i] = p1[i] - p0[i];
+        len2 += dir[i] * dir[i];
+    }
+    if (len2 < 1e-6f)
+    {
+        std::fill(result, result + 16, 0);
+        return;
+    }
+    const float scale = float(steps) / len2;
+
+#ifdef BLOCKCOMPRESSION_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxStep = _mm_set1_ps(float(steps));
+    for (int p = 0; p < 16; p += 4)
+    {
+        __m128 dot = _mm_setzero_ps();
+        for (int i = 0; i < numChannels; ++i)
+        {
+            const __m128 v = _mm_sub_ps(_mm_load_ps(&block.channel[channels[i]][p]), _mm_set1_ps(p0[i]));
+            dot = _mm_add_ps(dot, _mm_mul_ps(v, _mm_set1_ps(dir[i] * scale)));
+        }
+        dot = _mm_min_ps(_mm_max_ps(dot, zero), maxStep);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(result + p), _mm_cvtps_epi32(dot));
+    }
+#else
+    for (int p = 0; p < 16; ++p)
+    {
+        float dot = 0.0f;
+        for (int i = 0; i < numChannels; ++i) {
+            dot += (block.channel[channels[i]][p] - p0[i]) * dir[i] * scale;
+        }
+        dot = std::min(std::max(dot, 0.0f), float(steps));
+        result[p] = int(std::lround(dot));
+    }
+#endif
+}
+
+static quint16 packRGB565(const float *rgb)
+{
+    const int r = std::min(std::max(int(rgb[0] * 31.0f / 255.0f + 0.5f), 0), 31);
+    const int g = std::min(std::max(int(rgb[1] * 63.0f / 255.0f + 0.5f), 0), 63);
+    const int b = std::min(std::max(int(rgb[2] * 31.0f / 255.0f + 0.5f), 0), 31);
+    return quint16((r << 11) | (g << 5) | b);
+}
+
+static void unpackRGB565(quint16 c, float *rgb)
+{
+    const int r = (c >> 11) & 31;
+    const int g = (c >> 5) & 63;
+    const int b = c & 31;
+    rgb[0] = float((r << 3) | (r >> 2));
+    rgb[1] = float((g << 2) | (g >> 4));
+    rgb[2] = float((b << 3) | (b >> 2));
+}
+
+static void encodeColorBlock(const Block &block, uchar *out)
+{
+    // Principal axis of the colors (power iteration on the covariance)
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int p = 0; p < 16; ++p) mean[c] += block.channel[c][p];
+        mean[c] /= 16.0f;
+    }
+
+    float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int p = 0; p < 16; ++p)
+    {
+        const float r = block.channel[0][p] - mean[0];
+        const float g = block.channel[1][p] - mean[1];
+        const float b = block.channel[2][p] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+    }
+
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int i = 0; i < 4; ++i)
+    {
+        const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        const float len = std::max(std::max(std::fabs(x), std::fabs(y)), std::fabs(z));
+        if (len < 1e-6f) break;
+        axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+    }
+
+    // Endpoints: extreme projections of the colors on the axis
+    float minT = 0.0f, maxT = 0.0f;
+    for (int p = 0; p < 16; ++p)
+    {
+        const float t = (block.channel[0][p] - mean[0]) * axis[0] +
+                        (block.channel[1][p] - mean[1]) * axis[1] +
+                        (block.channel[2][p] - mean[2]) * axis[2];
+        minT = std::min(minT, t);
+        maxT = std::max(maxT, t);
+    }
+    const float len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float e0[3], e1[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        e0[c] = mean[c] + axis[c] * maxT / len2;
+        e1[c] = mean[c] + axis[c] * minT / len2;
+    }
+
+    quint16 c0 = packRGB565(e0);
+    quint16 c1 = packRGB565(e1);
+
+    // c0 > c1 selects the four color mode
+    quint32 indices = 0;
+    if (c0 != c1)
+    {
+        if (c0 < c1) std::swap(c0, c1);
+
+        float p0[3], p1[3];
+        unpackRGB565(c0, p0);
+        unpackRGB565(c1, p1);
+
+        static const int channels[3] = { 0, 1, 2 };
+        static const quint32 indexForStep[4] = { 0, 2, 3, 1 };
+        int steps[16];
+        projectOnSegment(block, 3, channels, p0, p1, 3, steps);
+        for (int p = 0; p < 16; ++p) {
+            indices |= indexForStep[steps[p]] << (2 * p);
+        }
+    }
+
+    out[0] = uchar(c0 & 0xFF); out[1] = uchar(c0 >> 8);
+    out[2] = uchar(c1 & 0xFF); out[3] = uchar(c1 >> 8);
+    out[4] = uchar(indices & 0xFF);
+    out[5] = uchar((indices >> 8) & 0xFF);
+    out[6] = uchar((indices >> 16) & 0xFF);
+    out[7] = uchar(indices >> 24);
+}
+
+static void encodeSingleChannelBlock(const Block &block, int channel, uchar *out)
+{
+    const float *values = block.channel[channel];
+    float minV = values[0], maxV = values[0];
+    for (int p = 1; p < 16; ++p)
+    {
+        minV = std::min(minV, values[p]);
+        maxV = std::max(maxV, values[p]);
+    }
+
+    // a0 > a1 selects the eight value mode
+    const uchar a0 = uchar(maxV);
+    const uchar a1 = uchar(minV);
+
+    quint64 indices = 0;
+    if (a0 != a1)
+    {
+        const float p0[1] = { float(a0) };
+        const float p1[1] = { float(a1) };
+        int steps[16];
+        projectOnSegment(block, 1, &channel, p0, p1, 7, steps);
+        for (int p = 0; p < 16; ++p)
+        {
+            // Step 0 is a0, step 7 is a1 and the rest are interpolated
+            const int s = steps[p];
+            const quint64 index = (s == 0) ? 0 : (s == 7) ? 1 : quint64(s + 1);
+            indices |= index << (3 * p);
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; ++i) {
+        out[2 + i] = uchar((indices >> (8 * i)) & 0xFF);
+    }
+}
+
+int blockSize(Format format)
+{
+    return (format == Format::BC1) ? 8 : 16;
+}
+
+int compressedSize(Format format, int width, int height)
+{
+    return ((width + 3) / 4) * ((height + 3) / 4) * blockSize(format);
+}
+
+QByteArray encode(const QImage &image, Format format)
+{
+    Q_ASSERT(image.format() == QImage::Format_RGBA8888);
+
+    const int blocksX = (image.width() + 3) / 4;
+    const int blocksY = (image.height() + 3) / 4;
+    const int size = blockSize(format);
+
+    QByteArray result(compressedSize(format, image.width(), image.height()), Qt::Uninitialized);
+    uchar *out = reinterpret_cast<uchar *>(result.data());
+
+    Block block;
+    for (int by = 0; by < blocksY; ++by)
+    {
+        for (int bx = 0; bx < blocksX; ++bx)
+        {
+            fetchBlock(image, bx, by, block);
+            switch (format)
+            {
+            case Format::BC1:
+                encodeColorBlock(block, out);
+                break;
+            case Format::BC3:
+                encodeSingleChannelBlock(block, 3, out);
+                encodeColorBlock(block, out + 8);
+                break;
+            case Format::BC5:
+                encodeSingleChannelBlock(block, 0, out);
+                encodeSingleChannelBlock(block, 1, out + 8);
+                break;
+            }
+            out += size;
+        }
+    }
+
+    return result;
+}
+
+bool hasTransparency(const QImage &image)
+{
+    if (!image.hasAlphaChannel()) return false;
+
+    const QImage rgba = image.convertToFormat(QImage::Format_RGBA8888);
+    for (int y = 0; y < rgba.height(); ++y)
+    {
+        const uchar *row = rgba.constScanLine(y);
+        for (int x = 0; x < rgba.width(); ++x) {
+            if (row[4 * x + 3] != 255) return true;
+        }
+    }
+    return false;
+}
+
+} // namespace BlockCompression
@@ -0,0 +1,31 @@
+#ifndef BLOCKCOMPRESSION_H
+#define BLOCKCOMPRESSION_H
+
+#include <QByteArray>
+#include <QImage>
+
+// CPU encoders of the BCn block formats (4x4 pixel blocks):
+//   BC1 (DXT1): RGB, 8 bytes per block
+//   BC3 (DXT5): RGBA, 16 bytes per block (BC4 alpha + BC1 color)
+//   BC5 (RGTC2): two channels, 16 bytes per block (normal maps, XY only)
+// The input images must be in QImage::Format_RGBA8888. Sizes don't need to
+// be multiples of 4: the border blocks repeat the last row/column.
+namespace BlockCompression
+{
+    enum class Format
+    {
+        BC1,
+        BC3,
+        BC5
+    };
+
+    int blockSize(Format format);
+    int compressedSize(Format format, int width, int height);
+
+    QByteArray encode(const QImage &image, Format format);
+
+    // True if any pixel is not fully opaque
+    bool hasTransparency(const QImage &image);
+}
+
+#endif // BLOCKCOMPRESSION_H
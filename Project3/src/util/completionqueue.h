@@ -0,0 +1,70 @@
+#ifndef COMPLETIONQUEUE_H
+#define COMPLETIONQUEUE_H
+
+#include <QVector>
+#include <algorithm>
+#include <atomic>
+
+// Lock-free queue used by worker threads to hand results to the main thread.
+// Any thread can push(); a single consumer takes everything at once with
+// takeAll(). Items are owned by the queue until they are taken.
+template <typename T>
+class CompletionQueue
+{
+public:
+
+    CompletionQueue() : head(nullptr) { }
+
+    ~CompletionQueue()
+    {
+        for (T *item : takeAll()) {
+            delete item;
+        }
+    }
+
+    CompletionQueue(const CompletionQueue &) = delete;
+    CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+    void push(T *item)
+    {
+        Node *node = new Node;
+        node->item = item;
+        node->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(node->next, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) { }
+    }
+
+    // Items pushed so far, in the order they were pushed
+    QVector<T*> takeAll()
+    {
+        QVector<T*> items;
+        Node *node = head.exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr)
+        {
+            items.push_back(node->item);
+            Node *next = node->next;
+            delete node;
+            node = next;
+        }
+        std::reverse(items.begin(), items.end());
+        return items;
+    }
+
+    bool isEmpty() const
+    {
+        return head.load(std::memory_order_relaxed) == nullptr;
+    }
+
+private:
+
+    struct Node
+    {
+        T *item;
+        Node *next;
+    };
+
+    std::atomic<Node*> head;
+};
+
+#endif // COMPLETIONQUEUE_H
@@ -0,0 +1,729 @@
+#include "util/gltfloader.h"
+#include "util/modelimporter.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMatrix4x4>
+#include <QUrl>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+
+static const quint32 GLB_MAGIC = 0x46546C67;      // "glTF"
+static const quint32 GLB_CHUNK_JSON = 0x4E4F534A; // "JSON"
+static const quint32 GLB_CHUNK_BIN = 0x004E4942;  // "BIN\0"
+
+// Accessor component types
+static const int GLTF_BYTE = 5120;
+static const int GLTF_UNSIGNED_BYTE = 5121;
+static const int GLTF_SHORT = 5122;
+static const int GLTF_UNSIGNED_SHORT = 5123;
+static const int GLTF_UNSIGNED_INT = 5125;
+static const int GLTF_FLOAT = 5126;
+
+// Primitive modes
+static const int GLTF_TRIANGLES = 4;
+
+// Owner of the buffers of a glTF file: the mapped files, and the data that
+// had to be decoded or repacked
+class GltfFile : public MeshSource
+{
+public:
+
+    ~GltfFile() override
+    {
+        for (int i = 0; i < files.size(); ++i)
+        {
+            if (mappings[i] != nullptr) {
+                files[i]->unmap(mappings[i]);
+            }
+            delete files[i];
+        }
+    }
+
+    const uchar *map(const QString &path, qint64 &size)
+    {
+        QFile *file = new QFile(path);
+        uchar *mapping = nullptr;
+        if (file->open(QIODevice::ReadOnly) && file->size() > 0)
+        {
+            size = file->size();
+            mapping = file->map(0, size);
+        }
+        files.push_back(file);
+        mappings.push_back(mapping);
+        return mapping;
+    }
+
+    const uchar *store(const QByteArray &data)
+    {
+        storage.push_back(data);
+        return reinterpret_cast<const uchar *>(storage.back().constData());
+    }
+
+private:
+
+    QVector<QFile*> files;
+    QVector<uchar*> mappings;
+    QVector<QByteArray> storage;
+};
+
+struct GltfSpan
+{
+    const uchar *data = nullptr;
+    qint64 size = 0;
+};
+
+struct GltfContext
+{
+    QJsonObject json;
+    QDir directory;
+    QString fileName;
+    QSharedPointer<GltfFile> file;
+    QVector<GltfSpan> buffers;
+
+    qint64 referencedBytes = 0; // Geometry uploaded straight from the buffers
+    qint64 copiedBytes = 0;     // Geometry that had to be repacked
+};
+
+// Typed view of a buffer view
+struct GltfAccessor
+{
+    const uchar *data = nullptr; // First element
+    const uchar *end = nullptr;  // End of the buffer view
+    int count = 0;
+    int componentType = 0;
+    int components = 0;
+    int stride = 0;
+    bool normalized = false;
+    int bufferView = -1;
+};
+
+static int componentSize(int componentType)
+{
+    switch (componentType)
+    {
+    case GLTF_BYTE:
+    case GLTF_UNSIGNED_BYTE: return 1;
+    case GLTF_SHORT:
+    case GLTF_UNSIGNED_SHORT: return 2;
+    case GLTF_UNSIGNED_INT:
+    case GLTF_FLOAT: return 4;
+    }
+    return 0;
+}
+
+static int typeComponents(const QString &type)
+{
+    if (type == "SCALAR") return 1;
+    if (type == "VEC2") return 2;
+    if (type == "VEC3") return 3;
+    if (type == "VEC4") return 4;
+    return 0;
+}
+
+static bool readAccessor(const GltfContext &context, int index, GltfAccessor &accessor)
+{
+    const QJsonArray accessors = context.json["accessors"].toArray();
+    if (index < 0 || index >= accessors.size()) return false;
+
+    // Sparse accessors and accessors without data are not used by static meshes
+    const QJsonObject json = accessors[index].toObject();
+    if (json.contains("sparse") || !json.contains("bufferView")) return false;
+
+    accessor.count = json["count"].toInt();
+    accessor.componentType = json["componentType"].toInt();
+    accessor.components = typeComponents(json["type"].toString());
+    accessor.normalized = json["normalized"].toBool();
+    accessor.bufferView = json["bufferView"].toInt(-1);
+    const int elementSize = componentSize(accessor.componentType) * accessor.components;
+    if (elementSize == 0 || accessor.count <= 0) return false;
+
+    const QJsonArray views = context.json["bufferViews"].toArray();
+    if (accessor.bufferView < 0 || accessor.bufferView >= views.size()) return false;
+    const QJsonObject view = views[accessor.bufferView].toObject();
+    const int buffer = view["buffer"].toInt(-1);
+    if (buffer < 0 || buffer >= context.buffers.size()) return false;
+
+    const qint64 viewOffset = qint64(view["byteOffset"].toDouble());
+    const qint64 viewLength = qint64(view["byteLength"].toDouble());
+    const qint64 offset = qint64(json["byteOffset"].toDouble());
+    accessor.stride = view["byteStride"].toInt(elementSize);
+    if (accessor.stride < elementSize) return false;
+
+    // The accessor must lie inside its view, and the view inside its buffer
+    const GltfSpan &span = context.buffers[buffer];
+    if (span.data == nullptr || viewOffset < 0 || viewLength < 0 || viewOffset + viewLength > span.size) return false;
+    if (offset < 0 || offset + qint64(accessor.count - 1) * accessor.stride + elementSize > viewLength) return false;
+
+    accessor.data = span.data + viewOffset + offset;
+    accessor.end = span.data + viewOffset + viewLength;
+    return true;
+}
+
+static float readComponent(const uchar *p, int componentType, bool normalized)
+{
+    switch (componentType)
+    {
+    case GLTF_FLOAT:
+    {
+        float v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case GLTF_UNSIGNED_BYTE:
+        return normalized ? *p / 255.0f : float(*p);
+    case GLTF_BYTE:
+    {
+        const qint8 v = qint8(*p);
+        return normalized ? std::max(v / 127.0f, -1.0f) : float(v);
+    }
+    case GLTF_UNSIGNED_SHORT:
+    {
+        quint16 v;
+        std::memcpy(&v, p, sizeof(v));
+        return normalized ? v / 65535.0f : float(v);
+    }
+    case GLTF_SHORT:
+    {
+        qint16 v;
+        std::memcpy(&v, p, sizeof(v));
+        return normalized ? std::max(v / 32767.0f, -1.0f) : float(v);
+    }
+    }
+    return 0.0f;
+}
+
+// Reads up to n components of an element as floats
+static void readElement(const GltfAccessor &accessor, int i, float *out, int n)
+{
+    const uchar *element = accessor.data + qint64(i) * accessor.stride;
+    const int size = componentSize(accessor.componentType);
+    for (int c = 0; c < std::min(n, accessor.components); ++c) {
+        out[c] = readComponent(element + c * size, accessor.componentType, accessor.normalized);
+    }
+}
+
+static unsigned int readIndex(const GltfAccessor &accessor, int i)
+{
+    const uchar *p = accessor.data + qint64(i) * accessor.stride;
+    if (accessor.componentType == GLTF_UNSIGNED_BYTE) return *p;
+    if (accessor.componentType == GLTF_UNSIGNED_SHORT)
+    {
+        quint16 v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    quint32 v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Smooth normals (area weighted) for primitives that come without them
+static void computeNormals(float *vertices, int stride, int vertexCount, const unsigned int *indices, int indexCount)
+{
+    const int count = (indices != nullptr) ? indexCount : vertexCount;
+    for (int i = 0; i + 2 < count; i += 3)
+    {
+        unsigned int t[3];
+        QVector3D p[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            t[k] = (indices != nullptr) ? indices[i + k] : unsigned(i + k);
+            const float *v = vertices + t[k] * stride;
+            p[k] = QVector3D(v[0], v[1], v[2]);
+        }
+        const QVector3D n = QVector3D::crossProduct(p[1] - p[0], p[2] - p[0]);
+        for (int k = 0; k < 3; ++k)
+        {
+            float *v = vertices + t[k] * stride;
+            v[3] += n.x();
+            v[4] += n.y();
+            v[5] += n.z();
+        }
+    }
+    for (int i = 0; i < vertexCount; ++i)
+    {
+        float *v = vertices + i * stride;
+        const QVector3D n = QVector3D(v[3], v[4], v[5]).normalized();
+        v[3] = n.x();
+        v[4] = n.y();
+        v[5] = n.z();
+    }
+}
+
+// Fills the entry with a triangle primitive. Vertices use the attribute
+// locations of the shaders (see ModelImporter::processMesh()).
+static bool loadPrimitive(GltfContext &context, const QJsonObject &primitive, MeshCache::Entry &entry)
+{
+    if (primitive["mode"].toInt(GLTF_TRIANGLES) != GLTF_TRIANGLES) return false;
+
+    const QJsonObject attributes = primitive["attributes"].toObject();
+    GltfAccessor position, normal, texCoords, tangent;
+    if (!readAccessor(context, attributes["POSITION"].toInt(-1), position) || position.components != 3) return false;
+    const int vertexCount = position.count;
+    const bool hasNormals = readAccessor(context, attributes["NORMAL"].toInt(-1), normal) &&
+            normal.count == vertexCount && normal.components == 3;
+    const bool hasTexCoords = readAccessor(context, attributes["TEXCOORD_0"].toInt(-1), texCoords) &&
+            texCoords.count == vertexCount && texCoords.components == 2;
+    const bool hasTangents = hasNormals && readAccessor(context, attributes["TANGENT"].toInt(-1), tangent) &&
+            tangent.count == vertexCount && tangent.components == 4;
+
+    // Indices: 32-bit ones are used in place, smaller ones are widened
+    if (primitive.contains("indices"))
+    {
+        GltfAccessor accessor;
+        if (!readAccessor(context, primitive["indices"].toInt(-1), accessor) || accessor.components != 1) return false;
+        if (accessor.componentType != GLTF_UNSIGNED_BYTE &&
+                accessor.componentType != GLTF_UNSIGNED_SHORT &&
+                accessor.componentType != GLTF_UNSIGNED_INT) return false;
+
+        entry.indexCount = accessor.count;
+        if (accessor.componentType == GLTF_UNSIGNED_INT && accessor.stride == 4 && (quintptr(accessor.data) & 3) == 0)
+        {
+            entry.indices = reinterpret_cast<const unsigned int *>(accessor.data);
+            context.referencedBytes += entry.indexCount * qint64(sizeof(unsigned int));
+        }
+        else
+        {
+            QByteArray widened(entry.indexCount * int(sizeof(unsigned int)), '\0');
+            unsigned int *out = reinterpret_cast<unsigned int *>(widened.data());
+            for (int i = 0; i < entry.indexCount; ++i) {
+                out[i] = readIndex(accessor, i);
+            }
+            entry.indices = reinterpret_cast<const unsigned int *>(context.file->store(widened));
+            context.copiedBytes += widened.size();
+        }
+
+        // Out of range indices would read past the vertex buffer
+        for (int i = 0; i < entry.indexCount; ++i) {
+            if (entry.indices[i] >= unsigned(vertexCount)) return false;
+        }
+    }
+
+    // In place: position, normal and texture coordinates as floats, one
+    // vertex after the other in the same buffer view. Tangents need the
+    // bitangent computed, and missing normals need to be generated.
+    const GltfAccessor *streams[3] = { &position, &normal, &texCoords };
+    const int streamCount = hasTexCoords ? 3 : 2;
+    bool interleaved = hasNormals && !hasTangents;
+    const uchar *base = position.data;
+    for (int s = 0; interleaved && s < streamCount; ++s)
+    {
+        const GltfAccessor &stream = *streams[s];
+        interleaved = stream.componentType == GLTF_FLOAT && !stream.normalized &&
+                stream.bufferView == position.bufferView && stream.stride == position.stride;
+        base = std::min(base, stream.data);
+    }
+    for (int s = 0; interleaved && s < streamCount; ++s)
+    {
+        const GltfAccessor &stream = *streams[s];
+        interleaved = (stream.data - base) + stream.components * int(sizeof(float)) <= position.stride;
+    }
+    interleaved = interleaved && base + qint64(vertexCount) * position.stride <= position.end;
+
+    if (interleaved)
+    {
+        for (int s = 0; s < streamCount; ++s) {
+            entry.vertexFormat.setVertexAttribute(s, int(streams[s]->data - base), streams[s]->components);
+        }
+        entry.vertexFormat.size = position.stride;
+        entry.vertices = base;
+        entry.vertexBytes = vertexCount * position.stride;
+        context.referencedBytes += entry.vertexBytes;
+    }
+    else
+    {
+        VertexFormat &vertexFormat = entry.vertexFormat;
+        vertexFormat.setVertexAttribute(0, 0, 3);
+        vertexFormat.setVertexAttribute(1, 3 * sizeof(float), 3);
+        if (hasTexCoords)
+        {
+            vertexFormat.setVertexAttribute(2, vertexFormat.size, 2);
+        }
+        if (hasTangents)
+        {
+            vertexFormat.setVertexAttribute(3, vertexFormat.size, 3);
+            vertexFormat.setVertexAttribute(4, vertexFormat.size, 3);
+        }
+
+        const int stride = vertexFormat.size / int(sizeof(float));
+        QByteArray vertices(vertexCount * vertexFormat.size, '\0');
+        float *out = reinterpret_cast<float *>(vertices.data());
+        for (int i = 0; i < vertexCount; ++i)
+        {
+            float *vertex = out + i * stride;
+            readElement(position, i, vertex, 3);
+            if (hasNormals) {
+                readElement(normal, i, vertex + 3, 3);
+            }
+            if (hasTexCoords) {
+                readElement(texCoords, i, vertex + 6, 2);
+            }
+            if (hasTangents)
+            {
+                // The fourth component tells the handedness of the bitangent
+                float t[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+                readElement(tangent, i, t, 4);
+                const QVector3D n(vertex[3], vertex[4], vertex[5]);
+                const QVector3D b = QVector3D::crossProduct(n, QVector3D(t[0], t[1], t[2])) * t[3];
+                float *tangentSpace = vertex + vertexFormat.attribute[3].offset / int(sizeof(float));
+                tangentSpace[0] = t[0];
+                tangentSpace[1] = t[1];
+                tangentSpace[2] = t[2];
+                tangentSpace[3] = b.x();
+                tangentSpace[4] = b.y();
+                tangentSpace[5] = b.z();
+            }
+        }
+        if (!hasNormals) {
+            computeNormals(out, stride, vertexCount, entry.indices, entry.indexCount);
+        }
+
+        entry.vertices = context.file->store(vertices);
+        entry.vertexBytes = vertices.size();
+        context.copiedBytes += vertices.size();
+    }
+
+    // The bounds of positions are mandatory in glTF, but just in case
+    const QJsonObject positionJson = context.json["accessors"].toArray()[attributes["POSITION"].toInt()].toObject();
+    const QJsonArray min = positionJson["min"].toArray();
+    const QJsonArray max = positionJson["max"].toArray();
+    if (min.size() == 3 && max.size() == 3)
+    {
+        entry.bounds.min = QVector3D(float(min[0].toDouble()), float(min[1].toDouble()), float(min[2].toDouble()));
+        entry.bounds.max = QVector3D(float(max[0].toDouble()), float(max[1].toDouble()), float(max[2].toDouble()));
+    }
+    else
+    {
+        for (int i = 0; i < vertexCount; ++i)
+        {
+            float p[3];
+            readElement(position, i, p, 3);
+            entry.bounds.min = QVector3D(qMin(entry.bounds.min.x(), p[0]), qMin(entry.bounds.min.y(), p[1]), qMin(entry.bounds.min.z(), p[2]));
+            entry.bounds.max = QVector3D(qMax(entry.bounds.max.x(), p[0]), qMax(entry.bounds.max.y(), p[1]), qMax(entry.bounds.max.z(), p[2]));
+        }
+    }
+
+    entry.materialIndex = primitive["material"].toInt(-1);
+    return true;
+}
+
+static void loadBuffers(GltfContext &context, const uchar *glbBin, qint64 glbBinSize)
+{
+    for (const QJsonValue &value : context.json["buffers"].toArray())
+    {
+        const QJsonObject buffer = value.toObject();
+        const qint64 length = qint64(buffer["byteLength"].toDouble());
+
+        GltfSpan span;
+        if (!buffer.contains("uri"))
+        {
+            // The binary chunk of a .glb file is the first buffer
+            if (context.buffers.isEmpty())
+            {
+                span.data = glbBin;
+                span.size = glbBinSize;
+            }
+        }
+        else
+        {
+            const QString uri = buffer["uri"].toString();
+            if (uri.startsWith("data:"))
+            {
+                const QByteArray decoded = QByteArray::fromBase64(uri.mid(uri.indexOf(',') + 1).toLatin1());
+                span.data = context.file->store(decoded);
+                span.size = decoded.size();
+            }
+            else
+            {
+                const QString path = context.directory.absoluteFilePath(QUrl::fromPercentEncoding(uri.toUtf8()));
+                span.data = context.file->map(path, span.size);
+            }
+        }
+
+        if (span.data == nullptr || span.size < length)
+        {
+            std::cout << "Could not read buffer " << context.buffers.size() << " of " << context.fileName.toStdString() << std::endl;
+            span = GltfSpan();
+        }
+        context.buffers.push_back(span);
+    }
+}
+
+// Name of the image of a texture for the material descriptions. External
+// images are named by their path, and embedded ones are copied into the
+// model (they are decoded later on the texture loading threads).
+static QString imageName(const GltfContext &context, int textureIndex, ImportedModel *model)
+{
+    const QJsonArray textures = context.json["textures"].toArray();
+    const QJsonArray images = context.json["images"].toArray();
+    if (textureIndex < 0 || textureIndex >= textures.size()) return QString();
+    const int source = textures[textureIndex].toObject()["source"].toInt(-1);
+    if (source < 0 || source >= images.size()) return QString();
+
+    const QJsonObject image = images[source].toObject();
+    const QString uri = image["uri"].toString();
+    if (!uri.isEmpty() && !uri.startsWith("data:")) {
+        return QUrl::fromPercentEncoding(uri.toUtf8());
+    }
+
+    QByteArray encoded;
+    if (!uri.isEmpty())
+    {
+        encoded = QByteArray::fromBase64(uri.mid(uri.indexOf(',') + 1).toLatin1());
+    }
+    else
+    {
+        const QJsonArray views = context.json["bufferViews"].toArray();
+        const int viewIndex = image["bufferView"].toInt(-1);
+        if (viewIndex < 0 || viewIndex >= views.size()) return QString();
+        const QJsonObject view = views[viewIndex].toObject();
+        const int buffer = view["buffer"].toInt(-1);
+        if (buffer < 0 || buffer >= context.buffers.size()) return QString();
+        const GltfSpan &span = context.buffers[buffer];
+        const qint64 offset = qint64(view["byteOffset"].toDouble());
+        const qint64 length = qint64(view["byteLength"].toDouble());
+        if (span.data == nullptr || offset < 0 || length <= 0 || offset + length > span.size) return QString();
+        encoded = QByteArray(reinterpret_cast<const char *>(span.data + offset), int(length));
+    }
+
+    const QString name = QString::fromLatin1("%1#image%2").arg(context.fileName).arg(source);
+    model->embeddedImages.insert(name, encoded);
+    return name;
+}
+
+// Same description as ModelImporter::processMaterial(), from the
+// metallic-roughness model
+static QJsonObject processMaterial(const GltfContext &context, const QJsonObject &material, ImportedModel *model)
+{
+    const QJsonObject pbr = material["pbrMetallicRoughness"].toObject();
+    const QJsonArray baseColor = pbr["baseColorFactor"].toArray();
+    const QJsonArray emissive = material["emissiveFactor"].toArray();
+
+    QJsonObject json;
+    json["name"] = material["name"].toString();
+    json["albedo"] = (baseColor.size() >= 3) ? QJsonArray({ baseColor[0], baseColor[1], baseColor[2] }) : QJsonArray({ 1.0, 1.0, 1.0 });
+    json["emissive"] = (emissive.size() == 3) ? emissive : QJsonArray({ 0.0, 0.0, 0.0 });
+    json["smoothness"] = 1.0 - pbr["roughnessFactor"].toDouble(1.0);
+
+    auto addTexture = [&](const QJsonObject &textureInfo, const char *key) {
+        if (!textureInfo.contains("index")) return;
+        const QString name = imageName(context, textureInfo["index"].toInt(-1), model);
+        if (!name.isEmpty()) {
+            json[key] = name;
+        }
+    };
+    addTexture(pbr["baseColorTexture"].toObject(), "albedoTexture");
+    addTexture(material["emissiveTexture"].toObject(), "emissiveTexture");
+    addTexture(material["normalTexture"].toObject(), "normalsTexture");
+
+    return json;
+}
+
+static void processNode(const GltfContext &context, int index, int parent,
+                        const QVector<QVector<int>> &meshSubmeshes, QVector<bool> &visited,
+                        ImportedModel *model)
+{
+    const QJsonArray nodes = context.json["nodes"].toArray();
+    if (index < 0 || index >= nodes.size() || visited[index]) return;
+    visited[index] = true;
+
+    const QJsonObject json = nodes[index].toObject();
+    ImportedModel::Node node;
+    node.name = json["name"].toString(QString::fromLatin1("Node %1").arg(index));
+    node.parent = parent;
+
+    const QJsonArray matrix = json["matrix"].toArray();
+    if (matrix.size() == 16)
+    {
+        // Column-major in glTF
+        float values[16];
+        for (int i = 0; i < 16; ++i) {
+            values[i] = float(matrix[i].toDouble());
+        }
+        const QMatrix4x4 local = QMatrix4x4(values).transposed();
+        node.position = QVector3D(local.column(3));
+        node.scale = QVector3D(QVector3D(local.column(0)).length(),
+                               QVector3D(local.column(1)).length(),
+                               QVector3D(local.column(2)).length());
+        QMatrix3x3 rotation;
+        for (int c = 0; c < 3; ++c)
+            for (int r = 0; r < 3; ++r)
+                rotation(r, c) = (node.scale[c] != 0.0f) ? local(r, c) / node.scale[c] : 0.0f;
+        node.rotation = QQuaternion::fromRotationMatrix(rotation);
+    }
+    else
+    {
+        const QJsonArray t = json["translation"].toArray();
+        const QJsonArray r = json["rotation"].toArray();
+        const QJsonArray s = json["scale"].toArray();
+        if (t.size() == 3) {
+            node.position = QVector3D(float(t[0].toDouble()), float(t[1].toDouble()), float(t[2].toDouble()));
+        }
+        if (r.size() == 4) { // x, y, z, w
+            node.rotation = QQuaternion(float(r[3].toDouble()), float(r[0].toDouble()), float(r[1].toDouble()), float(r[2].toDouble()));
+        }
+        if (s.size() == 3) {
+            node.scale = QVector3D(float(s[0].toDouble()), float(s[1].toDouble()), float(s[2].toDouble()));
+        }
+    }
+
+    const int mesh = json["mesh"].toInt(-1);
+    if (mesh >= 0 && mesh < meshSubmeshes.size()) {
+        node.submeshes = meshSubmeshes[mesh];
+    }
+
+    const int myIndex = model->nodes.size();
+    model->nodes.push_back(node);
+
+    for (const QJsonValue &child : json["children"].toArray()) {
+        processNode(context, child.toInt(-1), myIndex, meshSubmeshes, visited, model);
+    }
+}
+
+ImportedModel *GltfLoader::load(const QString &path)
+{
+    QFileInfo fileInfo(path);
+
+    GltfContext context;
+    context.directory = fileInfo.dir();
+    context.fileName = fileInfo.fileName();
+    context.file.reset(new GltfFile);
+
+    // .glb: header, JSON chunk and binary chunk, all of them kept mapped
+    QByteArray jsonText;
+    const uchar *bin = nullptr;
+    qint64 binSize = 0;
+    if (fileInfo.suffix().toLower() == "glb")
+    {
+        qint64 size = 0;
+        const uchar *data = context.file->map(path, size);
+        if (data == nullptr) {
+            std::cout << "Could not open file for read: " << path.toStdString() << std::endl;
+            return nullptr;
+        }
+
+        quint32 header[3] = { 0, 0, 0 };
+        if (size >= qint64(sizeof(header))) {
+            std::memcpy(header, data, sizeof(header));
+        }
+        if (header[0] != GLB_MAGIC || header[1] != 2 || header[2] > size) {
+            std::cout << "Not a glTF 2.0 binary file: " << path.toStdString() << std::endl;
+            return nullptr;
+        }
+
+        qint64 offset = sizeof(header);
+        const qint64 end = header[2];
+        while (offset + 8 <= end)
+        {
+            quint32 chunk[2]; // Length and type
+            std::memcpy(chunk, data + offset, sizeof(chunk));
+            offset += sizeof(chunk);
+            if (offset + chunk[0] > end) break;
+
+            if (chunk[1] == GLB_CHUNK_JSON && jsonText.isEmpty()) {
+                jsonText = QByteArray::fromRawData(reinterpret_cast<const char *>(data + offset), int(chunk[0]));
+            } else if (chunk[1] == GLB_CHUNK_BIN && bin == nullptr) {
+                bin = data + offset;
+                binSize = chunk[0];
+            }
+            offset += (chunk[0] + 3) & ~3u;
+        }
+    }
+    else
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            std::cout << "Could not open file for read: " << path.toStdString() << std::endl;
+            return nullptr;
+        }
+        jsonText = file.readAll();
+    }
+
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(jsonText, &error);
+    if (!document.isObject()) {
+        std::cout << "Could not parse " << path.toStdString() << ": " << error.errorString().toStdString() << std::endl;
+        return nullptr;
+    }
+    context.json = document.object();
+    if (!context.json["asset"].toObject()["version"].toString().startsWith("2.")) {
+        std::cout << "Only glTF 2.0 is supported: " << path.toStdString() << std::endl;
+        return nullptr;
+    }
+
+    loadBuffers(context, bin, binSize);
+
+    ImportedModel *model = new ImportedModel;
+    model->filePath = path;
+    model->source = context.file;
+    model->flipTextures = false;
+
+    for (const QJsonValue &material : context.json["materials"].toArray()) {
+        model->materials.append(processMaterial(context, material.toObject(), model));
+    }
+
+    // Every primitive is a submesh, and every mesh the list of its primitives
+    QVector<QVector<int>> meshSubmeshes;
+    int skipped = 0;
+    for (const QJsonValue &mesh : context.json["meshes"].toArray())
+    {
+        QVector<int> submeshes;
+        for (const QJsonValue &primitive : mesh.toObject()["primitives"].toArray())
+        {
+            MeshCache::Entry entry;
+            if (loadPrimitive(context, primitive.toObject(), entry))
+            {
+                submeshes.push_back(model->mappedSubmeshes.size());
+                model->mappedSubmeshes.push_back(entry);
+            }
+            else
+            {
+                skipped++;
+            }
+        }
+        meshSubmeshes.push_back(submeshes);
+    }
+    if (skipped > 0) {
+        std::cout << "Skipped " << skipped << " primitives of " << context.fileName.toStdString()
+                  << " (not triangles, or invalid data)" << std::endl;
+    }
+
+    // The root entity holds the root nodes of the default scene
+    model->nodes.push_back(ImportedModel::Node());
+
+    const QJsonArray nodes = context.json["nodes"].toArray();
+    QVector<bool> visited(nodes.size(), false);
+    const QJsonArray scenes = context.json["scenes"].toArray();
+    const int scene = context.json["scene"].toInt(0);
+    if (scene >= 0 && scene < scenes.size())
+    {
+        for (const QJsonValue &root : scenes[scene].toObject()["nodes"].toArray()) {
+            processNode(context, root.toInt(-1), 0, meshSubmeshes, visited, model);
+        }
+    }
+    else
+    {
+        // No scenes: the nodes that are nobody's children are the roots
+        QVector<bool> isChild(nodes.size(), false);
+        for (const QJsonValue &node : nodes) {
+            for (const QJsonValue &child : node.toObject()["children"].toArray()) {
+                const int index = child.toInt(-1);
+                if (index >= 0 && index < nodes.size()) isChild[index] = true;
+            }
+        }
+        for (int i = 0; i < nodes.size(); ++i) {
+            if (!isChild[i]) processNode(context, i, 0, meshSubmeshes, visited, model);
+        }
+    }
+
+    qInfo("%s: %lld KB of geometry used in place, %lld KB repacked",
+          context.fileName.toLatin1().data(), context.referencedBytes / 1024, context.copiedBytes / 1024);
+
+    return model;
+}
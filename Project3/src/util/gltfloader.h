@@ -0,0 +1,22 @@
+#ifndef GLTFLOADER_H
+#define GLTFLOADER_H
+
+#include <QString>
+
+struct ImportedModel;
+
+// Reader of glTF 2.0 files (.glb and .gltf with .bin buffers) that doesn't
+// go through Assimp. The buffers are memory-mapped, and the primitives whose
+// vertices are interleaved floats (the layout of a VertexFormat) and whose
+// indices are 32-bit are referenced in place until they are uploaded. The
+// other ones are repacked once into the interleaved layout.
+class GltfLoader
+{
+public:
+
+    // Like ModelImporter::load(), it can run on any thread. The model keeps
+    // the node hierarchy of the default scene.
+    static ImportedModel *load(const QString &path);
+};
+
+#endif // GLTFLOADER_H
@@ -0,0 +1,130 @@
+#include "util/ktxfile.h"
+#include <cstring>
+
+
+static const uchar KTX_IDENTIFIER[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+};
+static const quint32 KTX_ENDIANNESS = 0x04030201;
+
+// Fields of the header following the identifier
+struct KtxHeader
+{
+    quint32 endianness;
+    quint32 glType;
+    quint32 glTypeSize;
+    quint32 glFormat;
+    quint32 glInternalFormat;
+    quint32 glBaseInternalFormat;
+    quint32 pixelWidth;
+    quint32 pixelHeight;
+    quint32 pixelDepth;
+    quint32 numberOfArrayElements;
+    quint32 numberOfFaces;
+    quint32 numberOfMipmapLevels;
+    quint32 bytesOfKeyValueData;
+};
+
+KtxFile::KtxFile()
+{ }
+
+KtxFile::~KtxFile()
+{
+    if (mapped != nullptr) {
+        file.unmap(mapped);
+    }
+}
+
+bool KtxFile::map(const QString &path)
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    mapped = file.map(0, file.size());
+    if (mapped == nullptr) return false;
+
+    return parse(mapped, file.size());
+}
+
+bool KtxFile::load(const QByteArray &contents)
+{
+    storage = contents;
+    return parse(reinterpret_cast<const uchar *>(storage.constData()), storage.size());
+}
+
+bool KtxFile::parse(const uchar *data, qint64 size)
+{
+    levels.clear();
+
+    const qint64 headerSize = sizeof(KTX_IDENTIFIER) + sizeof(KtxHeader);
+    if (size < headerSize) return false;
+    if (std::memcmp(data, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)) != 0) return false;
+
+    KtxHeader header;
+    std::memcpy(&header, data + sizeof(KTX_IDENTIFIER), sizeof(KtxHeader));
+
+    // Only files written by build(): native endianness, compressed 2D data
+    if (header.endianness != KTX_ENDIANNESS) return false;
+    if (header.glType != 0 || header.pixelDepth != 0 || header.numberOfFaces != 1) return false;
+    if (header.numberOfMipmapLevels == 0) return false;
+
+    glInternalFormat = header.glInternalFormat;
+    glBaseInternalFormat = header.glBaseInternalFormat;
+    width = int(header.pixelWidth);
+    height = int(header.pixelHeight);
+
+    qint64 offset = headerSize + header.bytesOfKeyValueData;
+    for (quint32 i = 0; i < header.numberOfMipmapLevels; ++i)
+    {
+        if (offset + 4 > size) return false;
+
+        quint32 imageSize = 0;
+        std::memcpy(&imageSize, data + offset, 4);
+        offset += 4;
+        if (offset + imageSize > size) return false;
+
+        Level level;
+        level.data = data + offset;
+        level.size = int(imageSize);
+        level.width = qMax(1, width >> i);
+        level.height = qMax(1, height >> i);
+        levels.push_back(level);
+
+        // Levels are padded to 4 bytes
+        offset += (imageSize + 3) & ~quint32(3);
+    }
+
+    return true;
+}
+
+QByteArray KtxFile::build(quint32 glInternalFormat, quint32 glBaseInternalFormat,
+                          int width, int height, const QVector<QByteArray> &levels)
+{
+    KtxHeader header;
+    header.endianness = KTX_ENDIANNESS;
+    header.glType = 0;     // Compressed
+    header.glTypeSize = 1;
+    header.glFormat = 0;   // Compressed
+    header.glInternalFormat = glInternalFormat;
+    header.glBaseInternalFormat = glBaseInternalFormat;
+    header.pixelWidth = quint32(width);
+    header.pixelHeight = quint32(height);
+    header.pixelDepth = 0;
+    header.numberOfArrayElements = 0;
+    header.numberOfFaces = 1;
+    header.numberOfMipmapLevels = quint32(levels.size());
+    header.bytesOfKeyValueData = 0;
+
+    QByteArray contents;
+    contents.append(reinterpret_cast<const char *>(KTX_IDENTIFIER), sizeof(KTX_IDENTIFIER));
+    contents.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const QByteArray &level : levels)
+    {
+        const quint32 imageSize = quint32(level.size());
+        contents.append(reinterpret_cast<const char *>(&imageSize), 4);
+        contents.append(level);
+        const int padding = int(((imageSize + 3) & ~quint32(3)) - imageSize);
+        contents.append(QByteArray(padding, '\0'));
+    }
+    return contents;
+}
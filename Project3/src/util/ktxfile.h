@@ -0,0 +1,54 @@
+#ifndef KTXFILE_H
+#define KTXFILE_H
+
+#include <QFile>
+#include <QByteArray>
+#include <QVector>
+
+// Reader/writer of KTX 1.1 files holding a single 2D texture with its mip
+// chain. The reader can memory-map the file, so the levels are uploaded
+// straight from the page cache without copies.
+class KtxFile
+{
+public:
+
+    struct Level
+    {
+        const uchar *data;
+        int size;
+        int width;
+        int height;
+    };
+
+    KtxFile();
+    ~KtxFile();
+
+    KtxFile(const KtxFile &) = delete;
+    KtxFile &operator=(const KtxFile &) = delete;
+
+    // Memory-maps an existing file
+    bool map(const QString &path);
+
+    // Takes the contents of a file already in memory
+    bool load(const QByteArray &contents);
+
+    // File contents for the given levels (level 0 first)
+    static QByteArray build(quint32 glInternalFormat, quint32 glBaseInternalFormat,
+                            int width, int height, const QVector<QByteArray> &levels);
+
+    quint32 glInternalFormat = 0;
+    quint32 glBaseInternalFormat = 0;
+    int width = 0;
+    int height = 0;
+    QVector<Level> levels;
+
+private:
+
+    bool parse(const uchar *data, qint64 size);
+
+    QFile file;
+    uchar *mapped = nullptr;
+    QByteArray storage;
+};
+
+#endif // KTXFILE_H
@@ -0,0 +1,256 @@
+#include "util/meshcache.h"
+#include "util/assetcache.h"
+#include <cstring>
+
+
+static const quint32 MESH_CACHE_MAGIC = 0x4853454D; // "MESH"
+static const quint32 MESH_CACHE_VERSION = 6;
+
+// Data blocks start at multiples of 16 bytes
+static int align16(int offset)
+{
+    return (offset + 15) & ~15;
+}
+
+struct MeshCacheHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 entryCount;
+    quint32 descriptionOffset;
+    quint32 descriptionSize;
+};
+
+struct MeshCacheEntry
+{
+    qint32 attributeEnabled[MAX_VERTEX_ATTRIBUTES];
+    qint32 attributeOffset[MAX_VERTEX_ATTRIBUTES];
+    qint32 attributeComponents[MAX_VERTEX_ATTRIBUTES];
+    quint32 attributeType[MAX_VERTEX_ATTRIBUTES];
+    qint32 attributeNormalized[MAX_VERTEX_ATTRIBUTES];
+    qint32 vertexSize;
+    float positionOffset[3];
+    float positionScale[3];
+    float texCoordsOffset[2];
+    float texCoordsScale[2];
+    quint32 verticesOffset;
+    quint32 vertexBytes;
+    quint32 indicesOffset;
+    quint32 indexCount;
+    qint32 lodCount;
+    qint32 lodFirstIndex[MAX_MESH_LODS];
+    qint32 lodIndexCount[MAX_MESH_LODS];
+    quint32 meshletsOffset;
+    quint32 meshletCount;
+    float boundsMin[3];
+    float boundsMax[3];
+    qint32 materialIndex;
+};
+
+struct MeshCacheMeshlet
+{
+    qint32 firstIndex;
+    qint32 indexCount;
+    float center[3];
+    float radius;
+    float coneAxis[3];
+    float coneCutoff;
+};
+
+MeshCache::MeshCache()
+{ }
+
+MeshCache::~MeshCache()
+{
+    if (mapped != nullptr) {
+        file.unmap(mapped);
+    }
+}
+
+bool MeshCache::map(const QString &path)
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    mapped = file.map(0, file.size());
+    if (mapped == nullptr) return false;
+
+    return parse(mapped, file.size());
+}
+
+bool MeshCache::parse(const uchar *data, qint64 size)
+{
+    entries.clear();
+
+    if (size < qint64(sizeof(MeshCacheHeader))) return false;
+
+    MeshCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION) return false;
+
+    const qint64 tableEnd = qint64(sizeof(header)) + qint64(header.entryCount) * qint64(sizeof(MeshCacheEntry));
+    if (tableEnd > size) return false;
+    if (qint64(header.descriptionOffset) + header.descriptionSize > size) return false;
+
+    // Tiny compared to the geometry: copied instead of referenced
+    description = QByteArray(reinterpret_cast<const char *>(data + header.descriptionOffset), int(header.descriptionSize));
+
+    const uchar *table = data + sizeof(header);
+    for (quint32 i = 0; i < header.entryCount; ++i)
+    {
+        MeshCacheEntry stored;
+        std::memcpy(&stored, table + i * sizeof(MeshCacheEntry), sizeof(stored));
+
+        if (qint64(stored.verticesOffset) + stored.vertexBytes > size) return false;
+        if (qint64(stored.indicesOffset) + qint64(stored.indexCount) * 4 > size) return false;
+        if (qint64(stored.meshletsOffset) + qint64(stored.meshletCount) * qint64(sizeof(MeshCacheMeshlet)) > size) return false;
+
+        Entry entry;
+        for (int location = 0; location < MAX_VERTEX_ATTRIBUTES; ++location)
+        {
+            entry.vertexFormat.attribute[location].enabled = stored.attributeEnabled[location] != 0;
+            entry.vertexFormat.attribute[location].offset = stored.attributeOffset[location];
+            entry.vertexFormat.attribute[location].ncomp = stored.attributeComponents[location];
+            entry.vertexFormat.attribute[location].type = GLenum(stored.attributeType[location]);
+            entry.vertexFormat.attribute[location].normalized = stored.attributeNormalized[location] != 0;
+        }
+        entry.vertexFormat.size = stored.vertexSize;
+        entry.vertexFormat.positionOffset = QVector3D(stored.positionOffset[0], stored.positionOffset[1], stored.positionOffset[2]);
+        entry.vertexFormat.positionScale = QVector3D(stored.positionScale[0], stored.positionScale[1], stored.positionScale[2]);
+        entry.vertexFormat.texCoordsOffset = QVector2D(stored.texCoordsOffset[0], stored.texCoordsOffset[1]);
+        entry.vertexFormat.texCoordsScale = QVector2D(stored.texCoordsScale[0], stored.texCoordsScale[1]);
+        entry.vertices = data + stored.verticesOffset;
+        entry.vertexBytes = int(stored.vertexBytes);
+        entry.indices = (stored.indexCount > 0) ? reinterpret_cast<const unsigned int *>(data + stored.indicesOffset) : nullptr;
+        entry.indexCount = int(stored.indexCount);
+        if (stored.lodCount < 0 || stored.lodCount > MAX_MESH_LODS) return false;
+        for (int lod = 0; lod < stored.lodCount; ++lod)
+        {
+            LodLevel level;
+            level.firstIndex = stored.lodFirstIndex[lod];
+            level.indexCount = stored.lodIndexCount[lod];
+            if (level.firstIndex < 0 || level.indexCount < 0 || quint32(level.firstIndex + level.indexCount) > stored.indexCount) return false;
+            entry.lods.push_back(level);
+        }
+        for (quint32 m = 0; m < stored.meshletCount; ++m)
+        {
+            MeshCacheMeshlet storedMeshlet;
+            std::memcpy(&storedMeshlet, data + stored.meshletsOffset + m * sizeof(MeshCacheMeshlet), sizeof(storedMeshlet));
+            if (storedMeshlet.firstIndex < 0 || storedMeshlet.indexCount < 0 ||
+                quint32(storedMeshlet.firstIndex + storedMeshlet.indexCount) > stored.indexCount) return false;
+
+            Meshlet meshlet;
+            meshlet.firstIndex = storedMeshlet.firstIndex;
+            meshlet.indexCount = storedMeshlet.indexCount;
+            meshlet.center = QVector3D(storedMeshlet.center[0], storedMeshlet.center[1], storedMeshlet.center[2]);
+            meshlet.radius = storedMeshlet.radius;
+            meshlet.coneAxis = QVector3D(storedMeshlet.coneAxis[0], storedMeshlet.coneAxis[1], storedMeshlet.coneAxis[2]);
+            meshlet.coneCutoff = storedMeshlet.coneCutoff;
+            entry.meshlets.push_back(meshlet);
+        }
+        entry.bounds.min = QVector3D(stored.boundsMin[0], stored.boundsMin[1], stored.boundsMin[2]);
+        entry.bounds.max = QVector3D(stored.boundsMax[0], stored.boundsMax[1], stored.boundsMax[2]);
+        entry.materialIndex = stored.materialIndex;
+        entries.push_back(entry);
+    }
+
+    return true;
+}
+
+bool MeshCache::write(const QString &path, const QVector<Entry> &entries, const QByteArray &description)
+{
+    const int count = entries.size();
+
+    // Layout: header, entry table, description, then the data of each submesh
+    int offset = int(sizeof(MeshCacheHeader) + count * sizeof(MeshCacheEntry));
+    const int descriptionOffset = offset;
+    offset = align16(offset + description.size());
+
+    QVector<MeshCacheEntry> table(count);
+    for (int i = 0; i < count; ++i)
+    {
+        const Entry &entry = entries[i];
+
+        MeshCacheEntry &stored = table[i];
+        std::memset(&stored, 0, sizeof(stored));
+        for (int location = 0; location < MAX_VERTEX_ATTRIBUTES; ++location)
+        {
+            stored.attributeEnabled[location] = entry.vertexFormat.attribute[location].enabled ? 1 : 0;
+            stored.attributeOffset[location] = entry.vertexFormat.attribute[location].offset;
+            stored.attributeComponents[location] = entry.vertexFormat.attribute[location].ncomp;
+            stored.attributeType[location] = quint32(entry.vertexFormat.attribute[location].type);
+            stored.attributeNormalized[location] = entry.vertexFormat.attribute[location].normalized ? 1 : 0;
+        }
+        stored.vertexSize = entry.vertexFormat.size;
+        for (int c = 0; c < 3; ++c)
+        {
+            stored.positionOffset[c] = entry.vertexFormat.positionOffset[c];
+            stored.positionScale[c] = entry.vertexFormat.positionScale[c];
+        }
+        for (int c = 0; c < 2; ++c)
+        {
+            stored.texCoordsOffset[c] = entry.vertexFormat.texCoordsOffset[c];
+            stored.texCoordsScale[c] = entry.vertexFormat.texCoordsScale[c];
+        }
+        stored.verticesOffset = quint32(offset);
+        stored.vertexBytes = quint32(entry.vertexBytes);
+        offset = align16(offset + entry.vertexBytes);
+        stored.indicesOffset = quint32(offset);
+        stored.indexCount = quint32(entry.indexCount);
+        stored.lodCount = qMin(entry.lods.size(), MAX_MESH_LODS);
+        for (int lod = 0; lod < stored.lodCount; ++lod)
+        {
+            stored.lodFirstIndex[lod] = entry.lods[lod].firstIndex;
+            stored.lodIndexCount[lod] = entry.lods[lod].indexCount;
+        }
+        offset = align16(offset + entry.indexCount * int(sizeof(unsigned int)));
+        stored.meshletsOffset = quint32(offset);
+        stored.meshletCount = quint32(entry.meshlets.size());
+        offset = align16(offset + entry.meshlets.size() * int(sizeof(MeshCacheMeshlet)));
+        for (int c = 0; c < 3; ++c)
+        {
+            stored.boundsMin[c] = entry.bounds.min[c];
+            stored.boundsMax[c] = entry.bounds.max[c];
+        }
+        stored.materialIndex = entry.materialIndex;
+    }
+
+    QByteArray contents(offset, '\0');
+    char *out = contents.data();
+
+    MeshCacheHeader header;
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.entryCount = quint32(count);
+    header.descriptionOffset = quint32(descriptionOffset);
+    header.descriptionSize = quint32(description.size());
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), table.constData(), count * sizeof(MeshCacheEntry));
+    std::memcpy(out + descriptionOffset, description.constData(), size_t(description.size()));
+
+    for (int i = 0; i < count; ++i)
+    {
+        const Entry &entry = entries[i];
+        std::memcpy(out + table[i].verticesOffset, entry.vertices, size_t(entry.vertexBytes));
+        if (entry.indices != nullptr) {
+            std::memcpy(out + table[i].indicesOffset, entry.indices, entry.indexCount * sizeof(unsigned int));
+        }
+        for (int m = 0; m < entry.meshlets.size(); ++m)
+        {
+            const Meshlet &meshlet = entry.meshlets[m];
+            MeshCacheMeshlet stored;
+            stored.firstIndex = meshlet.firstIndex;
+            stored.indexCount = meshlet.indexCount;
+            stored.radius = meshlet.radius;
+            stored.coneCutoff = meshlet.coneCutoff;
+            for (int c = 0; c < 3; ++c)
+            {
+                stored.center[c] = meshlet.center[c];
+                stored.coneAxis[c] = meshlet.coneAxis[c];
+            }
+            std::memcpy(out + table[i].meshletsOffset + m * sizeof(MeshCacheMeshlet), &stored, sizeof(stored));
+        }
+    }
+
+    return AssetCache::write(path, contents);
+}
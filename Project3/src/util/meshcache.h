@@ -0,0 +1,54 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include "resources/mesh.h"
+#include <QFile>
+#include <QByteArray>
+#include <QVector>
+
+// Binary image of an imported model: vertex formats, interleaved vertices,
+// indices, levels of detail, meshlets, bounds and material bindings of every submesh, plus a description
+// of the materials and nodes. The file is read
+// through a memory mapping, and the submeshes point straight into it until
+// their data is uploaded to the GPU.
+class MeshCache : public MeshSource
+{
+public:
+
+    struct Entry
+    {
+        VertexFormat vertexFormat;
+        const unsigned char *vertices = nullptr;
+        int vertexBytes = 0;
+        const unsigned int *indices = nullptr;
+        int indexCount = 0;
+        QVector<LodLevel> lods;
+        QVector<Meshlet> meshlets;
+        Bounds bounds;
+        int materialIndex = -1;
+    };
+
+    MeshCache();
+    ~MeshCache() override;
+
+    MeshCache(const MeshCache &) = delete;
+    MeshCache &operator=(const MeshCache &) = delete;
+
+    // Memory-maps an existing cache file
+    bool map(const QString &path);
+
+    // Stores the given entries (their data is copied into the file)
+    static bool write(const QString &path, const QVector<Entry> &entries, const QByteArray &description);
+
+    QVector<Entry> entries;
+    QByteArray description; // Materials and nodes of the model, stored as is
+
+private:
+
+    bool parse(const uchar *data, qint64 size);
+
+    QFile file;
+    uchar *mapped = nullptr;
+};
+
+#endif // MESHCACHE_H
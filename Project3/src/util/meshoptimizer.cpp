@@ -0,0 +1,604 @@
+#include "util/meshoptimizer.h"
+#include <QVector2D>
+#include <QVector3D>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+
+namespace MeshOptimizer
+{
+
+// LRU cache modelled by the triangle ordering
+static const int VERTEX_CACHE_SIZE = 32;
+
+// FIFO cache used to measure the results (the usual post-transform cache)
+static const int FIFO_CACHE_SIZE = 16;
+
+// Limits of a meshlet
+static const int MAX_MESHLET_VERTICES = 64;
+static const int MAX_MESHLET_TRIANGLES = 124;
+
+static int vertexCount(const ImportedModel::SubMeshData &submesh)
+{
+    return submesh.vertices.size() / (submesh.vertexFormat.size / int(sizeof(float)));
+}
+
+static qint64 cacheMisses(const QVector<unsigned int> &indices, int vertexCount)
+{
+    // Timestamps instead of a queue: a vertex is cached if it was inserted
+    // less than FIFO_CACHE_SIZE misses ago
+    QVector<qint64> insertedAt(vertexCount, -FIFO_CACHE_SIZE - 1);
+    qint64 misses = 0;
+    for (unsigned int index : indices)
+    {
+        if (misses - insertedAt[int(index)] > FIFO_CACHE_SIZE)
+        {
+            insertedAt[int(index)] = misses;
+            misses++;
+        }
+    }
+    return misses;
+}
+
+Statistics analyze(const QVector<ImportedModel::SubMeshData> &submeshes, bool shortIndices)
+{
+    Statistics statistics;
+    for (const ImportedModel::SubMeshData &submesh : submeshes)
+    {
+        const int vertices = vertexCount(submesh);
+        const int indexSize = (shortIndices && vertices <= 65536) ? 2 : 4;
+        const QVector<unsigned int> lod0 = submesh.lods.isEmpty() ? submesh.indices :
+                submesh.indices.mid(0, submesh.lods[0].indexCount);
+        statistics.triangles += lod0.size() / 3;
+        statistics.vertices += vertices;
+        statistics.cacheMisses += cacheMisses(lod0, vertices);
+        statistics.bytes += qint64(submesh.vertices.size()) * int(sizeof(float)) + qint64(submesh.indices.size()) * indexSize;
+    }
+    return statistics;
+}
+
+// Merges the vertices with the same bytes (open addressing hash table)
+static void weldVertices(ImportedModel::SubMeshData &submesh)
+{
+    const int stride = submesh.vertexFormat.size / int(sizeof(float));
+    const int count = vertexCount(submesh);
+    const quint32 *words = reinterpret_cast<const quint32 *>(submesh.vertices.constData());
+
+    int tableSize = 1;
+    while (tableSize < 2 * count) tableSize *= 2;
+    QVector<int> table(tableSize, -1);
+
+    QVector<unsigned int> remap(count);
+    QVector<float> welded;
+    welded.reserve(submesh.vertices.size());
+    for (int v = 0; v < count; ++v)
+    {
+        const quint32 *vertex = words + v * stride;
+        quint32 hash = 2166136261u; // FNV-1a on whole words
+        for (int i = 0; i < stride; ++i) {
+            hash = (hash ^ vertex[i]) * 16777619u;
+        }
+
+        int slot = int(hash & quint32(tableSize - 1));
+        while (table[slot] >= 0)
+        {
+            const int other = table[slot];
+            if (std::memcmp(welded.constData() + other * stride, vertex, size_t(stride) * sizeof(float)) == 0) break;
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (table[slot] < 0)
+        {
+            table[slot] = welded.size() / stride;
+            const float *floats = reinterpret_cast<const float *>(vertex);
+            for (int i = 0; i < stride; ++i) {
+                welded.push_back(floats[i]);
+            }
+        }
+        remap[v] = unsigned(table[slot]);
+    }
+
+    for (unsigned int &index : submesh.indices) {
+        index = remap[int(index)];
+    }
+    submesh.vertices = welded;
+}
+
+static float vertexScore(int cachePosition, int remainingTriangles)
+{
+    if (remainingTriangles == 0) return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        // The vertices of the last triangle get a fixed score, so the next
+        // triangle doesn't just reuse its edge
+        score = (cachePosition < 3) ? 0.75f :
+                std::pow(1.0f - float(cachePosition - 3) / (VERTEX_CACHE_SIZE - 3), 1.5f);
+    }
+
+    // Favour the vertices with few triangles left, to avoid leaving them alone
+    return score + 2.0f / std::sqrt(float(remainingTriangles));
+}
+
+// Tom Forsyth's "Linear-speed vertex cache optimisation"
+void optimizeVertexCache(QVector<unsigned int> &indices, int count)
+{
+    const int triangleCount = indices.size() / 3;
+
+    // Triangles of each vertex
+    QVector<int> remaining(count, 0);
+    for (unsigned int index : indices) {
+        remaining[int(index)]++;
+    }
+    QVector<int> offsets(count + 1, 0);
+    for (int v = 0; v < count; ++v) {
+        offsets[v + 1] = offsets[v] + remaining[v];
+    }
+    QVector<int> adjacency(indices.size());
+    QVector<int> filled = offsets;
+    for (int i = 0; i < indices.size(); ++i) {
+        adjacency[filled[int(indices[i])]++] = i / 3;
+    }
+
+    QVector<int> cachePosition(count, -1);
+    QVector<float> vertexScores(count);
+    for (int v = 0; v < count; ++v) {
+        vertexScores[v] = vertexScore(-1, remaining[v]);
+    }
+    QVector<float> triangleScores(triangleCount);
+    for (int t = 0; t < triangleCount; ++t) {
+        triangleScores[t] = vertexScores[int(indices[3 * t])] + vertexScores[int(indices[3 * t + 1])] + vertexScores[int(indices[3 * t + 2])];
+    }
+    QVector<bool> emitted(triangleCount, false);
+
+    QVector<unsigned int> result;
+    result.reserve(indices.size());
+    int cache[VERTEX_CACHE_SIZE + 3];
+    int cacheCount = 0;
+    int best = -1;
+    int cursor = 0;
+    for (int n = 0; n < triangleCount; ++n)
+    {
+        if (best < 0)
+        {
+            // Dead end: continue with the next triangle in the input order
+            while (emitted[cursor]) cursor++;
+            best = cursor;
+        }
+
+        emitted[best] = true;
+        const unsigned int *triangle = indices.constData() + 3 * best;
+        result << triangle[0] << triangle[1] << triangle[2];
+
+        // The vertices of the triangle go to the front of the cache
+        int newCache[VERTEX_CACHE_SIZE + 3];
+        int newCount = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            newCache[newCount++] = int(triangle[k]);
+            remaining[int(triangle[k])]--;
+        }
+        for (int i = 0; i < cacheCount; ++i)
+        {
+            const int v = cache[i];
+            if (v != int(triangle[0]) && v != int(triangle[1]) && v != int(triangle[2])) {
+                newCache[newCount++] = v;
+            }
+        }
+        for (int i = 0; i < newCount; ++i)
+        {
+            const int v = newCache[i];
+            cachePosition[v] = (i < VERTEX_CACHE_SIZE) ? i : -1;
+            vertexScores[v] = vertexScore(cachePosition[v], remaining[v]);
+        }
+
+        // Rescore the triangles around the cache (including the vertices
+        // that just left it) and take the best one of the cache
+        best = -1;
+        float bestScore = -1.0f;
+        for (int i = 0; i < newCount; ++i)
+        {
+            const int v = newCache[i];
+            for (int a = offsets[v]; a < offsets[v + 1]; ++a)
+            {
+                const int t = adjacency[a];
+                if (emitted[t]) continue;
+                const unsigned int *other = indices.constData() + 3 * t;
+                triangleScores[t] = vertexScores[int(other[0])] + vertexScores[int(other[1])] + vertexScores[int(other[2])];
+                if (i < VERTEX_CACHE_SIZE && triangleScores[t] > bestScore)
+                {
+                    best = t;
+                    bestScore = triangleScores[t];
+                }
+            }
+        }
+
+        cacheCount = std::min(newCount, VERTEX_CACHE_SIZE);
+        std::copy(newCache, newCache + cacheCount, cache);
+    }
+
+    indices = result;
+}
+
+// Splits the cache-optimized order into clusters where the cache restarts
+// (triangles with three misses) and draws first the clusters that face
+// outwards, which are more likely to occlude the rest
+static void optimizeOverdraw(ImportedModel::SubMeshData &submesh)
+{
+    const QVector<unsigned int> &indices = submesh.indices;
+    const int stride = submesh.vertexFormat.size / int(sizeof(float));
+    const float *vertices = submesh.vertices.constData();
+    const int triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+
+    QVector<int> clusterStarts;
+    QVector<qint64> insertedAt(vertexCount(submesh), -FIFO_CACHE_SIZE - 1);
+    qint64 misses = 0;
+    for (int t = 0; t < triangleCount; ++t)
+    {
+        int triangleMisses = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            const int v = int(indices[3 * t + k]);
+            if (misses - insertedAt[v] > FIFO_CACHE_SIZE)
+            {
+                insertedAt[v] = misses++;
+                triangleMisses++;
+            }
+        }
+        if (t == 0 || triangleMisses == 3) {
+            clusterStarts.push_back(t);
+        }
+    }
+    clusterStarts.push_back(triangleCount);
+
+    struct Cluster
+    {
+        int begin, end;
+        QVector3D centroid; // Area weighted
+        QVector3D normal;
+        float area;
+        float sortKey;
+    };
+    QVector<Cluster> clusters;
+    QVector3D meshCentroid;
+    float meshArea = 0.0f;
+    for (int c = 0; c + 1 < clusterStarts.size(); ++c)
+    {
+        Cluster cluster = { clusterStarts[c], clusterStarts[c + 1], QVector3D(), QVector3D(), 0.0f, 0.0f };
+        for (int t = cluster.begin; t < cluster.end; ++t)
+        {
+            QVector3D p[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                const float *v = vertices + indices[3 * t + k] * stride;
+                p[k] = QVector3D(v[0], v[1], v[2]);
+            }
+            const QVector3D n = QVector3D::crossProduct(p[1] - p[0], p[2] - p[0]);
+            const float area = n.length();
+            cluster.centroid += (p[0] + p[1] + p[2]) * (area / 3.0f);
+            cluster.normal += n;
+            cluster.area += area;
+        }
+        meshCentroid += cluster.centroid;
+        meshArea += cluster.area;
+        if (cluster.area > 0.0f) {
+            cluster.centroid /= cluster.area;
+        }
+        clusters.push_back(cluster);
+    }
+    if (meshArea > 0.0f) {
+        meshCentroid /= meshArea;
+    }
+
+    for (Cluster &cluster : clusters) {
+        cluster.sortKey = QVector3D::dotProduct(cluster.centroid - meshCentroid, cluster.normal.normalized());
+    }
+    std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster &a, const Cluster &b) {
+        return a.sortKey > b.sortKey;
+    });
+
+    QVector<unsigned int> result;
+    result.reserve(indices.size());
+    for (const Cluster &cluster : clusters) {
+        for (int i = 3 * cluster.begin; i < 3 * cluster.end; ++i) {
+            result.push_back(indices[i]);
+        }
+    }
+    submesh.indices = result;
+}
+
+// Grows clusters of neighbouring triangles, preferring the ones that add
+// fewer vertices and face like the rest, and reorders the triangles so each
+// cluster is a range of the index buffer
+static void buildMeshlets(ImportedModel::SubMeshData &submesh)
+{
+    const QVector<unsigned int> &indices = submesh.indices;
+    const int stride = submesh.vertexFormat.size / int(sizeof(float));
+    const float *vertices = submesh.vertices.constData();
+    const int count = vertexCount(submesh);
+    const int triangleCount = indices.size() / 3;
+
+    auto position = [&](unsigned int index) {
+        const float *v = vertices + index * stride;
+        return QVector3D(v[0], v[1], v[2]);
+    };
+
+    QVector<QVector3D> normals(triangleCount);
+    for (int t = 0; t < triangleCount; ++t) {
+        normals[t] = QVector3D::normal(position(indices[3 * t]), position(indices[3 * t + 1]), position(indices[3 * t + 2]));
+    }
+
+    // Triangles of each vertex
+    QVector<int> offsets(count + 1, 0);
+    for (unsigned int index : indices) {
+        offsets[int(index) + 1]++;
+    }
+    for (int v = 0; v < count; ++v) {
+        offsets[v + 1] += offsets[v];
+    }
+    QVector<int> adjacency(indices.size());
+    QVector<int> filled = offsets;
+    for (int i = 0; i < indices.size(); ++i) {
+        adjacency[filled[int(indices[i])]++] = i / 3;
+    }
+
+    QVector<bool> emitted(triangleCount, false);
+    QVector<int> meshletOf(count, -1); // Last meshlet that used each vertex
+    QVector<unsigned int> result;
+    result.reserve(indices.size());
+    QVector<Meshlet> meshlets;
+
+    int cursor = 0;
+    while (true)
+    {
+        while (cursor < triangleCount && emitted[cursor]) cursor++;
+        if (cursor == triangleCount) break;
+
+        const int id = meshlets.size();
+        Meshlet meshlet;
+        meshlet.firstIndex = result.size();
+        QVector<int> meshletVertices;
+        QVector<int> candidates;
+        QVector3D normalSum;
+
+        int next = cursor;
+        while (next >= 0)
+        {
+            emitted[next] = true;
+            normalSum += normals[next];
+            for (int k = 0; k < 3; ++k)
+            {
+                const int v = int(indices[3 * next + k]);
+                result.push_back(unsigned(v));
+                if (meshletOf[v] != id)
+                {
+                    meshletOf[v] = id;
+                    meshletVertices.push_back(v);
+                    for (int a = offsets[v]; a < offsets[v + 1]; ++a) {
+                        if (!emitted[adjacency[a]]) candidates.push_back(adjacency[a]);
+                    }
+                }
+            }
+            if ((result.size() - meshlet.firstIndex) / 3 == MAX_MESHLET_TRIANGLES) break;
+
+            // Best neighbour that still fits
+            const QVector3D axis = normalSum.normalized();
+            next = -1;
+            int bestNewVertices = 3;
+            float bestFacing = -2.0f;
+            int kept = 0;
+            for (int c = 0; c < candidates.size(); ++c)
+            {
+                const int t = candidates[c];
+                if (emitted[t]) continue;
+                candidates[kept++] = t;
+
+                int newVertices = 0;
+                for (int k = 0; k < 3; ++k) {
+                    if (meshletOf[int(indices[3 * t + k])] != id) newVertices++;
+                }
+                if (meshletVertices.size() + newVertices > MAX_MESHLET_VERTICES) continue;
+
+                const float facing = QVector3D::dotProduct(normals[t], axis);
+                if (newVertices < bestNewVertices || (newVertices == bestNewVertices && facing > bestFacing))
+                {
+                    next = t;
+                    bestNewVertices = newVertices;
+                    bestFacing = facing;
+                }
+            }
+            candidates.resize(kept);
+        }
+
+        meshlet.indexCount = result.size() - meshlet.firstIndex;
+
+        // Bounding sphere around the center of the box
+        QVector3D min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for (int v : meshletVertices)
+        {
+            const QVector3D p = position(unsigned(v));
+            for (int c = 0; c < 3; ++c)
+            {
+                min[c] = qMin(min[c], p[c]);
+                max[c] = qMax(max[c], p[c]);
+            }
+        }
+        meshlet.center = (min + max) * 0.5f;
+        for (int v : meshletVertices) {
+            meshlet.radius = qMax(meshlet.radius, (position(unsigned(v)) - meshlet.center).length());
+        }
+
+        // Normal cone: with normals spread over a hemisphere or more, some
+        // triangle always faces the camera
+        meshlet.coneAxis = normalSum.normalized();
+        float minDot = 1.0f;
+        for (int i = meshlet.firstIndex; i < result.size(); i += 3)
+        {
+            const QVector3D n = QVector3D::normal(position(result[i]), position(result[i + 1]), position(result[i + 2]));
+            if (!n.isNull()) minDot = qMin(minDot, QVector3D::dotProduct(n, meshlet.coneAxis));
+        }
+        meshlet.coneCutoff = (meshlet.coneAxis.isNull() || minDot <= 0.1f) ? 2.0f : std::sqrt(1.0f - minDot * minDot);
+
+        meshlets.push_back(meshlet);
+    }
+
+    submesh.indices = result;
+    submesh.meshlets = meshlets;
+}
+
+// Renumbers the vertices in the order the indices use them (and drops the
+// unused ones)
+static void optimizeVertexFetch(ImportedModel::SubMeshData &submesh)
+{
+    const int stride = submesh.vertexFormat.size / int(sizeof(float));
+    QVector<int> remap(vertexCount(submesh), -1);
+    QVector<float> vertices;
+    vertices.reserve(submesh.vertices.size());
+    for (unsigned int &index : submesh.indices)
+    {
+        int &newIndex = remap[int(index)];
+        if (newIndex < 0)
+        {
+            newIndex = vertices.size() / stride;
+            const float *vertex = submesh.vertices.constData() + index * stride;
+            for (int i = 0; i < stride; ++i) {
+                vertices.push_back(vertex[i]);
+            }
+        }
+        index = unsigned(newIndex);
+    }
+    submesh.vertices = vertices;
+}
+
+static quint16 unorm16(float value)
+{
+    return quint16(std::lround(qBound(0.0f, value, 1.0f) * 65535.0f));
+}
+
+// Signed normalized 10_10_10_2 (x in the lowest bits)
+static quint32 snorm1010102(float x, float y, float z, float w)
+{
+    auto snorm10 = [](float value) {
+        return quint32(int(std::lround(qBound(-1.0f, value, 1.0f) * 511.0f)) & 0x3FF);
+    };
+    const quint32 sign = (w < 0.0f) ? 0x2u : 0x1u; // -2 and 1 both decode to -1 and 1
+    return snorm10(x) | (snorm10(y) << 10) | (snorm10(z) << 20) | (sign << 30);
+}
+
+void quantize(ImportedModel::SubMeshData &submesh)
+{
+    const VertexFormat &source = submesh.vertexFormat;
+    if (source.size == 0 || source.attribute[0].type != GL_FLOAT) return;
+
+    const int stride = source.size / int(sizeof(float));
+    const int count = vertexCount(submesh);
+    const float *vertices = submesh.vertices.constData();
+    const bool hasTexCoords = source.attribute[2].enabled;
+    const bool hasTangentSpace = source.attribute[3].enabled && source.attribute[4].enabled;
+    const int normal = source.attribute[1].offset / int(sizeof(float));
+    const int texCoords = source.attribute[2].offset / int(sizeof(float));
+    const int tangent = source.attribute[3].offset / int(sizeof(float));
+    const int bitangent = source.attribute[4].offset / int(sizeof(float));
+
+    // Ranges of the positions and texture coordinates
+    QVector3D positionMin(FLT_MAX, FLT_MAX, FLT_MAX), positionMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    QVector2D texCoordsMin(FLT_MAX, FLT_MAX), texCoordsMax(-FLT_MAX, -FLT_MAX);
+    for (int v = 0; v < count; ++v)
+    {
+        const float *vertex = vertices + v * stride;
+        for (int c = 0; c < 3; ++c)
+        {
+            positionMin[c] = qMin(positionMin[c], vertex[c]);
+            positionMax[c] = qMax(positionMax[c], vertex[c]);
+        }
+        for (int c = 0; hasTexCoords && c < 2; ++c)
+        {
+            texCoordsMin[c] = qMin(texCoordsMin[c], vertex[texCoords + c]);
+            texCoordsMax[c] = qMax(texCoordsMax[c], vertex[texCoords + c]);
+        }
+    }
+    if (count == 0) return;
+
+    VertexFormat format;
+    format.setVertexAttribute(0, 0, 3, GL_UNSIGNED_SHORT, true);
+    format.size += 2; // Keeps the next attributes 4-byte aligned
+    format.setVertexAttribute(1, format.size, 4, GL_INT_2_10_10_10_REV, true);
+    if (hasTangentSpace) {
+        format.setVertexAttribute(3, format.size, 4, GL_INT_2_10_10_10_REV, true);
+    }
+    if (hasTexCoords) {
+        format.setVertexAttribute(2, format.size, 2, GL_UNSIGNED_SHORT, true);
+    }
+    format.positionOffset = positionMin;
+    format.positionScale = positionMax - positionMin;
+    if (hasTexCoords)
+    {
+        format.texCoordsOffset = texCoordsMin;
+        format.texCoordsScale = texCoordsMax - texCoordsMin;
+    }
+
+    // Reciprocals of the ranges (flat axes store zeros)
+    float positionFactor[3], texCoordsFactor[2] = { 0.0f, 0.0f };
+    for (int c = 0; c < 3; ++c) {
+        positionFactor[c] = (format.positionScale[c] > 0.0f) ? 1.0f / format.positionScale[c] : 0.0f;
+    }
+    for (int c = 0; hasTexCoords && c < 2; ++c) {
+        texCoordsFactor[c] = (format.texCoordsScale[c] > 0.0f) ? 1.0f / format.texCoordsScale[c] : 0.0f;
+    }
+
+    // The vertex size is a multiple of 4, so the result still fits a QVector<float>
+    QVector<float> packed(count * format.size / int(sizeof(float)));
+    uchar *out = reinterpret_cast<uchar *>(packed.data());
+    for (int v = 0; v < count; ++v, out += format.size)
+    {
+        const float *vertex = vertices + v * stride;
+
+        quint16 position[4] = { 0, 0, 0, 0 };
+        for (int c = 0; c < 3; ++c) {
+            position[c] = unorm16((vertex[c] - positionMin[c]) * positionFactor[c]);
+        }
+        std::memcpy(out, position, sizeof(position));
+
+        const quint32 packedNormal = snorm1010102(vertex[normal], vertex[normal + 1], vertex[normal + 2], 1.0f);
+        std::memcpy(out + format.attribute[1].offset, &packedNormal, sizeof(packedNormal));
+
+        if (hasTangentSpace)
+        {
+            const QVector3D n(vertex[normal], vertex[normal + 1], vertex[normal + 2]);
+            const QVector3D t(vertex[tangent], vertex[tangent + 1], vertex[tangent + 2]);
+            const QVector3D b(vertex[bitangent], vertex[bitangent + 1], vertex[bitangent + 2]);
+            const float handedness = QVector3D::dotProduct(QVector3D::crossProduct(n, t), b);
+            const quint32 packedTangent = snorm1010102(t.x(), t.y(), t.z(), handedness);
+            std::memcpy(out + format.attribute[3].offset, &packedTangent, sizeof(packedTangent));
+        }
+
+        if (hasTexCoords)
+        {
+            const quint16 uv[2] = {
+                unorm16((vertex[texCoords] - texCoordsMin[0]) * texCoordsFactor[0]),
+                unorm16((vertex[texCoords + 1] - texCoordsMin[1]) * texCoordsFactor[1])
+            };
+            std::memcpy(out + format.attribute[2].offset, uv, sizeof(uv));
+        }
+    }
+
+    submesh.vertexFormat = format;
+    submesh.vertices = packed;
+}
+
+void optimize(ImportedModel::SubMeshData &submesh)
+{
+    if (submesh.indices.isEmpty() || submesh.vertexFormat.size == 0) return;
+    if (submesh.vertexFormat.attribute[0].type != GL_FLOAT) return; // Already quantized
+
+    weldVertices(submesh);
+    optimizeVertexCache(submesh.indices, vertexCount(submesh));
+    optimizeOverdraw(submesh);
+    buildMeshlets(submesh);
+    optimizeVertexFetch(submesh);
+}
+
+} // namespace MeshOptimizer
@@ -0,0 +1,53 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include "util/modelimporter.h"
+
+// Offline optimization of imported geometry, run once before the result is
+// stored in the mesh cache:
+// - identical vertices are welded
+// - triangles are reordered for the post-transform vertex cache (Forsyth),
+//   and then in clusters sorted to reduce overdraw
+// - triangles are grouped in meshlets (up to 124 triangles and 64
+//   vertices) with bounds for cluster culling
+// - vertices are reordered in the order they are first used, so the
+//   vertex fetch reads memory sequentially
+// - vertices are quantized into a packed format (see quantize())
+// Submeshes with up to 65536 vertices are drawn with 16-bit indices (see
+// SubMesh::update()).
+namespace MeshOptimizer
+{
+
+// Post-transform cache and memory figures of some submeshes (the cache
+// figures of their full detail level)
+struct Statistics
+{
+    qint64 triangles = 0;
+    qint64 vertices = 0;
+    qint64 cacheMisses = 0; // In a 16 entry FIFO cache
+    qint64 bytes = 0;       // Vertices plus indices
+
+    double acmr() const { return triangles > 0 ? double(cacheMisses) / triangles : 0.0; } // Misses per triangle
+    double atvr() const { return vertices > 0 ? double(cacheMisses) / vertices : 0.0; }   // Misses per vertex
+};
+
+Statistics analyze(const QVector<ImportedModel::SubMeshData> &submeshes, bool shortIndices);
+
+void optimize(ImportedModel::SubMeshData &submesh);
+
+// Reorders the triangles of an index list for the post-transform cache
+void optimizeVertexCache(QVector<unsigned int> &indices, int vertexCount);
+
+// Packs the float vertices (56 bytes with tangent space) into 20 bytes:
+// - position: unorm16 x3 relative to the submesh bounds, plus padding
+// - normal: snorm 10_10_10_2
+// - tangent: snorm 10_10_10_2, with the bitangent sign in w (the bitangent
+//   is rebuilt in the vertex shader)
+// - texture coordinates: unorm16 x2 relative to their own range
+// The decoding ranges are stored in the vertex format. It has to be the
+// last step, the rest of the processing works with floats.
+void quantize(ImportedModel::SubMeshData &submesh);
+
+} // namespace MeshOptimizer
+
+#endif // MESHOPTIMIZER_H
@@ -0,0 +1,345 @@
+#include "util/meshsimplifier.h"
+#include "util/meshoptimizer.h"
+#include <QHash>
+#include <QVector3D>
+#include <algorithm>
+#include <queue>
+
+
+namespace MeshSimplifier
+{
+
+// Smallest level worth generating
+static const int MIN_LOD_TRIANGLES = 64;
+
+// A level has to remove at least 20% of the previous one (with many locked
+// vertices the simplification gets stuck)
+static const float MAX_LOD_RATIO = 0.8f;
+
+// Collapses can't turn the normal of a triangle more than ~78 degrees
+static const float MIN_NORMAL_DOT = 0.2f;
+
+// Sum of squared distances to a set of planes (symmetric 4x4 matrix)
+struct Quadric
+{
+    double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+    double b2 = 0.0, bc = 0.0, bd = 0.0;
+    double c2 = 0.0, cd = 0.0;
+    double d2 = 0.0;
+
+    void addPlane(const QVector3D &n, double d)
+    {
+        const double a = n.x(), b = n.y(), c = n.z();
+        a2 += a * a; ab += a * b; ac += a * c; ad += a * d;
+        b2 += b * b; bc += b * c; bd += b * d;
+        c2 += c * c; cd += c * d;
+        d2 += d * d;
+    }
+
+    void operator+=(const Quadric &q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+        b2 += q.b2; bc += q.bc; bd += q.bd;
+        c2 += q.c2; cd += q.cd;
+        d2 += q.d2;
+    }
+
+    double error(const QVector3D &p) const
+    {
+        const double x = p.x(), y = p.y(), z = p.z();
+        return a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x
+             + b2 * y * y + 2.0 * bc * y * z + 2.0 * bd * y
+             + c2 * z * z + 2.0 * cd * z
+             + d2;
+    }
+};
+
+// Moves the vertex 'from' onto 'to'. The versions detect the queued
+// collapses whose quadrics have changed since.
+struct Collapse
+{
+    double cost;
+    int from, to;
+    int fromVersion, toVersion;
+
+    bool operator<(const Collapse &other) const { return cost > other.cost; } // Cheapest first
+};
+
+class Simplifier
+{
+public:
+
+    explicit Simplifier(const ImportedModel::SubMeshData &submesh);
+
+    // Collapses edges until there are targetTriangles left, or no valid collapse
+    void simplifyTo(int targetTriangles);
+
+    int triangleCount() const { return liveTriangles; }
+    QVector<unsigned int> indices() const;
+
+private:
+
+    void queueCollapse(int from, int to);
+    bool canCollapse(int from, int to) const;
+    void collapse(int from, int to);
+    QVector3D triangleNormal(int t, int moved, const QVector3D &position) const;
+
+    QVector<QVector3D> positions;
+    QVector<unsigned int> triangles;
+    QVector<bool> alive;
+    int liveTriangles = 0;
+
+    QVector<QVector<int>> vertexTriangles;
+    QVector<Quadric> quadrics;
+    QVector<bool> locked;
+    QVector<bool> removed;
+    QVector<int> versions;
+
+    std::priority_queue<Collapse> queue;
+};
+
+Simplifier::Simplifier(const ImportedModel::SubMeshData &submesh)
+{
+    const int stride = submesh.vertexFormat.size / int(sizeof(float));
+    const int vertexCount = submesh.vertices.size() / stride;
+    const int triangleCount = (submesh.lods.isEmpty() ? submesh.indices.size() : submesh.lods[0].indexCount) / 3;
+
+    positions.resize(vertexCount);
+    for (int v = 0; v < vertexCount; ++v)
+    {
+        const float *p = submesh.vertices.constData() + v * stride;
+        positions[v] = QVector3D(p[0], p[1], p[2]);
+    }
+
+    triangles = submesh.indices.mid(0, 3 * triangleCount);
+    alive.fill(true, triangleCount);
+    liveTriangles = triangleCount;
+
+    vertexTriangles.resize(vertexCount);
+    quadrics.resize(vertexCount);
+    locked.fill(false, vertexCount);
+    removed.fill(false, vertexCount);
+    versions.fill(0, vertexCount);
+
+    // Edges used by a single triangle (borders and seams) or by more than
+    // two (non-manifold) lock their vertices
+    QHash<quint64, int> edgeUses;
+    for (int t = 0; t < triangleCount; ++t)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            const quint32 a = triangles[3 * t + k];
+            const quint32 b = triangles[3 * t + (k + 1) % 3];
+            edgeUses[(quint64(qMin(a, b)) << 32) | qMax(a, b)]++;
+        }
+    }
+    for (auto it = edgeUses.constBegin(); it != edgeUses.constEnd(); ++it)
+    {
+        if (it.value() != 2)
+        {
+            locked[int(it.key() >> 32)] = true;
+            locked[int(it.key() & 0xFFFFFFFFu)] = true;
+        }
+    }
+
+    for (int t = 0; t < triangleCount; ++t)
+    {
+        const QVector3D &p0 = positions[int(triangles[3 * t])];
+        const QVector3D normal = QVector3D::normal(p0, positions[int(triangles[3 * t + 1])], positions[int(triangles[3 * t + 2])]);
+        for (int k = 0; k < 3; ++k)
+        {
+            const int v = int(triangles[3 * t + k]);
+            vertexTriangles[v].push_back(t);
+            if (!normal.isNull()) {
+                quadrics[v].addPlane(normal, -QVector3D::dotProduct(normal, p0));
+            }
+        }
+    }
+
+    for (int t = 0; t < triangleCount; ++t)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            const int a = int(triangles[3 * t + k]);
+            const int b = int(triangles[3 * t + (k + 1) % 3]);
+            queueCollapse(a, b);
+            queueCollapse(b, a);
+        }
+    }
+}
+
+void Simplifier::queueCollapse(int from, int to)
+{
+    if (locked[from] || from == to) return;
+
+    Quadric quadric = quadrics[from];
+    quadric += quadrics[to];
+    queue.push({ quadric.error(positions[to]), from, to, versions[from], versions[to] });
+}
+
+QVector3D Simplifier::triangleNormal(int t, int moved, const QVector3D &position) const
+{
+    QVector3D p[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        const int v = int(triangles[3 * t + k]);
+        p[k] = (v == moved) ? position : positions[v];
+    }
+    return QVector3D::crossProduct(p[1] - p[0], p[2] - p[0]);
+}
+
+bool Simplifier::canCollapse(int from, int to) const
+{
+    // The vertices have to share an edge, and only the two triangles on it
+    // (otherwise the collapse would pinch the surface)
+    QVector<int> fromNeighbours, toNeighbours;
+    for (int t : vertexTriangles[from])
+    {
+        if (!alive[t]) continue;
+        for (int k = 0; k < 3; ++k)
+        {
+            const int v = int(triangles[3 * t + k]);
+            if (v != from && !fromNeighbours.contains(v)) fromNeighbours.push_back(v);
+        }
+    }
+    if (!fromNeighbours.contains(to)) return false;
+    for (int t : vertexTriangles[to])
+    {
+        if (!alive[t]) continue;
+        for (int k = 0; k < 3; ++k)
+        {
+            const int v = int(triangles[3 * t + k]);
+            if (v != to && !toNeighbours.contains(v)) toNeighbours.push_back(v);
+        }
+    }
+    int shared = 0;
+    for (int v : fromNeighbours) {
+        if (toNeighbours.contains(v)) shared++;
+    }
+    if (shared > 2) return false;
+
+    // The triangles that stay can't flip or degenerate
+    for (int t : vertexTriangles[from])
+    {
+        if (!alive[t]) continue;
+        const unsigned int *triangle = triangles.constData() + 3 * t;
+        if (int(triangle[0]) == to || int(triangle[1]) == to || int(triangle[2]) == to) continue;
+
+        const QVector3D before = triangleNormal(t, -1, QVector3D());
+        const QVector3D after = triangleNormal(t, from, positions[to]);
+        if (after.isNull()) return false;
+        if (QVector3D::dotProduct(before.normalized(), after.normalized()) < MIN_NORMAL_DOT) return false;
+    }
+    return true;
+}
+
+void Simplifier::collapse(int from, int to)
+{
+    for (int t : vertexTriangles[from])
+    {
+        if (!alive[t]) continue;
+        unsigned int *triangle = triangles.data() + 3 * t;
+        if (int(triangle[0]) == to || int(triangle[1]) == to || int(triangle[2]) == to)
+        {
+            alive[t] = false;
+            liveTriangles--;
+            continue;
+        }
+        for (int k = 0; k < 3; ++k) {
+            if (int(triangle[k]) == from) triangle[k] = unsigned(to);
+        }
+        vertexTriangles[to].push_back(t);
+    }
+    vertexTriangles[from].clear();
+    removed[from] = true;
+
+    quadrics[to] += quadrics[from];
+    versions[to]++;
+
+    // Drop the dead triangles, and queue again the edges around the vertex
+    QVector<int> &around = vertexTriangles[to];
+    around.erase(std::remove_if(around.begin(), around.end(), [this](int t) { return !alive[t]; }), around.end());
+    for (int t : around)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            const int v = int(triangles[3 * t + k]);
+            if (v == to) continue;
+            queueCollapse(v, to);
+            queueCollapse(to, v);
+        }
+    }
+}
+
+void Simplifier::simplifyTo(int targetTriangles)
+{
+    while (liveTriangles > targetTriangles && !queue.empty())
+    {
+        const Collapse collapse = queue.top();
+        queue.pop();
+
+        if (removed[collapse.from] || removed[collapse.to]) continue;
+        if (collapse.fromVersion != versions[collapse.from] || collapse.toVersion != versions[collapse.to]) continue;
+        if (!canCollapse(collapse.from, collapse.to)) continue;
+
+        this->collapse(collapse.from, collapse.to);
+    }
+}
+
+QVector<unsigned int> Simplifier::indices() const
+{
+    QVector<unsigned int> result;
+    result.reserve(3 * liveTriangles);
+    for (int t = 0; t < alive.size(); ++t)
+    {
+        if (alive[t]) {
+            result << triangles[3 * t] << triangles[3 * t + 1] << triangles[3 * t + 2];
+        }
+    }
+    return result;
+}
+
+void generateLods(ImportedModel::SubMeshData &submesh)
+{
+    if (submesh.indices.isEmpty() || submesh.vertexFormat.size == 0) return;
+    if (submesh.vertexFormat.attribute[0].type != GL_FLOAT || !submesh.lods.isEmpty()) return;
+
+    const int triangleCount = submesh.indices.size() / 3;
+    if (triangleCount < 2 * MIN_LOD_TRIANGLES) return;
+
+    const int vertexCount = submesh.vertices.size() / (submesh.vertexFormat.size / int(sizeof(float)));
+
+    QVector<unsigned int> indices = submesh.indices;
+    QVector<LodLevel> lods(1);
+    lods[0].indexCount = indices.size();
+
+    // Every level continues the simplification of the previous one
+    Simplifier simplifier(submesh);
+    int previousCount = triangleCount;
+    for (int lod = 1; lod < MAX_MESH_LODS; ++lod)
+    {
+        const int target = triangleCount >> lod;
+        if (target < MIN_LOD_TRIANGLES) break;
+
+        simplifier.simplifyTo(target);
+        if (simplifier.triangleCount() > previousCount * MAX_LOD_RATIO) break;
+        previousCount = simplifier.triangleCount();
+
+        QVector<unsigned int> levelIndices = simplifier.indices();
+        MeshOptimizer::optimizeVertexCache(levelIndices, vertexCount);
+
+        LodLevel level;
+        level.firstIndex = indices.size();
+        level.indexCount = levelIndices.size();
+        lods.push_back(level);
+        indices += levelIndices;
+    }
+
+    if (lods.size() > 1)
+    {
+        submesh.indices = indices;
+        submesh.lods = lods;
+    }
+}
+
+} // namespace MeshSimplifier
@@ -0,0 +1,23 @@
+#ifndef MESHSIMPLIFIER_H
+#define MESHSIMPLIFIER_H
+
+#include "util/modelimporter.h"
+
+// Levels of detail of imported geometry, generated once before the model is
+// stored in the mesh cache. The triangles are simplified with edge
+// collapses ordered by quadric error (Garland & Heckbert). The collapses
+// move a vertex onto one of its neighbours, so the levels only need new
+// indices over the same vertices. Vertices on open edges are locked: UV and
+// normal seams were split into separate vertices at import, so this keeps
+// the seams (and the borders of the chunks) closed.
+namespace MeshSimplifier
+{
+
+// Fills submesh.lods, appending the indices of up to MAX_MESH_LODS - 1
+// coarser levels (half the triangles each) after the full detail ones.
+// Submeshes too small to be worth it keep a single level.
+void generateLods(ImportedModel::SubMeshData &submesh);
+
+} // namespace MeshSimplifier
+
+#endif // MESHSIMPLIFIER_H
@@ -5,12 +5,26 @@
 #include "resources/texture.h"
 #include "ecs/scene.h"
 #include "globals.h"
+#include "util/assetcache.h"
+#include "util/meshcache.h"
+#include "util/gltfloader.h"
+#include "util/objloader.h"
+#include "util/meshoptimizer.h"
+#include "util/meshsimplifier.h"
+#include "util/vertexkernels.h"
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QtConcurrent>
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <algorithm>
 #include <iostream>
+#include <numeric>
 
 
 ModelImporter::ModelImporter()
@@ -23,126 +37,614 @@ ModelImporter::~ModelImporter()
 
 }
 
-Entity* ModelImporter::import(const QString &path)
+// Post-processing applied by Assimp (part of the mesh cache key)
+static const unsigned int IMPORT_FLAGS =
+        aiProcess_Triangulate |
+        aiProcess_GenSmoothNormals |
+        aiProcess_OptimizeMeshes |
+        aiProcess_CalcTangentSpace;
+
+static unsigned int importFlags(ImportMode mode)
 {
-    Assimp::Importer import;
+    // The hierarchy keeps the node transforms out of the vertices
+    if (mode == ImportMode::HierarchyImport) return IMPORT_FLAGS;
+    return IMPORT_FLAGS | aiProcess_PreTransformVertices;
+}
+
+// Target size of the pieces of ChunkedImport
+static const int TRIANGLES_PER_CHUNK = 16384;
+
+// Other flags
+// - aiProcess_JoinIdenticalVertices, aiProcess_ImproveCacheLocality (done by MeshOptimizer)
+// - aiProcess_SortByPType
+// - aiProcess_RemoveRedundantMaterials
+// - https://www.ics.com/blog/qt-and-opengl-loading-3d-model-open-asset-import-library-assimp
+
+// Material libraries referenced by an OBJ file (mtllib), which both parsers
+// read next to the model. Their materials end up in the cache entry too.
+static QStringList materialLibraries(const QString &path)
+{
+    QStringList libraries;
+    if (!path.endsWith(".obj", Qt::CaseInsensitive)) return libraries;
 
     QFile file(path);
-    if (!file.open(QIODevice::ReadOnly)) {
-        std::cout << "Could not open file for read: " << path.toStdString() << std::endl;
-        return nullptr;
+    if (!file.open(QIODevice::ReadOnly)) return libraries;
+
+    const QDir directory = QFileInfo(path).dir();
+    while (!file.atEnd())
+    {
+        const QByteArray line = file.readLine().trimmed();
+        if (!line.startsWith("mtllib")) continue;
+
+        // The whole line is a name for ObjLoader, a list of names for Assimp
+        const QString names = QString::fromUtf8(line.mid(6)).trimmed();
+        if (QFileInfo::exists(directory.absoluteFilePath(names))) {
+            libraries << directory.absoluteFilePath(names);
+            continue;
+        }
+        for (const QString &name : names.split(' ', Qt::SkipEmptyParts)) {
+            libraries << directory.absoluteFilePath(name);
+        }
     }
+    return libraries;
+}
 
-    QFileInfo fileInfo(file);
-
-#if 0
-    QByteArray data = file.readAll();
-
-    const aiScene *scene = import.ReadFileFromMemory(
-                data.data(), data.size(),
-                aiProcess_Triangulate |
-                aiProcess_GenSmoothNormals |
-                aiProcess_OptimizeMeshes |
-                aiProcess_PreTransformVertices |
-                aiProcess_ImproveCacheLocality |
-                aiProcess_CalcTangentSpace,
-                fileInfo.suffix().toLatin1());
-#else
-    const aiScene *scene = import.ReadFile(
-                path.toStdString(),
-                aiProcess_Triangulate |
-                aiProcess_GenSmoothNormals |
-                aiProcess_OptimizeMeshes |
-                aiProcess_PreTransformVertices |
-                aiProcess_ImproveCacheLocality |
-                aiProcess_CalcTangentSpace);
-#endif
-
-    // Other flags
-    // - aiProcess_JoinIdenticalVertices
-    // - aiProcess_SortByPType
-    // - aiProcess_RemoveRedundantMaterials
-    // - https://www.ics.com/blog/qt-and-opengl-loading-3d-model-open-asset-import-library-assimp
+static QString meshCachePath(const QString &path, ImportMode mode, bool objParser)
+{
+    const QByteArray fileHash = AssetCache::hashFile(path);
+    if (fileHash.isEmpty()) return QString();
 
-    if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(fileHash);
+    for (const QString &library : materialLibraries(path))
     {
-        std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
-        return nullptr;
+        // Missing libraries hash as empty, so adding them later also counts
+        hash.addData(QFileInfo(library).fileName().toUtf8());
+        hash.addData(AssetCache::hashFile(library));
     }
+    hash.addData(QByteArray::number(importFlags(mode)));
+    hash.addData(QByteArray::number(int(mode)));
+    hash.addData(objParser ? "obj" : "assimp");
+    return AssetCache::filePath("meshes", hash.result(), "mesh");
+}
 
-    // Used to find material files
-    directory = fileInfo.path();
+static QColor colorFromJson(const QJsonValue &value)
+{
+    const QJsonArray a = value.toArray();
+    return QColor::fromRgbF(a[0].toDouble(), a[1].toDouble(), a[2].toDouble());
+}
 
-    // Create a list of materials
-    QVector<Material*> myMaterials(scene->mNumMaterials, nullptr);
-    QVector<Material*> mySubmeshMaterials(1024, nullptr);
-    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+// Material descriptions hold texture paths relative to the model file, or
+// the names of images embedded in it
+static void materialFromJson(const QJsonObject &json, const ImportedModel &model, Material *material)
+{
+    const QDir directory = QFileInfo(model.filePath).dir();
+
+    material->name = json["name"].toString();
+    if (json.contains("albedo")) material->albedo = colorFromJson(json["albedo"]);
+    if (json.contains("emissive")) material->emissive = colorFromJson(json["emissive"]);
+    if (json.contains("smoothness")) material->smoothness = float(json["smoothness"].toDouble());
+
+    auto loadTexture = [&](const char *key, TextureUsage usage) -> Texture * {
+        if (!json.contains(key)) return nullptr;
+        const QString name = json[key].toString();
+        return resourceManager->loadTexture(directory.absoluteFilePath(name), usage,
+                                            model.embeddedImages.value(name), model.flipTextures);
+    };
+    material->albedoTexture = loadTexture("albedoTexture", TextureUsage::Color);
+    material->emissiveTexture = loadTexture("emissiveTexture", TextureUsage::Color);
+    material->specularTexture = loadTexture("specularTexture", TextureUsage::Color);
+    material->normalsTexture = loadTexture("normalsTexture", TextureUsage::NormalMap);
+    // Read back on the CPU by createNormalFromBump()
+    material->bumpTexture = loadTexture("bumpTexture", TextureUsage::Data);
+
+    material->createNormalFromBump();
+}
+
+static QJsonObject nodeToJson(const ImportedModel::Node &node)
+{
+    QJsonObject json;
+    json["name"] = node.name;
+    json["parent"] = node.parent;
+    json["position"] = QJsonArray({ node.position.x(), node.position.y(), node.position.z() });
+    json["rotation"] = QJsonArray({ node.rotation.scalar(), node.rotation.x(), node.rotation.y(), node.rotation.z() });
+    json["scale"] = QJsonArray({ node.scale.x(), node.scale.y(), node.scale.z() });
+    QJsonArray submeshes;
+    for (int index : node.submeshes) {
+        submeshes.append(index);
+    }
+    json["submeshes"] = submeshes;
+    return json;
+}
+
+static ImportedModel::Node nodeFromJson(const QJsonObject &json)
+{
+    ImportedModel::Node node;
+    node.name = json["name"].toString();
+    node.parent = json["parent"].toInt();
+    const QJsonArray p = json["position"].toArray();
+    node.position = QVector3D(float(p[0].toDouble()), float(p[1].toDouble()), float(p[2].toDouble()));
+    const QJsonArray r = json["rotation"].toArray();
+    node.rotation = QQuaternion(float(r[0].toDouble()), float(r[1].toDouble()), float(r[2].toDouble()), float(r[3].toDouble()));
+    const QJsonArray sc = json["scale"].toArray();
+    node.scale = QVector3D(float(sc[0].toDouble()), float(sc[1].toDouble()), float(sc[2].toDouble()));
+    for (const QJsonValue &index : json["submeshes"].toArray()) {
+        node.submeshes.push_back(index.toInt());
+    }
+    return node;
+}
+
+// Triangle of a flattened submesh, for the spatial split
+struct ChunkTriangle
+{
+    int submesh;
+    int triangle;
+    QVector3D centroid;
+};
+
+// Splits the range of triangles at the median of its longest axis until
+// the pieces are small enough. Leaves are appended in depth-first order.
+static void splitTriangles(QVector<ChunkTriangle> &triangles, int begin, int end, QVector<QPair<int, int>> &leaves)
+{
+    if (end - begin <= TRIANGLES_PER_CHUNK)
     {
-        myMaterials[i] = resourceManager->createMaterial();
-        processMaterial(scene->mMaterials[i], myMaterials[i]);
+        leaves.push_back(qMakePair(begin, end));
+        return;
+    }
+
+    QVector3D minC = triangles[begin].centroid, maxC = minC;
+    for (int i = begin + 1; i < end; ++i)
+    {
+        const QVector3D &c = triangles[i].centroid;
+        minC = QVector3D(qMin(minC.x(), c.x()), qMin(minC.y(), c.y()), qMin(minC.z(), c.z()));
+        maxC = QVector3D(qMax(maxC.x(), c.x()), qMax(maxC.y(), c.y()), qMax(maxC.z(), c.z()));
+    }
+    const QVector3D extent = maxC - minC;
+    const int axis = (extent.x() >= extent.y() && extent.x() >= extent.z()) ? 0 : (extent.y() >= extent.z()) ? 1 : 2;
+
+    const int middle = begin + (end - begin) / 2;
+    std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end,
+                     [axis](const ChunkTriangle &a, const ChunkTriangle &b) {
+        if (a.centroid[axis] != b.centroid[axis]) return a.centroid[axis] < b.centroid[axis];
+        if (a.submesh != b.submesh) return a.submesh < b.submesh;
+        return a.triangle < b.triangle;
+    });
+
+    splitTriangles(triangles, begin, middle, leaves);
+    splitTriangles(triangles, middle, end, leaves);
+}
+
+// Replaces the flattened submeshes by spatially coherent chunks, each one
+// with a submesh per material, under a root node
+static void splitIntoChunks(ImportedModel &model)
+{
+    QVector<ChunkTriangle> triangles;
+    for (int s = 0; s < model.submeshes.size(); ++s)
+    {
+        const ImportedModel::SubMeshData &submesh = model.submeshes[s];
+        const int stride = submesh.vertexFormat.size / int(sizeof(float));
+        const float *v = submesh.vertices.constData();
+        for (int t = 0; t < submesh.indices.size() / 3; ++t)
+        {
+            QVector3D centroid;
+            for (int k = 0; k < 3; ++k)
+            {
+                const float *p = v + submesh.indices[3 * t + k] * stride;
+                centroid += QVector3D(p[0], p[1], p[2]);
+            }
+            triangles.push_back({ s, t, centroid / 3.0f });
+        }
+    }
+
+    if (triangles.size() <= TRIANGLES_PER_CHUNK) return;
+
+    QVector<QPair<int, int>> leaves;
+    splitTriangles(triangles, 0, triangles.size(), leaves);
+
+    QVector<ImportedModel::SubMeshData> chunks;
+    QVector<ImportedModel::Node> nodes(1);
+    QVector<QVector<int>> remap(model.submeshes.size());
+    for (int s = 0; s < model.submeshes.size(); ++s) {
+        remap[s].fill(-1, model.submeshes[s].vertices.size() / (model.submeshes[s].vertexFormat.size / int(sizeof(float))));
+    }
+
+    for (const QPair<int, int> &leaf : leaves)
+    {
+        // Original order inside the chunk (keeps the vertex cache ordering)
+        std::sort(triangles.begin() + leaf.first, triangles.begin() + leaf.second,
+                  [](const ChunkTriangle &a, const ChunkTriangle &b) {
+            return (a.submesh != b.submesh) ? a.submesh < b.submesh : a.triangle < b.triangle;
+        });
+
+        ImportedModel::Node node;
+        node.name = QString::fromLatin1("Chunk %1").arg(nodes.size() - 1);
+        node.parent = 0;
+
+        int i = leaf.first;
+        while (i < leaf.second)
+        {
+            const int s = triangles[i].submesh;
+            const ImportedModel::SubMeshData &source = model.submeshes[s];
+            const int stride = source.vertexFormat.size / int(sizeof(float));
+
+            ImportedModel::SubMeshData chunk;
+            chunk.vertexFormat = source.vertexFormat;
+            chunk.materialIndex = source.materialIndex;
+
+            QVector<int> used;
+            for (; i < leaf.second && triangles[i].submesh == s; ++i)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    const unsigned int index = source.indices[3 * triangles[i].triangle + k];
+                    int &newIndex = remap[s][int(index)];
+                    if (newIndex < 0)
+                    {
+                        newIndex = chunk.vertices.size() / stride;
+                        used.push_back(int(index));
+                        const float *p = source.vertices.constData() + index * stride;
+                        for (int f = 0; f < stride; ++f) {
+                            chunk.vertices.push_back(p[f]);
+                        }
+                    }
+                    chunk.indices.push_back(unsigned(newIndex));
+                }
+            }
+            for (int index : used) {
+                remap[s][index] = -1;
+            }
+
+            chunk.bounds = VertexKernels::bounds(StridedView<const QVector3D>(chunk.vertices.constData(), chunk.vertexFormat.size, chunk.vertices.size() / stride));
+
+            node.submeshes.push_back(chunks.size());
+            chunks.push_back(chunk);
+        }
+
+        nodes.push_back(node);
+    }
+
+    model.submeshes = chunks;
+    model.nodes = nodes;
+}
+
+// Done once per model: the cache stores the optimized and quantized geometry,
+// with its levels of detail
+static void optimizeSubMeshes(ImportedModel &model)
+{
+    const MeshOptimizer::Statistics before = MeshOptimizer::analyze(model.submeshes, false);
+    QtConcurrent::blockingMap(model.submeshes, MeshOptimizer::optimize);
+    QtConcurrent::blockingMap(model.submeshes, MeshSimplifier::generateLods);
+    QtConcurrent::blockingMap(model.submeshes, MeshOptimizer::quantize);
+    const MeshOptimizer::Statistics after = MeshOptimizer::analyze(model.submeshes, true);
+
+    qint64 lodTriangles[MAX_MESH_LODS] = { };
+    for (const ImportedModel::SubMeshData &submesh : model.submeshes)
+    {
+        for (int lod = 0; lod < MAX_MESH_LODS; ++lod)
+        {
+            const int level = qMin(lod, qMax(submesh.lods.size(), 1) - 1);
+            lodTriangles[lod] += (submesh.lods.isEmpty() ? submesh.indices.size() : submesh.lods[level].indexCount) / 3;
+        }
     }
+    qInfo("LOD triangles of %s: %lld, %lld, %lld, %lld",
+          QFileInfo(model.filePath).fileName().toLatin1().data(),
+          lodTriangles[0], lodTriangles[1], lodTriangles[2], lodTriangles[3]);
+
+    qInfo("Optimized %s: %lld -> %lld vertices, ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, %lld -> %lld KB",
+          QFileInfo(model.filePath).fileName().toLatin1().data(),
+          before.vertices, after.vertices, before.acmr(), after.acmr(), before.atvr(), after.atvr(),
+          before.bytes / 1024, after.bytes / 1024);
+}
 
-    // Create the mesh and process the submeshes read by Assimp
-    Mesh *myMesh = resourceManager->createMesh();
-    myMesh->name = fileInfo.baseName();
-    myMesh->filePath = fileInfo.filePath();
-    processNode(scene->mRootNode, scene, myMesh, &myMaterials[0], &mySubmeshMaterials[0]);
+static void storeInCache(const ImportedModel &model, const QString &cachePath)
+{
+    if (cachePath.isEmpty()) return;
 
-    // Create an entity showing the mesh
-    Entity *entity = ::scene->addEntity();
-    entity->name = fileInfo.baseName();
-    entity->addComponent(ComponentType::MeshRenderer);
-    entity->meshRenderer->mesh = myMesh;
-    for (int i = 0; i < myMesh->submeshes.size(); ++i)
+    QVector<MeshCache::Entry> entries;
+    for (const ImportedModel::SubMeshData &submesh : model.submeshes)
     {
-        entity->meshRenderer->materials.push_back(mySubmeshMaterials[i]);
+        MeshCache::Entry entry;
+        entry.vertexFormat = submesh.vertexFormat;
+        entry.vertices = reinterpret_cast<const unsigned char *>(submesh.vertices.constData());
+        entry.vertexBytes = submesh.vertices.size() * int(sizeof(float));
+        entry.indices = submesh.indices.constData();
+        entry.indexCount = submesh.indices.size();
+        entry.lods = submesh.lods;
+        entry.meshlets = submesh.meshlets;
+        entry.bounds = submesh.bounds;
+        entry.materialIndex = submesh.materialIndex;
+        entries.push_back(entry);
     }
+    QJsonArray nodes;
+    for (const ImportedModel::Node &node : model.nodes) {
+        nodes.append(nodeToJson(node));
+    }
+    QJsonObject description;
+    description["materials"] = model.materials;
+    description["nodes"] = nodes;
+    MeshCache::write(cachePath, entries, QJsonDocument(description).toJson(QJsonDocument::Compact));
+}
 
+// Owner of the geometry of a cold import once it's handed over to the
+// meshes: like with the mesh cache, the submeshes point into it until they
+// are uploaded, instead of copying it
+class ImportedGeometry : public MeshSource
+{
+public:
+    QVector<ImportedModel::SubMeshData> submeshes;
+};
+
+// Moves the converted submeshes into a source, so the model references them
+// the same way it references a mapped cache. Returns the bytes handed over.
+static qint64 shareGeometry(ImportedModel &model)
+{
+    QSharedPointer<ImportedGeometry> geometry(new ImportedGeometry);
+    geometry->submeshes.swap(model.submeshes);
+
+    qint64 bytes = 0;
+    model.mappedSubmeshes.clear();
+    model.mappedSubmeshes.reserve(geometry->submeshes.size());
+    for (const ImportedModel::SubMeshData &submesh : qAsConst(geometry->submeshes))
+    {
+        MeshCache::Entry entry;
+        entry.vertexFormat = submesh.vertexFormat;
+        entry.vertices = reinterpret_cast<const unsigned char *>(submesh.vertices.constData());
+        entry.vertexBytes = submesh.vertices.size() * int(sizeof(float));
+        entry.indices = submesh.indices.constData();
+        entry.indexCount = submesh.indices.size();
+        entry.lods = submesh.lods;
+        entry.meshlets = submesh.meshlets;
+        entry.bounds = submesh.bounds;
+        entry.materialIndex = submesh.materialIndex;
+        model.mappedSubmeshes.push_back(entry);
+
+        bytes += entry.vertexBytes + qint64(entry.indexCount) * qint64(sizeof(unsigned int));
+    }
+    model.source = geometry;
+    return bytes;
+}
+
+Entity* ModelImporter::import(const QString &path, ImportMode mode)
+{
+    ImportedModel *model = load(path, mode);
+    if (model == nullptr) return nullptr;
+
+    Entity *entity = instantiate(*model);
+    delete model;
     return entity;
 }
 
 void ModelImporter::loadMesh(Mesh *mesh, const QString &path)
 {
-    Assimp::Importer import;
+    ImportedModel *model = load(path);
+    if (model == nullptr) return;
+
+    QVector<int> submeshes(model->submeshes.size());
+    if (model->source) submeshes.resize(model->mappedSubmeshes.size());
+    std::iota(submeshes.begin(), submeshes.end(), 0);
+    fillMesh(mesh, *model, submeshes);
+    delete model;
+}
 
-    QFile file(path);
-    if (!file.open(QIODevice::ReadOnly)) {
+ImportedModel *ModelImporter::load(const QString &path, ImportMode mode)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QFileInfo fileInfo(path);
+    if (!fileInfo.isFile()) {
         std::cout << "Could not open file for read: " << path.toStdString() << std::endl;
-        return;
+        return nullptr;
     }
 
-    QFileInfo fileInfo(file);
+    // glTF files are read in place, they need neither Assimp nor the cache
+    const QString suffix = fileInfo.suffix().toLower();
+    if (suffix == "glb" || suffix == "gltf")
+    {
+        ImportedModel *model = GltfLoader::load(path);
+        if (model != nullptr) {
+            qInfo("Loaded %s in %lld ms (glTF)", fileInfo.fileName().toLatin1().data(), timer.elapsed());
+        }
+        return model;
+    }
 
+    // OBJ files have their own parser, except for the node hierarchy
+    // (OBJ groups), which comes from Assimp
+    const bool objParser = suffix == "obj" && mode != ImportMode::HierarchyImport;
 
-    const aiScene *scene = import.ReadFile(
-                path.toStdString(),
-                aiProcess_Triangulate |
-                aiProcess_GenSmoothNormals |
-                aiProcess_OptimizeMeshes |
-                aiProcess_PreTransformVertices |
-                aiProcess_ImproveCacheLocality |
-                aiProcess_CalcTangentSpace);
+    // Warm imports skip parsing entirely
+    const QString cachePath = meshCachePath(path, mode, objParser);
+    ImportedModel *model = loadFromCache(path, cachePath);
+    const bool fromCache = model != nullptr;
+    if (!fromCache)
+    {
+        model = objParser ? ObjLoader::load(path) : loadWithAssimp(path, mode);
+        if (model != nullptr)
+        {
+            if (mode == ImportMode::ChunkedImport) {
+                splitIntoChunks(*model);
+            }
+
+            optimizeSubMeshes(*model);
+
+            // Store the result for the next imports
+            storeInCache(*model, cachePath);
+
+            const qint64 sharedBytes = shareGeometry(*model);
+            qInfo("%lld KB of geometry handed over to the meshes without copies", sharedBytes / 1024);
+        }
+    }
+
+    if (model != nullptr) {
+        qInfo("Loaded %s in %lld ms (%s)", fileInfo.fileName().toLatin1().data(), timer.elapsed(),
+              fromCache ? "warm, mesh cache" : objParser ? "cold, OBJ parser" : "cold, Assimp");
+    }
+    return model;
+}
 
-    // Other flags
-    // - aiProcess_JoinIdenticalVertices
-    // - aiProcess_SortByPType
-    // - aiProcess_RemoveRedundantMaterials
-    // - https://www.ics.com/blog/qt-and-opengl-loading-3d-model-open-asset-import-library-assimp
+Entity *ModelImporter::instantiate(const ImportedModel &model)
+{
+    QFileInfo fileInfo(model.filePath);
+
+    // Create a list of materials
+    QVector<Material*> myMaterials(model.materials.size(), nullptr);
+    for (int i = 0; i < model.materials.size(); ++i)
+    {
+        myMaterials[i] = resourceManager->createMaterial();
+        materialFromJson(model.materials[i].toObject(), model, myMaterials[i]);
+    }
+
+    // Create the entities, sharing a mesh among the nodes with the same submeshes
+    QHash<QVector<int>, Mesh*> meshes;
+    QHash<Mesh*, QVector<int>> meshMaterials;
+    QVector<Entity*> entities;
+    for (const ImportedModel::Node &node : model.nodes)
+    {
+        Entity *entity = ::scene->addEntity();
+        entity->name = (node.parent < 0) ? fileInfo.baseName() : node.name;
+        entity->transform->position = node.position;
+        entity->transform->rotation = node.rotation;
+        entity->transform->scale = node.scale;
+        if (node.parent >= 0) {
+            entity->transform->parent = entities[node.parent]->transform;
+        }
+        entities.push_back(entity);
+
+        if (node.submeshes.isEmpty()) continue;
+
+        Mesh *myMesh = meshes.value(node.submeshes, nullptr);
+        if (myMesh == nullptr)
+        {
+            myMesh = resourceManager->createMesh();
+            myMesh->name = (model.nodes.size() == 1) ? fileInfo.baseName() : fileInfo.baseName() + "/" + node.name;
+            myMesh->filePath = fileInfo.filePath();
+            meshMaterials.insert(myMesh, fillMesh(myMesh, model, node.submeshes));
+            meshes.insert(node.submeshes, myMesh);
+        }
+
+        // Create an entity showing the mesh
+        entity->addComponent(ComponentType::MeshRenderer);
+        entity->meshRenderer->mesh = myMesh;
+        for (int index : meshMaterials.value(myMesh))
+        {
+            const bool hasMaterial = index >= 0 && index < myMaterials.size();
+            entity->meshRenderer->materials.push_back(hasMaterial ? myMaterials[index] : nullptr);
+        }
+    }
+
+    return entities.isEmpty() ? nullptr : entities[0];
+}
+
+QVector<int> ModelImporter::fillMesh(Mesh *mesh, const ImportedModel &model, const QVector<int> &submeshes)
+{
+    QVector<int> materialIndices;
+
+    if (model.source)
+    {
+        // The submeshes reference the mapped file (or the imported
+        // geometry) until they are uploaded
+        for (int index : submeshes)
+        {
+            const MeshCache::Entry &entry = model.mappedSubmeshes[index];
+            mesh->addMappedSubMesh(model.source, entry.vertexFormat,
+                                   entry.vertices, entry.vertexBytes,
+                                   entry.indices, entry.indexCount,
+                                   entry.bounds, entry.lods, entry.meshlets);
+            materialIndices.push_back(entry.materialIndex);
+        }
+    }
+    else
+    {
+        for (int index : submeshes)
+        {
+            const ImportedModel::SubMeshData &submesh = model.submeshes[index];
+            mesh->addSubMesh(
+                    submesh.vertexFormat,
+                    (void *)submesh.vertices.constData(), submesh.vertices.size() * sizeof(float),
+                    (unsigned int *)submesh.indices.constData(), submesh.indices.size(),
+                    submesh.lods, submesh.meshlets);
+            materialIndices.push_back(submesh.materialIndex);
+        }
+    }
+
+    return materialIndices;
+}
+
+ImportedModel *ModelImporter::loadFromCache(const QString &path, const QString &cachePath)
+{
+    if (cachePath.isEmpty() || !QFile::exists(cachePath)) return nullptr;
+
+    QSharedPointer<MeshCache> cache(new MeshCache);
+    if (!cache->map(cachePath))
+    {
+        cache.clear();
+        AssetCache::remove(cachePath);
+        return nullptr;
+    }
+
+    ImportedModel *model = new ImportedModel;
+    model->filePath = path;
+    const QJsonObject description = QJsonDocument::fromJson(cache->description).object();
+    model->materials = description["materials"].toArray();
+    for (const QJsonValue &node : description["nodes"].toArray()) {
+        model->nodes.push_back(nodeFromJson(node.toObject()));
+    }
+    model->mappedSubmeshes = cache->entries;
+    model->source = cache;
+    return model;
+}
+
+ImportedModel *ModelImporter::loadWithAssimp(const QString &path, ImportMode mode)
+{
+    Assimp::Importer import;
+
+    const aiScene *scene = import.ReadFile(path.toStdString(), importFlags(mode));
 
     if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
     {
         std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
-        return;
+        return nullptr;
     }
 
-    // Used to find material files
-    directory = fileInfo.path();
+    ImportedModel *model = new ImportedModel;
+    model->filePath = path;
 
-    // Create the mesh and process the submeshes read by Assimp
-    processNode(scene->mRootNode, scene, mesh, nullptr, nullptr);
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    {
+        model->materials.append(processMaterial(scene->mMaterials[i]));
+    }
+
+    // The hierarchy refers to the meshes of the scene; flattened models have
+    // a single node with the meshes in node order
+    QVector<aiMesh*> meshes;
+    if (mode == ImportMode::HierarchyImport)
+    {
+        meshes = QVector<aiMesh*>::fromStdVector(std::vector<aiMesh*>(scene->mMeshes, scene->mMeshes + scene->mNumMeshes));
+        processHierarchy(scene->mRootNode, -1, model);
+    }
+    else
+    {
+        processNode(scene->mRootNode, scene, meshes);
+        ImportedModel::Node root;
+        root.submeshes.resize(meshes.size());
+        std::iota(root.submeshes.begin(), root.submeshes.end(), 0);
+        model->nodes.push_back(root);
+    }
+
+    // Convert the submeshes in parallel, each one into its own slot so the
+    // result doesn't depend on the scheduling
+    model->submeshes.resize(meshes.size());
+
+    QVector<int> order(meshes.size());
+    std::iota(order.begin(), order.end(), 0);
+    QtConcurrent::blockingMap(order, [&](int i) {
+        processMesh(meshes[i], model->submeshes[i]);
+    });
+
+    return model;
 }
 
-void ModelImporter::processMaterial(aiMaterial *material, Material *myMaterial)
+QJsonObject ModelImporter::processMaterial(aiMaterial *material)
 {
     aiString name;
     aiColor3D diffuseColor;
@@ -155,93 +657,117 @@ void ModelImporter::processMaterial(aiMaterial *material, Material *myMaterial)
     material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
     material->Get(AI_MATKEY_SHININESS, shininess);
 
-    myMaterial->name = QString::fromLatin1(name.C_Str());
-    myMaterial->albedo = QColor::fromRgbF(diffuseColor.r, diffuseColor.g, diffuseColor.b);
-    myMaterial->emissive = QColor::fromRgbF(emissiveColor.r, emissiveColor.g, emissiveColor.b);
-    myMaterial->smoothness = shininess / 256.0f;
+    QJsonObject json;
+    json["name"] = QString::fromLatin1(name.C_Str());
+    json["albedo"] = QJsonArray({ diffuseColor.r, diffuseColor.g, diffuseColor.b });
+    json["emissive"] = QJsonArray({ emissiveColor.r, emissiveColor.g, emissiveColor.b });
+    json["smoothness"] = shininess / 256.0f;
 
-    aiString filename;
-    if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
-    {
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &filename);
-        QString filepath = QString::fromLatin1("%0/%1").arg(directory.toLatin1().data()).arg(filename.C_Str());
-        myMaterial->albedoTexture = resourceManager->loadTexture(filepath);
-    }
-    if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
-    {
-        material->GetTexture(aiTextureType_EMISSIVE, 0, &filename);
-        QString filepath = QString::fromLatin1("%0/%1").arg(directory.toLatin1().data()).arg(filename.C_Str());
-        myMaterial->emissiveTexture = resourceManager->loadTexture(filepath);
-    }
-    if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
-    {
-        material->GetTexture(aiTextureType_SPECULAR, 0, &filename);
-        QString filepath = QString::fromLatin1("%0/%1").arg(directory.toLatin1().data()).arg(filename.C_Str());
-        myMaterial->specularTexture = resourceManager->loadTexture(filepath);
-    }
-    if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
+    // Textures are loaded by instantiate(), on the main thread
+    auto addTexture = [&](aiTextureType type, const char *key) {
+        aiString filename;
+        if (material->GetTextureCount(type) > 0)
+        {
+            material->GetTexture(type, 0, &filename);
+            json[key] = QString::fromLatin1(filename.C_Str());
+        }
+    };
+    addTexture(aiTextureType_DIFFUSE, "albedoTexture");
+    addTexture(aiTextureType_EMISSIVE, "emissiveTexture");
+    addTexture(aiTextureType_SPECULAR, "specularTexture");
+    addTexture(aiTextureType_NORMALS, "normalsTexture");
+    addTexture(aiTextureType_HEIGHT, "bumpTexture");
+
+    return json;
+}
+
+void ModelImporter::processNode(aiNode *node, const aiScene *scene, QVector<aiMesh*> &meshes)
+{
+    // process all the node's meshes (if any)
+    for(unsigned int i = 0; i < node->mNumMeshes; i++)
     {
-        material->GetTexture(aiTextureType_NORMALS, 0, &filename);
-        QString filepath = QString::fromLatin1("%0/%1").arg(directory.toLatin1().data()).arg(filename.C_Str());
-        myMaterial->normalsTexture = resourceManager->loadTexture(filepath);
+        meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
     }
-    if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
+
+    // then do the same for each of its children
+    for(unsigned int i = 0; i < node->mNumChildren; i++)
     {
-        material->GetTexture(aiTextureType_HEIGHT, 0, &filename);
-        QString filepath = QString::fromLatin1("%0/%1").arg(directory.toLatin1().data()).arg(filename.C_Str());
-        myMaterial->bumpTexture = resourceManager->loadTexture(filepath);
+        processNode(node->mChildren[i], scene, meshes);
     }
-
-    myMaterial->createNormalFromBump();
 }
 
-void ModelImporter::processNode(aiNode *node, const aiScene *scene, Mesh *myMesh, Material **myMaterials, Material **mySubmeshMaterials)
+void ModelImporter::processHierarchy(aiNode *node, int parent, ImportedModel *model)
 {
-    // process all the node's meshes (if any)
+    ImportedModel::Node myNode;
+    myNode.name = QString::fromLatin1(node->mName.C_Str());
+    myNode.parent = parent;
+
+    aiVector3D scaling, position;
+    aiQuaternion rotation;
+    node->mTransformation.Decompose(scaling, rotation, position);
+    myNode.position = QVector3D(position.x, position.y, position.z);
+    myNode.rotation = QQuaternion(rotation.w, rotation.x, rotation.y, rotation.z);
+    myNode.scale = QVector3D(scaling.x, scaling.y, scaling.z);
+
+    // Indices into the meshes of the scene, shared with other nodes
     for(unsigned int i = 0; i < node->mNumMeshes; i++)
     {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-        processMesh(mesh, scene, myMesh, myMaterials, mySubmeshMaterials);
+        myNode.submeshes.push_back(int(node->mMeshes[i]));
     }
 
-    // then do the same for each of its children
+    const int index = model->nodes.size();
+    model->nodes.push_back(myNode);
+
     for(unsigned int i = 0; i < node->mNumChildren; i++)
     {
-        processNode(node->mChildren[i], scene, myMesh, myMaterials, mySubmeshMaterials);
+        processHierarchy(node->mChildren[i], index, model);
     }
 }
 
-void ModelImporter::processMesh(aiMesh *mesh, const aiScene *scene, Mesh *myMesh, Material **myMaterials, Material **mySubmeshMaterials)
+void ModelImporter::processMesh(aiMesh *mesh, ImportedModel::SubMeshData &submesh)
 {
-    QVector<float> vertices;
-    QVector<unsigned int> indices;
+    const bool hasTexCoords = mesh->mTextureCoords[0] != nullptr;
+    const bool hasTangentSpace = mesh->mTangents != nullptr && mesh->mBitangents != nullptr;
 
-    bool hasTexCoords = false;
-    bool hasTangentSpace = false;
+    // create the vertex format
+    VertexFormat &vertexFormat = submesh.vertexFormat;
+    vertexFormat.setVertexAttribute(0, 0, 3);
+    vertexFormat.setVertexAttribute(1, 3 * sizeof(float), 3);
+    if (hasTexCoords)
+    {
+        vertexFormat.setVertexAttribute(2, vertexFormat.size, 2);
+    }
+    if (hasTangentSpace)
+    {
+        vertexFormat.setVertexAttribute(3, vertexFormat.size, 3);
+        vertexFormat.setVertexAttribute(4, vertexFormat.size, 3);
+    }
 
     // process vertices
+    const int stride = vertexFormat.size / int(sizeof(float));
+    submesh.vertices.resize(int(mesh->mNumVertices) * stride);
+    float *vertex = submesh.vertices.data();
     for(unsigned int i = 0; i < mesh->mNumVertices; i++)
     {
-        vertices.push_back(mesh->mVertices[i].x);
-        vertices.push_back(mesh->mVertices[i].y);
-        vertices.push_back(mesh->mVertices[i].z);
-        vertices.push_back(mesh->mNormals[i].x);
-        vertices.push_back(mesh->mNormals[i].y);
-        vertices.push_back(mesh->mNormals[i].z);
-
-        if(mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+        const aiVector3D &position = mesh->mVertices[i];
+        *vertex++ = position.x;
+        *vertex++ = position.y;
+        *vertex++ = position.z;
+        *vertex++ = mesh->mNormals[i].x;
+        *vertex++ = mesh->mNormals[i].y;
+        *vertex++ = mesh->mNormals[i].z;
+
+        if(hasTexCoords)
         {
-            hasTexCoords = true;
-            vertices.push_back(mesh->mTextureCoords[0][i].x);
-            vertices.push_back(mesh->mTextureCoords[0][i].y);
+            *vertex++ = mesh->mTextureCoords[0][i].x;
+            *vertex++ = mesh->mTextureCoords[0][i].y;
         }
 
-        if(mesh->mTangents != nullptr && mesh->mBitangents)
+        if(hasTangentSpace)
         {
-            hasTangentSpace = true;
-            vertices.push_back(mesh->mTangents[i].x);
-            vertices.push_back(mesh->mTangents[i].y);
-            vertices.push_back(mesh->mTangents[i].z);
+            *vertex++ = mesh->mTangents[i].x;
+            *vertex++ = mesh->mTangents[i].y;
+            *vertex++ = mesh->mTangents[i].z;
 
             // For some reason ASSIMP gives me the bitangents flipped.
             // Maybe it's my fault, but when I generate my own geometry
@@ -251,45 +777,30 @@ void ModelImporter::processMesh(aiMesh *mesh, const aiScene *scene, Mesh *myMesh
             // I think that (even if the documentation says the opposite)
             // it returns a left-handed tangent space matrix.
             // SOLUTION: I invert the components of the bitangent here.
-            vertices.push_back(-mesh->mBitangents[i].x);
-            vertices.push_back(-mesh->mBitangents[i].y);
-            vertices.push_back(-mesh->mBitangents[i].z);
+            *vertex++ = -mesh->mBitangents[i].x;
+            *vertex++ = -mesh->mBitangents[i].y;
+            *vertex++ = -mesh->mBitangents[i].z;
         }
     }
+    submesh.bounds = VertexKernels::bounds(StridedView<const QVector3D>(submesh.vertices.constData(), vertexFormat.size, int(mesh->mNumVertices)));
 
     // process indices
+    int indexCount = 0;
+    for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+    {
+        indexCount += int(mesh->mFaces[i].mNumIndices);
+    }
+    submesh.indices.resize(indexCount);
+    unsigned int *index = submesh.indices.data();
     for(unsigned int i = 0; i < mesh->mNumFaces; i++)
     {
-        aiFace face = mesh->mFaces[i];
+        const aiFace &face = mesh->mFaces[i];
         for(unsigned int j = 0; j < face.mNumIndices; j++)
         {
-            indices.push_back(face.mIndices[j]);
+            *index++ = face.mIndices[j];
         }
     }
 
-    // store the proper (previously proceessed) material for this mesh
-    if(mesh->mMaterialIndex >= 0 && mySubmeshMaterials != nullptr && myMaterials != nullptr)
-    {
-        mySubmeshMaterials[myMesh->submeshes.size()] = myMaterials[mesh->mMaterialIndex];
-    }
-
-    // create the vertex format
-    VertexFormat vertexFormat;
-    vertexFormat.setVertexAttribute(0, 0, 3);
-    vertexFormat.setVertexAttribute(1, 3 * sizeof(float), 3);
-    if (hasTexCoords)
-    {
-        vertexFormat.setVertexAttribute(2, 6 * sizeof(float), 2);
-    }
-    if (hasTangentSpace)
-    {
-        vertexFormat.setVertexAttribute(3, 8 * sizeof(float), 3);
-        vertexFormat.setVertexAttribute(4, 11 * sizeof(float), 3);
-    }
-
-    // add the submesh into the mesh
-    myMesh->addSubMesh(
-            vertexFormat,
-            &vertices[0], vertices.size() * sizeof(float),
-            &indices[0], indices.size());
+    // store the proper material for this mesh
+    submesh.materialIndex = int(mesh->mMaterialIndex);
 }
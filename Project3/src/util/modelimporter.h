@@ -1,7 +1,16 @@
 #ifndef MODELIMPORTER_H
 #define MODELIMPORTER_H
 
+#include "resources/mesh.h"
+#include "rendering/miscsettings.h"
+#include "util/meshcache.h"
 #include <QString>
+#include <QHash>
+#include <QQuaternion>
+#include <QVector>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QSharedPointer>
 
 class Entity;
 class Mesh;
@@ -11,6 +20,43 @@ struct aiNode;
 struct aiScene;
 struct aiMaterial;
 
+// Contents of a model file read by ModelImporter::load(). It doesn't own
+// any resource, so it can be produced on any thread.
+struct ImportedModel
+{
+    struct SubMeshData
+    {
+        VertexFormat vertexFormat;
+        QVector<float> vertices;
+        QVector<unsigned int> indices;   // All the levels of detail, one after the other
+        QVector<LodLevel> lods;          // Empty with a single level
+        QVector<Meshlet> meshlets;       // Of the full detail level
+        Bounds bounds;
+        int materialIndex = -1;
+    };
+
+    // Future entity. Nodes listing the same submeshes share a Mesh.
+    struct Node
+    {
+        QString name;
+        int parent = -1;
+        QVector3D position;
+        QQuaternion rotation;
+        QVector3D scale = QVector3D(1.0f, 1.0f, 1.0f);
+        QVector<int> submeshes;
+    };
+
+    QString filePath;
+    QJsonArray materials;            // Material descriptions
+    QVector<Node> nodes;             // Parents first, nodes[0] is the root
+    QVector<SubMeshData> submeshes;  // Geometry converted from Assimp or ObjLoader (until load() returns)...
+    QVector<MeshCache::Entry> mappedSubmeshes; // ...or referenced in source (same indices)
+    QSharedPointer<MeshSource> source; // Mesh cache, glTF file or converted geometry
+
+    QHash<QString, QByteArray> embeddedImages; // Encoded images by texture name
+    bool flipTextures = true;        // False when the UV origin is at the top (glTF)
+};
+
 class ModelImporter
 {
 public:
@@ -18,20 +64,37 @@ public:
     ModelImporter();
     ~ModelImporter();
 
-    // It loads a model and creates an entity with it
-    Entity *import(const QString &path);
+    // It loads a model and creates an entity with it. The entity has
+    // children with the other parts of the model, depending on the mode:
+    // - FlattenedImport: one entity with one mesh (all the transforms applied)
+    // - ChunkedImport: one child per spatial chunk of the flattened geometry
+    // - HierarchyImport: the node hierarchy of the file, sharing the meshes
+    //   referenced by several nodes
+    // glTF files (.glb, .gltf) always keep their hierarchy (see GltfLoader).
+    Entity *import(const QString &path, ImportMode mode = ImportMode::FlattenedImport);
 
     // It only loads the mesh geometry into a mesh
     void loadMesh(Mesh *mesh, const QString &path);
 
+    // import() in two steps: load() reads the file and can run on any
+    // thread, so several models can be read at once; instantiate() creates
+    // the resources and the entity, and must run on the main thread.
+    static ImportedModel *load(const QString &path, ImportMode mode = ImportMode::FlattenedImport);
+    static Entity *instantiate(const ImportedModel &model);
+
 private:
 
-    // Assimp stuff
-    void processMaterial(aiMaterial *material, Material *myMaterial);
-    void processNode(aiNode *node, const aiScene *scene, Mesh *myMesh, Material **myMaterials, Material **mySubmeshMaterials);
-    void processMesh(aiMesh *mesh, const aiScene *scene, Mesh *myMesh, Material **myMaterials, Material **mySubmeshMaterials);
+    static ImportedModel *loadFromCache(const QString &path, const QString &cachePath);
+    static ImportedModel *loadWithAssimp(const QString &path, ImportMode mode);
 
-    QString directory; /**< Directory in which the file to import is located. */
+    // Adds the given submeshes and returns the material index of each one
+    static QVector<int> fillMesh(Mesh *mesh, const ImportedModel &model, const QVector<int> &submeshes);
+
+    // Assimp stuff
+    static QJsonObject processMaterial(aiMaterial *material);
+    static void processNode(aiNode *node, const aiScene *scene, QVector<aiMesh*> &meshes);
+    static void processHierarchy(aiNode *node, int parent, ImportedModel *model);
+    static void processMesh(aiMesh *mesh, ImportedModel::SubMeshData &submesh);
 };
 
 #endif // MODELIMPORTER_H
@@ -0,0 +1,127 @@
+#include "util/normalmapgenerator.h"
+#include <QtConcurrent>
+#include <QVector>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NORMALMAPGENERATOR_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace NormalMapGenerator
+{
+
+static const int ROWS_PER_BAND = 32;
+
+// Heights of a row in [0, 1], with one wrapped pixel on each side so the
+// left/right neighbours of every pixel are at [x] and [x + 2]
+static void loadRow(const QImage &heights, int y, float *row)
+{
+    const int w = heights.width();
+    const uchar *src = heights.constScanLine(y);
+    for (int x = 0; x < w; ++x) {
+        row[x + 1] = src[4 * x] / 255.0f;
+    }
+    row[0] = row[w];
+    row[w + 1] = row[1];
+}
+
+static inline uchar toByte(float v)
+{
+    return uchar(std::min(std::max(v * 0.5f + 0.5f, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+static void filterRow(const float *top, const float *mid, const float *bottom,
+                      int w, float dZ, uchar *out)
+{
+    int x = 0;
+
+#ifdef NORMALMAPGENERATOR_SSE2
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 z = _mm_set1_ps(dZ);
+    const __m128 z2 = _mm_set1_ps(dZ * dZ);
+    for (; x + 4 <= w; x += 4)
+    {
+        const __m128 tl = _mm_loadu_ps(top + x);
+        const __m128 t  = _mm_loadu_ps(top + x + 1);
+        const __m128 tr = _mm_loadu_ps(top + x + 2);
+        const __m128 l  = _mm_loadu_ps(mid + x);
+        const __m128 r  = _mm_loadu_ps(mid + x + 2);
+        const __m128 bl = _mm_loadu_ps(bottom + x);
+        const __m128 b  = _mm_loadu_ps(bottom + x + 1);
+        const __m128 br = _mm_loadu_ps(bottom + x + 2);
+
+        const __m128 dX = _mm_sub_ps(_mm_add_ps(_mm_add_ps(tl, _mm_mul_ps(two, l)), bl),
+                                     _mm_add_ps(_mm_add_ps(tr, _mm_mul_ps(two, r)), br));
+        const __m128 dY = _mm_sub_ps(_mm_add_ps(_mm_add_ps(bl, _mm_mul_ps(two, b)), br),
+                                     _mm_add_ps(_mm_add_ps(tl, _mm_mul_ps(two, t)), tr));
+
+        const __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dX, dX), _mm_mul_ps(dY, dY)), z2);
+        const __m128 invLen = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(len2));
+
+        alignas(16) float nx[4], ny[4], nz[4];
+        _mm_store_ps(nx, _mm_mul_ps(dX, invLen));
+        _mm_store_ps(ny, _mm_mul_ps(dY, invLen));
+        _mm_store_ps(nz, _mm_mul_ps(z, invLen));
+        for (int i = 0; i < 4; ++i)
+        {
+            out[3 * (x + i) + 0] = toByte(nx[i]);
+            out[3 * (x + i) + 1] = toByte(ny[i]);
+            out[3 * (x + i) + 2] = toByte(nz[i]);
+        }
+    }
+#endif
+
+    for (; x < w; ++x)
+    {
+        const float dX = (top[x] + 2.0f * mid[x] + bottom[x]) - (top[x + 2] + 2.0f * mid[x + 2] + bottom[x + 2]);
+        const float dY = (bottom[x] + 2.0f * bottom[x + 1] + bottom[x + 2]) - (top[x] + 2.0f * top[x + 1] + top[x + 2]);
+        const float invLen = 1.0f / std::sqrt(dX * dX + dY * dY + dZ * dZ);
+        out[3 * x + 0] = toByte(dX * invLen);
+        out[3 * x + 1] = toByte(dY * invLen);
+        out[3 * x + 2] = toByte(dZ * invLen);
+    }
+}
+
+QImage fromBump(const QImage &bumpMap, float bumpiness)
+{
+    const QImage heights = bumpMap.convertToFormat(QImage::Format_RGBA8888);
+    const int w = heights.width();
+    const int h = heights.height();
+    const float dZ = 1.0f / bumpiness;
+
+    QImage normalMap(w, h, QImage::Format_RGB888);
+
+    // Raw pointers: scanLine() is not safe to call from several threads
+    uchar *bits = normalMap.bits();
+    const int bytesPerLine = normalMap.bytesPerLine();
+
+    QVector<int> bands;
+    for (int y = 0; y < h; y += ROWS_PER_BAND) {
+        bands.push_back(y);
+    }
+
+    QtConcurrent::blockingMap(bands, [&](int firstRow)
+    {
+        // Three rolling rows: above, current and below (wrapping vertically)
+        QVector<float> buffer(3 * (w + 2));
+        float *rows[3] = { buffer.data(), buffer.data() + (w + 2), buffer.data() + 2 * (w + 2) };
+
+        loadRow(heights, (firstRow + h - 1) % h, rows[0]);
+        loadRow(heights, firstRow, rows[1]);
+
+        const int lastRow = std::min(firstRow + ROWS_PER_BAND, h);
+        for (int y = firstRow; y < lastRow; ++y)
+        {
+            loadRow(heights, (y + 1) % h, rows[2]);
+            filterRow(rows[0], rows[1], rows[2], w, dZ, bits + y * bytesPerLine);
+            std::rotate(rows, rows + 1, rows + 3);
+        }
+    });
+
+    return normalMap;
+}
+
+} // namespace NormalMapGenerator
@@ -0,0 +1,15 @@
+#ifndef NORMALMAPGENERATOR_H
+#define NORMALMAPGENERATOR_H
+
+#include <QImage>
+
+// Tangent-space normal maps from height maps (red channel), using a Sobel
+// filter that wraps around the borders. Bands of rows are filtered in
+// parallel, several pixels at a time.
+namespace NormalMapGenerator
+{
+    // The result is in QImage::Format_RGB888
+    QImage fromBump(const QImage &bumpMap, float bumpiness);
+}
+
+#endif // NORMALMAPGENERATOR_H
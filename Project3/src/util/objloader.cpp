@@ -0,0 +1,606 @@
+#include "util/objloader.h"
+#include "util/modelimporter.h"
+#include "util/vertexkernels.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QVarLengthArray>
+#include <QtConcurrent>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+
+// Size of the pieces of the file parsed in parallel
+static const qint64 BYTES_PER_CHUNK = 1 << 20;
+
+// Face indices are global (0-based) once resolved. While the chunks are
+// parsed, negative (relative) OBJ indices are stored relative to the chunk,
+// biased to keep them apart from the global ones.
+static const int NO_INDEX = INT_MIN;
+static const int RELATIVE_BIAS = 1 << 30;
+
+struct ObjCorner
+{
+    int v = NO_INDEX;
+    int vt = NO_INDEX;
+    int vn = NO_INDEX;
+};
+
+static bool operator==(const ObjCorner &a, const ObjCorner &b)
+{
+    return a.v == b.v && a.vt == b.vt && a.vn == b.vn;
+}
+
+static uint qHash(const ObjCorner &corner, uint seed = 0)
+{
+    return (uint(corner.v) * 73856093u) ^ (uint(corner.vt) * 19349663u) ^ (uint(corner.vn) * 83492791u) ^ seed;
+}
+
+struct ObjChunk
+{
+    const char *begin = nullptr;
+    const char *end = nullptr;
+
+    QVector<float> positions;   // x, y, z
+    QVector<float> texCoords;   // u, v
+    QVector<float> normals;     // x, y, z
+    QVector<ObjCorner> corners; // Three per triangle
+    QVector<QPair<int, QByteArray>> materials; // usemtl: first triangle and name
+    QVector<QByteArray> libraries;             // mtllib
+
+    // Elements in the previous chunks
+    int positionOffset = 0;
+    int texCoordOffset = 0;
+    int normalOffset = 0;
+};
+
+static inline bool isDigit(char c)
+{
+    return unsigned(c - '0') < 10u;
+}
+
+static inline const char *skipSpaces(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Locale independent and without strtod(): up to 19 significant digits are
+// accumulated in an integer, which is scaled once by a power of ten
+static const char *parseFloat(const char *p, const char *end, float &value)
+{
+    p = skipSpaces(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        ++p;
+    }
+
+    quint64 mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; p < end && isDigit(*p); ++p)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + quint64(*p - '0');
+            if (mantissa != 0) digits++;
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && isDigit(*p); ++p)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + quint64(*p - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negativeExponent = *p == '-';
+            ++p;
+        }
+        int e = 0;
+        for (; p < end && isDigit(*p); ++p) {
+            if (e < 1000) e = e * 10 + (*p - '0');
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+
+    double v = double(mantissa);
+    if (exponent < 0) {
+        v = (exponent >= -22) ? v / POWERS_OF_TEN[-exponent] : v * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        v = (exponent <= 22) ? v * POWERS_OF_TEN[exponent] : v * std::pow(10.0, exponent);
+    }
+    value = float(negative ? -v : v);
+    return p;
+}
+
+static const char *parseInt(const char *p, const char *end, int &value, bool &valid)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        ++p;
+    }
+
+    const char *start = p;
+    int v = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        if (v < RELATIVE_BIAS) v = v * 10 + (*p - '0');
+    }
+    valid = p != start && v < RELATIVE_BIAS;
+    value = negative ? -v : v;
+    return p;
+}
+
+// OBJ indices are 1-based, or negative to count back from the last element
+static int encodeIndex(int raw, int localCount)
+{
+    if (raw > 0) return raw - 1;
+    if (raw < 0) return localCount + raw - RELATIVE_BIAS;
+    return NO_INDEX;
+}
+
+// Global index, or -1 if missing or out of range
+static int resolveIndex(int index, int chunkOffset, int count)
+{
+    if (index == NO_INDEX) return -1;
+    const int global = (index >= 0) ? index : chunkOffset + index + RELATIVE_BIAS;
+    return (global >= 0 && global < count) ? global : -1;
+}
+
+static void parseFace(ObjChunk &chunk, const char *p, const char *end)
+{
+    const int positions = chunk.positions.size() / 3;
+    const int texCoords = chunk.texCoords.size() / 2;
+    const int normals = chunk.normals.size() / 3;
+
+    // v, v/vt, v//vn or v/vt/vn
+    QVarLengthArray<ObjCorner, 8> polygon;
+    while (true)
+    {
+        p = skipSpaces(p, end);
+        if (p >= end || !(isDigit(*p) || *p == '-' || *p == '+')) break;
+
+        ObjCorner corner;
+        int raw = 0;
+        bool valid = false;
+        p = parseInt(p, end, raw, valid);
+        if (valid) corner.v = encodeIndex(raw, positions);
+        if (p < end && *p == '/')
+        {
+            ++p;
+            if (p < end && *p != '/')
+            {
+                p = parseInt(p, end, raw, valid);
+                if (valid) corner.vt = encodeIndex(raw, texCoords);
+            }
+            if (p < end && *p == '/')
+            {
+                p = parseInt(p + 1, end, raw, valid);
+                if (valid) corner.vn = encodeIndex(raw, normals);
+            }
+        }
+        while (p < end && *p != ' ' && *p != '\t') ++p;
+
+        if (corner.v == NO_INDEX) return;
+        polygon.push_back(corner);
+    }
+
+    // Triangle fan, like aiProcess_Triangulate does with convex polygons
+    for (int i = 1; i + 1 < polygon.size(); ++i)
+    {
+        chunk.corners.push_back(polygon[0]);
+        chunk.corners.push_back(polygon[i]);
+        chunk.corners.push_back(polygon[i + 1]);
+    }
+}
+
+static bool startsWith(const char *p, const char *end, const char *keyword)
+{
+    const int length = int(std::strlen(keyword));
+    return end - p > length && std::memcmp(p, keyword, size_t(length)) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+static void parseLine(ObjChunk &chunk, const char *p, const char *end)
+{
+    p = skipSpaces(p, end);
+    if (end - p < 2) return;
+
+    if (p[0] == 'v')
+    {
+        float x = 0.0f, y = 0.0f, z = 0.0f;
+        if (p[1] == ' ' || p[1] == '\t')
+        {
+            p = parseFloat(p + 1, end, x);
+            p = parseFloat(p, end, y);
+            parseFloat(p, end, z);
+            chunk.positions << x << y << z;
+        }
+        else if (p[1] == 't')
+        {
+            p = parseFloat(p + 2, end, x);
+            parseFloat(p, end, y);
+            chunk.texCoords << x << y;
+        }
+        else if (p[1] == 'n')
+        {
+            p = parseFloat(p + 2, end, x);
+            p = parseFloat(p, end, y);
+            parseFloat(p, end, z);
+            chunk.normals << x << y << z;
+        }
+    }
+    else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+    {
+        parseFace(chunk, p + 2, end);
+    }
+    else if (startsWith(p, end, "usemtl"))
+    {
+        chunk.materials.push_back(qMakePair(chunk.corners.size() / 3, QByteArray(p + 6, int(end - p - 6)).trimmed()));
+    }
+    else if (startsWith(p, end, "mtllib"))
+    {
+        chunk.libraries.push_back(QByteArray(p + 6, int(end - p - 6)).trimmed());
+    }
+}
+
+static void parseChunk(ObjChunk &chunk)
+{
+    // memchr() scans for the line ends several bytes at a time
+    const char *p = chunk.begin;
+    while (p < chunk.end)
+    {
+        const char *lineEnd = static_cast<const char *>(std::memchr(p, '\n', size_t(chunk.end - p)));
+        if (lineEnd == nullptr) lineEnd = chunk.end;
+        parseLine(chunk, p, lineEnd);
+        p = lineEnd + 1;
+    }
+}
+
+// Same description as ModelImporter::processMaterial(), with the MTL maps
+// that Assimp assigns to each texture type
+static void parseMaterialLibrary(const QString &path, QJsonArray &materials, QHash<QByteArray, int> &indices)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::cout << "Could not open material library: " << path.toStdString() << std::endl;
+        return;
+    }
+
+    QJsonObject material;
+    auto flush = [&]() {
+        if (material.isEmpty()) return;
+        indices.insert(material["name"].toString().toUtf8(), materials.size());
+        materials.append(material);
+    };
+
+    for (const QByteArray &rawLine : file.readAll().split('\n'))
+    {
+        const QByteArray line = rawLine.simplified();
+        const int space = line.indexOf(' ');
+        if (line.isEmpty() || line[0] == '#' || space < 0) continue;
+
+        const QByteArray key = line.left(space);
+        const QByteArray value = line.mid(space + 1);
+        const QList<QByteArray> tokens = value.split(' ');
+
+        if (key == "newmtl")
+        {
+            flush();
+            material = QJsonObject();
+            material["name"] = QString::fromUtf8(value);
+        }
+        else if (key == "Kd" && tokens.size() >= 3)
+        {
+            material["albedo"] = QJsonArray({ tokens[0].toDouble(), tokens[1].toDouble(), tokens[2].toDouble() });
+        }
+        else if (key == "Ke" && tokens.size() >= 3)
+        {
+            material["emissive"] = QJsonArray({ tokens[0].toDouble(), tokens[1].toDouble(), tokens[2].toDouble() });
+        }
+        else if (key == "Ns")
+        {
+            material["smoothness"] = value.toDouble() / 256.0;
+        }
+        else
+        {
+            // Texture options go before the file name
+            const QString texture = QString::fromUtf8(tokens.last());
+            if (key == "map_Kd") material["albedoTexture"] = texture;
+            else if (key == "map_Ke") material["emissiveTexture"] = texture;
+            else if (key == "map_Ks") material["specularTexture"] = texture;
+            else if (key == "norm" || key == "map_Kn") material["normalsTexture"] = texture;
+            else if (key == "map_bump" || key == "map_Bump" || key == "bump") material["bumpTexture"] = texture;
+        }
+    }
+    flush();
+}
+
+struct ObjGeometry
+{
+    QVector<float> positions;
+    QVector<float> texCoords;
+    QVector<float> normals;
+};
+
+// Converts the triangles of a material into a submesh with the vertex
+// format of ModelImporter::processMesh()
+static void buildSubMesh(const ObjGeometry &geometry, const QVector<ObjCorner> &corners, ImportedModel::SubMeshData &submesh)
+{
+    bool hasTexCoords = false;
+    bool hasNormals = true;
+    for (const ObjCorner &corner : corners)
+    {
+        hasTexCoords = hasTexCoords || corner.vt >= 0;
+        hasNormals = hasNormals && corner.vn >= 0;
+    }
+
+    typedef VertexLayout<Pos3f, Norm3f, UV2f, Tan3f, Bitan3f> TexturedLayout;
+    typedef VertexLayout<Pos3f, Norm3f> PlainLayout;
+
+    VertexFormat &vertexFormat = submesh.vertexFormat;
+    vertexFormat = hasTexCoords ? TexturedLayout::format() : PlainLayout::format();
+    const int stride = vertexFormat.size / int(sizeof(float));
+
+    // One vertex per different position/UV/normal tuple
+    QHash<ObjCorner, unsigned int> vertexIndices;
+    vertexIndices.reserve(corners.size());
+    QVector<int> vertexPositions; // OBJ position of each vertex
+    submesh.indices.resize(corners.size());
+    for (int i = 0; i < corners.size(); ++i)
+    {
+        const ObjCorner &corner = corners[i];
+        auto it = vertexIndices.find(corner);
+        if (it == vertexIndices.end())
+        {
+            it = vertexIndices.insert(corner, unsigned(vertexPositions.size()));
+            vertexPositions.push_back(corner.v);
+
+            const int base = submesh.vertices.size();
+            submesh.vertices.resize(base + stride);
+            float *vertex = submesh.vertices.data() + base;
+            const float *position = geometry.positions.constData() + 3 * corner.v;
+            std::memcpy(vertex, position, 3 * sizeof(float));
+            if (corner.vn >= 0) {
+                std::memcpy(vertex + 3, geometry.normals.constData() + 3 * corner.vn, 3 * sizeof(float));
+            }
+            if (corner.vt >= 0) {
+                std::memcpy(vertex + 6, geometry.texCoords.constData() + 2 * corner.vt, 2 * sizeof(float));
+            }
+        }
+        submesh.indices[i] = it.value();
+    }
+
+    const int vertexCount = vertexPositions.size();
+    submesh.bounds = VertexKernels::bounds(StridedView<const QVector3D>(submesh.vertices.constData(), vertexFormat.size, vertexCount));
+
+    float *vertices = submesh.vertices.data();
+    const unsigned int *indices = submesh.indices.constData();
+    auto position = [&](unsigned int v) {
+        const float *p = vertices + v * stride;
+        return QVector3D(p[0], p[1], p[2]);
+    };
+
+    // Smooth normals shared by all the vertices at the same position, like
+    // aiProcess_GenSmoothNormals
+    if (!hasNormals)
+    {
+        QHash<int, QVector3D> positionNormals;
+        for (int i = 0; i + 2 < submesh.indices.size(); i += 3)
+        {
+            const QVector3D p0 = position(indices[i]);
+            const QVector3D n = QVector3D::crossProduct(position(indices[i + 1]) - p0, position(indices[i + 2]) - p0);
+            for (int k = 0; k < 3; ++k) {
+                positionNormals[vertexPositions[int(indices[i + k])]] += n;
+            }
+        }
+        for (int v = 0; v < vertexPositions.size(); ++v)
+        {
+            const QVector3D n = positionNormals.value(vertexPositions[v]).normalized();
+            float *vertex = vertices + v * stride;
+            vertex[3] = n.x();
+            vertex[4] = n.y();
+            vertex[5] = n.z();
+        }
+    }
+
+    // Tangents along +U and bitangents along +V (the orientation that
+    // ModelImporter::processMesh() gets after flipping the ones of Assimp)
+    if (hasTexCoords)
+    {
+        const float *source = vertices;
+        VertexKernels::generateTangents(TexturedLayout::view<Pos3f>(source, vertexCount),
+                                        TexturedLayout::view<Norm3f>(source, vertexCount),
+                                        TexturedLayout::view<UV2f>(source, vertexCount),
+                                        TexturedLayout::view<Tan3f>(vertices, vertexCount),
+                                        TexturedLayout::view<Bitan3f>(vertices, vertexCount),
+                                        indices, submesh.indices.size());
+    }
+}
+
+ImportedModel *ObjLoader::load(const QString &path)
+{
+    QFile file(path);
+    uchar *mapped = nullptr;
+    if (file.open(QIODevice::ReadOnly) && file.size() > 0) {
+        mapped = file.map(0, file.size());
+    }
+    if (mapped == nullptr) {
+        std::cout << "Could not open file for read: " << path.toStdString() << std::endl;
+        return nullptr;
+    }
+
+    // Chunks of about the same size, ending at line ends
+    const qint64 size = file.size();
+    const char *text = reinterpret_cast<const char *>(mapped);
+    const char *end = text + size;
+    const int chunkCount = int(qBound<qint64>(1, size / BYTES_PER_CHUNK, 1024));
+    QVector<ObjChunk> chunks(chunkCount);
+    const char *begin = text;
+    for (int i = 0; i < chunkCount; ++i)
+    {
+        const char *split = end;
+        if (i + 1 < chunkCount)
+        {
+            const char *target = std::max(begin, text + size * (i + 1) / chunkCount);
+            const char *newline = static_cast<const char *>(std::memchr(target, '\n', size_t(end - target)));
+            split = (newline != nullptr) ? newline + 1 : end;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = split;
+        begin = split;
+    }
+
+    QtConcurrent::blockingMap(chunks, parseChunk);
+    file.unmap(mapped);
+
+    // Put the chunks together
+    ObjGeometry geometry;
+    int positionCount = 0, texCoordCount = 0, normalCount = 0;
+    for (ObjChunk &chunk : chunks)
+    {
+        chunk.positionOffset = positionCount;
+        chunk.texCoordOffset = texCoordCount;
+        chunk.normalOffset = normalCount;
+        positionCount += chunk.positions.size() / 3;
+        texCoordCount += chunk.texCoords.size() / 2;
+        normalCount += chunk.normals.size() / 3;
+    }
+    geometry.positions.reserve(positionCount * 3);
+    geometry.texCoords.reserve(texCoordCount * 2);
+    geometry.normals.reserve(normalCount * 3);
+    for (ObjChunk &chunk : chunks)
+    {
+        geometry.positions += chunk.positions;
+        geometry.texCoords += chunk.texCoords;
+        geometry.normals += chunk.normals;
+        chunk.positions.clear();
+        chunk.texCoords.clear();
+        chunk.normals.clear();
+    }
+
+    QtConcurrent::blockingMap(chunks, [&](ObjChunk &chunk) {
+        for (ObjCorner &corner : chunk.corners)
+        {
+            corner.v = resolveIndex(corner.v, chunk.positionOffset, positionCount);
+            corner.vt = resolveIndex(corner.vt, chunk.texCoordOffset, texCoordCount);
+            corner.vn = resolveIndex(corner.vn, chunk.normalOffset, normalCount);
+        }
+    });
+
+    ImportedModel *model = new ImportedModel;
+    model->filePath = path;
+
+    // Materials of all the libraries, in order
+    const QDir directory = QFileInfo(path).dir();
+    QHash<QByteArray, int> materialIndices;
+    QVector<QByteArray> libraries;
+    for (const ObjChunk &chunk : chunks)
+    {
+        for (const QByteArray &library : chunk.libraries)
+        {
+            if (libraries.contains(library)) continue;
+            libraries.push_back(library);
+            parseMaterialLibrary(directory.absoluteFilePath(QString::fromUtf8(library)), model->materials, materialIndices);
+        }
+    }
+
+    // Faces without a known material get a default one
+    int defaultMaterial = -1;
+    auto findMaterial = [&](const QByteArray &name) {
+        const int index = materialIndices.value(name, -1);
+        if (index >= 0) return index;
+        if (defaultMaterial < 0)
+        {
+            defaultMaterial = model->materials.size();
+            QJsonObject material;
+            material["name"] = QString::fromLatin1("DefaultMaterial");
+            model->materials.append(material);
+        }
+        return defaultMaterial;
+    };
+
+    // Triangles of each material, in the order the materials are first used
+    QVector<QVector<ObjCorner>> groups;
+    QVector<int> groupMaterials;
+    QHash<int, int> materialGroups;
+    int currentMaterial = -1;
+    for (const ObjChunk &chunk : chunks)
+    {
+        int run = 0;
+        const int triangles = chunk.corners.size() / 3;
+        for (int t = 0; t < triangles; ++t)
+        {
+            while (run < chunk.materials.size() && chunk.materials[run].first <= t) {
+                currentMaterial = findMaterial(chunk.materials[run++].second);
+            }
+            if (currentMaterial < 0) {
+                currentMaterial = findMaterial(QByteArray());
+            }
+
+            const ObjCorner *corners = chunk.corners.constData() + 3 * t;
+            if (corners[0].v < 0 || corners[1].v < 0 || corners[2].v < 0) continue;
+
+            int group = materialGroups.value(currentMaterial, -1);
+            if (group < 0)
+            {
+                group = groups.size();
+                materialGroups.insert(currentMaterial, group);
+                groups.push_back(QVector<ObjCorner>());
+                groupMaterials.push_back(currentMaterial);
+            }
+            groups[group] << corners[0] << corners[1] << corners[2];
+        }
+
+        // usemtl lines after the last face of the chunk
+        while (run < chunk.materials.size()) {
+            currentMaterial = findMaterial(chunk.materials[run++].second);
+        }
+    }
+    chunks.clear();
+
+    // Build the submeshes in parallel, each one into its own slot
+    model->submeshes.resize(groups.size());
+    QVector<int> order(groups.size());
+    std::iota(order.begin(), order.end(), 0);
+    QtConcurrent::blockingMap(order, [&](int i) {
+        buildSubMesh(geometry, groups[i], model->submeshes[i]);
+        model->submeshes[i].materialIndex = groupMaterials[i];
+    });
+
+    ImportedModel::Node root;
+    root.submeshes = order;
+    model->nodes.push_back(root);
+
+    return model;
+}
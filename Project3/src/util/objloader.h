@@ -0,0 +1,23 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <QString>
+
+struct ImportedModel;
+
+// Parser of Wavefront OBJ/MTL files, faster than going through Assimp. The
+// file is memory-mapped and split at line boundaries into chunks that are
+// parsed in parallel. The submeshes (one per material) are built in
+// parallel too, in the same vertex format as ModelImporter::processMesh():
+// vertices de-duplicated, polygons triangulated, smooth normals when the
+// file has none, and tangents when it has texture coordinates.
+class ObjLoader
+{
+public:
+
+    // Like ModelImporter::load(), it can run on any thread. The model is
+    // flattened: a single node with all the submeshes.
+    static ImportedModel *load(const QString &path);
+};
+
+#endif // OBJLOADER_H
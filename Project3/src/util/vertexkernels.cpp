@@ -0,0 +1,108 @@
+#include "util/vertexkernels.h"
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VERTEX_KERNELS_SSE
+#include <xmmintrin.h>
+#endif
+
+
+namespace VertexKernels
+{
+
+Bounds bounds(StridedView<const QVector3D> positions)
+{
+    Bounds result;
+    const int count = positions.size();
+    if (count == 0) return result;
+
+    auto position = [&](int i) { return reinterpret_cast<const float *>(&positions[i]); };
+
+#ifdef VERTEX_KERNELS_SSE
+    // 16 byte loads also pick the float after the position, which is
+    // ignored. The last vertex is loaded on its own so it never reads past
+    // the end. Two accumulators hide the latency of min/max.
+    __m128 min0 = _mm_set1_ps(FLT_MAX), max0 = _mm_set1_ps(-FLT_MAX);
+    __m128 min1 = min0, max1 = max0;
+    int i = 0;
+    for (; i + 2 < count; i += 2)
+    {
+        const __m128 a = _mm_loadu_ps(position(i));
+        const __m128 b = _mm_loadu_ps(position(i + 1));
+        min0 = _mm_min_ps(min0, a);
+        max0 = _mm_max_ps(max0, a);
+        min1 = _mm_min_ps(min1, b);
+        max1 = _mm_max_ps(max1, b);
+    }
+    for (; i + 1 < count; ++i)
+    {
+        const __m128 a = _mm_loadu_ps(position(i));
+        min0 = _mm_min_ps(min0, a);
+        max0 = _mm_max_ps(max0, a);
+    }
+    const float *last = position(count - 1);
+    const __m128 l = _mm_setr_ps(last[0], last[1], last[2], 0.0f);
+    min0 = _mm_min_ps(_mm_min_ps(min0, min1), l);
+    max0 = _mm_max_ps(_mm_max_ps(max0, max1), l);
+
+    float minValues[4], maxValues[4];
+    _mm_storeu_ps(minValues, min0);
+    _mm_storeu_ps(maxValues, max0);
+    result.min = QVector3D(minValues[0], minValues[1], minValues[2]);
+    result.max = QVector3D(maxValues[0], maxValues[1], maxValues[2]);
+#else
+    float minValues[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float maxValues[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < count; ++i)
+    {
+        const float *p = position(i);
+        for (int c = 0; c < 3; ++c)
+        {
+            minValues[c] = p[c] < minValues[c] ? p[c] : minValues[c];
+            maxValues[c] = p[c] > maxValues[c] ? p[c] : maxValues[c];
+        }
+    }
+    result.min = QVector3D(minValues[0], minValues[1], minValues[2]);
+    result.max = QVector3D(maxValues[0], maxValues[1], maxValues[2]);
+#endif
+
+    return result;
+}
+
+void generateTangents(StridedView<const QVector3D> positions,
+                      StridedView<const QVector3D> normals,
+                      StridedView<const QVector2D> texCoords,
+                      StridedView<QVector3D> tangents,
+                      StridedView<QVector3D> bitangents,
+                      const unsigned int *indices, int indexCount)
+{
+    // Scattered writes per triangle: it doesn't vectorize, but the views
+    // keep the loop free of hand-written offsets
+    for (int i = 0; i + 2 < indexCount; i += 3)
+    {
+        const int i0 = int(indices[i]), i1 = int(indices[i + 1]), i2 = int(indices[i + 2]);
+        const QVector3D e1 = positions[i1] - positions[i0];
+        const QVector3D e2 = positions[i2] - positions[i0];
+        const QVector2D d1 = texCoords[i1] - texCoords[i0];
+        const QVector2D d2 = texCoords[i2] - texCoords[i0];
+        const float det = d1.x() * d2.y() - d2.x() * d1.y();
+        if (std::fabs(det) < 1e-12f) continue;
+
+        const QVector3D t = (e1 * d2.y() - e2 * d1.y()) / det;
+        const QVector3D b = (e2 * d1.x() - e1 * d2.x()) / det;
+        tangents[i0] += t; tangents[i1] += t; tangents[i2] += t;
+        bitangents[i0] += b; bitangents[i1] += b; bitangents[i2] += b;
+    }
+
+    for (int v = 0; v < tangents.size(); ++v)
+    {
+        const QVector3D &n = normals[v];
+        QVector3D &t = tangents[v];
+        QVector3D &b = bitangents[v];
+        t = (t - n * QVector3D::dotProduct(n, t)).normalized();
+        b = (b - n * QVector3D::dotProduct(n, b)).normalized();
+    }
+}
+
+} // namespace VertexKernels
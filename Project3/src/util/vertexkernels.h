@@ -0,0 +1,25 @@
+#ifndef VERTEXKERNELS_H
+#define VERTEXKERNELS_H
+
+#include "resources/vertexlayout.h"
+
+// Loops over whole vertex streams, used by the importers and the meshes.
+// They work on typed views, so any interleaved layout can be passed.
+namespace VertexKernels
+{
+
+// Axis aligned box of some positions (SSE when available)
+Bounds bounds(StridedView<const QVector3D> positions);
+
+// Per vertex tangents along +U and bitangents along +V, accumulated over
+// the triangles and made orthogonal to the normals
+void generateTangents(StridedView<const QVector3D> positions,
+                      StridedView<const QVector3D> normals,
+                      StridedView<const QVector2D> texCoords,
+                      StridedView<QVector3D> tangents,
+                      StridedView<QVector3D> bitangents,
+                      const unsigned int *indices, int indexCount);
+
+} // namespace VertexKernels
+
+#endif // VERTEXKERNELS_H